@@ -128,6 +128,8 @@ typedef uint32_t uint32_u;
     *(ucp)++ = ((uint64_t) (val) >> 56) & 0xff;
 
 static int bam_more_input(bam_file_t *b);
+static void bam_read_ahead_free(bam_file_t *b);
+static void sam_parse_free(bam_file_t *b);
 static int bam_uncompress_input(bam_file_t *b);
 static int reg2bin(int start, int end);
 static int bgzf_block_write(bam_file_t *bf, int level, const void *buf, size_t count);
@@ -439,6 +441,19 @@ static void bam_file_init(bam_file_t *b) {
     b->eof      = 0;
     b->nd_jobs    = 0;
     b->ne_jobs    = 0;
+    b->last_job = NULL;
+    b->job_free = NULL;
+    b->rqueue   = NULL;
+    b->ra       = NULL;
+    b->ra_spare = NULL;
+    b->ra_inflight = 0;
+    b->squeue   = NULL;
+    b->sam_mt   = 0;
+    b->sam_job  = NULL;
+    b->sam_free = NULL;
+    b->sam_idx  = 0;
+    b->sam_eof  = 0;
+    b->sam_carry = 0;
     b->idx = NULL;
     b->current_block = 0;
     b->bgbuf_p = b->bgbuf;
@@ -589,6 +604,9 @@ int bam_close(bam_file_t *b) {
     if (!b)
 	return 0;
 
+    /* Parse jobs use the header, so finish them first */
+    sam_parse_free(b);
+
     if (b->mode & O_WRONLY) {
 	if (b->binary) {
 	    if (bgzf_block_write(b, b->level, b->uncomp,
@@ -624,6 +642,9 @@ int bam_close(bam_file_t *b) {
     if (b->sam_str)
 	free(b->sam_str);
 
+    /* Before closing fp, as a read-ahead job may be using it */
+    bam_read_ahead_free(b);
+
     if (b->fp)
 	r = fclose(b->fp);
 
@@ -654,12 +675,156 @@ int bam_close(bam_file_t *b) {
 	t_results_queue_destroy(b->equeue);
     if (b->dqueue)
 	t_results_queue_destroy(b->dqueue);
+    if (b->last_job)
+	free(b->last_job);
+    if (b->job_free)
+	free(b->job_free);
 
     free(b);
 
     return r;
 }
 
+/*
+ * Read-ahead of the input when threaded.
+ *
+ * Input is read BGZF_READ_AHEAD bytes at a time by a job in the thread
+ * pool, so the next chunk is being read while the current one is split
+ * into BGZF blocks and decoded.  Two chunks alternate, one being read
+ * while the other is consumed.  Only one read is ever in flight so
+ * there is no need to order reads on b->fp.
+ */
+#define BGZF_READ_AHEAD (4*1024*1024)
+
+typedef struct {
+    FILE *fp;
+    unsigned char *buf;
+    size_t sz, pos;
+    int err;
+} bgzf_read_job;
+
+static void *bgzf_read_thread(void *arg) {
+    bgzf_read_job *j = (bgzf_read_job *)arg;
+
+    j->sz = fread(j->buf, 1, BGZF_READ_AHEAD, j->fp);
+    j->err = ferror(j->fp);
+
+    return j;
+}
+
+static void bgzf_read_job_free(bgzf_read_job *j) {
+    if (!j)
+	return;
+    free(j->buf);
+    free(j);
+}
+
+/*
+ * Dispatches a job to read the next chunk of input.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bam_read_ahead(bam_file_t *b) {
+    bgzf_read_job *j = (bgzf_read_job *)b->ra_spare;
+
+    if (!j) {
+	if (!(j = malloc(sizeof(*j))))
+	    return -1;
+	if (!(j->buf = malloc(BGZF_READ_AHEAD))) {
+	    free(j);
+	    return -1;
+	}
+    }
+    b->ra_spare = NULL;
+
+    j->fp = b->fp;
+    j->sz = j->pos = 0;
+    j->err = 0;
+
+    // Over-fill the pool if need be: we must not block behind the very
+    // decode jobs that are waiting on this input.
+    if (-1 == t_pool_dispatch2(b->pool, b->rqueue, bgzf_read_thread, j, -1)) {
+	bgzf_read_job_free(j);
+	return -1;
+    }
+    b->ra_inflight = 1;
+
+    return 0;
+}
+
+/*
+ * Waits for any in-flight read and frees the read-ahead buffers.
+ */
+static void bam_read_ahead_free(bam_file_t *b) {
+    if (b->ra_inflight) {
+	t_pool_result *res = t_pool_next_result_wait(b->rqueue);
+	if (res) {
+	    bgzf_read_job_free((bgzf_read_job *)res->data);
+	    t_pool_delete_result(res, 0);
+	}
+	b->ra_inflight = 0;
+    }
+
+    bgzf_read_job_free((bgzf_read_job *)b->ra);
+    bgzf_read_job_free((bgzf_read_job *)b->ra_spare);
+    b->ra = b->ra_spare = NULL;
+
+    if (b->rqueue) {
+	t_results_queue_destroy(b->rqueue);
+	b->rqueue = NULL;
+    }
+}
+
+/*
+ * Appends to the compressed buffer from the read-ahead chunks, starting
+ * the read of the following chunk each time we move on to a new one.
+ *
+ * Returns 0 on success
+ *        -1 on failure or EOF.
+ */
+static int bam_more_input_ra(bam_file_t *b) {
+    bgzf_read_job *ra;
+    size_t l;
+
+    if (!b->ra && !b->ra_inflight && -1 == bam_read_ahead(b))
+	return -1;
+
+    while (!(ra = (bgzf_read_job *)b->ra) || ra->pos == ra->sz) {
+	t_pool_result *res;
+
+	if (!b->ra_inflight)
+	    return -1; // EOF or earlier error
+
+	res = t_pool_next_result_wait(b->rqueue);
+	b->ra_inflight = 0;
+	if (!res || !res->data)
+	    return -1;
+
+	b->ra_spare = b->ra;
+	b->ra = res->data;
+	t_pool_delete_result(res, 0);
+
+	ra = (bgzf_read_job *)b->ra;
+	if (ra->err) {
+	    fprintf(stderr, "Failed to read BAM input\n");
+	    return -1;
+	}
+	if (ra->sz == 0)
+	    return -1; // EOF
+
+	if (-1 == bam_read_ahead(b))
+	    return -1;
+    }
+
+    l = MIN(Z_BUFF_SIZE - b->comp_sz, ra->sz - ra->pos);
+    memcpy(&b->comp[b->comp_sz], ra->buf + ra->pos, l);
+    ra->pos += l;
+    b->comp_sz += l;
+
+    return 0;
+}
+
 /*
  * Loads more data into the input (compressed) buffer.
  *
@@ -677,6 +842,9 @@ static int bam_more_input(bam_file_t *b) {
 	b->comp_p = b->comp;
     }
 
+    if (b->rqueue)
+	return bam_more_input_ra(b);
+
     l = fread(&b->comp[b->comp_sz], 1, Z_BUFF_SIZE - b->comp_sz, b->fp);
     if (l <= 0)
 	return -1;
@@ -691,7 +859,6 @@ typedef struct {
     size_t comp_sz, uncomp_sz;
     int ignore_chksum;
 } bgzf_decode_job;
-static bgzf_decode_job *last_job = NULL;
 
 
 /*
@@ -807,7 +974,11 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    if (b->job_pending) {
 		j = b->job_pending;
 	    } else {
-		if (!(j = malloc(sizeof(*j))))
+		// Reuse the last consumed job; they're too big to malloc
+		// cheaply.
+		if ((j = b->job_free))
+		    b->job_free = NULL;
+		else if (!(j = malloc(sizeof(*j))))
 		    return -1;
 
 	    empty_block_1:
@@ -932,9 +1103,12 @@ static int bam_uncompress_input(bam_file_t *b) {
 	memcpy(b->uncomp, j->uncomp, j->uncomp_sz);
 	b->uncomp_p = b->uncomp;
 #else
-	if (last_job)
-	    free(last_job);
-	last_job = j;
+	if (b->last_job) {
+	    if (b->job_free)
+		free(b->job_free);
+	    b->job_free = b->last_job;
+	}
+	b->last_job = j;
 	b->uncomp_p = j->uncomp;
 #endif
 	b->uncomp_sz = j->uncomp_sz;
@@ -1217,22 +1391,94 @@ static int64_t inline STRTOL64(const char *v, const char **rv, int b) {
     return neg*n;
 }
 
+/* A single entry cache of the last reference name looked up */
+typedef struct {
+    const char *name;
+    int len, id;
+} sam_ref_cache;
+
 /*
- * Decodes the next line of SAM into a bam_seq_t struct.
+ * Returns the reference id for name[0..len-1], consulting and updating
+ * the cache 'c' if non-NULL.  Unknown references are added to the
+ * header when 'add' is true, reporting them with the printf format
+ * 'what'.  While SAM is being parsed by multiple threads the header
+ * is guarded by b->sam_lock.
+ *
+ * Returns reference id on success
+ *        -1 on failure
+ *        -2 if unknown and 'add' is false
+ */
+static int sam_ref_id(bam_file_t *b, sam_ref_cache *c,
+		      unsigned char *name, int len, int add,
+		      const char *what) {
+    SAM_hdr *sh = b->header;
+    HashItem *hi;
+    int id = -1;
+
+    if (c && c->name && c->len == len && memcmp(c->name, name, len) == 0)
+	return c->id;
+
+    if (b->sam_mt)
+	pthread_mutex_lock(&b->sam_lock);
+
+    hi = HashTableSearch(sh->ref_hash, (char *)name, len);
+    if (!hi) {
+	HashData hd;
+
+	if (!add) {
+	    id = -2;
+	    goto out;
+	}
+
+	fprintf(stderr, what, len, name);
+
+	/* Fabricate it instead */
+	sh->ref = realloc(sh->ref, (sh->nref+1)*sizeof(*sh->ref));
+	if (!sh->ref)
+	    goto out;
+	sh->ref[sh->nref].len  = 0; /* Unknown value */
+	sh->ref[sh->nref].name = malloc(len+1);
+	if (!sh->ref[sh->nref].name)
+	    goto out;
+	memcpy(sh->ref[sh->nref].name, name, len);
+	sh->ref[sh->nref].name[len] = 0;
+
+	hd.i = sh->nref;
+	hi = HashTableAdd(sh->ref_hash, sh->ref[sh->nref].name, 0,
+			  hd, NULL);
+	sh->nref++;
+    }
+    id = hi->data.i;
+
+    if (c) {
+	c->name = sh->ref[id].name;
+	c->len = len;
+	c->id = id;
+    }
+
+ out:
+    if (b->sam_mt)
+	pthread_mutex_unlock(&b->sam_lock);
+
+    return id;
+}
+
+/*
+ * Decodes a single NUL terminated line of SAM, of length used_l, into a
+ * bam_seq_t struct.  See sam_ref_id for 'c' and 'add'.
  *
  * Returns 1 on success
- *         0 on eof
  *        -1 on error
+ *        -2 if the line needs a reference adding but 'add' is false
  */
-static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
-    int used_l, sign;
+static int sam_parse_line(bam_file_t *b, unsigned char *line, int used_l,
+			  bam_seq_t **bsp, sam_ref_cache *c, int add) {
+    int sign;
     int64_t n;
     unsigned char *cpf, *cpt, *cp;
     int cigar_len;
     bam_seq_t *bs;
-    HashItem *hi;
     int64_t start, end;
-    SAM_hdr *sh = b->header;
 
     static const char lookup[256] = {
 	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* 00 */
@@ -1252,11 +1498,6 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15, /* e0 */
 	15,15,15,15,15,15,15,15, 15,15,15,15,15,15,15,15};/* f0 */
 
-    /* Fetch a single line */
-    if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
-	return used_l;
-    }
-
     used_l *= 4; // FIXME, what is the correct max size?
 
     /* Over sized memory, for worst case? FIXME: cigar can break this! */
@@ -1272,7 +1513,7 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     bs->bin_packed = 0;
     
     /* Decode line */
-    cpf = b->sam_str;
+    cpf = line;
     cpt = (unsigned char *)&bs->data;
     
     /* Name */
@@ -1304,30 +1545,11 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
 	/* Unmapped */
 	bs->ref = -1;
     } else {
-	hi = HashTableSearch(b->header->ref_hash, (char *)cp, cpf-cp);
-	if (!hi) {
-	    SAM_hdr *sh = b->header;
-	    HashData hd;
-
-	    fprintf(stderr, "Reference seq %.*s unknown\n", (int)(cpf-cp), cp);
-
-	    /* Fabricate it instead */
-	    sh->ref = realloc(sh->ref, (sh->nref+1)*sizeof(*sh->ref));
-	    if (!sh->ref)
-		return -1;
-	    sh->ref[sh->nref].len  = 0; /* Unknown value */
-	    sh->ref[sh->nref].name = malloc(cpf-cp+1);
-	    if (!sh->ref[sh->nref].name)
-		return -1;
-	    memcpy(sh->ref[sh->nref].name, cp, cpf-cp);
-	    sh->ref[sh->nref].name[cpf-cp] = 0;
-
-	    hd.i = sh->nref;
-	    hi = HashTableAdd(sh->ref_hash, sh->ref[sh->nref].name, 0,
-			      hd, NULL);
-	    sh->nref++;
-	}
-	bs->ref = hi->data.i;
+	int id = sam_ref_id(b, c, cp, cpf-cp, add,
+			    "Reference seq %.*s unknown\n");
+	if (id < 0)
+	    return id;
+	bs->ref = id;
     }
     if (!*cpf++) return -1;
 
@@ -1406,29 +1628,11 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     } else if (*cp == '=' && cp[1] == '\t') {
 	bs->mate_ref = bs->ref;
     } else {
-	hi = HashTableSearch(sh->ref_hash, (char *)cp, cpf-cp);
-	if (!hi) {
-	    HashData hd;
-
-	    fprintf(stderr, "Mate ref seq \"%.*s\" unknown\n", (int)(cpf-cp), cp);
-
-	    /* Fabricate it instead */
-	    sh->ref = realloc(sh->ref, (sh->nref+1)*sizeof(*sh->ref));
-	    if (!sh->ref)
-		return -1;
-	    sh->ref[sh->nref].len  = 0; /* Unknown value */
-	    sh->ref[sh->nref].name = malloc(cpf-cp+1);
-	    if (!sh->ref[sh->nref].name)
-		return -1;
-	    memcpy(sh->ref[sh->nref].name, cp, cpf-cp);
-	    sh->ref[sh->nref].name[cpf-cp] = 0;
-
-	    hd.i = sh->nref;
-	    hi = HashTableAdd(sh->ref_hash, sh->ref[sh->nref].name, 0,
-			      hd, NULL);
-	    sh->nref++;
-	}
-	bs->mate_ref = hi->data.i;
+	int id = sam_ref_id(b, c, cp, cpf-cp, add,
+			    "Mate ref seq \"%.*s\" unknown\n");
+	if (id < 0)
+	    return id;
+	bs->mate_ref = id;
     }
     if (!*cpf++) return -1;
 
@@ -1643,6 +1847,344 @@ static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
     return 1;
 }
 
+/*
+ * Decodes the next line of SAM into a bam_seq_t struct.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int sam_next_seq(bam_file_t *b, bam_seq_t **bsp) {
+    int used_l;
+
+    /* Fetch a single line */
+    if ((used_l = bam_get_line(b, &b->sam_str, &b->alloc_l)) <= 0) {
+	return used_l;
+    }
+
+    return sam_parse_line(b, b->sam_str, used_l, bsp, NULL, 1);
+}
+
+/* --------------------------------------------------------------------------
+ * Multi-threaded SAM parsing.
+ *
+ * The input is cut into chunks of about SAM_CHUNK_SIZE bytes ending on a
+ * newline, and each chunk is parsed into an array of bam_seq_t by a job
+ * in the thread pool.  The results queue returns the chunks in order, and
+ * sam_next_seq_mt hands back the records one at a time by swapping them
+ * with the caller's bam_seq_t.
+ *
+ * Reference ids in headerless SAM are assigned in the order references
+ * are first seen, so jobs never add references to the header.  On an
+ * unknown reference a job stops, and the consumer parses the rest of the
+ * chunk itself, in order, adding the reference as it goes.
+ */
+#define SAM_CHUNK_SIZE (256*1024)
+
+typedef struct sam_parse_job {
+    bam_file_t *b;
+    unsigned char *text;      // newline terminated lines
+    size_t text_sz, text_alloc;
+    bam_seq_t **bs;           // parsed records
+    int nbs, bs_alloc;
+    size_t resume;            // offset of the first line not in bs[]
+    int resume_len;           // its length if already NUL terminated, or -1
+    size_t resume_next;       // and the offset of the line after it
+    int err;                  // line at resume failed to parse
+    struct sam_parse_job *next; // free list
+} sam_parse_job;
+
+/*
+ * Finds the next line of text starting at offset *pos, NUL terminates
+ * it (removing any \r too) and moves *pos past it.
+ *
+ * Returns the line length, or -1 if there are no more lines.
+ */
+static int sam_chunk_line(sam_parse_job *j, size_t *pos, unsigned char **line) {
+    unsigned char *cp, *nl;
+
+    if (*pos >= j->text_sz)
+	return -1;
+
+    cp = j->text + *pos;
+    nl = memchr(cp, '\n', j->text_sz - *pos); // always present
+    *pos = nl+1 - j->text;
+    if (nl > cp && nl[-1] == '\r')
+	nl--;
+    *nl = 0;
+    *line = cp;
+
+    return nl - cp;
+}
+
+static void *sam_parse_thread(void *arg) {
+    sam_parse_job *j = (sam_parse_job *)arg;
+    sam_ref_cache c = {NULL, 0, 0};
+    size_t pos = 0;
+    unsigned char *line;
+    int len, r;
+
+    j->nbs = 0;
+    j->err = 0;
+    j->resume_len = -1;
+
+    for (j->resume = pos; (len = sam_chunk_line(j, &pos, &line)) >= 0;
+	 j->resume = pos) {
+	if (j->nbs == j->bs_alloc) {
+	    int n = j->bs_alloc ? j->bs_alloc*2 : 1024;
+	    bam_seq_t **bs = realloc(j->bs, n * sizeof(*bs));
+	    if (!bs) {
+		j->err = 1;
+		break;
+	    }
+	    memset(&bs[j->bs_alloc], 0, (n - j->bs_alloc) * sizeof(*bs));
+	    j->bs = bs;
+	    j->bs_alloc = n;
+	}
+
+	if (len == 0)
+	    continue;
+
+	if ((r = sam_parse_line(j->b, line, len, &j->bs[j->nbs], &c, 0)) < 0) {
+	    // Leave -2 (unknown reference) for the consumer to parse.
+	    j->err = (r == -1);
+	    j->resume_len = len;
+	    j->resume_next = pos;
+	    break;
+	}
+	j->nbs++;
+    }
+
+    return j;
+}
+
+static void sam_parse_job_free(sam_parse_job *j) {
+    int i;
+
+    for (i = 0; i < j->bs_alloc; i++)
+	if (j->bs[i])
+	    free(j->bs[i]);
+    free(j->bs);
+    free(j->text);
+    free(j);
+}
+
+/*
+ * Fills j with the next chunk of input, ending on a newline.  Any partial
+ * line left over is kept in b->sam_str for the next chunk.
+ *
+ * Returns 0 on success (with j->text_sz 0 at eof)
+ *        -1 on failure
+ */
+static int sam_fill_chunk(bam_file_t *b, sam_parse_job *j) {
+    size_t nl = 0, sz = 0;
+    int r = 0, found = 0;
+
+    j->text_sz = 0;
+    for (;;) {
+	// The previous partial line first, then whole buffers of input.
+	if (b->sam_carry) {
+	    sz = b->sam_carry;
+	} else {
+	    if (j->text_sz >= SAM_CHUNK_SIZE) {
+		// Look for a line end in what we added last.
+		for (nl = j->text_sz; nl > j->text_sz - sz; nl--)
+		    if (j->text[nl-1] == '\n')
+			break;
+		if ((found = nl > j->text_sz - sz))
+		    break;
+	    }
+	    if (!b->uncomp_sz && (r = bam_uncompress_input(b)) <= 0)
+		break;
+	    sz = b->uncomp_sz;
+	}
+
+	// +9 for an added newline and the COPY_CPF_TO_CPTM over-read.
+	if (j->text_sz + sz + 9 > j->text_alloc) {
+	    size_t n = j->text_alloc ? j->text_alloc : SAM_CHUNK_SIZE + 65536;
+	    unsigned char *t;
+	    while (n < j->text_sz + sz + 9)
+		n *= 2;
+	    if (!(t = realloc(j->text, n)))
+		return -1;
+	    j->text = t;
+	    j->text_alloc = n;
+	}
+
+	if (b->sam_carry) {
+	    memcpy(j->text, b->sam_str, sz);
+	    b->sam_carry = 0;
+	} else {
+	    memcpy(j->text + j->text_sz, b->uncomp_p, sz);
+	    b->uncomp_p += sz;
+	    b->uncomp_sz = 0;
+	}
+	j->text_sz += sz;
+    }
+
+    if (r < 0)
+	return -1;
+    if (!found)
+	b->eof_block = 1; // expected eof, as per bam_get_line
+
+    if (found) {
+	// Keep the partial line after the last newline for next time.
+	size_t left = j->text_sz - nl;
+	if (left > b->alloc_l) {
+	    // Same convention as bam_get_line: alloc_l excludes the 8 byte pad
+	    size_t alloc_l = b->alloc_l ? b->alloc_l * 2 : 1024;
+	    unsigned char *t;
+	    while (alloc_l < left)
+		alloc_l *= 2;
+	    if (!(t = realloc(b->sam_str, alloc_l + 8)))
+		return -1;
+	    b->sam_str = t;
+	    b->alloc_l = alloc_l;
+	}
+	memcpy(b->sam_str, j->text + nl, left);
+	b->sam_carry = left;
+	j->text_sz = nl;
+    } else if (j->text_sz && j->text[j->text_sz-1] != '\n') {
+	// EOF without a final newline
+	j->text[j->text_sz++] = '\n';
+    }
+
+    return 0;
+}
+
+/*
+ * Keeps the pool supplied with chunks to parse.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int sam_dispatch_chunks(bam_file_t *b) {
+    while (!b->sam_eof &&
+	   t_pool_results_queue_sz(b->squeue) < b->pool->qsize) {
+	sam_parse_job *j;
+
+	if ((j = b->sam_free)) {
+	    b->sam_free = j->next;
+	} else {
+	    if (!(j = calloc(1, sizeof(*j))))
+		return -1;
+	    j->b = b;
+	}
+
+	if (-1 == sam_fill_chunk(b, j)) {
+	    sam_parse_job_free(j);
+	    return -1;
+	}
+
+	if (j->text_sz == 0) {
+	    b->sam_eof = 1;
+	    j->next = b->sam_free;
+	    b->sam_free = j;
+	    break;
+	}
+
+	if (-1 == t_pool_dispatch(b->pool, b->squeue, sam_parse_thread, j)) {
+	    sam_parse_job_free(j);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * As sam_next_seq, but with the parsing done by the thread pool.
+ *
+ * Returns 1 on success
+ *         0 on eof
+ *        -1 on error
+ */
+static int sam_next_seq_mt(bam_file_t *b, bam_seq_t **bsp) {
+    sam_parse_job *j;
+
+    for (;;) {
+	if ((j = b->sam_job)) {
+	    if (b->sam_idx < j->nbs) {
+		bam_seq_t *tmp = *bsp;
+		*bsp = j->bs[b->sam_idx];
+		j->bs[b->sam_idx++] = tmp;
+		return 1;
+	    }
+
+	    if (j->err)
+		return -1;
+
+	    // Parse the remainder ourselves, adding unknown references.
+	    if (j->resume < j->text_sz) {
+		unsigned char *line = j->text + j->resume;
+		int len = j->resume_len;
+
+		if (len >= 0) {
+		    j->resume = j->resume_next;
+		    j->resume_len = -1;
+		} else {
+		    len = sam_chunk_line(j, &j->resume, &line);
+		}
+		if (len == 0)
+		    continue;
+
+		return sam_parse_line(b, line, len, bsp, NULL, 1) < 0 ? -1 : 1;
+	    }
+
+	    j->next = b->sam_free;
+	    b->sam_free = j;
+	    b->sam_job = NULL;
+	}
+
+	if (-1 == sam_dispatch_chunks(b))
+	    return -1;
+
+	if (t_pool_results_queue_empty(b->squeue))
+	    return 0;
+
+	{
+	    t_pool_result *res = t_pool_next_result_wait(b->squeue);
+	    if (!res || !res->data)
+		return -1;
+	    b->sam_job = res->data;
+	    b->sam_idx = 0;
+	    t_pool_delete_result(res, 0);
+	}
+    }
+}
+
+/*
+ * Waits for outstanding SAM parsing jobs and frees them.
+ */
+static void sam_parse_free(bam_file_t *b) {
+    sam_parse_job *j, *next;
+
+    if (!b->squeue)
+	return;
+
+    while (!t_pool_results_queue_empty(b->squeue)) {
+	t_pool_result *res = t_pool_next_result_wait(b->squeue);
+	if (!res)
+	    break;
+	if (res->data)
+	    sam_parse_job_free(res->data);
+	t_pool_delete_result(res, 0);
+    }
+
+    if (b->sam_job)
+	sam_parse_job_free(b->sam_job);
+    for (j = b->sam_free; j; j = next) {
+	next = j->next;
+	sam_parse_job_free(j);
+    }
+    b->sam_job = b->sam_free = NULL;
+
+    t_results_queue_destroy(b->squeue);
+    b->squeue = NULL;
+    pthread_mutex_destroy(&b->sam_lock);
+    b->sam_mt = 0;
+}
+
 /*
  * Based on htslib's copy from htslib/sam.c
  *
@@ -1842,7 +2384,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     b->line++;
 
     if (!b->bam)
-	return sam_next_seq(b, bsp);
+	return b->sam_mt ? sam_next_seq_mt(b, bsp) : sam_next_seq(b, bsp);
 
     if (b->next_len > 0) {
 	blk_size = b->next_len;
@@ -1924,7 +2466,7 @@ int bam_get_seq(bam_file_t *b, bam_seq_t **bsp) {
     b->line++;
 
     if (!b->bam)
-	return sam_next_seq(b, bsp);
+	return b->sam_mt ? sam_next_seq_mt(b, bsp) : sam_next_seq(b, bsp);
 
     if (b->next_len > 0) {
 	blk_size = b->next_len;
@@ -4115,6 +4657,31 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
 	fd->pool = va_arg(args, t_pool *);
 	fd->equeue = t_results_queue_init();
 	fd->dqueue = t_results_queue_init();
+	t_results_queue_set_name(fd->equeue, "bgzf_encode");
+	t_results_queue_set_name(fd->dqueue, "bgzf_decode");
+
+	// Input is read ahead by the pool too, at the highest priority
+	// as everything else waits on it.
+	if (fd->pool && !(fd->mode & O_WRONLY) && !fd->rqueue) {
+	    if (!(fd->rqueue = t_results_queue_init()))
+		return -1;
+	    t_results_queue_set_name(fd->rqueue, "bgzf_read");
+	    t_results_queue_set_priority(fd->rqueue, 2);
+	}
+
+	// And SAM is parsed in the pool.
+	if (fd->pool && !(fd->mode & O_WRONLY) && !fd->bam && !fd->squeue) {
+	    if (!(fd->squeue = t_results_queue_init()))
+		return -1;
+	    t_results_queue_set_name(fd->squeue, "sam_parse");
+	    pthread_mutex_init(&fd->sam_lock, NULL);
+	    fd->sam_mt = 1;
+	}
+
+	// Favour output over input, as per cram_set_queue_sched.
+	t_results_queue_set_priority(fd->equeue, 1);
+	if (fd->pool)
+	    t_results_queue_set_limit(fd->dqueue, (fd->pool->qsize*3)/4 + 1);
 	break;
 
     case BAM_OPT_BINNING:
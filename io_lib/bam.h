@@ -197,6 +197,24 @@ typedef struct {
     void *job_pending;
     int eof;
     int nd_jobs, ne_jobs;
+    void *last_job;  /* Decode job holding uncomp_p */
+    void *job_free;  /* Spare decode job for reuse */
+
+    /* Read-ahead of compressed input, when threaded */
+    t_results_queue *rqueue;
+    void *ra;        /* Chunk being consumed */
+    void *ra_spare;  /* Consumed chunk for the next read */
+    int ra_inflight; /* A read job is in the pool */
+
+    /* Multi-threaded SAM parsing */
+    t_results_queue *squeue;
+    int sam_mt;          /* SAM is being parsed by the pool */
+    pthread_mutex_t sam_lock; /* Guards header while sam_mt */
+    void *sam_job;       /* Parsed chunk being returned */
+    void *sam_free;      /* Chunks for reuse */
+    int sam_idx;         /* Next record in sam_job */
+    int sam_eof;         /* All input dispatched */
+    size_t sam_carry;    /* Partial line held in sam_str */
 
     /* Quality binning */
     enum quality_binning binning;
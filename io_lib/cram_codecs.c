@@ -345,8 +345,10 @@ static char *cram_extract_block(cram_block *b, int size) {
  */
 int cram_external_decode_int(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int32_t *out_i = (int32_t *)out;
+    char *cp, *cp_end;
     cram_block *b;
+    int n = *out_size, err = 0;
 
     /* Find the external block */
     b = cram_get_block_by_id(slice, c->external.content_id);
@@ -354,19 +356,20 @@ int cram_external_decode_int(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int32_t *)out = c->vv->varint_get32(&cp, (char *)b->data + b->uncomp_size, &err);
+    cp_end = (char *)b->data + b->uncomp_size;
+    n = c->vv->varint_get32_blk(&cp, cp_end, out_i, n, &err);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    *out_size = n;
 
     return err ? -1 : 0;
 }
 
 int cram_external_decode_long(cram_slice *slice, cram_codec *c,
 			      cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int64_t *out_i = (int64_t *)out;
+    char *cp, *cp_end;
     cram_block *b;
+    int n = *out_size, err = 0;
 
     /* Find the external block */
     b = cram_get_block_by_id(slice, c->external.content_id);
@@ -374,11 +377,10 @@ int cram_external_decode_long(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int64_t *)out = c->vv->varint_get64(&cp, (char *)b->data + b->uncomp_size, &err);
+    cp_end = (char *)b->data + b->uncomp_size;
+    n = c->vv->varint_get64_blk(&cp, cp_end, out_i, n, &err);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    *out_size = n;
 
     return err ? -1 : 0;
 }
@@ -620,8 +622,10 @@ cram_codec *cram_external_encode_init(cram_stats *st,
  */
 int cram_varint_decode_int(cram_slice *slice, cram_codec *c,
 			   cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int32_t *out_i = (int32_t *)out;
+    char *cp, *cp_end;
     cram_block *b;
+    int i, n = *out_size, err = 0;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -629,19 +633,24 @@ int cram_varint_decode_int(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int32_t *)out = c->vv->varint_get32(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    cp_end = (char *)b->data + b->uncomp_size;
+    n = c->vv->varint_get32_blk(&cp, cp_end, out_i, n, &err);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    *out_size = n;
+
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
 
 int cram_varint_decode_sint(cram_slice *slice, cram_codec *c,
 			      cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int32_t *out_i = (int32_t *)out;
+    char *cp, *cp_end;
     cram_block *b;
+    int i, n = *out_size, err = 0;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -649,19 +658,24 @@ int cram_varint_decode_sint(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int32_t *)out = c->vv->varint_get32s(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    cp_end = (char *)b->data + b->uncomp_size;
+    n = c->vv->varint_get32s_blk(&cp, cp_end, out_i, n, &err);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    *out_size = n;
+
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
 
 int cram_varint_decode_long(cram_slice *slice, cram_codec *c,
 			      cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int64_t *out_i = (int64_t *)out;
+    char *cp, *cp_end;
     cram_block *b;
+    int i, n = *out_size, err = 0;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -669,19 +683,24 @@ int cram_varint_decode_long(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int64_t *)out = c->vv->varint_get64(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    cp_end = (char *)b->data + b->uncomp_size;
+    n = c->vv->varint_get64_blk(&cp, cp_end, out_i, n, &err);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    *out_size = n;
+
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
 
 int cram_varint_decode_slong(cram_slice *slice, cram_codec *c,
 			       cram_block *in, char *out, int *out_size) {
-    char *cp;
+    int64_t *out_i = (int64_t *)out;
+    char *cp, *cp_end;
     cram_block *b;
+    int i, n = *out_size, err = 0;
 
     /* Find the data block */
     b = cram_get_block_by_id(slice, c->varint.content_id);
@@ -689,11 +708,14 @@ int cram_varint_decode_slong(cram_slice *slice, cram_codec *c,
         return *out_size?-1:0;
 
     cp = (char *)b->data + b->idx;
-    // E_INT and E_LONG are guaranteed single item queries
-    int err = 0;
-    *(int64_t *)out = c->vv->varint_get64s(&cp, (char *)b->data + b->uncomp_size, &err) + c->varint.offset;
+    cp_end = (char *)b->data + b->uncomp_size;
+    n = c->vv->varint_get64s_blk(&cp, cp_end, out_i, n, &err);
     b->idx = cp - (char *)b->data;
-    *out_size = 1;
+    *out_size = n;
+
+    if (c->varint.offset)
+	for (i = 0; i < n; i++)
+	    out_i[i] += c->varint.offset;
 
     return err ? -1 : 0;
 }
@@ -1238,6 +1260,9 @@ int cram_xpack_decode_long(cram_slice *slice, cram_codec *c, cram_block *in, cha
     int i, n = *out_size;
 
     if (c->xpack.nbits) {
+        if (cram_not_enough_bits(in, c->xpack.nbits * n))
+	    return -1;
+
 	for (i = 0; i < n; i++)
 	    out_i[i] = c->xpack.rmap[get_bits_MSB(in, c->xpack.nbits)];
     } else {
@@ -1558,24 +1583,40 @@ static uint32_t zigzag32(int32_t x) { return (x << 1) ^ (x >> 31); }
 //static int8_t  unzigzag8 (uint8_t  x) { return (x >> 1) ^ -(x & 1); }
 static int16_t unzigzag16(uint16_t x) { return (x >> 1) ^ -(x & 1); }
 static int32_t unzigzag32(uint32_t x) { return (x >> 1) ^ -(x & 1); }
+static int64_t unzigzag64(uint64_t x) { return (x >> 1) ^ -(x & 1); }
 
+/*
+ * The sub-codec decodes all *out_size zig-zagged deltas straight into
+ * out, which are then turned back into values in place.
+ */
 int cram_xdelta_decode_long(cram_slice *slice, cram_codec *c, cram_block *in, char *out, int *out_size) {
-    return -1;
+    uint64_t *out64 = (uint64_t *)out;
+    int64_t last = c->xdelta.last;
+    int i, n = *out_size;
+
+    if (c->xdelta.sub_codec->decode(slice, c->xdelta.sub_codec, in,
+				    out, &n) < 0 || n != *out_size)
+	return -1;
+
+    for (i = 0; i < n; i++)
+	out64[i] = last += unzigzag64(out64[i]);
+    c->xdelta.last = last;
+
+    return 0;
 }
 
 int cram_xdelta_decode_int(cram_slice *slice, cram_codec *c, cram_block *in, char *out, int *out_size) {
-    // Slow value-by-value method for now
     uint32_t *out32 = (uint32_t *)out;
-    int i;
-    for (i = 0; i < *out_size; i++) {
-	uint32_t v;
-	int one = 1;
-	if (c->e_xdelta.sub_codec->decode(slice, c->e_xdelta.sub_codec, in,
-					  (char *)&v, &one) < 0)
-	    return -1;
-	uint32_t d = unzigzag32(v);
-	c->xdelta.last = out32[i] = d + c->xdelta.last;
-    }
+    uint32_t last = c->xdelta.last;
+    int i, n = *out_size;
+
+    if (c->xdelta.sub_codec->decode(slice, c->xdelta.sub_codec, in,
+				    out, &n) < 0 || n != *out_size)
+	return -1;
+
+    for (i = 0; i < n; i++)
+	out32[i] = last += unzigzag32(out32[i]);
+    c->xdelta.last = last;
 
     return 0;
 }
@@ -1927,14 +1968,18 @@ cram_codec *cram_xdelta_encode_init(cram_stats *st,
  * of all elements enmasse instead of needing to only extract the bits
  * necessary per item.
  */
+/*
+ * Only byte data can be XRLE encoded at present; cram_xrle_encode_int
+ * and _long write nothing, so there is no integer layout to decode.
+ */
 int cram_xrle_decode_long(cram_slice *slice, cram_codec *c, cram_block *in, char *out, int *out_size) {
-    // TODO
-    return 0;
+    fprintf(stderr, "XRLE is not supported for integer data series\n");
+    return -1;
 }
 
 int cram_xrle_decode_int(cram_slice *slice, cram_codec *c, cram_block *in, char *out, int *out_size) {
-    // TODO
-    return 0;
+    fprintf(stderr, "XRLE is not supported for integer data series\n");
+    return -1;
 }
 
 // Expands an XRLE transform and caches result in slice->block_by_id[]
@@ -2495,9 +2540,76 @@ void cram_huffman_decode_free(cram_codec *c) {
 
     if (c->huffman.codes)
 	free(c->huffman.codes);
+    if (c->huffman.lut)
+	free(c->huffman.lut);
     free(c);
 }
 
+/*
+ * Returns the next nbits (<= 17) of input, MSB first, without consuming
+ * them.  Bits beyond the end of the block read as zero; callers must
+ * check the length of the code actually decoded against the remaining
+ * input.
+ */
+static inline uint32_t huffman_peek(cram_block *in, int nbits) {
+    size_t b = in->byte, sz = in->uncomp_size;
+    uint32_t w;
+
+    if (b + 3 <= sz) {
+	w = (in->data[b] << 16) | (in->data[b+1] << 8) | in->data[b+2];
+    } else {
+	w  = (b   < sz ? in->data[b]   : 0) << 16;
+	w |= (b+1 < sz ? in->data[b+1] : 0) << 8;
+	w |= (b+2 < sz ? in->data[b+2] : 0);
+    }
+
+    return ((w << (7 - in->bit)) & 0xffffff) >> (24 - nbits);
+}
+
+static inline void huffman_skip(cram_block *in, int nbits) {
+    size_t pos = in->byte*8 + (7 - in->bit) + nbits;
+    in->byte = pos >> 3;
+    in->bit  = 7 - (pos & 7);
+}
+
+/*
+ * Decodes a single symbol using the lookup table, storing its index
+ * into the codes array in *idx.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static inline int huffman_decode_lut(cram_huffman_decoder *h,
+				     cram_block *in, int *idx) {
+    uint32_t v = huffman_peek(in, h->lut_bits);
+    uint32_t e = h->lut[v];
+    int len;
+
+    if ((len = e & 0xff)) {
+	if (cram_not_enough_bits(in, len))
+	    return -1;
+	huffman_skip(in, len);
+	*idx = e >> 8;
+	return 0;
+    }
+
+    /* Prefix of a longer code, or an unused code */
+    if (cram_not_enough_bits(in, h->lut_bits))
+	return -1;
+    huffman_skip(in, h->lut_bits);
+    for (len = h->lut_bits + 1; len <= h->max_len; len++) {
+	if (cram_not_enough_bits(in, 1))
+	    return -1;
+	GET_BIT_MSB(in, v);
+	if (v - (uint32_t)h->first_code[len] < (uint32_t)h->count[len]) {
+	    *idx = h->first_idx[len] + v - h->first_code[len];
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
 int cram_huffman_decode_null(cram_slice *slice, cram_codec *c,
 			     cram_block *in, char *out, int *out_size) {
     return -1;
@@ -2522,6 +2634,17 @@ int cram_huffman_decode_char(cram_slice *slice, cram_codec *c,
     int i, n, ncodes = c->huffman.ncodes;
     const cram_huffman_code * const codes = c->huffman.codes;
 
+    if (c->huffman.lut) {
+	for (i = 0, n = *out_size; i < n; i++) {
+	    int idx;
+	    if (huffman_decode_lut(&c->huffman, in, &idx) < 0)
+		return -1;
+	    if (out)
+		out[i] = codes[idx].symbol;
+	}
+	return 0;
+    }
+
     for (i = 0, n = *out_size; i < n; i++) {
 	int idx = 0;
 	int val = 0, len = 0, last_len = 0;
@@ -2572,6 +2695,16 @@ int cram_huffman_decode_int(cram_slice *slice, cram_codec *c,
     int i, n, ncodes = c->huffman.ncodes;
     const cram_huffman_code * const codes = c->huffman.codes;
 
+    if (c->huffman.lut) {
+	for (i = 0, n = *out_size; i < n; i++) {
+	    int idx;
+	    if (huffman_decode_lut(&c->huffman, in, &idx) < 0)
+		return -1;
+	    out_i[i] = codes[idx].symbol;
+	}
+	return 0;
+    }
+
     for (i = 0, n = *out_size; i < n; i++) {
 	int idx = 0;
 	int val = 0, len = 0, last_len = 0;
@@ -2622,6 +2755,16 @@ int cram_huffman_decode_long(cram_slice *slice, cram_codec *c,
     int i, n, ncodes = c->huffman.ncodes;
     const cram_huffman_code * const codes = c->huffman.codes;
 
+    if (c->huffman.lut) {
+	for (i = 0, n = *out_size; i < n; i++) {
+	    int idx;
+	    if (huffman_decode_lut(&c->huffman, in, &idx) < 0)
+		return -1;
+	    out_i[i] = codes[idx].symbol;
+	}
+	return 0;
+    }
+
     for (i = 0, n = *out_size; i < n; i++) {
 	int idx = 0;
 	int val = 0, len = 0, last_len = 0;
@@ -2653,6 +2796,55 @@ int cram_huffman_decode_long(cram_slice *slice, cram_codec *c,
     return 0;
 }
 
+/*
+ * Builds the lookup table for decoding whole symbols at a time from the
+ * sorted canonical codes.  Code sets with ridiculously long codes or
+ * too many symbols to fit in a table entry are left with lut == NULL
+ * and use the bit at a time decoder instead.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_huffman_build_lut(cram_huffman_decoder *h) {
+    cram_huffman_code *codes = h->codes;
+    int i, ncodes = h->ncodes, max_len = codes[ncodes-1].len;
+    uint32_t j, lut_size;
+
+    if (max_len > HUFF_MAX_LEN || ncodes >= (1<<24))
+	return 0;
+
+    memset(h->count, 0, sizeof(h->count));
+    for (i = ncodes-1; i >= 0; i--) {
+	h->first_code[codes[i].len] = codes[i].code;
+	h->first_idx[codes[i].len] = i;
+	h->count[codes[i].len]++;
+    }
+
+    h->max_len = max_len;
+    h->lut_bits = MIN(max_len, HUFF_LUT_BITS);
+    lut_size = 1 << h->lut_bits;
+    if (!(h->lut = calloc(lut_size, sizeof(*h->lut))))
+	return -1;
+
+    for (i = 0; i < ncodes && codes[i].len <= h->lut_bits; i++) {
+	int shift = h->lut_bits - codes[i].len;
+	uint32_t start = (uint32_t)codes[i].code << shift;
+	uint32_t end = start + (1 << shift);
+
+	if (end > lut_size) {
+	    // Over-subscribed code set; leave it to the slow path
+	    free(h->lut);
+	    h->lut = NULL;
+	    return 0;
+	}
+
+	for (j = start; j < end; j++)
+	    h->lut[j] = (i << 8) | codes[i].len;
+    }
+
+    return 0;
+}
+
 /*
  * Initialises a huffman decoder from an encoding data stream.
  */
@@ -2761,6 +2953,12 @@ cram_codec *cram_huffman_decode_init(cram_block_compression_hdr *hdr,
 	codes[i].p = j;
     }
 
+    if (codes[0].len > 0 && cram_huffman_build_lut(&h->huffman) < 0) {
+	free(codes);
+	free(h);
+	return NULL;
+    }
+
 //    puts("==HUFF LEN==");
 //    for (i = 0; i <= last_len+1; i++) {
 //	printf("len %d=%d prefix %d\n", i, h->huffman.lengths[i], h->huffman.prefix[i]); 
@@ -3832,6 +4030,8 @@ int cram_codec_decoder2encoder(cram_fd *fd, cram_codec *c) {
 	t->codec = E_HUFFMAN;
 	t->free = cram_huffman_encode_free;
 	t->store = cram_huffman_encode_store;
+	if (c->huffman.lut)
+	    free(c->huffman.lut);
 	t->e_huffman.codes = c->huffman.codes;
 	t->e_huffman.nvals = c->huffman.ncodes;
 	t->e_huffman.option = c->huffman.option;
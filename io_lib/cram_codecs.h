@@ -62,10 +62,25 @@ typedef struct {
     int32_t len;
 } cram_huffman_code;
 
+/*
+ * The decoder also has a lookup table indexed by the next lut_bits bits
+ * of input, giving (code index << 8) | code length for every code of up
+ * to lut_bits long, or 0 for prefixes of longer codes.  These are then
+ * resolved a bit at a time using the canonical code ranges per length.
+ */
+#define HUFF_LUT_BITS 10
+#define HUFF_MAX_LEN  31
+
 typedef struct {
     int ncodes;
     cram_huffman_code *codes;
     int option;
+
+    uint32_t *lut;  // NULL if codes are unsuitable; use the slow path
+    int lut_bits, max_len;
+    int32_t first_code[HUFF_MAX_LEN+1]; // first code of each length
+    int32_t first_idx[HUFF_MAX_LEN+1];  // and its index in codes[]
+    int32_t count[HUFF_MAX_LEN+1];      // number of codes of each length
 } cram_huffman_decoder;
 
 #define MAX_HUFF 128
@@ -173,6 +188,8 @@ typedef struct cram_codec {
     varint_vec *vv;
     int codec_id;
     void (*free)(struct cram_codec *codec);
+    // Decodes *out_size items.  For fixed width types (byte, int, long)
+    // this may be many values at once, making it a bulk decoder.
     int (*decode)(cram_slice *slice, struct cram_codec *codec,
 		  cram_block *in, char *out, int *out_size);
     int (*encode)(cram_slice *slice, struct cram_codec *codec,
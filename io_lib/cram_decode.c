@@ -611,19 +611,173 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
 
 
 /*
+ * Parallel block decompression.  Decoding a slice needs most of its
+ * blocks, so we uncompress them all up front spread over the thread
+ * pool, largest first.
+ */
+typedef struct {
+    cram_block **b;
+    int nb;
+} cram_uncomp_list;
+
+/* Blocks smaller than this aren't worth a pool job of their own */
+#define UNCOMP_JOB_MIN 10000
+
+static int cram_uncompress_job(void *arg, int i) {
+    cram_uncomp_list *l = (cram_uncomp_list *)arg;
+    return cram_uncompress_block(l->b[i]);
+}
+
+/*
+ * Uncompresses the blocks of s for which used[] is set, or all blocks
+ * if used is NULL.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_uncompress_blocks(cram_fd *fd, cram_slice *s, int *used) {
+    cram_uncomp_list l;
+    int i, n = 0, ret;
+
+    if (!fd->pool) {
+	for (i = 0; i < s->hdr->num_blocks; i++)
+	    if ((!used || used[i]) && cram_uncompress_block(s->block[i]))
+		return -1;
+	return 0;
+    }
+
+    if (!(l.b = malloc(s->hdr->num_blocks * sizeof(*l.b))))
+	return -1;
+
+    for (i = l.nb = 0; i < s->hdr->num_blocks; i++) {
+	cram_block *b = s->block[i];
+	int k;
+
+	if (used && !used[i])
+	    continue;
+
+	for (k = l.nb++; k > 0 && l.b[k-1]->comp_size < b->comp_size; k--)
+	    l.b[k] = l.b[k-1];
+	l.b[k] = b;
+	n += b->method != RAW && b->comp_size >= UNCOMP_JOB_MIN;
+    }
+
+    ret = t_pool_parallel_for(fd->pool, l.nb, MIN(n-1, fd->pool->tsize-1),
+			      cram_uncompress_job, &l);
+    free(l.b);
+
+    return ret;
+}
+
+/*
+ * Returns 1 if the external block with content id 'id' is needed to
+ * decode the data series in r, 0 if not.
+ */
+int cram_required_id(cram_required *r, int32_t id) {
+    int i;
+
+    for (i = 0; i < r->nids; i++)
+	if (r->ids[i] == id)
+	    return 1;
+
+    return 0;
+}
+
+/*
+ * Adds the blocks read by codec c to r, noting in *core_used whether
+ * it reads from the CORE block.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_required_add(cram_required *r, cram_codec *c,
+			     int *core_used) {
+    int bnum1, bnum2;
+
+    bnum1 = cram_codec_to_id(c, &bnum2);
+
+    for (;;) {
+	switch (bnum1) {
+	case -2:
+	    break;
+
+	case -1:
+	    *core_used = 1;
+	    break;
+
+	default:
+	    if (!cram_required_id(r, bnum1)) {
+		int32_t *ids = realloc(r->ids, (r->nids+1) * sizeof(*ids));
+		if (!ids)
+		    return -1;
+		r->ids = ids;
+		r->ids[r->nids++] = bnum1;
+	    }
+	    break;
+	}
+
+	if (bnum2 == -2 || bnum1 == bnum2)
+	    break;
+
+	bnum1 = bnum2; // 2nd pass
+    }
+
+    return 0;
+}
+
+/*
+ * Returns 1 if codec c reads from any block already in r, or from the
+ * CORE block when core_used is set.  Otherwise returns 0.
+ */
+static int cram_required_shared(cram_required *r, cram_codec *c,
+				int core_used) {
+    int bnum1, bnum2;
+
+    bnum1 = cram_codec_to_id(c, &bnum2);
+
+    for (;;) {
+	switch (bnum1) {
+	case -2:
+	    break;
+
+	case -1:
+	    if (core_used)
+		return 1;
+	    break;
+
+	default:
+	    if (cram_required_id(r, bnum1))
+		return 1;
+	    break;
+	}
+
+	if (bnum2 == -2 || bnum1 == bnum2)
+	    break;
+
+	bnum1 = bnum2; // 2nd pass
+    }
+
+    return 0;
+}
+
+/*
+ * Works out which data series and which external blocks are needed to
+ * decode the fields in fd->required_fields for containers using
+ * compression header hdr.
+ *
  * Note we also need to scan through the record encoding map to
  * see which data series share the same block, either external or
  * CORE. For example if we need the BF data series but MQ and CF
  * are also encoded in the same block then we need to add those in
  * as a dependency in order to correctly decode BF.
  *
- * Returns 0 on success
- *        -1 on failure
+ * Returns a cram_required struct on success, to be freed with
+ *           cram_required_free();
+ *         NULL on failure
  */
-int cram_dependent_data_series(cram_fd *fd,
-			       cram_block_compression_hdr *hdr,
-			       cram_slice *s) {
-    int *block_used;
+cram_required *cram_required_new(cram_fd *fd,
+				 cram_block_compression_hdr *hdr) {
+    cram_required *r;
     int core_used = 0;
     int i;
     static int i_to_id[] = {
@@ -632,79 +786,58 @@ int cram_dependent_data_series(cram_fd *fd,
 	DS_NS, DS_NP, DS_TS, DS_MF, DS_CF, DS_RI, DS_RS, DS_PD,
 	DS_HC, DS_SC, DS_BB, DS_QQ,
     };
-    uint32_t orig_ds;
+    uint32_t ds = 0, orig_ds;
+
+    if (!(r = calloc(1, sizeof(*r))))
+	return NULL;
+    r->fields = fd->required_fields;
 
     /*
      * Set the data_series bit field based on fd->required_fields
      * contents.
      */
-    if (fd->required_fields && fd->required_fields != INT_MAX) {
-	s->data_series = 0;
-
-	if (fd->required_fields & SAM_QNAME)
-	    s->data_series |= CRAM_RN;
-
-	if (fd->required_fields & SAM_FLAG)
-	    s->data_series |= CRAM_BF;
-
-	if (fd->required_fields & SAM_RNAME)
-	    s->data_series |= CRAM_RI | CRAM_BF;
-
-	if (fd->required_fields & SAM_POS)
-	    s->data_series |= CRAM_AP | CRAM_BF;
+    if (fd->required_fields & SAM_QNAME)
+	ds |= CRAM_RN;
 
-	if (fd->required_fields & SAM_MAPQ)
-	    s->data_series |= CRAM_MQ;
+    if (fd->required_fields & SAM_FLAG)
+	ds |= CRAM_BF;
 
-	if (fd->required_fields & SAM_CIGAR)
-	    s->data_series |= CRAM_CIGAR;
+    if (fd->required_fields & SAM_RNAME)
+	ds |= CRAM_RI | CRAM_BF;
 
-	if (fd->required_fields & SAM_RNEXT)
-	    s->data_series |= CRAM_CF | CRAM_NF | CRAM_RI | CRAM_NS |CRAM_BF;
+    if (fd->required_fields & SAM_POS)
+	ds |= CRAM_AP | CRAM_BF;
 
-	if (fd->required_fields & SAM_PNEXT)
-	    s->data_series |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_NP | CRAM_BF;
+    if (fd->required_fields & SAM_MAPQ)
+	ds |= CRAM_MQ;
 
-	if (fd->required_fields & SAM_TLEN)
-	    s->data_series |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_TS |
-		CRAM_BF | CRAM_MF | CRAM_RI | CRAM_CIGAR;
+    if (fd->required_fields & SAM_CIGAR)
+	ds |= CRAM_CIGAR;
 
-	if (fd->required_fields & SAM_SEQ)
-	    s->data_series |= CRAM_SEQ;
+    if (fd->required_fields & SAM_RNEXT)
+	ds |= CRAM_CF | CRAM_NF | CRAM_RI | CRAM_NS |CRAM_BF;
 
-	if (!(fd->required_fields & SAM_AUX))
-	    // No easy way to get MD/NM without other tags at present
-	    s->decode_md = 0;
+    if (fd->required_fields & SAM_PNEXT)
+	ds |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_NP | CRAM_BF;
 
-	if (fd->required_fields & SAM_QUAL) {
-	    s->data_series |= CRAM_QUAL;
-	    if (CRAM_MAJOR_VERS(fd->version) >= 4)
-		s->data_series |= CRAM_BF;
-	}
-
-	if (fd->required_fields & SAM_AUX)
-	    s->data_series |= CRAM_RG | CRAM_TL | CRAM_aux;
-
-	if (fd->required_fields & SAM_RGAUX)
-	    s->data_series |= CRAM_RG | CRAM_BF;
-
-	// Always uncompress CORE block
-	if (cram_uncompress_block(s->block[0]))
-	    return -1;
-    } else {
-	s->data_series = CRAM_ALL;
+    if (fd->required_fields & SAM_TLEN)
+	ds |= CRAM_CF | CRAM_NF | CRAM_AP | CRAM_TS |
+	    CRAM_BF | CRAM_MF | CRAM_RI | CRAM_CIGAR;
 
-	for (i = 0; i < s->hdr->num_blocks; i++) {
-	    if (cram_uncompress_block(s->block[i]))
-		return -1;
-	}
+    if (fd->required_fields & SAM_SEQ)
+	ds |= CRAM_SEQ;
 
-	return 0;
+    if (fd->required_fields & SAM_QUAL) {
+	ds |= CRAM_QUAL;
+	if (CRAM_MAJOR_VERS(fd->version) >= 4)
+	    ds |= CRAM_BF;
     }
 
-    block_used = calloc(s->hdr->num_blocks+1, sizeof(int));
-    if (!block_used)
-	return -1;
+    if (fd->required_fields & SAM_AUX)
+	ds |= CRAM_RG | CRAM_TL | CRAM_aux;
+
+    if (fd->required_fields & SAM_RGAUX)
+	ds |= CRAM_RG | CRAM_BF;
 
     do {
 	/*
@@ -715,125 +848,56 @@ int cram_dependent_data_series(cram_fd *fd,
 	 * It's not reciprocal though. We may be needing to decode FN
 	 * but have no need to decode FC, FP and cigar ops.
 	 */
-	if (s->data_series & CRAM_RS)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_PD)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_HC)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_QS)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_IN)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_SC)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_BS)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_DL)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_BA)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_BB)    s->data_series |= CRAM_FC|CRAM_FP;
-	if (s->data_series & CRAM_QQ)    s->data_series |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_RS)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_PD)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_HC)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_QS)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_IN)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_SC)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_BS)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_DL)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_BA)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_BB)    ds |= CRAM_FC|CRAM_FP;
+	if (ds & CRAM_QQ)    ds |= CRAM_FC|CRAM_FP;
 
 	// cram_decode_seq() needs seq[] array
-	if (s->data_series & (CRAM_SEQ|CRAM_CIGAR)) s->data_series |= CRAM_RL;
-
-	if (s->data_series & CRAM_FP)    s->data_series |= CRAM_FC;
-	if (s->data_series & CRAM_FC)    s->data_series |= CRAM_FN;
-	if (s->data_series & CRAM_aux)   s->data_series |= CRAM_TL;
-	if (s->data_series & CRAM_MF)    s->data_series |= CRAM_CF;
-	if (s->data_series & CRAM_MQ)    s->data_series |= CRAM_BF;
-	if (s->data_series & CRAM_BS)    s->data_series |= CRAM_RI;
-	if (s->data_series & (CRAM_MF |CRAM_NS |CRAM_NP |CRAM_TS |CRAM_NF))
-	    s->data_series |= CRAM_CF;
-	if (!hdr->read_names_included && s->data_series & CRAM_RN)
-	    s->data_series |= CRAM_CF | CRAM_NF;
-	if (s->data_series & (CRAM_BA | CRAM_QS | CRAM_BB | CRAM_QQ))
-	    s->data_series |= CRAM_BF | CRAM_CF | CRAM_RL;
-
-	orig_ds = s->data_series;
+	if (ds & (CRAM_SEQ|CRAM_CIGAR)) ds |= CRAM_RL;
+
+	if (ds & CRAM_FP)    ds |= CRAM_FC;
+	if (ds & CRAM_FC)    ds |= CRAM_FN;
+	if (ds & CRAM_aux)   ds |= CRAM_TL;
+	if (ds & CRAM_MF)    ds |= CRAM_CF;
+	if (ds & CRAM_MQ)    ds |= CRAM_BF;
+	if (ds & CRAM_BS)    ds |= CRAM_RI;
+	if (ds & (CRAM_MF |CRAM_NS |CRAM_NP |CRAM_TS |CRAM_NF))
+	    ds |= CRAM_CF;
+	if (!hdr->read_names_included && ds & CRAM_RN)
+	    ds |= CRAM_CF | CRAM_NF;
+	if (ds & (CRAM_BA | CRAM_QS | CRAM_BB | CRAM_QQ))
+	    ds |= CRAM_BF | CRAM_CF | CRAM_RL;
+
+	orig_ds = ds;
 
 	// Find which blocks are in use.
 	for (i = 0; i < sizeof(i_to_id)/sizeof(*i_to_id); i++) {
-	    int bnum1, bnum2, j;
 	    cram_codec *c = hdr->codecs[i_to_id[i]];
 
-	    if (!(s->data_series & (1<<i)))
-		continue;
-
-	    if (!c)
+	    if (!(ds & (1<<i)) || !c)
 		continue;
 
-	    bnum1 = cram_codec_to_id(c, &bnum2);
-
-	    for (;;) {
-		switch (bnum1) {
-		case -2:
-		    break;
-
-		case -1:
-		    core_used = 1;
-		    break;
-
-		default:
-		    for (j = 0; j < s->hdr->num_blocks; j++) {
-			if (s->block[j]->content_type == EXTERNAL &&
-			    s->block[j]->content_id == bnum1) {
-			    block_used[j] = 1;
-			    if (cram_uncompress_block(s->block[j])) {
-				free(block_used);
-				return -1;
-			    }
-			}
-		    }
-		    break;
-		}
-
-		if (bnum2 == -2 || bnum1 == bnum2)
-		    break;
-
-		bnum1 = bnum2; // 2nd pass
-	    }
+	    if (cram_required_add(r, c, &core_used) < 0)
+		goto err;
 	}
 
 	// Tags too
-	if ((fd->required_fields & SAM_AUX) ||
-	    (s->data_series & CRAM_aux)) {
+	if ((fd->required_fields & SAM_AUX) || (ds & CRAM_aux)) {
 	    for (i = 0; i < CRAM_MAP_HASH; i++) {
-		int bnum1, bnum2, j;
-		cram_map *m = hdr->tag_encoding_map[i];
-
-		while (m) {
-		    cram_codec *c = m->codec;
-		    if (!c) {
-			m = m->next;
-			continue;
-		    }
-
-		    bnum1 = cram_codec_to_id(c, &bnum2);
-
-		    for (;;) {
-			switch (bnum1) {
-			case -2:
-			    break;
-
-			case -1:
-			    core_used = 1;
-			    break;
-
-			default:
-			    for (j = 0; j < s->hdr->num_blocks; j++) {
-				if (s->block[j]->content_type == EXTERNAL &&
-				    s->block[j]->content_id == bnum1) {
-				    block_used[j] = 1;
-				    if (cram_uncompress_block(s->block[j])) {
-					free(block_used);
-					return -1;
-				    }
-				}
-			    }
-			    break;
-			}
-
-			if (bnum2 == -2 || bnum1 == bnum2)
-			    break;
-
-			bnum1 = bnum2; // 2nd pass
-		    }
+		cram_map *m;
 
-		    m = m->next;
+		for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+		    if (m->codec &&
+			cram_required_add(r, m->codec, &core_used) < 0)
+			goto err;
 		}
 	    }
 	}
@@ -841,97 +905,93 @@ int cram_dependent_data_series(cram_fd *fd,
 	// We now know which blocks are in used, so repeat and find
 	// which other data series need to be added.
 	for (i = 0; i < sizeof(i_to_id)/sizeof(*i_to_id); i++) {
-	    int bnum1, bnum2, j;
 	    cram_codec *c = hdr->codecs[i_to_id[i]];
 
-	    if (!c)
-		continue;
+	    if (c && cram_required_shared(r, c, core_used))
+		ds |= 1<<i;
+	}
 
-	    bnum1 = cram_codec_to_id(c, &bnum2);
+	// Tags too.  Any tag in CORE also implies CRAM_aux.
+	for (i = 0; i < CRAM_MAP_HASH; i++) {
+	    cram_map *m;
 
-	    for (;;) {
-		switch (bnum1) {
-		case -2:
-		    break;
+	    for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+		if (m->codec && cram_required_shared(r, m->codec, 1))
+		    ds |= CRAM_aux;
+	    }
+	}
+    } while (orig_ds != ds);
 
-		case -1:
-		    if (core_used) {
-			//printf(" + data series %08x:\n", 1<<i);
-			s->data_series |= 1<<i;
-		    }
-		    break;
+    r->data_series = ds;
+    return r;
 
-		default:
-		    for (j = 0; j < s->hdr->num_blocks; j++) {
-			if (s->block[j]->content_type == EXTERNAL &&
-			    s->block[j]->content_id == bnum1) {
-			    if (block_used[j]) {
-				//printf(" + data series %08x:\n", 1<<i);
-				s->data_series |= 1<<i;
-			    }
-			}
-		    }
-		    break;
-		}
+ err:
+    cram_required_free(r);
+    return NULL;
+}
 
-		if (bnum2 == -2 || bnum1 == bnum2)
-		    break;
+void cram_required_free(cram_required *r) {
+    if (!r)
+	return;
 
-		bnum1 = bnum2; // 2nd pass
-	    }
-	}
+    free(r->ids);
+    free(r);
+}
 
-	// Tags too
-	for (i = 0; i < CRAM_MAP_HASH; i++) {
-	    int bnum1, bnum2, j;
-	    cram_map *m = hdr->tag_encoding_map[i];
+/*
+ * Sets s->data_series to the data series needed for fd->required_fields
+ * and uncompresses the blocks holding them.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_dependent_data_series(cram_fd *fd,
+			       cram_block_compression_hdr *hdr,
+			       cram_slice *s) {
+    cram_required *r = hdr->required, *r_tmp = NULL;
+    int *block_used;
+    int i;
 
-	    while (m) {
-		cram_codec *c = m->codec;
-		if (!c) {
-		    m = m->next;
-		    continue;
-		}
+    if (!fd->required_fields || fd->required_fields == INT_MAX) {
+	s->data_series = CRAM_ALL;
 
-		bnum1 = cram_codec_to_id(c, &bnum2);
-		
-		for (;;) {
-		    switch (bnum1) {
-		    case -2:
-			break;
+	return cram_uncompress_blocks(fd, s, NULL);
+    }
 
-		    case -1:
-			//printf(" + data series %08x:\n", CRAM_aux);
-			s->data_series |= CRAM_aux;
-			break;
+    // Usually computed once per container by cram_next_slice().
+    // Otherwise work it out here, without caching it in hdr as other
+    // slices of this container may be being decoded in parallel.
+    if (!r || r->fields != fd->required_fields)
+	if (!(r = r_tmp = cram_required_new(fd, hdr)))
+	    return -1;
 
-		    default:
-			for (j = 0; j < s->hdr->num_blocks; j++) {
-			    if (s->block[j]->content_type == EXTERNAL &&
-				s->block[j]->content_id == bnum1) {
-				if (block_used[j]) {
-				    //printf(" + data series %08x:\n",
-				    //       CRAM_aux);
-				    s->data_series |= CRAM_aux;
-				}
-			    }
-			}
-			break;
-		    }
+    s->data_series = r->data_series;
 
-		    if (bnum2 == -2 || bnum1 == bnum2)
-			break;
+    if (!(fd->required_fields & SAM_AUX))
+	// No easy way to get MD/NM without other tags at present
+	s->decode_md = 0;
 
-		    bnum1 = bnum2; // 2nd pass
-		}
+    // Always uncompress CORE block
+    if (cram_uncompress_block(s->block[0])) {
+	cram_required_free(r_tmp);
+	return -1;
+    }
 
-		m = m->next;
-	    }
-	}
-    } while (orig_ds != s->data_series);
+    block_used = calloc(s->hdr->num_blocks+1, sizeof(int));
+    if (!block_used) {
+	cram_required_free(r_tmp);
+	return -1;
+    }
 
+    for (i = 0; i < s->hdr->num_blocks; i++)
+	block_used[i] = s->block[i]->content_type == EXTERNAL &&
+	    cram_required_id(r, s->block[i]->content_id);
+
+    i = cram_uncompress_blocks(fd, s, block_used);
     free(block_used);
-    return 0;
+    cram_required_free(r_tmp);
+
+    return i;
 }
 
 /*
@@ -1275,14 +1335,184 @@ static int sort_freqs(const void *vp1, const void *vp2) {
  * Primary CRAM sequence decoder
  */
 
+/*
+ * Records a decoded feature against cr, for use when fd->keep_features
+ * is set.  seq_len and ref_len are the number of sequence and reference
+ * bases the feature consumed, and len the decoded length for features
+ * consuming neither (H and P).  qual may be NULL if not decoded.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_keep_feature(cram_slice *s, cram_record *cr, char op, int pos,
+			     int seq_len, int ref_len, int32_t len,
+			     char *seq, char *qual) {
+    cram_feature *f;
+
+    if (s->nfeatures >= s->afeatures) {
+	int a = s->afeatures ? s->afeatures*2 : 1024;
+	cram_feature *fn = realloc(s->features, a * sizeof(*fn));
+	if (!fn)
+	    return -1;
+	s->features = fn;
+	s->afeatures = a;
+    }
+
+    f = &s->features[s->nfeatures++];
+    cr->nfeature++;
+    f->X.pos = pos;
+    f->X.code = op;
+
+    switch (op) {
+    case 'X':
+	f->X.base = pos <= cr->len ? seq[pos-1] : 'N';
+	break;
+
+    case 'B':
+	f->B.base = pos <= cr->len ? seq[pos-1] : 'N';
+	f->B.qual = qual && pos <= cr->len ? qual[pos-1] : 0;
+	break;
+
+    case 'i':
+	f->i.base = pos <= cr->len ? seq[pos-1] : 'N';
+	break;
+
+    case 'b':
+	f->b.seq_idx = cr->seq + pos-1;
+	f->b.len = seq_len;
+	break;
+
+    case 'S':
+	f->S.seq_idx = cr->seq + pos-1;
+	f->S.len = seq_len;
+	break;
+
+    case 'I':
+	f->I.seq_idx = cr->seq + pos-1;
+	f->I.len = seq_len;
+	break;
+
+    case 'Q':
+	f->Q.qual = qual && pos <= cr->len ? qual[pos-1] : 0;
+	break;
+
+    case 'D':
+	f->D.len = ref_len;
+	break;
+
+    case 'N':
+	f->N.len = ref_len;
+	break;
+
+    case 'H':
+	f->H.len = len;
+	break;
+
+    case 'P':
+	f->P.len = len;
+	break;
+    }
+
+    return 0;
+}
+
+/*
+ * Multi-reference slices hold only the part of each reference spanned by
+ * the records decoded so far.  This ensures the window for reference id
+ * covers start..end (1-based, inclusive), fetching a larger one if not,
+ * and points s->ref at it.
+ *
+ * Windows grow by at least their current size, so a sorted slice unpacks
+ * O(span) bases of each reference in total rather than a copy per record.
+ * References which are not packed are shared rather than copied, so for
+ * those we simply take the whole sequence.
+ *
+ * Returns 0 on success
+ *        -1 on failure, with s->ref set to NULL
+ */
+static int cram_ref_win_cover(cram_fd *fd, cram_slice *s, int id,
+			      int64_t start, int64_t end) {
+    cram_ref_win *w = &s->ref_win[id];
+    char *seq, *copy;
+    int64_t len;
+
+    if (w->len < 0)
+	goto fail; // already failed; don't report it for every record
+
+    if (start < 1)
+	start = 1;
+    if (end < start)
+	end = start;
+
+    if (w->seq) {
+	if (end > w->len)
+	    end = w->len;
+	if (start >= w->start && end <= w->end)
+	    goto found;
+
+	start = start < w->start ? MIN(start, w->start - (w->end-w->start+1))
+	                         : w->start;
+	end   = end   > w->end   ? MAX(end,   w->end   + (w->end-w->start+1))
+	                         : w->end;
+	if (start < 1)
+	    start = 1;
+    }
+
+    if (!fd->refs->packed) {
+	start = 1;
+	end = 0;
+    }
+
+    if (!(seq = cram_get_ref_copy(fd, id, start, end, &copy))) {
+	if (!w->seq)
+	    w->len = -1;
+	goto fail;
+    }
+
+    if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
+    pthread_mutex_lock(&fd->refs->lock);
+    len = fd->refs->ref_id[id]->length;
+    pthread_mutex_unlock(&fd->refs->lock);
+    if (w->seq)
+	cram_ref_decr(fd->refs, id);
+    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+    free(w->copy);
+
+    w->seq   = seq;
+    w->copy  = copy;
+    w->start = start;
+    w->end   = end < 1 || end > len ? len : end;
+    w->len   = len;
+
+ found:
+    s->ref       = w->seq;
+    s->ref_start = w->start;
+    s->ref_end   = w->end;
+    s->ref_id    = id;
+    return 0;
+
+ fail:
+    s->ref = NULL;
+    s->ref_id = -1;
+    return -1;
+}
+
 /*
  * Internal part of cram_decode_slice().
  * Generates the sequence, quality and cigar components.
+ *
+ * With fd->keep_features set the decoded features are also appended to
+ * s->features, and the reference is not copied into the sequence unless
+ * needed to verify the slice's sequence (BD) checksum.  Otherwise only
+ * the bases at feature positions are then valid.
+ *
+ * mq is the already decoded mapping quality, or NULL if it is to be
+ * decoded here.
  */
 static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 			   cram_block *blk, cram_record *cr, SAM_hdr *bfd,
 			   int cf, char *seq, char *qual,
-			   int has_MD, int has_NM) {
+			   int has_MD, int has_NM, const int64_t *mq) {
     int prev_pos = 0, f, r = 0, out_sz = 1;
     int seq_pos = 1;
     int cig_len = 0;
@@ -1298,6 +1528,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
     int decode_md = s->ref && ((s->decode_md && !has_MD) || has_MD < 0);
     int decode_nm = s->ref && ((s->decode_md && !has_NM) || has_NM < 0);
     uint32_t ds = s->data_series;
+    int skip_ref = fd->keep_features &&
+	(fd->ignore_chksum || !s->hdr->BD_crc || !(ds & CRAM_BA));
 
     if ((ds & CRAM_QS) && !(cf & CRAM_FLAG_PRESERVE_QUAL_SCORES)) {
 	memset(qual, 255, cr->len);
@@ -1323,6 +1555,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 
     ref_pos--; // count from 0
     cr->cigar = ncigar;
+    cr->feature = s->nfeatures;
+    cr->nfeature = 0;
 
     if (!(ds & (CRAM_FC | CRAM_FP)))
 	goto skip_cigar;
@@ -1330,6 +1564,8 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
     for (f = 0; f < fn; f++) {
 	int32_t pos = 0;
 	char op;
+	int seq_pos0;
+	int64_t ref_pos0;
 
 	if (ncigar+2 >= cigar_alloc) {
 	    cigar_alloc = cigar_alloc ? cigar_alloc*2 : 1024;
@@ -1386,7 +1622,7 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 		    } else {
 		        memset(&seq[seq_pos-1], 'N', cr->len - seq_pos + 1);
 		    }
-		} else {
+		} else if (!skip_ref) {
 		    memcpy(&seq[seq_pos-1], &s->ref[ref_pos - s->ref_start +1],
 			   pos - seq_pos);
 		}
@@ -1416,6 +1652,9 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 	if (!(ds & CRAM_FC))
 	    goto skip_cigar;
 
+	seq_pos0 = seq_pos;
+	ref_pos0 = ref_pos;
+
 	switch(op) {
 	case 'S': { // soft clip: IN
 	    int32_t out_sz2 = 1;
@@ -1541,6 +1780,10 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 		                ->decode(s, c->comp_hdr->codecs[DS_DL], blk,
 					 (char *)&i32, &out_sz);
 		if (r) return r;
+		if (s->ref_win && s->ref_id == cr->ref_id &&
+		    cram_ref_win_cover(fd, s, cr->ref_id, cr->apos,
+				       ref_pos + i32 + cr->len-seq_pos+1) < 0)
+		    return -1;
 		if (decode_md || decode_nm) {
 		    if (md_dist >= 0 && decode_md)
 			BLOCK_APPEND_UINT(s->aux_blk, md_dist);
@@ -1816,6 +2059,10 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 		cig_op = BAM_CREF_SKIP;
 		cig_len += i32;
 		ref_pos += i32;
+		if (s->ref_win && s->ref_id == cr->ref_id &&
+		    cram_ref_win_cover(fd, s, cr->ref_id, cr->apos,
+				       ref_pos + cr->len-seq_pos+1) < 0)
+		    return -1;
 	    }
 	    break;
 	}
@@ -1824,6 +2071,12 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
             fprintf(stderr, "Error: Unknown feature code '%c'\n", op);
 	    return -1;
 	}
+
+	if (fd->keep_features &&
+	    cram_keep_feature(s, cr, op, pos, seq_pos - seq_pos0,
+			      ref_pos - ref_pos0, i32, seq,
+			      (ds & CRAM_QS) ? qual : NULL) < 0)
+	    return -1;
     }
 
     if (!(ds & CRAM_FC))
@@ -1851,7 +2104,7 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
 			memset(&seq[seq_pos-1], 'N', cr->len - seq_pos + 1);
 		}
 	    } else {
-		if (cr->len - seq_pos + 1 > 0)
+		if (cr->len - seq_pos + 1 > 0 && !skip_ref)
 		    memcpy(&seq[seq_pos-1], &s->ref[ref_pos - s->ref_start +1],
 			   cr->len - seq_pos + 1);
 		ref_pos += cr->len - seq_pos + 1;
@@ -1909,10 +2162,14 @@ static int cram_decode_seq(cram_fd *fd, cram_container *c, cram_slice *s,
     //printf("2: %.*s %d .. %d %d\n", cr->name_len, (char *)BLOCK_DATA(s->name_blk) + cr->name, cr->apos, ref_pos, seq_pos);
 
     if (ds & CRAM_MQ) {
-	if (!c->comp_hdr->codecs[DS_MQ]) return -1;
-	r |= c->comp_hdr->codecs[DS_MQ]
-	                ->decode(s, c->comp_hdr->codecs[DS_MQ], blk,
-				 (char *)&cr->mqual, &out_sz);
+	if (mq) {
+	    cr->mqual = *mq;
+	} else {
+	    if (!c->comp_hdr->codecs[DS_MQ]) return -1;
+	    r |= c->comp_hdr->codecs[DS_MQ]
+		            ->decode(s, c->comp_hdr->codecs[DS_MQ], blk,
+				     (char *)&cr->mqual, &out_sz);
+	}
     } else {
 	cr->mqual = 40;
     }
@@ -2384,14 +2641,21 @@ static int bulk_cram_to_bam(SAM_hdr *bfd, cram_fd *fd, cram_slice *s) {
 
 /*
  * Utility function to decode tlen (ISIZE), as it's called
- * in multiple places.
+ * in multiple places.  If col is non-NULL the value is taken from the
+ * next item, *col_idx, of the pre-decoded TS column instead.
  *
  * Returns codec return value (0 on success).
  */
 static int cram_decode_tlen(cram_fd *fd, cram_container *c, cram_slice *s,
-			    cram_block *blk, int64_t *tlen) {
+			    cram_block *blk, int64_t *tlen,
+			    int64_t *col, int *col_idx) {
     int out_sz = 1, r = 0;
 
+    if (col) {
+	*tlen = col[(*col_idx)++];
+	return 0;
+    }
+
     if (!c->comp_hdr->codecs[DS_TS]) return -1;
     if (CRAM_MAJOR_VERS(fd->version) < 4) {
 	int32_t i32;
@@ -2407,6 +2671,180 @@ static int cram_decode_tlen(cram_fd *fd, cram_container *c, cram_slice *s,
     return r;
 }
 
+/*
+ * Returns true if data series ds_id can be decoded for the entire slice
+ * with a single codec call.  This needs the values to not be interleaved
+ * with those of any other data series or tag, so codecs using the CORE
+ * block or an external block shared with anything else are excluded.
+ */
+static int cram_ds_columnar(cram_block_compression_hdr *hdr, int ds_id) {
+    cram_codec *cd = hdr->codecs[ds_id];
+    int i, id, bnum1, bnum2, n_id = 0;
+
+    if (!cd)
+	return 0;
+
+    switch (cd->codec) {
+    case E_CONST_INT:
+    case E_CONST_BYTE:
+	return 1;
+
+    case E_HUFFMAN:
+	return cd->huffman.ncodes == 1;
+
+    case E_EXTERNAL:
+    case E_VARINT_UNSIGNED:
+    case E_VARINT_SIGNED:
+	break;
+
+    default:
+	return 0;
+    }
+
+    id = cram_codec_to_id(cd, NULL);
+
+    for (i = 0; i < DS_END; i++) {
+	if (!hdr->codecs[i])
+	    continue;
+	bnum1 = cram_codec_to_id(hdr->codecs[i], &bnum2);
+	if (bnum1 == id || bnum2 == id)
+	    n_id++;
+    }
+
+    for (i = 0; i < CRAM_MAP_HASH; i++) {
+	cram_map *m;
+	for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+	    if (!m->codec)
+		continue;
+	    bnum1 = cram_codec_to_id(m->codec, &bnum2);
+	    if (bnum1 == id || bnum2 == id)
+		n_id++;
+	}
+    }
+
+    return n_id == 1;
+}
+
+/*
+ * Decodes n values of data series ds_id in one call into col[].  Series
+ * that are 32-bit in this CRAM version are widened in place.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_decode_column(cram_slice *s, cram_codec *cd, cram_block *blk,
+			      int is_long, int64_t *col, int n) {
+    int i, out_sz = n, r;
+
+    if (is_long) {
+	r = cd->decode(s, cd, blk, (char *)col, &out_sz);
+    } else {
+	int32_t *col32 = (int32_t *)col;
+	r = cd->decode(s, cd, blk, (char *)col32, &out_sz);
+	for (i = n-1; i >= 0; i--)
+	    col[i] = col32[i];
+    }
+
+    return r || out_sz != n ? -1 : 0;
+}
+
+/*
+ * Decodes the fixed width per-record data series (BF, CF, RL, AP, RG,
+ * MQ, NS, NP, TS) for the whole slice up front into columnar arrays,
+ * avoiding a codec call per value during record reconstruction.
+ *
+ * BF, CF, RL, AP and RG have one value per record.  MQ is only present
+ * for mapped reads and NS, NP and TS for detached ones (plus explicit
+ * TLEN for TS), so these are only pre-decoded when the BF or CF column
+ * tells us how many values there are.
+ *
+ * On return col[DS_x] points to the values for series x, or is NULL if
+ * it has to be decoded record by record.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_decode_columns(cram_fd *fd, cram_container *c, cram_slice *s,
+			       cram_block *blk, int64_t **col) {
+    cram_block_compression_hdr *hdr = c->comp_hdr;
+    uint32_t ds = s->data_series;
+    int nrec = s->hdr->num_records, is_long = CRAM_MAJOR_VERS(fd->version) >= 4;
+    int i, n, n_mapped = -1, n_detached = -1, n_tlen = -1;
+    int64_t *buf;
+    static const struct {
+	int ds_id;
+	uint32_t ds_bit;
+	int is_long; // 64-bit in CRAM 4
+    } ds_col[] = {
+	{DS_BF, CRAM_BF, 0},
+	{DS_CF, CRAM_CF, 0},
+	{DS_RL, CRAM_RL, 0},
+	{DS_AP, CRAM_AP, 1},
+	{DS_RG, CRAM_RG, 0},
+	{DS_MQ, CRAM_MQ, 0},
+	{DS_NS, CRAM_NS, 0},
+	{DS_NP, CRAM_NP, 1},
+	{DS_TS, CRAM_TS, 1},
+    };
+
+    memset(col, 0, DS_END * sizeof(*col));
+    if (IS_CRAM_1_VERS(fd) || nrec <= 0)
+	return 0;
+
+    // At most one value per record for each series
+    n = sizeof(ds_col)/sizeof(*ds_col);
+    if (!(buf = realloc(s->columns, (size_t)n * nrec * sizeof(*buf))))
+	return -1;
+    s->columns = buf;
+
+    for (i = 0; i < n; i++) {
+	int id = ds_col[i].ds_id, nval = nrec;
+
+	switch (id) {
+	case DS_MQ:
+	    nval = n_mapped;
+	    break;
+	case DS_NS:
+	case DS_NP:
+	    nval = n_detached;
+	    break;
+	case DS_TS:
+	    nval = n_tlen;
+	    break;
+	}
+
+	if (nval < 0 || !(ds & ds_col[i].ds_bit) || !cram_ds_columnar(hdr, id))
+	    continue;
+
+	col[id] = buf + (size_t)i * nrec;
+	if (cram_decode_column(s, hdr->codecs[id], blk,
+			       ds_col[i].is_long && is_long,
+			       col[id], nval) < 0)
+	    return -1;
+
+	if (id == DS_BF) {
+	    int j, max_bf = sizeof(fd->bam_flag_swap)/sizeof(*fd->bam_flag_swap);
+	    for (n_mapped = j = 0; j < nrec; j++) {
+		int64_t bf = col[DS_BF][j];
+		if (bf >= 0 && bf < max_bf
+		    && !(fd->bam_flag_swap[bf] & BAM_FUNMAP))
+		    n_mapped++;
+	    }
+	} else if (id == DS_CF) {
+	    int j;
+	    for (n_detached = n_tlen = j = 0; j < nrec; j++) {
+		int64_t cf = col[DS_CF][j];
+		if (cf & CRAM_FLAG_DETACHED)
+		    n_detached++;
+		if (cf & (CRAM_FLAG_DETACHED | CRAM_FLAG_EXPLICIT_TLEN))
+		    n_tlen++;
+	    }
+	}
+    }
+
+    return 0;
+}
+
 /*
  * Decode an entire slice from container blocks. Fills out s->crecs[] array.
  * Returns 0 on success
@@ -2422,8 +2860,10 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     char *seq = NULL, *qual = NULL;
     int unknown_rg = -1;
     int embed_ref;
-    char **refs = NULL;
+    cram_ref_win *refs = NULL;
     uint32_t ds;
+    int64_t *col[DS_END];
+    int col_idx[DS_END] = {0};
 
     if (cram_dependent_data_series(fd, c->comp_hdr, s) != 0)
 	return -1;
@@ -2514,11 +2954,13 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    //s->ref = cram_get_ref(fd, s->hdr->ref_seq_id, 1, 0);
 	    //s->ref_start = 1;
 
-	    if (fd->required_fields & SAM_SEQ)
+	    if (fd->required_fields & SAM_SEQ) {
 		s->ref =
-		cram_get_ref(fd, s->hdr->ref_seq_id,
-			     s->hdr->ref_seq_start,
-			     s->hdr->ref_seq_start + s->hdr->ref_seq_span -1);
+		cram_get_ref_copy(fd, s->hdr->ref_seq_id,
+				  s->hdr->ref_seq_start,
+				  s->hdr->ref_seq_start + s->hdr->ref_seq_span -1,
+				  &s->ref_free);
+	    }
 	    s->ref_start = s->hdr->ref_seq_start;
 	    s->ref_end   = s->hdr->ref_seq_start + s->hdr->ref_seq_span-1;
 
@@ -2600,11 +3042,20 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     if (ref_id == -2) {
 	if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
 	pthread_mutex_lock(&fd->refs->lock);
-	refs = calloc(fd->refs->nref, sizeof(char *));
+	refs = calloc(fd->refs->nref, sizeof(*refs));
 	pthread_mutex_unlock(&fd->refs->lock);
 	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 	if (!refs)
 	    return -1;
+	s->ref_win = refs;
+	s->ref_id = -1;
+    }
+
+    if (cram_decode_columns(fd, c, s, blk, col) < 0) {
+	if (refs)
+	    free(refs);
+	s->ref_win = NULL;
+	return -1;
     }
 
 #define RETURN return printf("Fail to decode CRAM rec %d at %s:%d\n", rec, __FILE__, __LINE__),
@@ -2619,10 +3070,14 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 
 	out_sz = 1; /* decode 1 item */
 	if (ds & CRAM_BF) {
-	    if (!c->comp_hdr->codecs[DS_BF]) RETURN -1;
-	    r |= c->comp_hdr->codecs[DS_BF]
-		            ->decode(s, c->comp_hdr->codecs[DS_BF], blk,
-				     (char *)&bf, &out_sz);
+	    if (col[DS_BF]) {
+		bf = col[DS_BF][rec];
+	    } else {
+		if (!c->comp_hdr->codecs[DS_BF]) RETURN -1;
+		r |= c->comp_hdr->codecs[DS_BF]
+		                ->decode(s, c->comp_hdr->codecs[DS_BF], blk,
+					 (char *)&bf, &out_sz);
+	    }
 	    if (r || bf < 0 ||
 		bf >= sizeof(fd->bam_flag_swap)/sizeof(*fd->bam_flag_swap))
 		RETURN -1;
@@ -2641,6 +3096,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 				 	 (char *)&cf, &out_sz);
 		if (r) RETURN -1;
 		cr->cram_flags = cf;
+	    } else if (col[DS_CF]) {
+		cf = cr->cram_flags = col[DS_CF][rec];
 	    } else {
 		if (!c->comp_hdr->codecs[DS_CF]) RETURN -1;
 		r |= c->comp_hdr->codecs[DS_CF]
@@ -2663,23 +3120,13 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 		if ((fd->required_fields & (SAM_SEQ|SAM_TLEN))
 		    && cr->ref_id >= 0
 		    && cr->ref_id != last_ref_id) {
-		    if (!c->comp_hdr->no_ref) {
-			if (!refs[cr->ref_id])
-			    refs[cr->ref_id] = cram_get_ref(fd, cr->ref_id,
-							    1, 0);
-			s->ref = refs[cr->ref_id];
-
-			if (!fd->unsorted && last_ref_id >= 0 && refs[last_ref_id]) {
-			    cram_ref_decr(fd->refs, last_ref_id);
-			    refs[last_ref_id] = NULL;
-			}
+		    // The window itself is fetched once AP is known, below.
+		    if (!c->comp_hdr->no_ref && !fd->unsorted &&
+			last_ref_id >= 0 && refs[last_ref_id].seq) {
+			cram_ref_decr(fd->refs, last_ref_id);
+			free(refs[last_ref_id].copy);
+			memset(&refs[last_ref_id], 0, sizeof(*refs));
 		    }
-		    s->ref_start = 1;
-		    if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
-		    pthread_mutex_lock(&fd->refs->lock);
-		    s->ref_end = fd->refs->ref_id[cr->ref_id]->length;
-		    pthread_mutex_unlock(&fd->refs->lock);
-		    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 
 		    last_ref_id = cr->ref_id;
 		}
@@ -2695,11 +3142,15 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	}
 
 	if (ds & CRAM_RL) {
-	    if (!c->comp_hdr->codecs[DS_RL]) RETURN -1;
-	    r |= c->comp_hdr->codecs[DS_RL]
-		            ->decode(s, c->comp_hdr->codecs[DS_RL], blk,
-				     (char *)&cr->len, &out_sz);
-	    if (r) RETURN r;
+	    if (col[DS_RL]) {
+		cr->len = col[DS_RL][rec];
+	    } else {
+		if (!c->comp_hdr->codecs[DS_RL]) RETURN -1;
+		r |= c->comp_hdr->codecs[DS_RL]
+		                ->decode(s, c->comp_hdr->codecs[DS_RL], blk,
+					 (char *)&cr->len, &out_sz);
+		if (r) RETURN r;
+	    }
 	    if (cr->len < 0) {
 	        fprintf(stderr, "Read has negative length\n");
 		RETURN -1;
@@ -2707,8 +3158,11 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	}
 
 	if (ds & CRAM_AP) {
-	    if (!c->comp_hdr->codecs[DS_AP]) RETURN -1;
-	    if (CRAM_MAJOR_VERS(fd->version) < 4) {
+	    if (col[DS_AP]) {
+		cr->apos = col[DS_AP][rec];
+	    } else if (!c->comp_hdr->codecs[DS_AP]) {
+		RETURN -1;
+	    } else if (CRAM_MAJOR_VERS(fd->version) < 4) {
 		int32_t i32;
 		r |= c->comp_hdr->codecs[DS_AP]
 		                ->decode(s, c->comp_hdr->codecs[DS_AP], blk,
@@ -2726,13 +3180,22 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	} else {
 	    cr->apos = c->ref_seq_start;
 	}
+
+	if (refs && cr->ref_id >= 0 && cr->ref_id == last_ref_id &&
+	    !c->comp_hdr->no_ref)
+	    cram_ref_win_cover(fd, s, cr->ref_id, cr->apos,
+			       cr->apos + cr->len-1);
 		    
 	if (ds & CRAM_RG) {
-	    if (!c->comp_hdr->codecs[DS_RG]) RETURN -1;
-	    r |= c->comp_hdr->codecs[DS_RG]
-		           ->decode(s, c->comp_hdr->codecs[DS_RG], blk,
-				    (char *)&cr->rg, &out_sz);
-	    if (r) RETURN r;
+	    if (col[DS_RG]) {
+		cr->rg = col[DS_RG][rec];
+	    } else {
+		if (!c->comp_hdr->codecs[DS_RG]) RETURN -1;
+		r |= c->comp_hdr->codecs[DS_RG]
+		               ->decode(s, c->comp_hdr->codecs[DS_RG], blk,
+					(char *)&cr->rg, &out_sz);
+		if (r) RETURN r;
+	    }
 	    if (cr->rg == unknown_rg)
 		cr->rg = -1;
 	} else {
@@ -2801,11 +3264,15 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 		    
 	    if (ds & CRAM_NS) {
-		if (!c->comp_hdr->codecs[DS_NS]) RETURN -1;
-		r |= c->comp_hdr->codecs[DS_NS]
-		                ->decode(s, c->comp_hdr->codecs[DS_NS], blk,
-					 (char *)&cr->mate_ref_id, &out_sz);
-		if (r) RETURN r;
+		if (col[DS_NS]) {
+		    cr->mate_ref_id = col[DS_NS][col_idx[DS_NS]++];
+		} else {
+		    if (!c->comp_hdr->codecs[DS_NS]) RETURN -1;
+		    r |= c->comp_hdr->codecs[DS_NS]
+			            ->decode(s, c->comp_hdr->codecs[DS_NS], blk,
+					     (char *)&cr->mate_ref_id, &out_sz);
+		    if (r) RETURN r;
+		}
 	    }
 
 // Skip as mate_ref of "*" is legit. It doesn't mean unmapped, just unknown.
@@ -2815,8 +3282,11 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 //	    }
 
 	    if (ds & CRAM_NP) {
-		if (!c->comp_hdr->codecs[DS_NP]) RETURN -1;
-		if (CRAM_MAJOR_VERS(fd->version) < 4) {
+		if (col[DS_NP]) {
+		    cr->mate_pos = col[DS_NP][col_idx[DS_NP]++];
+		} else if (!c->comp_hdr->codecs[DS_NP]) {
+		    RETURN -1;
+		} else if (CRAM_MAJOR_VERS(fd->version) < 4) {
 		    int32_t i32;
 		    r |= c->comp_hdr->codecs[DS_NP]
 			            ->decode(s, c->comp_hdr->codecs[DS_NP], blk,
@@ -2831,7 +3301,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 
 	    if (ds & CRAM_TS) {
-		r = cram_decode_tlen(fd, c, s, blk, &cr->tlen);
+		r = cram_decode_tlen(fd, c, s, blk, &cr->tlen,
+				     col[DS_TS], &col_idx[DS_TS]);
 		if (r) RETURN r;
 	    } else {
 		cr->tlen = INT64_MIN;
@@ -2860,7 +3331,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 	    if ((ds & CRAM_CF) && (cf & CRAM_FLAG_EXPLICIT_TLEN)) {
 		if (ds & CRAM_TS) {
-		    r = cram_decode_tlen(fd, c, s, blk, &cr->explicit_tlen);
+		    r = cram_decode_tlen(fd, c, s, blk, &cr->explicit_tlen,
+				     col[DS_TS], &col_idx[DS_TS]);
 		    if (r) RETURN r;
 		} else {
 		    cr->mate_flags = 0;
@@ -2869,7 +3341,8 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    }
 	} else if ((ds & CRAM_CF) && (cf & CRAM_FLAG_EXPLICIT_TLEN)) {
 	    if (ds & CRAM_TS) {
-		r = cram_decode_tlen(fd, c, s, blk, &cr->explicit_tlen);
+		r = cram_decode_tlen(fd, c, s, blk, &cr->explicit_tlen,
+				     col[DS_TS], &col_idx[DS_TS]);
 		if (r) RETURN r;
 	    } else {
 		cr->mate_flags = 0;
@@ -2930,7 +3403,9 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    /* Decode sequence and generate CIGAR */
 	    if (ds & (CRAM_SEQ | CRAM_MQ)) {
 		r |= cram_decode_seq(fd, c, s, blk, cr, bfd, cf, seq, qual,
-				     has_MD, has_NM);
+				     has_MD, has_NM,
+				     col[DS_MQ]
+				     ? &col[DS_MQ][col_idx[DS_MQ]++] : NULL);
 		if (r) RETURN r;
 	    } else {
 		cr->cigar = 0;
@@ -2996,10 +3471,13 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     if (refs) {
 	int i;
 	for (i = 0; i < fd->refs->nref; i++) {
-	    if (refs[i])
-		cram_ref_decr(fd->refs, i);
+	    if (!refs[i].seq)
+		continue;
+	    cram_ref_decr(fd->refs, i);
+	    free(refs[i].copy);
 	}
 	free(refs);
+	s->ref_win = NULL;
     } else if (ref_id >= 0 && s->ref != fd->ref_free && !embed_ref) {
 	cram_ref_decr(fd->refs, ref_id);
     }
@@ -3013,6 +3491,13 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	int i;
 	for (i = 0; i < s->hdr->num_blocks; i++) {
 	    cram_block *b = s->block[i];
+	    // Except an embedded reference, so s->ref remains valid for
+	    // callers working from the features (see fd->keep_features).
+	    if (embed_ref && b && s->ref && !s->ref_free &&
+		(char *)b->data == s->ref) {
+		s->ref_free = s->ref;
+		b->data = NULL;
+	    }
 	    cram_free_block(b);
 	    s->block[i] = NULL;
 	}
@@ -3059,7 +3544,7 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     // Possible future optimisation - check range query and don't
     // convert all reads to BAM.
 
-    if (fd->pool)
+    if (fd->pool && !fd->no_bam)
 	r |= bulk_cram_to_bam(bfd, fd, s);
 
     return r;
@@ -3305,6 +3790,24 @@ static cram_container *cram_first_slice(cram_fd *fd) {
     return c;
 }
 
+/*
+ * Works out up front which blocks a container's slices need, given
+ * fd->required_fields, so this can be shared by all of its slices and
+ * so cram_read_slice_required() can avoid reading the others.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_container_required(cram_fd *fd, cram_container *c) {
+    cram_block_compression_hdr *hdr = c->comp_hdr;
+
+    if (!fd->required_fields || fd->required_fields == INT_MAX ||
+	hdr->required)
+	return 0;
+
+    return (hdr->required = cram_required_new(fd, hdr)) ? 0 : -1;
+}
+
 static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
     cram_container *c_curr;  // container being consumed via cram_get_seq()
     cram_slice *s_curr = NULL;
@@ -3364,7 +3867,9 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 		for(;;) {
 		    if (!(c_next = cram_read_container(fd))) {
 			if (fd->pool) {
-			    fd->ooc = 1;
+			    // Let queued slices drain first, but remember
+			    // whether this was EOF or a read failure.
+			    fd->ooc = fd->eof ? 1 : -1;
 			    break;
 			}
 
@@ -3423,6 +3928,9 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 		if (!c_next->comp_hdr)
 		    return NULL;
 
+		if (cram_container_required(fd, c_next) != 0)
+		    return NULL;
+
 		if (!c_next->comp_hdr->AP_delta &&
 		    sam_hdr_sort_order(fd->header) != ORDER_COORD) {
 		    if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
@@ -3439,7 +3947,8 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 		goto empty_container;
 	    }
 
-	    if (!(s_next = c_next->slice = cram_read_slice(fd)))
+	    if (!(s_next = c_next->slice =
+		  cram_read_slice_required(fd, c_next->comp_hdr)))
 		return NULL;
 
 	    s_next->slice_num = ++c_next->curr_slice_mt;
@@ -3517,7 +4026,7 @@ static cram_slice *cram_next_slice(cram_fd *fd, cram_container **cp) {
 	cram_decode_job *j;
 	
 	if (fd->ooc && t_pool_results_queue_empty(fd->rqueue)) {
-	    fd->eof = 1;
+	    fd->eof = fd->ooc > 0;
 	    return NULL;
 	}
 
@@ -3628,28 +4137,20 @@ cram_record *cram_get_seq(cram_fd *fd) {
 }
 
 /*
- * Read the next cram record and convert it to a bam_seq_t struct.
+ * Converts record 'rec' of a decoded slice to a bam_seq_t struct.
+ *
+ * If the slice was decoded by a thread pool the records will already
+ * have been converted, in which case we simply take a copy.
  *
  * Returns 0 on success
- *        -1 on EOF or failure (check fd->err)
+ *        -1 on failure
  */
-int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
-    cram_record *cr;
-    cram_container *c;
-    cram_slice *s;
-
-    if (!(cr = cram_get_seq(fd))) {
-	//*bam=0;
-	return -1;
-    }
-
-    c = fd->ctr;
-    s = c->slice;
-
+static int cram_slice_to_bam(cram_fd *fd, cram_slice *s, int rec,
+			     bam_seq_t **bam) {
     if (s->bl) {
-	//*bam = s->bl[s->curr_rec-1]; return 0;
+	//*bam = s->bl[rec]; return 0;
 
-	// Ideally we'd just do: *bam = s->bl[s->curr_rec-1];
+	// Ideally we'd just do: *bam = s->bl[rec];
 	// That works, but it changes the API as the bam object is
 	// no longer a malloced block of memory and cannot be
 	// freed by the caller.  (Possibly we can do *bam=0
@@ -3660,7 +4161,7 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
 	// Hence instead we laboriously manage the memory and do a
 	// memcpy each time.  (This is around an extra 40% time taken
 	// in main to decode a CRAM file, harming parallel execution.)
-	int sz = s->bl[s->curr_rec-1]->alloc;
+	int sz = s->bl[rec]->alloc;
 	if (!*bam) {
 	    if (!(*bam = malloc(sz)))
 		return -1;
@@ -3670,9 +4171,679 @@ int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
 		return -1;
 	    (*bam)->alloc = sz;
 	}
-	memcpy(*bam, s->bl[s->curr_rec-1], sz);
+	memcpy(*bam, s->bl[rec], sz);
+	return 0;
+    }
+
+    return cram_to_bam(fd->header, fd, s, &s->crecs[rec], rec, bam) >= 0
+	? 0 : -1;
+}
+
+/*
+ * Read the next cram record and convert it to a bam_seq_t struct.
+ *
+ * Returns 0 on success
+ *        -1 on EOF or failure (check fd->err)
+ */
+int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam) {
+    cram_container *c;
+    cram_slice *s;
+
+    if (fd->no_bam) {
+	fprintf(stderr, "BAM records are not available with "
+		"CRAM_OPT_NO_BAM set\n");
+	return -1;
+    }
+
+    if (!cram_get_seq(fd)) {
+	//*bam=0;
+	return -1;
+    }
+
+    c = fd->ctr;
+    s = c->slice;
+
+    return cram_slice_to_bam(fd, s, s->curr_rec-1, bam);
+}
+
+/*
+ * Grows the arrays in cols to hold at least n records.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_columns_resize(cram_columns *cols, int n) {
+    void *p;
+
+    if (n <= cols->alloc)
 	return 0;
+
+#define COL_GROW(x) \
+    if (!(p = realloc(cols->x, n * sizeof(*cols->x)))) return -1; \
+    cols->x = p
+
+    COL_GROW(ref_id);
+    COL_GROW(flag);
+    COL_GROW(pos);
+    COL_GROW(end);
+    COL_GROW(len);
+    COL_GROW(mate_ref_id);
+    COL_GROW(mate_pos);
+    COL_GROW(mapq);
+    COL_GROW(rec);
+
+#undef COL_GROW
+
+    cols->alloc = n;
+    return 0;
+}
+
+/*
+ * Reads the remaining records of the current slice, or failing that
+ * the next non-empty slice, into the parallel arrays of cols.  Any range
+ * set via CRAM_OPT_RANGE is honoured as in cram_get_seq().
+ *
+ * No BAM records are built here.  Set CRAM_OPT_NO_BAM before the first
+ * read to stop the decoding threads building them too; combined with
+ * CRAM_OPT_REQUIRED_FIELDS this is the cheapest way to scan a few fields
+ * of every record.  cols should be zeroed before first use
+ * and released with cram_columns_free().  The slice referenced by cols->s
+ * remains valid until the next call.
+ *
+ * Returns 0 on success
+ *         1 on EOF
+ *        -1 on failure
+ */
+int cram_get_columns(cram_fd *fd, cram_columns *cols) {
+    cram_container *c;
+    cram_slice *s;
+    int i, n;
+
+    cols->n = 0;
+    cols->s = NULL;
+    cols->fields = fd->required_fields;
+
+    for (;;) {
+	c = fd->ctr;
+	if (c && c->slice && c->slice->curr_rec < c->slice->max_rec) {
+	    s = c->slice;
+	} else {
+	    if (!(s = cram_next_slice(fd, &c)))
+		return fd->eof ? 1 : -1;
+	    continue; /* In case slice contains no records */
+	}
+
+	if (cram_columns_resize(cols, s->max_rec - s->curr_rec) < 0)
+	    return -1;
+
+	for (n = 0, i = s->curr_rec; i < s->max_rec; i++) {
+	    cram_record *cr = &s->crecs[i];
+
+	    if (fd->range.refid != -2) {
+		// Same filtering as cram_get_seq().
+		if (fd->range.refid == -1 && cr->ref_id != -1)
+		    continue;
+		if (cr->ref_id < fd->range.refid && cr->ref_id != -1)
+		    continue;
+		if (cr->ref_id != fd->range.refid)
+		    break;
+		if (fd->range.refid != -1 && cr->apos > fd->range.end)
+		    break;
+		if (fd->range.refid != -1 && cr->aend < fd->range.start)
+		    continue;
+	    }
+
+	    cols->ref_id[n]      = cr->ref_id;
+	    cols->flag[n]        = cr->flags;
+	    cols->pos[n]         = cr->apos;
+	    cols->end[n]         = cr->aend;
+	    cols->len[n]         = cr->len;
+	    cols->mate_ref_id[n] = cr->mate_ref_id;
+	    cols->mate_pos[n]    = cr->mate_pos;
+	    cols->mapq[n]        = cr->mqual;
+	    cols->rec[n]         = i;
+	    n++;
+	}
+	s->curr_rec = i;
+
+	if (i < s->max_rec && n == 0) {
+	    // Past the end of the range.
+	    fd->eof = 1;
+	    cram_free_slice(s);
+	    c->slice = NULL;
+	    return 1;
+	}
+
+	if (n)
+	    break;
+    }
+
+    fd->ctr = c;
+    c->slice = s;
+    cols->s = s;
+    cols->n = n;
+
+    return 0;
+}
+
+/*
+ * Returns the sequence of record i in cols, of length cols->len[i], or
+ * NULL if SAM_SEQ was not among the required fields.  Not nul terminated.
+ */
+char *cram_columns_seq(cram_columns *cols, int i) {
+    cram_slice *s = cols->s;
+
+    if (!(cols->fields & SAM_SEQ) || !BLOCK_DATA(s->seqs_blk))
+	return NULL;
+
+    return (char *)BLOCK_DATA(s->seqs_blk) + s->crecs[cols->rec[i]].seq;
+}
+
+/*
+ * Returns the quality values of record i in cols, of length cols->len[i],
+ * or NULL if SAM_QUAL was not among the required fields.
+ */
+char *cram_columns_qual(cram_columns *cols, int i) {
+    cram_slice *s = cols->s;
+
+    if (!(cols->fields & SAM_QUAL) || !BLOCK_DATA(s->qual_blk))
+	return NULL;
+
+    return (char *)BLOCK_DATA(s->qual_blk) + s->crecs[cols->rec[i]].qual;
+}
+
+/*
+ * Returns the BAM encoded CIGAR of record i in cols, setting *ncigar to
+ * its number of operations, or NULL if SAM_CIGAR was not among the
+ * required fields.
+ */
+uint32_t *cram_columns_cigar(cram_columns *cols, int i, int *ncigar) {
+    cram_slice *s = cols->s;
+    cram_record *cr = &s->crecs[cols->rec[i]];
+
+    if (!(cols->fields & SAM_CIGAR)) {
+	*ncigar = 0;
+	return NULL;
+    }
+
+    *ncigar = cr->ncigar;
+    return &s->cigar[cr->cigar];
+}
+
+/*
+ * Frees the arrays held by cols.  The slice itself belongs to the
+ * cram_fd and is not freed.
+ */
+void cram_columns_free(cram_columns *cols) {
+    free(cols->ref_id);
+    free(cols->flag);
+    free(cols->pos);
+    free(cols->end);
+    free(cols->len);
+    free(cols->mate_ref_id);
+    free(cols->mate_pos);
+    free(cols->mapq);
+    free(cols->rec);
+    memset(cols, 0, sizeof(*cols));
+}
+
+
+/* ----------------------------------------------------------------------
+ * Multi-region iterator.
+ *
+ * Given a sorted list of regions we use the index to find every slice
+ * overlapping any region.  Slices shared between regions (overlapping
+ * or adjacent regions landing in the same slice) are read and decoded
+ * once only.  Slices are decoded in file order, on the thread pool if
+ * one is attached to fd, and kept until the last region needing them
+ * has been processed.
+ */
+
+typedef struct {
+    cram_container *c;  // loaded on demand
+    off_t hpos;         // file offset of the end of the container header
+    int nref;           // number of slices in plan still using c
+} cram_region_ctr;
+
+typedef struct {
+    cram_index *e;      // index entry, giving container offset + landmark
+    int ctr;            // index into it->ctrs[]
+    int last_use;       // last region that needs this slice
+    cram_slice *s;      // decoded slice, NULL if not (yet) available
+} cram_region_slice;
+
+struct cram_region_iter {
+    cram_fd *fd;
+    cram_range *r;      // regions, sorted by refid and start
+    int nr;
+
+    cram_region_slice *sl;
+    int nsl;
+    cram_region_ctr *ctrs;
+    int nctrs;
+
+    int *rsl;           // slice indices for all regions, concatenated
+    int *rsl_start;     // region i uses rsl[rsl_start[i]..rsl_start[i+1]-1]
+
+    int next_dispatch;  // next slice to read from file
+    int next_result;    // next slice to be decoded
+    t_results_queue *q;
+
+    int curr_r;         // current region
+    int curr_sl;        // current position in rsl[] for curr_r
+    int curr_rec;       // next record in the current slice
+    int freed;          // slices before this have all been freed
+};
+
+typedef struct {
+    cram_index *e;
+    int region;
+} cram_region_pair;
+
+static int cram_region_pair_cmp(const void *v1, const void *v2) {
+    const cram_region_pair *p1 = (const cram_region_pair *)v1;
+    const cram_region_pair *p2 = (const cram_region_pair *)v2;
+
+    if (p1->e->offset != p2->e->offset)
+	return p1->e->offset < p2->e->offset ? -1 : 1;
+    if (p1->e->slice != p2->e->slice)
+	return p1->e->slice < p2->e->slice ? -1 : 1;
+    return p1->region - p2->region;
+}
+
+static int int_cmp(const void *v1, const void *v2) {
+    return *(const int *)v1 - *(const int *)v2;
+}
+
+/*
+ * Loads the container and compression header holding slice i, if not
+ * already loaded, followed by the slice itself.
+ *
+ * Returns the slice on success;
+ *         NULL on failure
+ */
+static cram_slice *cram_region_read_slice(cram_region_iter *it, int i) {
+    cram_fd *fd = it->fd;
+    cram_region_slice *rs = &it->sl[i];
+    cram_region_ctr *rc = &it->ctrs[rs->ctr];
+    cram_container *c;
+    cram_slice *s;
+    int j;
+
+    if (!rc->c) {
+	if (cram_seek(fd, rs->e->offset, SEEK_SET) != 0)
+	    return NULL;
+	if (!(c = cram_read_container(fd)))
+	    return NULL;
+	rc->hpos = CRAM_IO_TELLO(fd);
+	rc->c = c;
+
+	if (!(c->comp_hdr_block = cram_read_block(fd)))
+	    return NULL;
+	if (c->comp_hdr_block->content_type != COMPRESSION_HEADER)
+	    return NULL;
+	if (!(c->comp_hdr = cram_decode_compression_header(fd,
+							   c->comp_hdr_block)))
+	    return NULL;
+	if (cram_container_required(fd, c) != 0)
+	    return NULL;
+
+	if (!c->comp_hdr->AP_delta &&
+	    sam_hdr_sort_order(fd->header) != ORDER_COORD) {
+	    if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
+	    fd->unsorted = 1;
+	    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+	}
+    }
+    c = rc->c;
+
+    if (cram_seek(fd, rc->hpos + rs->e->slice, SEEK_SET) != 0)
+	return NULL;
+    if (!(s = cram_read_slice_required(fd, c->comp_hdr)))
+	return NULL;
+
+    for (j = 0; j < c->num_landmarks; j++)
+	if (c->landmark[j] == rs->e->slice)
+	    break;
+    s->slice_num = j+1;
+    s->curr_rec = 0;
+    s->max_rec = s->hdr->num_records;
+    s->last_apos = s->hdr->ref_seq_start;
+
+    return s;
+}
+
+/*
+ * Reads slice it->next_dispatch and decodes it, either immediately or
+ * by adding a job to the thread pool.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_region_dispatch(cram_region_iter *it) {
+    int i = it->next_dispatch;
+    cram_fd *fd = it->fd;
+    cram_container *c;
+    cram_slice *s;
+    cram_decode_job *j;
+
+    if (!(s = cram_region_read_slice(it, i)))
+	return -1;
+    c = it->ctrs[it->sl[i].ctr].c;
+    it->next_dispatch++;
+
+    if (!fd->pool) {
+	it->sl[i].s = s;
+	if (cram_decode_slice(fd, c, s, fd->header) != 0) {
+	    fprintf(stderr, "Failure to decode slice\n");
+	    return -1;
+	}
+	return 0;
+    }
+
+    if (!(j = malloc(sizeof(*j)))) {
+	cram_free_slice(s);
+	return -1;
+    }
+    j->fd = fd;
+    j->c  = c;
+    j->s  = s;
+    j->h  = fd->header;
+
+    if (t_pool_dispatch(fd->pool, it->q, cram_decode_slice_thread, j) < 0) {
+	cram_free_slice(s);
+	free(j);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ensures slices up to and including 'i' have been decoded, keeping
+ * the thread pool topped up with later slices in the meantime.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_region_decode_to(cram_region_iter *it, int i) {
+    cram_fd *fd = it->fd;
+
+    while (it->next_result <= i) {
+	if (!fd->pool) {
+	    if (cram_region_dispatch(it) < 0)
+		return -1;
+	    it->next_result++;
+	    continue;
+	}
+
+	while (it->next_dispatch < it->nsl &&
+	       it->next_dispatch - it->next_result < fd->pool->qsize) {
+	    if (cram_region_dispatch(it) < 0)
+		return -1;
+	}
+
+	t_pool_result *res = t_pool_next_result_wait(it->q);
+	cram_decode_job *j;
+	int exit_code;
+
+	if (!res || !res->data)
+	    return -1;
+
+	j = (cram_decode_job *)res->data;
+	it->sl[it->next_result++].s = j->s;
+	exit_code = j->exit_code;
+	t_pool_delete_result(res, 1);
+
+	if (exit_code != 0) {
+	    fprintf(stderr, "Slice decode failure\n");
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/* Frees a decoded slice, and its container if no longer required. */
+static void cram_region_free_slice(cram_region_iter *it, int i) {
+    cram_region_slice *rs = &it->sl[i];
+    cram_region_ctr *rc = &it->ctrs[rs->ctr];
+
+    if (rs->s) {
+	cram_free_slice(rs->s);
+	rs->s = NULL;
+    }
+
+    if (--rc->nref == 0 && rc->c) {
+	cram_free_container(rc->c);
+	rc->c = NULL;
+    }
+}
+
+/*
+ * Creates an iterator over nr regions, which must be sorted by
+ * reference (in @SQ order) and then start position.
+ *
+ * The index must already have been loaded with cram_index_load().
+ * Any thread pool should be attached to fd before calling this.
+ *
+ * Returns iterator on success;
+ *         NULL on failure
+ */
+cram_region_iter *cram_region_iter_init(cram_fd *fd, cram_range *r, int nr) {
+    cram_region_iter *it;
+    cram_region_pair *pairs = NULL;
+    int npairs = 0, pairs_alloc = 0;
+    int i, k;
+
+    if (!fd->index) {
+	fprintf(stderr, "A CRAM index is required for region queries\n");
+	return NULL;
+    }
+
+    if (!(it = calloc(1, sizeof(*it))))
+	return NULL;
+    it->fd = fd;
+    it->r = r;
+    it->nr = nr;
+
+    // Find every (slice, region) pairing.
+    for (k = 0; k < nr; k++) {
+	cram_index **e;
+	int n = cram_index_query_range(fd, &r[k], &e);
+	if (n < 0)
+	    goto err;
+
+	if (npairs + n > pairs_alloc) {
+	    cram_region_pair *tmp;
+	    pairs_alloc = (npairs + n) * 2;
+	    if (!(tmp = realloc(pairs, pairs_alloc * sizeof(*pairs)))) {
+		free(e);
+		goto err;
+	    }
+	    pairs = tmp;
+	}
+	for (i = 0; i < n; i++) {
+	    pairs[npairs].e = e[i];
+	    pairs[npairs++].region = k;
+	}
+	free(e);
+    }
+
+    // Sort into file order, identifying the unique slices and containers.
+    qsort(pairs, npairs, sizeof(*pairs), cram_region_pair_cmp);
+
+    if (!(it->sl   = calloc(npairs+1, sizeof(*it->sl)))   ||
+	!(it->ctrs = calloc(npairs+1, sizeof(*it->ctrs))) ||
+	!(it->rsl  = malloc((npairs+1) * sizeof(*it->rsl))) ||
+	!(it->rsl_start = calloc(nr+1, sizeof(*it->rsl_start))))
+	goto err;
+
+    for (i = 0; i < npairs; i++) {
+	cram_index *e = pairs[i].e;
+	cram_region_slice *last = it->nsl ? &it->sl[it->nsl-1] : NULL;
+
+	if (!last ||
+	    last->e->offset != e->offset || last->e->slice != e->slice) {
+	    if (!last || last->e->offset != e->offset)
+		it->nctrs++;
+	    last = &it->sl[it->nsl++];
+	    last->e = e;
+	    last->ctr = it->nctrs-1;
+	    it->ctrs[last->ctr].nref++;
+	}
+	last->last_use = pairs[i].region;
+
+	it->rsl_start[pairs[i].region+1]++;
+	it->rsl[i] = it->nsl-1;
+    }
+
+    // Bucket the slice indices by region.
+    {
+	int *tmp = malloc((npairs+1) * sizeof(*tmp));
+	int *pos = malloc((nr+1) * sizeof(*pos));
+	if (!tmp || !pos) {
+	    free(tmp);
+	    free(pos);
+	    goto err;
+	}
+	for (k = 0; k < nr; k++)
+	    it->rsl_start[k+1] += it->rsl_start[k];
+	memcpy(pos, it->rsl_start, (nr+1) * sizeof(*pos));
+	for (i = 0; i < npairs; i++)
+	    tmp[pos[pairs[i].region]++] = it->rsl[i];
+	free(pos);
+	free(it->rsl);
+	it->rsl = tmp;
+    }
+
+    // Multi-ref slices may appear more than once per region, so we
+    // mark the duplicates as -1.
+    for (k = 0; k < nr; k++) {
+	int *a = &it->rsl[it->rsl_start[k]];
+	int n = it->rsl_start[k+1] - it->rsl_start[k];
+	qsort(a, n, sizeof(*a), int_cmp);
+	for (i = n-1; i > 0; i--)
+	    if (a[i] == a[i-1])
+		a[i] = -1;
+    }
+
+    free(pairs);
+    pairs = NULL;
+
+    if (fd->pool && !(it->q = t_results_queue_init()))
+	goto err;
+    if (it->q)
+	t_results_queue_set_name(it->q, "cram_region_read");
+
+    it->curr_sl = it->nr ? it->rsl_start[0] : 0;
+    return it;
+
+ err:
+    free(pairs);
+    cram_region_iter_free(it);
+    return NULL;
+}
+
+/*
+ * Fetches the next record overlapping the current region.  Records
+ * overlapping more than one region are returned once per region.
+ *
+ * If region is non-NULL it is set to the index into the original
+ * region list which this record belongs to.
+ *
+ * Returns 0 on success;
+ *         1 when all regions have been returned;
+ *        -1 on failure
+ */
+int cram_region_iter_next(cram_region_iter *it, bam_seq_t **bam,
+			  int *region) {
+    int i;
+
+    while (it->curr_r < it->nr) {
+	cram_range *r = &it->r[it->curr_r];
+	int end = it->rsl_start[it->curr_r+1];
+
+	while (it->curr_sl < end) {
+	    cram_slice *s;
+
+	    i = it->rsl[it->curr_sl];
+
+	    if (i < 0) {
+		it->curr_sl++;
+		continue;
+	    }
+
+	    if (cram_region_decode_to(it, i) < 0)
+		return -1;
+	    s = it->sl[i].s;
+
+	    while (it->curr_rec < s->hdr->num_records) {
+		int rec = it->curr_rec++;
+		cram_record *cr = &s->crecs[rec];
+
+		if (cr->ref_id != r->refid)
+		    continue;
+		if (r->refid != -1 &&
+		    (cr->apos > r->end || cr->aend < r->start))
+		    continue;
+
+		if (region)
+		    *region = it->curr_r;
+		return cram_slice_to_bam(it->fd, s, rec, bam);
+	    }
+
+	    it->curr_sl++;
+	    it->curr_rec = 0;
+	}
+
+	// Region done; discard slices no later region requires.
+	for (i = it->freed; i < it->next_result; i++)
+	    if (it->sl[i].s && it->sl[i].last_use <= it->curr_r)
+		cram_region_free_slice(it, i);
+	while (it->freed < it->next_result && !it->sl[it->freed].s)
+	    it->freed++;
+
+	if (++it->curr_r < it->nr)
+	    it->curr_sl = it->rsl_start[it->curr_r];
+    }
+
+    return 1;
+}
+
+/* Deallocates a region iterator, waiting on any outstanding jobs. */
+void cram_region_iter_free(cram_region_iter *it) {
+    int i;
+
+    if (!it)
+	return;
+
+    if (it->q) {
+	while (it->next_result < it->next_dispatch) {
+	    t_pool_result *res = t_pool_next_result_wait(it->q);
+	    if (res && res->data)
+		it->sl[it->next_result].s = ((cram_decode_job *)res->data)->s;
+	    it->next_result++;
+	    t_pool_delete_result(res, 1);
+	}
+	t_results_queue_destroy(it->q);
+    }
+
+    if (it->sl) {
+	for (i = 0; i < it->nsl; i++)
+	    if (it->sl[i].s)
+		cram_free_slice(it->sl[i].s);
+	free(it->sl);
+    }
+
+    if (it->ctrs) {
+	for (i = 0; i < it->nctrs; i++)
+	    if (it->ctrs[i].c)
+		cram_free_container(it->ctrs[i].c);
+	free(it->ctrs);
     }
 
-    return cram_to_bam(fd->header, fd, s, cr, s->curr_rec-1, bam) >= 0 ? 0 : -1;
+    free(it->rsl);
+    free(it->rsl_start);
+    free(it);
 }
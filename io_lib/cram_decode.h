@@ -65,6 +65,8 @@ extern "C" {
 cram_record *cram_get_seq(cram_fd *fd);
 
 /*! Read the next cram record and convert it to a bam_seq_t struct.
+ *
+ * This fails if CRAM_OPT_NO_BAM is set.
  *
  * @return
  * Returns 0 on success;
@@ -72,6 +74,77 @@ cram_record *cram_get_seq(cram_fd *fd);
  */
 int cram_get_bam_seq(cram_fd *fd, bam_seq_t **bam);
 
+/*! Read the records of the next slice into parallel arrays.
+ *
+ * Fills out cols with the flags, positions, mapping qualities and so on
+ * of every record in the remainder of the current slice (or the next
+ * one), without building BAM records.  Use CRAM_OPT_REQUIRED_FIELDS to
+ * avoid decoding the data series that are not wanted, and set
+ * CRAM_OPT_NO_BAM before the first read so that decoding threads do not
+ * build BAM records either.  cols must be zeroed before first use.
+ *
+ * @return
+ * Returns 0 on success;
+ *         1 on EOF;
+ *        -1 on failure
+ */
+int cram_get_columns(cram_fd *fd, cram_columns *cols);
+
+/*! Views into the slice for record i of cols.
+ *
+ * These point directly into the decoded slice and are valid until the
+ * next cram_get_columns() call.  Sequence and quality are cols->len[i]
+ * bytes long and are not nul terminated.
+ *
+ * @return
+ * Returns a pointer to the data on success;
+ *         NULL if the field was not in the required fields
+ */
+char *cram_columns_seq(cram_columns *cols, int i);
+char *cram_columns_qual(cram_columns *cols, int i);
+uint32_t *cram_columns_cigar(cram_columns *cols, int i, int *ncigar);
+
+/*! Frees the arrays held within cols. */
+void cram_columns_free(cram_columns *cols);
+
+/*! Opaque multi-region iterator state */
+typedef struct cram_region_iter cram_region_iter;
+
+/*! Creates an iterator over multiple regions.
+ *
+ * The nr regions in r must be sorted by reference (in @SQ order) and
+ * then by start position.  They may overlap.  The r array is not
+ * copied and must remain valid for the lifetime of the iterator.
+ *
+ * Every slice overlapping any region is read and decoded exactly once,
+ * using the thread pool attached to fd if present.  This requires a
+ * seekable file and a complete index already loaded via
+ * cram_index_load().  The iterator repositions fd, so it should not
+ * be mixed with cram_get_seq() calls.
+ *
+ * @return
+ * Returns iterator on success;
+ *         NULL on failure
+ */
+cram_region_iter *cram_region_iter_init(cram_fd *fd, cram_range *r, int nr);
+
+/*! Fetches the next record from a multi-region iterator.
+ *
+ * Records are returned region by region in the order the regions were
+ * supplied.  A record overlapping several regions is returned once for
+ * each of them.  If region is non-NULL it is filled out with the index
+ * of the region this record belongs to.
+ *
+ * @return
+ * Returns 0 on success;
+ *         1 when all regions have been returned;
+ *        -1 on failure
+ */
+int cram_region_iter_next(cram_region_iter *it, bam_seq_t **bam, int *region);
+
+/*! Deallocates a multi-region iterator. */
+void cram_region_iter_free(cram_region_iter *it);
+
 
 /* ----------------------------------------------------------------------
  * Internal functions
@@ -96,6 +169,29 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
  */
 cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b);
 
+/*! INTERNAL:
+ * Works out which data series and external blocks are needed to decode
+ * fd->required_fields from containers using compression header hdr.
+ *
+ * @return
+ * Returns cram_required ptr on success;
+ *         NULL on failure
+ */
+cram_required *cram_required_new(cram_fd *fd,
+				 cram_block_compression_hdr *hdr);
+
+/*! INTERNAL:
+ * Deallocates a cram_required struct.
+ */
+void cram_required_free(cram_required *r);
+
+/*! INTERNAL:
+ * @return
+ * Returns 1 if the external block with content id 'id' is needed;
+ *         0 if not
+ */
+int cram_required_id(cram_required *r, int32_t id);
+
 
 /*! INTERNAL:
  * Decode an entire slice from container blocks. Fills out s->crecs[] array.
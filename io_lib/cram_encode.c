@@ -770,6 +770,104 @@ static void squash_qual(cram_block *b) {
 }
 #endif
 
+/*
+ * Parallel block compression.
+ *
+ * cram_compress_slice queues each block with cram_block_add and then
+ * cram_block_run compresses them all, spread over the thread pool.
+ * Without a thread pool blocks are compressed immediately as they are
+ * added, in the same order as before.
+ */
+typedef struct {
+    cram_block *b;
+    cram_metrics *m;
+    int64_t method;
+    int level;
+} cram_block_job;
+
+typedef struct {
+    cram_fd *fd;
+    cram_slice *s;
+    cram_block_job *job;
+    int njob, ajob;
+} cram_block_queue;
+
+/* Blocks smaller than this aren't worth a pool job of their own */
+#define BLOCK_JOB_MIN 10000
+
+/*
+ * Adds block b to the queue for compression.  Blocks which have already
+ * been queued or compressed are skipped.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_block_add(cram_block_queue *q, cram_block *b,
+			  cram_metrics *m, int64_t method, int level) {
+    int i;
+
+    if (!q->fd->pool)
+	return cram_compress_block(q->fd, q->s, b, m, method, level);
+
+    if (!b || b->method != RAW)
+	return 0;
+
+    for (i = 0; i < q->njob; i++)
+	if (q->job[i].b == b)
+	    return 0;
+
+    if (q->njob == q->ajob) {
+	int n = q->ajob ? q->ajob*2 : 32;
+	cram_block_job *j = realloc(q->job, n * sizeof(*j));
+	if (!j)
+	    return -1;
+	q->job = j;
+	q->ajob = n;
+    }
+
+    q->job[q->njob].b = b;
+    q->job[q->njob].m = m;
+    q->job[q->njob].method = method;
+    q->job[q->njob].level = level;
+    q->njob++;
+
+    return 0;
+}
+
+static int cram_block_job_run(void *arg, int i) {
+    cram_block_queue *q = (cram_block_queue *)arg;
+    cram_block_job *j = &q->job[i];
+
+    return cram_compress_block(q->fd, q->s, j->b, j->m, j->method, j->level);
+}
+
+/*
+ * Compresses all queued blocks.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_block_run(cram_block_queue *q) {
+    int i, n = 0;
+
+    // Largest first for better balancing
+    for (i = 1; i < q->njob; i++) {
+	cram_block_job j = q->job[i];
+	int k;
+	for (k = i; k > 0 && q->job[k-1].b->uncomp_size < j.b->uncomp_size; k--)
+	    q->job[k] = q->job[k-1];
+	q->job[k] = j;
+    }
+    for (i = 0; i < q->njob; i++)
+	n += q->job[i].b->uncomp_size >= BLOCK_JOB_MIN;
+
+    if (q->fd->pool)
+	n = MIN(n-1, q->fd->pool->tsize-1);
+
+    return t_pool_parallel_for(q->fd->pool, q->njob, n,
+			       cram_block_job_run, q);
+}
+
 /*
  * Applies various compression methods to specific blocks, depending on
  * known observations of how data series compress.
@@ -781,13 +879,14 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
     int level = fd->level, i;
     int64_t method = 1<<GZIP | 1<<GZIP_RLE, methodF = method, qmethod, qmethodF;
     int v31_or_above = (fd->version >= (3<<8)+1);
+    cram_block_queue queue = {fd, s, NULL, 0, 0}, *q = &queue;
 
     /* Compress the CORE Block too, with minimal zlib level */
     if (level > 5 && s->block[0]->uncomp_size > 500)
 #ifdef HAVE_ZSTD
-	cram_compress_block(fd, s, s->block[0], NULL, 1<<ZSTD, 3);
+	cram_block_add(q, s->block[0], NULL, 1<<ZSTD, 3);
 #else
-	cram_compress_block(fd, s, s->block[0], NULL, 1<<GZIP, 1);
+	cram_block_add(q, s->block[0], NULL, 1<<GZIP, 1);
 #endif
 
     if (fd->use_bz2)
@@ -891,55 +990,55 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 
 
     /* Specific compression methods for certain block types */
-    if (cram_compress_block(fd, s, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
-			    method, level))
-	return -1;
+    if (cram_block_add(q, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
+		       method, level))
+	goto err;
 
     if (fd->level == 0) {
 	/* Do nothing */
     } else if (fd->level == 1) {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethodF, 1))
-	    return -1;
+	if (cram_block_add(q, s->block[DS_QS], fd->m[DS_QS],
+			   qmethodF, 1))
+	    goto err;
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, 1))
-		    return -1;
+		if (cram_block_add(q, s->block[i], fd->m[i],
+				   method, 1))
+		    goto err;
 	}
     } else if (fd->level <= 3) {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethod, 1))
-	    return -1;
-	if (cram_compress_block(fd, s, s->block[DS_BA], fd->m[DS_BA],
-				method, 1))
-	    return -1;
+	if (cram_block_add(q, s->block[DS_QS], fd->m[DS_QS],
+			   qmethod, 1))
+	    goto err;
+	if (cram_block_add(q, s->block[DS_BA], fd->m[DS_BA],
+			   method, 1))
+	    goto err;
 	if (s->block[DS_BB])
-	    if (cram_compress_block(fd, s, s->block[DS_BB], fd->m[DS_BB],
-				    method, 1))
-	    return -1;
+	    if (cram_block_add(q, s->block[DS_BB], fd->m[DS_BB],
+			       method, 1))
+	    goto err;
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, level))
-		    return -1;
+		if (cram_block_add(q, s->block[i], fd->m[i],
+				   method, level))
+		    goto err;
 	}
     } else {
-	if (cram_compress_block(fd, s, s->block[DS_QS], fd->m[DS_QS],
-				qmethod, level))
-	    return -1;
-	if (cram_compress_block(fd, s, s->block[DS_BA], fd->m[DS_BA],
-				method, level))
-	    return -1;
+	if (cram_block_add(q, s->block[DS_QS], fd->m[DS_QS],
+			   qmethod, level))
+	    goto err;
+	if (cram_block_add(q, s->block[DS_BA], fd->m[DS_BA],
+			   method, level))
+	    goto err;
 	if (s->block[DS_BB])
-	    if (cram_compress_block(fd, s, s->block[DS_BB], fd->m[DS_BB],
-				    method, level))
-	    return -1;
+	    if (cram_block_add(q, s->block[DS_BB], fd->m[DS_BB],
+			       method, level))
+	    goto err;
 	for (i = DS_aux; i <= DS_aux_oz; i++) {
 	    if (s->block[i])
-		if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-					method, level))
-		    return -1;
+		if (cram_block_add(q, s->block[i], fd->m[i],
+				   method, level))
+		    goto err;
 	}
     }
 
@@ -948,15 +1047,15 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
     int method_rn = method & ~(method_rans | method_ranspr | 1<<GZIP_RLE);
     if (fd->version >= (3<<8)+1 && fd->use_tok && level > 1)
 	method_rn |= fd->use_arith ? (1<<NAME_TOKA) : (1<<NAME_TOK3);
-    if (cram_compress_block(fd, s, s->block[DS_RN], fd->m[DS_RN],
-			    method_rn, level))
-	return -1;
+    if (cram_block_add(q, s->block[DS_RN], fd->m[DS_RN],
+		       method_rn, level))
+	goto err;
 
     // NS shows strong local correlation as rearrangements are localised
     if (s->block[DS_NS] && s->block[DS_NS] != s->block[0])
-	if (cram_compress_block(fd, s, s->block[DS_NS], fd->m[DS_NS],
-				method, level))
-	    return -1;
+	if (cram_block_add(q, s->block[DS_NS], fd->m[DS_NS],
+			   method, level))
+	    goto err;
 
     /*
      * Compress any auxiliary tags with their own per-tag metrics
@@ -978,9 +1077,9 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 		// m2 |= (1<<BZIP2); // approx 30% slower and 6% smaller
 		if (m2 & (1<<BZIP2)) ml = 1;
 	    }
-	    if (cram_compress_block(fd, s, s->aux_block[i], s->aux_block[i]->m,
-				    m2, ml))
-		return -1;
+	    if (cram_block_add(q, s->aux_block[i], s->aux_block[i]->m,
+			       m2, ml))
+		goto err;
 	}
     }
 
@@ -996,13 +1095,19 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 	    if (s->block[i]->method != RAW)
 		continue;
 
-	    if (cram_compress_block(fd, s, s->block[i], fd->m[i],
-				    methodF, level))
-		return -1;
+	    if (cram_block_add(q, s->block[i], fd->m[i],
+			       methodF, level))
+		goto err;
 	}
     }
 
-    return 0;
+    i = cram_block_run(q);
+    free(q->job);
+    return i;
+
+ err:
+    free(q->job);
+    return -1;
 }
 
 /*
@@ -1596,6 +1701,94 @@ int add_read_names(cram_fd *fd, cram_container *c, cram_slice *s,
     return 0;
 }
 
+/*
+ * Packed references are unpacked on demand, so rather than holding the
+ * whole sequence we take a private copy of just the region spanned by
+ * the container's records.  This computes the 1-based inclusive span
+ * on each reference, as span[id*2] to span[id*2+1].
+ *
+ * Returns malloced array on success
+ *         NULL on failure
+ */
+static int64_t *cram_ref_spans(cram_container *c, int nref) {
+    int64_t *span = malloc((nref+1) * 2 * sizeof(*span));
+    int i, r;
+
+    if (!span)
+	return NULL;
+
+    for (i = 0; i < nref; i++) {
+	span[i*2]   = INT64_MAX;
+	span[i*2+1] = 0;
+    }
+
+    for (r = 0; r < c->curr_c_rec; r++) {
+	bam_seq_t *b = c->bams[r];
+	uint32_t *cig = bam_cigar(b);
+	int ncig = bam_cigar_len(b);
+	int64_t start = bam_pos(b)+1, end;
+	int id = bam_ref(b);
+
+	if (id < 0 || id >= nref)
+	    continue;
+
+	if (start < 1)
+	    start = 1;
+	end = start-1;
+	for (i = 0; i < ncig; i++) {
+	    switch (cig[i] & BAM_CIGAR_MASK) {
+	    case BAM_CMATCH:
+	    case BAM_CDEL:
+	    case BAM_CREF_SKIP:
+	    case BAM_CBASE_MATCH:
+	    case BAM_CBASE_MISMATCH:
+		end += cig[i] >> BAM_CIGAR_SHIFT;
+		break;
+	    default:
+		break;
+	    }
+	}
+	if (end < start)
+	    end = start;
+
+	if (span[id*2] > start)
+	    span[id*2] = start;
+	if (span[id*2+1] < end)
+	    span[id*2+1] = end;
+    }
+
+    return span;
+}
+
+/*
+ * Sets c->ref to a private copy of reference 'id' covering span[] as
+ * computed by cram_ref_spans().  As with cram_get_ref(), this holds a
+ * reference count on id which the caller releases with cram_ref_decr().
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_ref_window(cram_fd *fd, cram_container *c, int id,
+			   int64_t *span) {
+    int64_t start = span[id*2], end = span[id*2+1];
+
+    if (start > end)
+	start = end = 1;
+
+    if (c->ref_free) {
+	free(c->ref_free);
+	c->ref_free = NULL;
+    }
+
+    if (!(c->ref = cram_get_ref_copy(fd, id, start, end, &c->ref_free)))
+	return -1;
+
+    c->ref_start = start;
+    c->ref_end   = MIN(end, fd->refs->ref_id[id]->length);
+
+    return 0;
+}
+
 /*
  * Encodes all slices in a container into blocks.
  * Returns 0 on success
@@ -1608,22 +1801,45 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
     int multi_ref = 0;
     int r1, r2, sn, nref;
     spare_bams *spares;
+    int64_t *ref_span = NULL;
 
     /* Cache references up-front if we have unsorted access patterns */
     if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
     nref = fd->refs->nref;
     if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 
+    if (!fd->no_ref && fd->refs->packed) {
+	if (!(ref_span = cram_ref_spans(c, nref)))
+	    return -1;
+    }
+
     if (!fd->no_ref && c->refs_used) {
 	for (i = 0; i < nref; i++) {
-	    if (c->refs_used[i])
+	    if (!c->refs_used[i])
+		continue;
+	    if (ref_span) {
+		// Just holding a reference count; discard the copy.
+		char *copy;
+		cram_get_ref_copy(fd, i, 1, 1, &copy);
+		free(copy);
+	    } else {
 		cram_get_ref(fd, i, 1, 0);
+	    }
 	}
     }
 
     /* To create M5 strings */
     /* Fetch reference sequence */
-    if (!fd->no_ref) {
+    if (!fd->no_ref && ref_span) {
+	bam_seq_t *b = c->bams[0];
+
+	c->ref_seq_id = c->ref_id = bam_ref(b);
+	if (c->ref_id >= 0 && cram_ref_window(fd, c, c->ref_id, ref_span)) {
+	    fprintf(stderr, "Failed to load reference #%d\n", bam_ref(b));
+	    free(ref_span);
+	    return -1;
+	}
+    } else if (!fd->no_ref) {
 	bam_seq_t *b = c->bams[0];
 	char *ref;
 
@@ -1684,18 +1900,28 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 		    if (c->ref_seq_id >= 0)
 			cram_ref_decr(fd->refs, c->ref_seq_id);
 
-		    if (!cram_get_ref(fd, bam_ref(b), 1, 0)) {
-			fprintf(stderr, "Failed to load reference #%d\n",
-				bam_ref(b));
-			return -1;
-		    }
+		    if (ref_span) {
+			if (cram_ref_window(fd, c, bam_ref(b), ref_span)) {
+			    fprintf(stderr, "Failed to load reference #%d\n",
+				    bam_ref(b));
+			    free(ref_span);
+			    return -1;
+			}
+			c->ref_seq_id = bam_ref(b); // overwritten later by -2
+		    } else {
+			if (!cram_get_ref(fd, bam_ref(b), 1, 0)) {
+			    fprintf(stderr, "Failed to load reference #%d\n",
+				    bam_ref(b));
+			    return -1;
+			}
 
-		    c->ref_seq_id = bam_ref(b); // overwritten later by -2
-		    if (!fd->refs->ref_id[c->ref_seq_id]->seq)
-			return -1;
-		    c->ref       = fd->refs->ref_id[c->ref_seq_id]->seq;
-		    c->ref_start = 1;
-		    c->ref_end   = fd->refs->ref_id[c->ref_seq_id]->length;
+			c->ref_seq_id = bam_ref(b); // overwritten later by -2
+			if (!fd->refs->ref_id[c->ref_seq_id]->seq)
+			    return -1;
+			c->ref       = fd->refs->ref_id[c->ref_seq_id]->seq;
+			c->ref_start = 1;
+			c->ref_end   = fd->refs->ref_id[c->ref_seq_id]->length;
+		    }
 		}
 	    }
 
@@ -1763,6 +1989,9 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 	    cram_ref_decr(fd->refs, c->ref_seq_id);
     }
 
+    if (ref_span)
+	free(ref_span);
+
     /* Link our bams[] array onto the spare bam list for reuse */
     spares = malloc(sizeof(*spares));
     if (fd->bam_list_lock) pthread_mutex_lock(fd->bam_list_lock);
@@ -3215,7 +3444,8 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 
     // FIXME: multi-ref containers
 
-    ref = c->ref;
+    // Indexed by 0-based apos; c->ref may be a window starting at ref_start
+    ref = c->ref ? c->ref - (c->ref_start-1) : NULL;
     cons = s->cons;
     cr->flags       = bam_flag(b);
     cr->len         = bam_seq_len(b);
@@ -55,6 +55,41 @@
  * earlier as it is sorted) range will be held within it. This ensures that
  * the outer list will never have containments and we can safely do a
  * binary search to find the first range which overlaps any given coordinate.
+ *
+ * Alongside this we also support a binary index, foo.cram.crbi, holding
+ * the same data as fixed width little-endian records.  This is mmapped
+ * and the nested containment list for each reference is only built on
+ * first use, so opening a file for a small query does not need to parse
+ * the entire index.  The layout is:
+ *
+ * Header:   "CRBI", uint32 version, uint64 CRAM file size (0 if unknown),
+ *           uint32 nref, uint32 unused, uint64 nentry, uint64 nctr,
+ *           uint64 total number of records
+ * Refs:     nref x {uint64 first entry, uint64 number of entries}
+ *           Ref 0 is unmapped data (refid -1), ref N is refid N-1.
+ * Entries:  nentry x {int32 refid, start, end, slice, len, nseq,
+ *                     int64 container offset}
+ * Records:  nctr x {int64 container offset, int64 ordinal of first record}
+ *           in file order, for seeking by record number.
+ *
+ * Container offsets are as in the .crai, relative to the end of the SAM
+ * header.  The record table is what cram_seek_to_record() and
+ * cram_index_num_records() use, and hence cram_filter -N, to find the
+ * container holding a given record without reading the containers before
+ * it.  Without a .crbi they scan the container headers instead.
+ *
+ * Compatibility: a reader only accepts the CRBI_VERSION it was built for.
+ * Any change to the layout above, including new fields or reuse of the
+ * unused word, must bump CRBI_VERSION.  Older and newer files are then
+ * simply ignored rather than misread, and the .crai is authoritative.
+ *
+ * Staleness: the header records the size of the CRAM file it was built
+ * from.  If that no longer matches the file on disk, e.g. because the
+ * CRAM was rewritten after indexing, the .crbi is ignored.  A size of 0
+ * disables this check.
+ *
+ * If the .crbi file is missing, malformed, of another version or stale
+ * we fall back to the .crai.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -72,10 +107,38 @@
 #include <math.h>
 #include <ctype.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
 #include "io_lib/cram.h"
 #include "io_lib/os.h"
 #include "io_lib/zfio.h"
 
+#define CRBI_VERSION 1
+
+/* On-disk binary index structures, see above */
+typedef struct {
+    char     magic[4];
+    uint32_t version;
+    uint64_t cram_size;
+    uint32_t nref;
+    uint32_t unused;
+    uint64_t nentry;
+    uint64_t nctr;
+    uint64_t nrecords;
+} crbi_header;
+
+typedef struct {
+    uint64_t first;
+    uint64_t count;
+} crbi_ref;
+
+typedef struct {
+    int32_t refid, start, end, slice, len, nseq;
+    int64_t offset;
+} crbi_entry;
+
 #if 0
 static void dump_index_(cram_index *e, int level) {
     int i, n;
@@ -108,11 +171,52 @@ static char * cram_io_input_buffer_fgets_func(char * s, int size, void * fp)
 }
 #endif
 
+/*
+ * Adds index entry e to the nested containment list.  (*stack)[0] is
+ * the root for this reference and (*stack)[*sp] the last entry added.
+ * Entries must be added in sorted order.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_nclist_add(cram_index ***stack, int *stack_alloc,
+				 int *sp, cram_index *e) {
+    cram_index *idx = (*stack)[*sp], *ep;
+
+    while (!(e->start >= idx->start && e->end <= idx->end) || idx->end == 0) {
+	idx = (*stack)[--*sp];
+    }
+
+    // Now contains, so append
+    if (idx->nslice+1 >= idx->nalloc) {
+	cram_index *tmp;
+	int nalloc = idx->nalloc ? idx->nalloc*2 : 16;
+	if (!(tmp = realloc(idx->e, nalloc * sizeof(*idx->e))))
+	    return -1;
+	idx->e = tmp;
+	idx->nalloc = nalloc;
+    }
+
+    *(ep = &idx->e[idx->nslice++]) = *e;
+    ep->nalloc = ep->nslice = 0; ep->e = NULL;
+
+    if (++*sp >= *stack_alloc) {
+	cram_index **tmp;
+	if (!(tmp = realloc(*stack, *stack_alloc * 2 * sizeof(*tmp))))
+	    return -1;
+	*stack = tmp;
+	*stack_alloc *= 2;
+    }
+    (*stack)[*sp] = ep;
+
+    return 0;
+}
+
 static int cram_index_load_private(cram_fd *fd, void * fp, fgets_functions fgets_func)
 {
     char line[1024];
     cram_index *idx = NULL;
-    cram_index **idx_stack = NULL, *ep, e;
+    cram_index **idx_stack = NULL, e;
     int idx_stack_alloc = 0, idx_stack_ptr = 0;
 
     fd->index = calloc((fd->index_sz = 1), sizeof(*fd->index));
@@ -169,25 +273,12 @@ static int cram_index_load_private(cram_fd *fd, void * fp, fgets_functions fgets
 	    idx_stack[(idx_stack_ptr = 0)] = idx;
 	}
 
-	while (!(e.start >= idx->start && e.end <= idx->end) || idx->end == 0) {
-	    idx = idx_stack[--idx_stack_ptr];
-	}
-
-	// Now contains, so append
-	if (idx->nslice+1 >= idx->nalloc) {
-	    idx->nalloc = idx->nalloc ? idx->nalloc*2 : 16;
-	    idx->e = realloc(idx->e, idx->nalloc * sizeof(*idx->e));
-	}
-
-	e.nalloc = e.nslice = 0; e.e = NULL;
-	*(ep = &idx->e[idx->nslice++]) = e;
-	idx = ep;
-
-	if (++idx_stack_ptr >= idx_stack_alloc) {
-	    idx_stack_alloc *= 2;
-	    idx_stack = realloc(idx_stack, idx_stack_alloc*sizeof(*idx_stack));
+	if (cram_index_nclist_add(&idx_stack, &idx_stack_alloc,
+				  &idx_stack_ptr, &e) < 0) {
+	    free(idx_stack);
+	    return -1;
 	}
-	idx_stack[idx_stack_ptr] = idx;
+	idx = idx_stack[idx_stack_ptr];
     }
     free(idx_stack);
 
@@ -247,7 +338,168 @@ int cram_index_load_via_callbacks(
 #endif
 
 /*
- * Loads a CRAM .crai index into memory.
+ * Opens a binary .crbi index and sets up fd->index so each reference
+ * is loaded on demand by cram_index_load_ref().
+ *
+ * Returns 0 on success
+ *        -1 on failure (including if the index is absent or out of date)
+ */
+static int cram_index_load_binary(cram_fd *fd, char const *fn) {
+    char fn2[PATH_MAX];
+    struct stat sb;
+    FILE *fp;
+    char *map = NULL;
+    size_t sz;
+    int mmapped = 0, i;
+    crbi_header *h;
+    crbi_ref *refs;
+    uint32_t nref;
+    uint64_t nentry, nctr;
+
+    if (strlen(fn) > PATH_MAX-6)
+	return -1;
+    sprintf(fn2, "%s.crbi", fn);
+
+    if (!(fp = fopen(fn2, "rb")))
+	return -1;
+
+    if (fstat(fileno(fp), &sb) != 0 || sb.st_size < sizeof(crbi_header))
+	goto err;
+    sz = sb.st_size;
+
+#ifdef HAVE_MMAP
+    map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED)
+	map = NULL;
+    else
+	mmapped = 1;
+#endif
+    if (!map) {
+	if (!(map = malloc(sz)))
+	    goto err;
+	if (fread(map, 1, sz, fp) != sz)
+	    goto err;
+    }
+    fclose(fp);
+    fp = NULL;
+
+    h = (crbi_header *)map;
+    nref   = le_int4(h->nref);
+    nentry = le_int8(h->nentry);
+    nctr   = le_int8(h->nctr);
+    if (memcmp(h->magic, "CRBI", 4) != 0 ||
+	le_int4(h->version) != CRBI_VERSION ||
+	nref < 1 || nref > INT_MAX ||
+	sz != sizeof(*h) + nref * sizeof(crbi_ref)
+	      + nentry * sizeof(crbi_entry) + nctr * 2 * sizeof(int64_t))
+	goto err;
+
+    // An index for a different or since modified CRAM file.
+    if (h->cram_size && stat(fn, &sb) == 0 &&
+	le_int8(h->cram_size) != (uint64_t)sb.st_size)
+	goto err;
+
+    refs = (crbi_ref *)(map + sizeof(*h));
+    for (i = 0; i < nref; i++) {
+	uint64_t first = le_int8(refs[i].first), count = le_int8(refs[i].count);
+	if (first > nentry || count > nentry - first)
+	    goto err;
+    }
+
+    fd->index_sz = nref;
+    fd->index = calloc(nref, sizeof(*fd->index));
+    fd->index_lazy = calloc(nref, 1);
+    if (!fd->index || !fd->index_lazy) {
+	free(fd->index);
+	free(fd->index_lazy);
+	fd->index = NULL;
+	fd->index_lazy = NULL;
+	goto err;
+    }
+
+    for (i = 0; i < nref; i++) {
+	fd->index[i].refid = i-1;
+	fd->index[i].start = INT_MIN;
+	fd->index[i].end   = INT_MAX;
+	fd->index_lazy[i]  = le_int8(refs[i].count) > 0;
+    }
+
+    fd->index_map = map;
+    fd->index_map_sz = sz;
+    fd->index_mmapped = mmapped;
+    fd->index_ctr = (int64_t *)(map + sizeof(*h) + nref * sizeof(crbi_ref)
+				+ nentry * sizeof(crbi_entry));
+    fd->index_nctr = nctr;
+    fd->index_nrecords = le_int8(h->nrecords);
+    fd->index_ctr_alloced = 0;
+
+    return 0;
+
+ err:
+    if (map) {
+#ifdef HAVE_MMAP
+	if (mmapped)
+	    munmap(map, sz);
+	else
+#endif
+	    free(map);
+    }
+    if (fp)
+	fclose(fp);
+    return -1;
+}
+
+/*
+ * Builds the nested containment list for index slot i (refid i-1) from
+ * the binary index, if not already done.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_load_ref(cram_fd *fd, int i) {
+    crbi_ref *ref;
+    crbi_entry *be;
+    cram_index **idx_stack, e;
+    int idx_stack_alloc = 16, idx_stack_ptr = 0;
+    uint64_t j, count;
+
+    if (!fd->index_lazy || !fd->index_lazy[i])
+	return 0;
+
+    ref = (crbi_ref *)(fd->index_map + sizeof(crbi_header)) + i;
+    be = (crbi_entry *)(fd->index_map + sizeof(crbi_header)
+			+ fd->index_sz * sizeof(crbi_ref))
+	+ le_int8(ref->first);
+    count = le_int8(ref->count);
+
+    if (!(idx_stack = malloc(idx_stack_alloc * sizeof(*idx_stack))))
+	return -1;
+    idx_stack[0] = &fd->index[i];
+
+    for (j = 0; j < count; j++) {
+	e.refid  = le_int4(be[j].refid);
+	e.start  = le_int4(be[j].start);
+	e.end    = le_int4(be[j].end);
+	e.slice  = le_int4(be[j].slice);
+	e.len    = le_int4(be[j].len);
+	e.nseq   = le_int4(be[j].nseq);
+	e.offset = le_int8(be[j].offset);
+
+	if (cram_index_nclist_add(&idx_stack, &idx_stack_alloc,
+				  &idx_stack_ptr, &e) < 0) {
+	    free(idx_stack);
+	    return -1;
+	}
+    }
+    free(idx_stack);
+
+    fd->index_lazy[i] = 0;
+    return 0;
+}
+
+/*
+ * Loads a CRAM index into memory.  We use the binary .crbi index if
+ * present and valid, otherwise the .crai.
  *
  * Returns 0 for success
  *        -1 for failure
@@ -261,6 +513,9 @@ int cram_index_load(cram_fd *fd, char const *fn) {
     if (fd->index)
 	return 0;
 
+    if (cram_index_load_binary(fd, fn) == 0)
+	return 0;
+
     /* copy filename */
     sprintf(fn2, "%s.crai", fn);
     
@@ -290,6 +545,11 @@ static void cram_index_free_recurse(cram_index *e) {
 void cram_index_free(cram_fd *fd) {
     int i;
 
+    if (fd->index_ctr_alloced)
+	free(fd->index_ctr);
+    fd->index_ctr = NULL;
+    fd->index_ctr_alloced = 0;
+
     if (!fd->index)
 	return;
     
@@ -298,7 +558,19 @@ void cram_index_free(cram_fd *fd) {
     }
     free(fd->index);
 
+    if (fd->index_map) {
+#ifdef HAVE_MMAP
+	if (fd->index_mmapped)
+	    munmap(fd->index_map, fd->index_map_sz);
+	else
+#endif
+	    free(fd->index_map);
+    }
+    free(fd->index_lazy);
+
     fd->index = NULL;
+    fd->index_map = NULL;
+    fd->index_lazy = NULL;
 }
 
 /*
@@ -323,8 +595,11 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
     if (refid+1 < 0 || refid+1 >= fd->index_sz)
 	return NULL;
 
-    if (!from)
+    if (!from) {
+	if (cram_index_load_ref(fd, refid+1) < 0)
+	    return NULL;
 	from = &fd->index[refid+1];
+    }
 
     // Ref with nothing aligned against it.
     if (!from->e)
@@ -373,6 +648,105 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos,
     return e;
 }
 
+/*
+ * Appends e to the *ep array, growing it as required.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_append(cram_index ***ep, int *n, int *nalloc,
+			     cram_index *e) {
+    if (*n >= *nalloc) {
+	cram_index **tmp;
+	*nalloc = *nalloc ? *nalloc*2 : 16;
+	if (!(tmp = realloc(*ep, *nalloc * sizeof(*tmp))))
+	    return -1;
+	*ep = tmp;
+    }
+    (*ep)[(*n)++] = e;
+
+    return 0;
+}
+
+/*
+ * Recursively collects entries from 'from' onwards that overlap r.
+ * Entries within a list are sorted by start and any child list is
+ * contained within its parent, so we can stop or prune early.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_collect(cram_index *from, int i, cram_range *r,
+			      cram_index ***ep, int *n, int *nalloc) {
+    for (; i < from->nslice; i++) {
+	cram_index *e = &from->e[i];
+
+	// Unmapped data has no coordinates, so take everything.
+	if (r->refid != -1) {
+	    if (e->start > r->end)
+		break;
+	    if (e->end < r->start)
+		continue;
+	}
+
+	if (cram_index_append(ep, n, nalloc, e) < 0)
+	    return -1;
+
+	if (e->e && cram_index_collect(e, 0, r, ep, n, nalloc) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Finds all index entries overlapping range r.
+ *
+ * Unlike cram_index_query this descends into the nested containment
+ * list, so it returns every entry rather than just the first.  Note
+ * that slices covering multiple references will have one entry per
+ * reference, so the same slice may be reported more than once when
+ * r->refid is -2.
+ *
+ * On success *ep is set to a malloced array of entries, which the
+ * caller should free.  The cram_index pointers within it belong to
+ * fd->index.
+ *
+ * Returns the number of entries found on success;
+ *        -1 on failure
+ */
+int cram_index_query_range(cram_fd *fd, cram_range *r, cram_index ***ep) {
+    cram_index *from, *e;
+    int n = 0, nalloc = 0;
+
+    *ep = NULL;
+
+    if (!fd->index || r->refid+1 < 0 || r->refid+1 >= fd->index_sz)
+	return 0;
+
+    if (cram_index_load_ref(fd, r->refid+1) < 0)
+	return -1;
+
+    from = &fd->index[r->refid+1];
+    if (!from->e)
+	return 0;
+
+    // Use the binary search to find a starting point at the top level.
+    if (r->refid != -1 && (e = cram_index_query(fd, r->refid, r->start, NULL))) {
+	if (cram_index_collect(from, e - from->e, r, ep, &n, &nalloc) < 0)
+	    goto err;
+    } else {
+	if (cram_index_collect(from, 0, r, ep, &n, &nalloc) < 0)
+	    goto err;
+    }
+
+    return n;
+
+ err:
+    free(*ep);
+    *ep = NULL;
+    return -1;
+}
+
 /*
  * Seek within a cram file.
  *
@@ -439,6 +813,330 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
     return 0;
 }
 
+/*
+ * Builds the container to record number table by reading every
+ * container header in the file, for use when no binary index is
+ * available.  The file position is restored afterwards.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_scan_records(cram_fd *fd) {
+    cram_container *c;
+    int64_t *ctr = NULL, nctr = 0, alloc = 0, nrecords = 0;
+    off_t cpos, orig_pos = CRAM_IO_TELLO(fd);
+    int orig_eof = fd->eof;
+
+    if (orig_pos < 0 || cram_seek(fd, fd->first_container, SEEK_SET) != 0)
+	return -1;
+
+    for (;;) {
+	if ((cpos = CRAM_IO_TELLO(fd)) < 0)
+	    goto err;
+	if (!(c = cram_read_container(fd)))
+	    break;
+
+	if (!fd->empty_container) {
+	    if (nctr >= alloc) {
+		int64_t *tmp;
+		alloc = alloc ? alloc*2 : 1024;
+		if (!(tmp = realloc(ctr, alloc * 2 * sizeof(*tmp)))) {
+		    cram_free_container(c);
+		    goto err;
+		}
+		ctr = tmp;
+	    }
+	    ctr[nctr*2]   = le_int8((int64_t)cpos);
+	    ctr[nctr*2+1] = le_int8(nrecords);
+	    nctr++;
+	    nrecords += c->num_records;
+	}
+
+	if (cram_seek(fd, c->length, SEEK_CUR) != 0) {
+	    cram_free_container(c);
+	    goto err;
+	}
+	cram_free_container(c);
+    }
+    if (fd->err)
+	goto err;
+
+    fd->eof = orig_eof;
+    if (cram_seek(fd, orig_pos, SEEK_SET) != 0)
+	goto err;
+
+    fd->index_ctr = ctr;
+    fd->index_nctr = nctr;
+    fd->index_nrecords = nrecords;
+    fd->index_ctr_alloced = 1;
+
+    return 0;
+
+ err:
+    free(ctr);
+    fd->eof = orig_eof;
+    cram_seek(fd, orig_pos, SEEK_SET);
+    return -1;
+}
+
+/*
+ * Finds the container holding record number 'rec', counting from 0 in
+ * file order.  The binary index is used if loaded, otherwise the
+ * container headers are scanned once and the result cached.
+ *
+ * On success *offset is set to the file offset of the container and
+ * *first to the number of the first record within it.
+ *
+ * Returns the container number (from 0) on success;
+ *        -1 if rec is beyond the end of the file or on failure
+ */
+int64_t cram_index_query_record(cram_fd *fd, int64_t rec,
+				off_t *offset, int64_t *first) {
+    int64_t i, j, k;
+
+    if (!fd->index_ctr && cram_index_scan_records(fd) != 0)
+	return -1;
+
+    if (rec < 0 || rec >= fd->index_nrecords || fd->index_nctr == 0)
+	return -1;
+
+    // Last container whose first record is <= rec.
+    i = 0, j = fd->index_nctr;
+    while (j - i > 1) {
+	k = i + (j-i)/2;
+	if (le_int8(fd->index_ctr[k*2+1]) <= rec)
+	    i = k;
+	else
+	    j = k;
+    }
+
+    *offset = le_int8(fd->index_ctr[i*2]);
+    *first  = le_int8(fd->index_ctr[i*2+1]);
+
+    return i;
+}
+
+/*
+ * Returns the number of the first record in container number 'ctr'
+ * (counting containers from 0 in file order), setting *offset to its
+ * file offset.
+ *
+ * Returns record number on success
+ *         -1 if ctr is beyond the end of the file or on failure
+ */
+int64_t cram_index_container_record(cram_fd *fd, int64_t ctr, off_t *offset) {
+    if (!fd->index_ctr && cram_index_scan_records(fd) != 0)
+	return -1;
+
+    if (ctr < 0 || ctr >= fd->index_nctr)
+	return -1;
+
+    *offset = le_int8(fd->index_ctr[ctr*2]);
+    return le_int8(fd->index_ctr[ctr*2+1]);
+}
+
+/*
+ * Returns the total number of records in the file, as counted by
+ * cram_index_query_record.
+ *
+ * Returns record count on success
+ *         -1 on failure
+ */
+int64_t cram_index_num_records(cram_fd *fd) {
+    if (!fd->index_ctr && cram_index_scan_records(fd) != 0)
+	return -1;
+
+    return fd->index_nrecords;
+}
+
+/*
+ * Positions fd such that the next record returned by cram_get_seq or
+ * cram_get_bam_seq is record number 'rec', counting from 0 in file
+ * order.  Records earlier in the same container are decoded and
+ * discarded.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_seek_to_record(cram_fd *fd, int64_t rec) {
+    off_t offset;
+    int64_t first;
+
+    if (cram_index_query_record(fd, rec, &offset, &first) < 0)
+	return -1;
+
+    if (cram_seek(fd, offset, SEEK_SET) != 0)
+	return -1;
+
+    if (fd->ctr) {
+	cram_free_container(fd->ctr);
+	fd->ctr = NULL;
+	fd->ctr_mt = NULL;
+    }
+    fd->ooc = 0;
+    fd->eof = 0;
+
+    for (; first < rec; first++)
+	if (!cram_get_seq(fd))
+	    return -1;
+
+    return 0;
+}
+
+/*
+ * Index entries accumulated while building, written as both .crai text
+ * and .crbi binary.
+ */
+typedef struct {
+    zfp *fp;
+    cram_index *e;
+    int n, nalloc;
+    int64_t *ctr;      // {offset, first record} pairs
+    int64_t nctr, ctr_alloc, nrecords;
+} cram_index_out;
+
+/*
+ * Outputs a single index entry.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_emit(cram_index_out *o, int refid, int64_t start,
+			   int64_t span, int64_t cpos, int32_t landmark,
+			   int sz) {
+    char buf[1024];
+    cram_index *e;
+
+    sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
+	    refid, start, span, cpos, landmark, sz);
+    if (zfputs(buf, o->fp) < 0)
+	return -1;
+
+    if (o->n >= o->nalloc) {
+	o->nalloc = o->nalloc ? o->nalloc*2 : 1024;
+	if (!(e = realloc(o->e, o->nalloc * sizeof(*e))))
+	    return -1;
+	o->e = e;
+    }
+    e = &o->e[o->n++];
+    e->refid  = refid;
+    e->start  = start;
+    e->end    = start + span - 1;
+    e->slice  = landmark;
+    e->len    = sz;
+    e->nseq   = 0;
+    e->offset = cpos;
+
+    return 0;
+}
+
+/*
+ * Records the start of a container holding nrec records.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_emit_container(cram_index_out *o, int64_t cpos,
+				     int nrec) {
+    if (o->nctr >= o->ctr_alloc) {
+	int64_t *tmp;
+	o->ctr_alloc = o->ctr_alloc ? o->ctr_alloc*2 : 1024;
+	if (!(tmp = realloc(o->ctr, o->ctr_alloc * 2 * sizeof(*tmp))))
+	    return -1;
+	o->ctr = tmp;
+    }
+    o->ctr[o->nctr*2]   = le_int8(cpos);
+    o->ctr[o->nctr*2+1] = le_int8(o->nrecords);
+    o->nctr++;
+    o->nrecords += nrec;
+
+    return 0;
+}
+
+/*
+ * Writes the accumulated entries to a binary .crbi index, grouped by
+ * reference.  cram_size is the size of the CRAM file, or 0 if unknown.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_index_write_binary(cram_index_out *o, const char *fn,
+				   int64_t cram_size) {
+    FILE *fp;
+    crbi_header h;
+    crbi_ref *refs = NULL;
+    int64_t *next = NULL;
+    crbi_entry *ents = NULL;
+    int i, nref = 1;
+
+    for (i = 0; i < o->n; i++)
+	if (nref < o->e[i].refid+2)
+	    nref = o->e[i].refid+2;
+
+    refs = calloc(nref, sizeof(*refs));
+    next = calloc(nref, sizeof(*next));
+    ents = malloc((o->n ? o->n : 1) * sizeof(*ents));
+    if (!refs || !next || !ents)
+	goto err;
+
+    // Counting sort by reference, keeping file order within each.
+    for (i = 0; i < o->n; i++)
+	refs[o->e[i].refid+1].count++;
+    for (i = 1; i < nref; i++)
+	next[i] = refs[i].first = refs[i-1].first + refs[i-1].count;
+
+    for (i = 0; i < o->n; i++) {
+	cram_index *e = &o->e[i];
+	crbi_entry *be = &ents[next[e->refid+1]++];
+	be->refid  = le_int4(e->refid);
+	be->start  = le_int4(e->start);
+	be->end    = le_int4(e->end);
+	be->slice  = le_int4(e->slice);
+	be->len    = le_int4(e->len);
+	be->nseq   = le_int4(e->nseq);
+	be->offset = le_int8(e->offset);
+    }
+
+    for (i = 0; i < nref; i++) {
+	refs[i].first = le_int8(refs[i].first);
+	refs[i].count = le_int8(refs[i].count);
+    }
+
+    memcpy(h.magic, "CRBI", 4);
+    h.version   = le_int4(CRBI_VERSION);
+    h.cram_size = le_int8(cram_size);
+    h.nref      = le_int4(nref);
+    h.unused    = 0;
+    h.nentry    = le_int8((uint64_t)o->n);
+    h.nctr      = le_int8((uint64_t)o->nctr);
+    h.nrecords  = le_int8((uint64_t)o->nrecords);
+
+    if (!(fp = fopen(fn, "wb"))) {
+	perror(fn);
+	goto err;
+    }
+    if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+	fwrite(refs, sizeof(*refs), nref, fp) != nref ||
+	fwrite(ents, sizeof(*ents), o->n, fp) != o->n ||
+	fwrite(o->ctr, 2*sizeof(*o->ctr), o->nctr, fp) != o->nctr) {
+	fclose(fp);
+	goto err;
+    }
+    if (fclose(fp) != 0)
+	goto err;
+
+    free(refs);
+    free(next);
+    free(ents);
+    return 0;
+
+ err:
+    free(refs);
+    free(next);
+    free(ents);
+    return -1;
+}
+
 /*
  * A specialised form of cram_index_build (below) that deals with slices
  * having multiple references in this (ref_id -2). In this scenario we
@@ -450,12 +1148,11 @@ int cram_seek_to_refpos(cram_fd *fd, cram_range *r) {
 static int cram_index_build_multiref(cram_fd *fd,
 				     cram_container *c,
 				     cram_slice *s,
-				     zfp *fp,
+				     cram_index_out *o,
 				     off_t cpos,
 				     int32_t landmark,
 				     int sz) {
     int i, ref = -2, ref_start = 0, ref_end;
-    char buf[1024];
 
     if (0 != cram_decode_slice(fd, c, s, fd->header))
 	return -1;
@@ -469,10 +1166,9 @@ static int cram_index_build_multiref(cram_fd *fd,
 	}
 
 	if (ref != -2) {
-	    sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		    ref, ref_start, ref_end - ref_start + 1,
-		    (int64_t)cpos, landmark, sz);
-	    zfputs(buf, fp);
+	    if (cram_index_emit(o, ref, ref_start, ref_end - ref_start + 1,
+				cpos, landmark, sz) < 0)
+		return -1;
 	}
 
 	ref = s->crecs[i].ref_id;
@@ -481,10 +1177,9 @@ static int cram_index_build_multiref(cram_fd *fd,
     }
 
     if (ref != -2) {
-	sprintf(buf, "%d\t%d\t%d\t%"PRId64"\t%d\t%d\n",
-		ref, ref_start, ref_end - ref_start + 1,
-		(int64_t)cpos, landmark, sz);
-	zfputs(buf, fp);
+	if (cram_index_emit(o, ref, ref_start, ref_end - ref_start + 1,
+			    cpos, landmark, sz) < 0)
+	    return -1;
     }
 
     return 0;
@@ -495,27 +1190,31 @@ static int cram_index_build_multiref(cram_fd *fd,
  *
  * fd is a newly opened cram file that we wish to index.
  * fn_base is the filename of the associated CRAM file. Internally we
- * add ".crai" to this to get the index filename.
+ * add ".crai" to this to get the index filename, and ".crbi" for the
+ * binary index.
  *
  * Returns 0 on success
  *        -1 on failure
  */
 int cram_index_build(cram_fd *fd, const char *fn_base) {
-    cram_container *c;
+    cram_container *c = NULL;
     off_t cpos, spos, hpos;
-    zfp *fp;
-    char fn_idx[PATH_MAX];
+    cram_index_out o = {NULL, NULL, 0, 0, NULL, 0, 0, 0};
+    char fn_idx[PATH_MAX], fn_bin[PATH_MAX];
     int seekable;
     size_t len;
 
     if ((len=strlen(fn_base)) > PATH_MAX-6)
 	return -1;
 
-    if (len >= 5 && strcmp(&fn_base[len-5], ".crai") == 0)
+    if (len >= 5 && strcmp(&fn_base[len-5], ".crai") == 0) {
 	strcpy(fn_idx, fn_base);
-    else
+	sprintf(fn_bin, "%.*s.crbi", (int)len-5, fn_base);
+    } else {
 	sprintf(fn_idx, "%s.crai", fn_base);
-    if (!(fp = zfopen(fn_idx, "wz"))) {
+	sprintf(fn_bin, "%s.crbi", fn_base);
+    }
+    if (!(o.fp = zfopen(fn_idx, "wz"))) {
         perror(fn_idx);
         return -1;
     }
@@ -532,7 +1231,7 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 
         if (fd->err) {
             perror("Cram container read");
-            return -1;
+            goto err;
         }
 
 	if (seekable) {
@@ -543,18 +1242,21 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 	}
 
         if (!(c->comp_hdr_block = cram_read_block(fd)))
-            return -1;
+            goto err;
         assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
 
         c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
         if (!c->comp_hdr)
-            return -1;
+            goto err;
+
+	if (!fd->empty_container &&
+	    cram_index_emit_container(&o, cpos, c->num_records) < 0)
+	    goto err;
 
         // 2.0 format
         for (j = 0; j < c->num_landmarks; j++) {
-            char buf[1024];
             cram_slice *s;
-            int sz;
+            int sz, r;
 
 	    if (seekable) {
 		spos = CRAM_IO_TELLO(fd);
@@ -563,10 +1265,8 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 		spos = cpos + c->offset + c->landmark[j];
 	    }
 
-            if (!(s = cram_read_slice(fd))) {
-		zfclose(fp);
-		return -1;
-	    }
+            if (!(s = cram_read_slice(fd)))
+		goto err;
 
 	    if (seekable) {
 		sz = (int)(CRAM_IO_TELLO(fd) - spos);
@@ -577,17 +1277,18 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 	    }
 
 	    if (s->hdr->ref_seq_id == -2) {
-		cram_index_build_multiref(fd, c, s, fp,
-					  cpos, c->landmark[j], sz);
+		r = cram_index_build_multiref(fd, c, s, &o,
+					      cpos, c->landmark[j], sz);
 	    } else {
-		sprintf(buf, "%d\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%d\t%d\n",
-			s->hdr->ref_seq_id, s->hdr->ref_seq_start,
-			s->hdr->ref_seq_span, (int64_t)cpos,
-			c->landmark[j], sz);
-		zfputs(buf, fp);
+		r = cram_index_emit(&o, s->hdr->ref_seq_id,
+				    s->hdr->ref_seq_start,
+				    s->hdr->ref_seq_span, (int64_t)cpos,
+				    c->landmark[j], sz);
 	    }
 
             cram_free_slice(s);
+	    if (r < 0)
+		goto err;
         }
 	
 	if (seekable) {
@@ -599,11 +1300,27 @@ int cram_index_build(cram_fd *fd, const char *fn_base) {
 
         cram_free_container(c);
     }
-    if (fd->err) {
-	zfclose(fp);
+    if (fd->err)
+	goto err;
+
+    // A non-seekable stream doesn't tell us the file size to validate
+    // against, so store 0.
+    if (cram_index_write_binary(&o, fn_bin, seekable ? cpos : 0) < 0) {
+	zfclose(o.fp);
+	free(o.e);
+	free(o.ctr);
 	return -1;
     }
-	
-
-    return (zfclose(fp) >= 0) ? 0 : -1;
+    free(o.e);
+    free(o.ctr);
+
+    return (zfclose(o.fp) >= 0) ? 0 : -1;
+
+ err:
+    if (c)
+	cram_free_container(c);
+    zfclose(o.fp);
+    free(o.e);
+    free(o.ctr);
+    return -1;
 }
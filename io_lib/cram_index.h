@@ -39,7 +39,9 @@ extern "C" {
 #endif
 
 /*
- * Loads a CRAM .crai index into memory.
+ * Loads a CRAM index into memory.  The binary .crbi index is used in
+ * preference to the .crai if present and up to date.
+ *
  * Returns 0 for success
  *        -1 for failure
  */
@@ -71,6 +73,18 @@ void cram_index_free(cram_fd *fd);
  */
 cram_index *cram_index_query(cram_fd *fd, int refid, int pos, cram_index *frm);
 
+/*
+ * Finds all index entries overlapping range r, including those nested
+ * within other entries.
+ *
+ * On success *ep is set to a malloced array of entries, which the
+ * caller should free.
+ *
+ * Returns the number of entries found on success;
+ *        -1 on failure
+ */
+int cram_index_query_range(cram_fd *fd, cram_range *r, cram_index ***ep);
+
 /*
  * Skips to a container overlapping the start coordinate listed in
  * cram_range.
@@ -80,6 +94,44 @@ cram_index *cram_index_query(cram_fd *fd, int refid, int pos, cram_index *frm);
  */
 int cram_seek_to_refpos(cram_fd *fd, cram_range *r);
 
+/*
+ * Finds the container holding record number 'rec', counting from 0 in
+ * file order.  On success *offset is set to the file offset of the
+ * container and *first to the number of the first record within it.
+ *
+ * Returns the container number (from 0) on success;
+ *        -1 if rec is beyond the end of the file or on failure
+ */
+int64_t cram_index_query_record(cram_fd *fd, int64_t rec,
+				off_t *offset, int64_t *first);
+
+/*
+ * Returns the number of the first record in container number 'ctr'
+ * (counting containers from 0 in file order), setting *offset to its
+ * file offset.
+ *
+ * Returns record number on success
+ *         -1 if ctr is beyond the end of the file or on failure
+ */
+int64_t cram_index_container_record(cram_fd *fd, int64_t ctr, off_t *offset);
+
+/*
+ * Returns the total number of records in the file on success
+ *         -1 on failure
+ */
+int64_t cram_index_num_records(cram_fd *fd);
+
+/*
+ * Positions fd such that the next record returned by cram_get_seq or
+ * cram_get_bam_seq is record number 'rec', counting from 0 in file
+ * order.  Uses the binary .crbi index if loaded, otherwise scans the
+ * container headers.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_seek_to_record(cram_fd *fd, int64_t rec);
+
 /*
  * Seek within a cram file.
  *
@@ -93,7 +145,8 @@ int cram_seek(cram_fd *fd, off_t offset, int whence);
  *
  * fd is a newly opened cram file that we wish to index.
  * fn_base is the filename of the associated CRAM file. Internally we
- * add ".crai" to this to get the index filename.
+ * add ".crai" to this to get the index filename.  A binary ".crbi"
+ * index is written alongside it.
  *
  * Returns 0 on success
  *        -1 on failure
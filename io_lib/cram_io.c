@@ -1268,6 +1268,278 @@ static int sint7_put_blk_64(cram_block *blk, int64_t v) {
     return sz;
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * Block varint decoding.
+ *
+ * These decode a run of up to n values from a buffer into an array, for
+ * use by the EXTERNAL and VARINT codecs.  Most values in typical data
+ * series fit in a single byte, so runs of those are widened to 32 or 64
+ * bits 16 or 32 at a time using SSE4.1 or AVX2 where the CPU supports
+ * it (checked at run time), with everything else going through the
+ * single value get functions above.
+ */
+
+#ifdef VARINT2
+#define UINT7_1BYTE 177
+#else
+#define UINT7_1BYTE 128
+#endif
+
+/*
+ * Converts the leading bytes in cp[0..max-1] that are below thresh to
+ * values in out[], returning how many were converted.  The SIMD versions
+ * may write up to max values to out[] regardless.
+ */
+typedef int (*varint_run32_f)(const uint8_t *cp, int max, int thresh,
+			      int32_t *out);
+typedef int (*varint_run64_f)(const uint8_t *cp, int max, int thresh,
+			      int64_t *out);
+
+static int varint_run32_scalar(const uint8_t *cp, int max, int thresh,
+			       int32_t *out) {
+    int i;
+    for (i = 0; i < max && cp[i] < thresh; i++)
+	out[i] = cp[i];
+    return i;
+}
+
+static int varint_run64_scalar(const uint8_t *cp, int max, int thresh,
+			       int64_t *out) {
+    int i;
+    for (i = 0; i < max && cp[i] < thresh; i++)
+	out[i] = cp[i];
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define VARINT_SIMD
+#include <immintrin.h>
+
+// Bit i set in the result if byte i of x is >= t.
+#define VARINT_GE_MASK16(x,t) \
+    _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8((x),(t)), (x)))
+#define VARINT_GE_MASK32(x,t) \
+    (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8((x),(t)),(x)))
+
+__attribute__((target("sse4.1")))
+static int varint_run32_sse4(const uint8_t *cp, int max, int thresh,
+			     int32_t *out) {
+    __m128i t = _mm_set1_epi8((char)thresh);
+    int i = 0;
+
+    while (i + 16 <= max) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(cp+i));
+	int m = VARINT_GE_MASK16(x, t);
+
+	_mm_storeu_si128((__m128i *)(out+i),    _mm_cvtepu8_epi32(x));
+	_mm_storeu_si128((__m128i *)(out+i+4),  _mm_cvtepu8_epi32(_mm_srli_si128(x, 4)));
+	_mm_storeu_si128((__m128i *)(out+i+8),  _mm_cvtepu8_epi32(_mm_srli_si128(x, 8)));
+	_mm_storeu_si128((__m128i *)(out+i+12), _mm_cvtepu8_epi32(_mm_srli_si128(x, 12)));
+	if (m)
+	    return i + __builtin_ctz(m);
+	i += 16;
+    }
+
+    return i + varint_run32_scalar(cp+i, max-i, thresh, out+i);
+}
+
+__attribute__((target("sse4.1")))
+static int varint_run64_sse4(const uint8_t *cp, int max, int thresh,
+			     int64_t *out) {
+    __m128i t = _mm_set1_epi8((char)thresh);
+    int i = 0, j;
+
+    while (i + 16 <= max) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(cp+i));
+	int m = VARINT_GE_MASK16(x, t);
+
+	for (j = 0; j < 16; j += 2, x = _mm_srli_si128(x, 2))
+	    _mm_storeu_si128((__m128i *)(out+i+j), _mm_cvtepu8_epi64(x));
+	if (m)
+	    return i + __builtin_ctz(m);
+	i += 16;
+    }
+
+    return i + varint_run64_scalar(cp+i, max-i, thresh, out+i);
+}
+
+__attribute__((target("avx2")))
+static int varint_run32_avx2(const uint8_t *cp, int max, int thresh,
+			     int32_t *out) {
+    __m256i t = _mm256_set1_epi8((char)thresh);
+    int i = 0, j;
+
+    while (i + 32 <= max) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(cp+i));
+	uint32_t m = VARINT_GE_MASK32(x, t);
+
+	for (j = 0; j < 32; j += 8)
+	    _mm256_storeu_si256((__m256i *)(out+i+j),
+		_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(cp+i+j))));
+	if (m)
+	    return i + __builtin_ctz(m);
+	i += 32;
+    }
+
+    return i + varint_run32_scalar(cp+i, max-i, thresh, out+i);
+}
+
+__attribute__((target("avx2")))
+static int varint_run64_avx2(const uint8_t *cp, int max, int thresh,
+			     int64_t *out) {
+    __m256i t = _mm256_set1_epi8((char)thresh);
+    int i = 0, j;
+
+    while (i + 32 <= max) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(cp+i));
+	uint32_t m = VARINT_GE_MASK32(x, t);
+
+	for (j = 0; j < 32; j += 4) {
+	    uint32_t w;
+	    memcpy(&w, cp+i+j, 4);
+	    _mm256_storeu_si256((__m256i *)(out+i+j),
+		_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(w)));
+	}
+	if (m)
+	    return i + __builtin_ctz(m);
+	i += 32;
+    }
+
+    return i + varint_run64_scalar(cp+i, max-i, thresh, out+i);
+}
+#endif
+
+static varint_run32_f varint_run32 = varint_run32_scalar;
+static varint_run64_f varint_run64 = varint_run64_scalar;
+static pthread_once_t varint_once = PTHREAD_ONCE_INIT;
+
+static void varint_init_once(void) {
+#ifdef VARINT_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	varint_run32 = varint_run32_avx2;
+	varint_run64 = varint_run64_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+	varint_run32 = varint_run32_sse4;
+	varint_run64 = varint_run64_sse4;
+    }
+#endif
+}
+
+/*
+ * Decodes up to n values from *cp into out[], using run32 for single
+ * byte values (below thresh) and get() for everything else.  zz applies
+ * zig-zag decoding to the single byte values, matching a signed get().
+ *
+ * Returns the number of values decoded, advancing *cp.  Sets *err to 1
+ * and stops on error.
+ */
+static inline int varint_get_blk32(char **cp, const char *endp,
+				   int32_t *out, int n, int *err, int thresh,
+				   int64_t (*get)(char **, const char *, int *),
+				   int zz) {
+    int i = 0, e = 0;
+
+    while (i < n) {
+	int max = MIN(n - i, endp - *cp), r;
+	if (max <= 0) {
+	    e = 1;
+	    break;
+	}
+
+	r = varint_run32((const uint8_t *)*cp, max, thresh, out+i);
+	if (zz) {
+	    int j;
+	    for (j = i; j < i+r; j++)
+		out[j] = ((uint32_t)out[j] >> 1) ^ -(out[j] & 1);
+	}
+	*cp += r;
+	i += r;
+
+	if (i < n && r < max) {
+	    out[i] = get(cp, endp, &e);
+	    if (e)
+		break;
+	    i++;
+	}
+    }
+
+    if (e && err)
+	*err = 1;
+    return i;
+}
+
+static inline int varint_get_blk64(char **cp, const char *endp,
+				   int64_t *out, int n, int *err, int thresh,
+				   int64_t (*get)(char **, const char *, int *),
+				   int zz) {
+    int i = 0, e = 0;
+
+    while (i < n) {
+	int max = MIN(n - i, endp - *cp), r;
+	if (max <= 0) {
+	    e = 1;
+	    break;
+	}
+
+	r = varint_run64((const uint8_t *)*cp, max, thresh, out+i);
+	if (zz) {
+	    int j;
+	    for (j = i; j < i+r; j++)
+		out[j] = ((uint64_t)out[j] >> 1) ^ -(out[j] & 1);
+	}
+	*cp += r;
+	i += r;
+
+	if (i < n && r < max) {
+	    out[i] = get(cp, endp, &e);
+	    if (e)
+		break;
+	    i++;
+	}
+    }
+
+    if (e && err)
+	*err = 1;
+    return i;
+}
+
+static int itf8_get_blk32(char **cp, const char *endp, int32_t *out, int n,
+			  int *err) {
+    return varint_get_blk32(cp, endp, out, n, err, 0x80, safe_itf8_get, 0);
+}
+
+static int ltf8_get_blk64(char **cp, const char *endp, int64_t *out, int n,
+			  int *err) {
+    return varint_get_blk64(cp, endp, out, n, err, 0x80, safe_ltf8_get, 0);
+}
+
+static int uint7_get_blk32(char **cp, const char *endp, int32_t *out, int n,
+			   int *err) {
+    return varint_get_blk32(cp, endp, out, n, err, UINT7_1BYTE,
+			    uint7_get_32, 0);
+}
+
+static int sint7_get_blk32(char **cp, const char *endp, int32_t *out, int n,
+			   int *err) {
+    return varint_get_blk32(cp, endp, out, n, err, UINT7_1BYTE,
+			    sint7_get_32, 1);
+}
+
+static int uint7_get_blk64(char **cp, const char *endp, int64_t *out, int n,
+			   int *err) {
+    return varint_get_blk64(cp, endp, out, n, err, UINT7_1BYTE,
+			    uint7_get_64, 0);
+}
+
+static int sint7_get_blk64(char **cp, const char *endp, int64_t *out, int n,
+			   int *err) {
+    return varint_get_blk64(cp, endp, out, n, err, UINT7_1BYTE,
+			    sint7_get_64, 1);
+}
+
 // Decode 32-bits with CRC update from cram_fd
 static int uint7_decode_crc32(cram_fd *fd, int32_t *val_p, uint32_t *crc) {
     uint8_t b[5], i = 0;
@@ -1786,12 +2058,41 @@ cram_block *cram_new_block(enum cram_content_type content_type,
     return b;
 }
 
+/*
+ * Moves len bytes forward in the input, by seeking if possible and
+ * reading otherwise.  Unlike cram_seek() this does not reset fd->ooc.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_io_skip(cram_fd *fd, off_t len) {
+    char buf[65536];
+
+    if (CRAM_IO_SEEK(fd, len, SEEK_CUR) == 0)
+	return 0;
+
+    while (len > 0) {
+	int l = MIN(65536, len);
+	if (l != CRAM_IO_READ(buf, 1, l, fd))
+	    return -1;
+	len -= l;
+    }
+
+    return 0;
+}
+
 /*
  * Reads a block from a cram file.
+ *
+ * If r is non-NULL then external blocks not needed by it, other than
+ * the embedded reference block ref_id, are skipped over instead.  These
+ * are returned with their header filled out but with no data.
+ *
  * Returns cram_block pointer on success.
  *         NULL on failure
  */
-cram_block *cram_read_block(cram_fd *fd) {
+static cram_block *cram_read_block_required(cram_fd *fd, cram_required *r,
+					    int ref_id) {
     cram_block *b = malloc(sizeof(*b));
     unsigned char c;
     uint32_t crc = 0;
@@ -1811,7 +2112,16 @@ cram_block *cram_read_block(cram_fd *fd) {
     //    fprintf(stderr, "  method %d, ctype %d, cid %d, csize %d, ucsize %d\n",
     //	    b->method, b->content_type, b->content_id, b->comp_size, b->uncomp_size);
 
-    if (b->method == RAW) {
+    if (r && b->content_type == EXTERNAL && b->content_id != ref_id &&
+	!cram_required_id(r, b->content_id)) {
+	b->alloc = 0;
+	b->data = NULL;
+	if (cram_io_skip(fd, b->method == RAW
+			 ? b->uncomp_size : b->comp_size) != 0) {
+	    free(b);
+	    return NULL;
+	}
+    } else if (b->method == RAW) {
 	b->alloc = b->uncomp_size;
 	if (!(b->data = malloc(b->uncomp_size))){ free(b); return NULL; }
 	if (b->uncomp_size != CRAM_IO_READ(b->data, 1, b->uncomp_size, fd)) {
@@ -1850,6 +2160,15 @@ cram_block *cram_read_block(cram_fd *fd) {
     return b;
 }
 
+/*
+ * Reads a block from a cram file.
+ * Returns cram_block pointer on success.
+ *         NULL on failure
+ */
+cram_block *cram_read_block(cram_fd *fd) {
+    return cram_read_block_required(fd, NULL, -1);
+}
+
 /*
  * Writes a CRAM block.
  * Returns 0 on success
@@ -1929,6 +2248,10 @@ int cram_uncompress_block(cram_block *b) {
     char *uncomp;
     size_t uncomp_size = 0;
 
+    if (!b->data && b->uncomp_size)
+	// Skipped over by cram_read_slice_required()
+	return -1;
+
     if (b->crc32_checked == 0) {
 	uint32_t crc = iolib_crc32(b->crc_part, b->data ? b->data : (uc *)"", b->alloc);
 	b->crc32_checked = 1;
@@ -2424,6 +2747,175 @@ static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
     return NULL;
 }
 
+/*
+ * Approximate CPU cost of compressing with each method, in multiples of
+ * an order-0 rANS pass.  Used with CRAM_OPT_TRIAL_BUDGET to limit how
+ * much work each trial does.  See enum cram_block_method.
+ */
+static const double meth_cpu[CRAM_MAX_METHOD] = {
+    0,    // 0  raw
+    5,    // 1  gzip (Z_FILTERED)
+    10,   // 2  bzip2
+    40,   // 3  lzma
+    1,    // 4  rans    (O0)
+    1,    // 5  ranspr  (O0)
+    3,    // 6  arithpr (O0)
+    15,   // 7  fqz
+    8,    // 8  tok3 (rans)
+    12,   // 9  libbsc
+    4,    // 10 ZSTD
+
+    15, 15, 15, // FQZ_b,c,d
+    1.5,  // rans O1
+
+    2,    // gzip rle
+    2,    // gzip -1
+
+    1.5,  // rans_pr1
+    1.2,  // rans_pr64
+    2,    // rans_pr65/9
+    1,    // rans_pr128
+    1.5,  // rans_pr129
+    1.2,  // rans_pr192
+    1.7,  // rans_pr193
+
+    12,   // tok3 arith
+
+    4,    // arith_pr1
+    3,    // arith_pr64
+    5,    // arith_pr65
+    3,    // arith_pr128
+    4,    // arith_pr129
+    3,    // arith_pr192
+    4.5,  // arith_pr193
+
+    1.5,  // ZSTD -1
+};
+
+/*
+ * Cheap compressibility statistics for a block: the order-0 and order-1
+ * entropy in bytes and the fraction of bytes starting a new run.
+ */
+static int cram_block_entropy(const unsigned char *data, size_t len,
+			      double *e0, double *e1, double *runs) {
+    uint32_t c0[256] = {0}, *c1;
+    size_t i, nruns = len > 0;
+    double h0 = 0, h1 = 0;
+    int j, k;
+
+    if (!(c1 = calloc(65536, sizeof(*c1))))
+	return -1;
+
+    if (len)
+	c0[data[0]]++;
+    for (i = 1; i < len; i++) {
+	c0[data[i]]++;
+	c1[(data[i-1]<<8) | data[i]]++;
+	nruns += data[i] != data[i-1];
+    }
+
+    for (j = 0; j < 256; j++) {
+	uint32_t tot = 0;
+	if (!c0[j])
+	    continue;
+	h0 -= c0[j] * log2((double)c0[j] / len);
+
+	for (k = 0; k < 256; k++)
+	    tot += c1[(j<<8)|k];
+	for (k = 0; k < 256; k++)
+	    if (c1[(j<<8)|k])
+		h1 -= c1[(j<<8)|k] * log2((double)c1[(j<<8)|k] / tot);
+    }
+    free(c1);
+
+    *e0 = h0/8 + 1;
+    *e1 = h1/8 + 1;
+    *runs = len ? (double)nruns / len : 1;
+
+    return 0;
+}
+
+/*
+ * Picks which of the methods in 'method' to trial on block b, within
+ * fd->trial_budget units of meth_cpu.  Each method's size is predicted
+ * as an entropy estimate scaled by the ratio learnt from its previous
+ * trials.  Methods with nothing learnt yet and the current best ('best')
+ * are always tried; the rest are added in order of predicted size.
+ *
+ * est[] is filled out with the entropy estimate and pred[] with the
+ * predicted size of every method in 'method'.
+ *
+ * Returns the mask of methods to try.
+ */
+static int64_t cram_trial_methods(cram_fd *fd, cram_block *b,
+				  int64_t method, int best,
+				  const double *ratio, const int *nratio,
+				  double *est, double *pred) {
+    double e0, e1, runs, cost = 0;
+    int order[CRAM_MAX_METHOD], n = 0, i, j, m;
+    int64_t trial = 0;
+
+    if (cram_block_entropy(b->data, b->uncomp_size, &e0, &e1, &runs) < 0)
+	return method;
+
+    for (m = 0; m < CRAM_MAX_METHOD; m++) {
+	if (!(method & (1LL<<m)))
+	    continue;
+
+	switch (m) {
+	case RANS0: case RANS_PR0: case ARITH_PR0:
+	case RANS_PR128: case ARITH_PR128:
+	    est[m] = e0;
+	    break;
+
+	case RANS1: case RANS_PR1: case ARITH_PR1:
+	case RANS_PR9: case ARITH_PR9:
+	case RANS_PR129: case ARITH_PR129:
+	    est[m] = e1;
+	    break;
+
+	case GZIP_RLE: case RANS_PR64: case ARITH_PR64:
+	case RANS_PR192: case ARITH_PR192:
+	    est[m] = e0 * runs + 1;
+	    break;
+
+	case RANS_PR193: case ARITH_PR193:
+	    est[m] = e1 * runs + 1;
+	    break;
+
+	default:
+	    est[m] = MIN(e0, e1);
+	}
+	pred[m] = est[m] * ratio[m];
+
+	if (!nratio[m] || m == best) {
+	    trial |= 1LL<<m;
+	    cost += meth_cpu[m];
+	    continue;
+	}
+
+	// insertion sort on predicted size
+	for (i = n++; i > 0 && pred[order[i-1]] > pred[m]; i--)
+	    order[i] = order[i-1];
+	order[i] = m;
+    }
+
+    for (j = 0; j < n; j++) {
+	m = order[j];
+	if (trial && cost + meth_cpu[m] > fd->trial_budget)
+	    break;
+	trial |= 1LL<<m;
+	cost += meth_cpu[m];
+    }
+
+    if (fd->verbose > 1)
+	fprintf(stderr, "Block ID %d entropy o0 %.0f o1 %.0f runs %.2f: "
+		"trial %lx of %lx\n", b->content_id, e0, e1, runs,
+		(long)trial, (long)method);
+
+    return trial;
+}
+
 /*
  * Compresses a block using one of two different zlib strategies. If we only
  * want one choice set strat2 to be -1.
@@ -2496,8 +2988,11 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	    int m;
 	    size_t sz_best = INT_MAX;
 	    size_t sz[CRAM_MAX_METHOD] = {0};
-	    int64_t method_best = 0;
+	    int64_t method_best = 0, trial;
 	    char *c_best = NULL, *c = NULL;
+	    double ratio[CRAM_MAX_METHOD], est[CRAM_MAX_METHOD] = {0};
+	    double pred[CRAM_MAX_METHOD] = {0};
+	    int nratio[CRAM_MAX_METHOD], best;
 
 	    if (metrics->revised_method)
 		method = metrics->revised_method;
@@ -2532,10 +3027,22 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		if (method & (1LL<<ARITH_PR193))
 		    method = (method|(1<<ARITH_PR64)|(1<<ARITH_PR1))&~(1LL<<ARITH_PR193);
 	    }
+	    memcpy(ratio, metrics->ratio, sizeof(ratio));
+	    memcpy(nratio, metrics->nratio, sizeof(nratio));
+	    best = metrics->method;
 	    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
 
+	    // Optionally only try the methods most likely to win
+	    trial = method;
+	    if (fd->trial_budget > 0)
+		trial = cram_trial_methods(fd, b, method, best, ratio, nratio,
+					   est, pred);
+
+	retry:
             for (m = 0; m < CRAM_MAX_METHOD; m++) {
-		if (method & (1LL<<m)) {
+		if (method & ~trial & (1LL<<m)) {
+		    sz[m] = pred[m]; // not tried, so use the prediction
+		} else if (method & (1LL<<m)) {
 		    int lvl = level;
 		    switch (m) {
 		    case GZIP:     strat = Z_FILTERED; break;
@@ -2573,6 +3080,12 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		}
 	    }
 
+	    // If everything we picked failed, fall back to trying the lot
+	    if (!c_best && trial != method) {
+		trial = method;
+		goto retry;
+	    }
+
 	    //fprintf(stderr, "sz_best = %d\n", sz_best);
 
 	    free(b->data);
@@ -2588,6 +3101,20 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
             for (m = 0; m < CRAM_MAX_METHOD; m++)
                 metrics->sz[m] += sz[m]+50; // don't be overly sure on small blocks
 
+	    // Learn how each method tried compares to the entropy estimate
+	    if (fd->trial_budget > 0) {
+		for (m = 0; m < CRAM_MAX_METHOD; m++) {
+		    double r;
+		    if (!(trial & (1LL<<m)) || est[m] <= 0 ||
+			sz[m] > b->uncomp_size*2)
+			continue;
+		    r = sz[m] / est[m];
+		    metrics->ratio[m] = metrics->nratio[m]++
+			? 0.75*metrics->ratio[m] + 0.25*r
+			: r;
+		}
+	    }
+
 	    // When enough trials performed, find the best on average
 	    if (--metrics->trial == 0) {
 		int best_method = RAW;
@@ -2894,6 +3421,12 @@ int paranoid_fclose(FILE *fp) {
  * track the number of callers interested in any specific reference.
  */
 
+/* True if the sequence is in memory, either as plain text or packed */
+#define REF_LOADED(e) ((e)->seq || (e)->packed)
+
+/* Bases read at a time when loading a packed reference */
+#define REF_PACK_CHUNK (1<<20)
+
 /*
  * Frees/unmaps a reference sequence and associated file handles.
  */
@@ -2902,9 +3435,167 @@ static void ref_entry_free_seq(ref_entry *e) {
 	mfclose(e->mf);
     if (e->seq && !e->mf)
 	free(e->seq);
+    if (e->packed)
+	free(e->packed);
+    if (e->exc)
+	free(e->exc);
 
     e->seq = NULL;
     e->mf = NULL;
+    e->packed = NULL;
+    e->exc = NULL;
+    e->nexc = 0;
+}
+
+/*
+ * Packs len bases of seq into e->packed, starting from 0-based position
+ * pos, with any bases other than A, C, G and T added to the e->exc list
+ * of exception runs.  Bases must be added in order.  e->packed must
+ * already be allocated and zeroed, and *exc_alloc holds the allocated
+ * size of e->exc.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int ref_pack_bases(ref_entry *e, const char *seq, int64_t pos,
+			  int64_t len, int *exc_alloc) {
+    const unsigned char *s = (const unsigned char *)seq;
+    unsigned char code[256];
+    int64_t i;
+
+    memset(code, 4, 256);
+    code['A'] = 0;
+    code['C'] = 1;
+    code['G'] = 2;
+    code['T'] = 3;
+
+    for (i = 0; i < len; i++) {
+	int64_t p = pos + i;
+	unsigned char c = code[s[i]];
+	if (c < 4) {
+	    e->packed[p>>2] |= c << ((p&3)*2);
+	    continue;
+	}
+
+	/* Extend the last run, or start a new one */
+	if (e->nexc && e->exc[e->nexc-1].base == s[i] &&
+	    e->exc[e->nexc-1].pos + e->exc[e->nexc-1].len == p) {
+	    e->exc[e->nexc-1].len++;
+	    continue;
+	}
+
+	if (e->nexc == *exc_alloc) {
+	    int n = *exc_alloc ? *exc_alloc*2 : 64;
+	    ref_exception *tmp = realloc(e->exc, n * sizeof(*e->exc));
+	    if (!tmp)
+		return -1;
+	    e->exc = tmp;
+	    *exc_alloc = n;
+	}
+	e->exc[e->nexc].pos  = p;
+	e->exc[e->nexc].len  = 1;
+	e->exc[e->nexc].base = s[i];
+	e->nexc++;
+    }
+
+    return 0;
+}
+
+/*
+ * Replaces e->seq by a 2-bit per base packed copy.  Memory mapped
+ * sequences are left alone as these are already shared via the page
+ * cache.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int ref_entry_pack(ref_entry *e) {
+    int exc_alloc = 0;
+
+    if (!e->seq || e->mf)
+	return 0;
+
+    if (!(e->packed = calloc(e->length/4 + 1, 1)))
+	return -1;
+
+    if (ref_pack_bases(e, e->seq, 0, e->length, &exc_alloc) < 0) {
+	free(e->packed);
+	free(e->exc);
+	e->packed = NULL;
+	e->exc = NULL;
+	e->nexc = 0;
+	return -1;
+    }
+
+    free(e->seq);
+    e->seq = NULL;
+
+    return 0;
+}
+
+/*
+ * Unpacks bases start..end (1-based, inclusive) of a packed reference
+ * into out.
+ */
+static void ref_entry_unpack(ref_entry *e, int64_t start, int64_t end,
+			     char *out) {
+    static const char acgt[4] = {'A', 'C', 'G', 'T'};
+    int64_t i = start-1, j = 0;
+    int lo, hi;
+
+    /* Up to the first whole byte, then 4 bases at a time */
+    for (; i < end && (i&3); i++)
+	out[j++] = acgt[(e->packed[i>>2] >> ((i&3)*2)) & 3];
+    for (; i+4 <= end; i += 4) {
+	uint8_t b = e->packed[i>>2];
+	out[j++] = acgt[b & 3];
+	out[j++] = acgt[(b>>2) & 3];
+	out[j++] = acgt[(b>>4) & 3];
+	out[j++] = acgt[(b>>6) & 3];
+    }
+    for (; i < end; i++)
+	out[j++] = acgt[(e->packed[i>>2] >> ((i&3)*2)) & 3];
+
+    /* Binary search for the first exception run ending after start */
+    lo = 0; hi = e->nexc;
+    while (lo < hi) {
+	int mid = (lo+hi)/2;
+	if (e->exc[mid].pos + e->exc[mid].len <= start-1)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+
+    for (; lo < e->nexc && e->exc[lo].pos < end; lo++) {
+	int64_t from = MAX(e->exc[lo].pos, start-1);
+	int64_t to   = MIN(e->exc[lo].pos + e->exc[lo].len, end);
+	memset(out + from - (start-1), e->exc[lo].base, to - from);
+    }
+}
+
+/*
+ * Returns a private copy of bases start..end (1-based, inclusive) of a
+ * loaded reference, packed or otherwise.
+ *
+ * Returns malloced sequence on success
+ *         NULL on failure
+ */
+static char *ref_entry_window(ref_entry *e, int64_t start, int64_t end) {
+    int64_t len = end >= start ? end - start + 1 : 0;
+    char *seq;
+
+    if (!(seq = malloc(len ? len : 1)))
+	return NULL;
+
+    if (!len)
+	return seq;
+
+    if (e->packed)
+	ref_entry_unpack(e, start, end, seq);
+    else
+	memcpy(seq, e->seq + start-1, len);
+
+    return seq;
 }
 
 void refs_free(refs_t *r) {
@@ -2916,6 +3607,12 @@ void refs_free(refs_t *r) {
     if (!r)
 	return;
 
+    /* Prefetch jobs still running on the thread pool write to r */
+    pthread_mutex_lock(&r->lock);
+    while (r->nprefetch > 0)
+	pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+
     if (r->pool)
 	string_pool_destroy(r->pool);
 
@@ -2942,6 +3639,7 @@ void refs_free(refs_t *r) {
 	bzi_close(r->fp);
 
     pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
 
     free(r);
 }
@@ -2954,20 +3652,20 @@ static refs_t *refs_create(void) {
     if (!r)
 	return NULL;
 
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
     if (!(r->pool = string_pool_create(8192)))
 	goto err;
 
     r->ref_id = NULL; // see refs2id() to populate.
     r->count = 1;
     r->last = NULL;
-    r->last_id = -1;
 
     r->h_meta = HashTableCreate(16, HASH_DYNAMIC_SIZE | HASH_NONVOLATILE_KEYS);
     if (!r->h_meta)
 	goto err;
 
-    pthread_mutex_init(&r->lock, NULL);
-
     return r;
 
  err:
@@ -3072,6 +3770,12 @@ refs_t *refs_load_fai(refs_t *r_orig, char *fn, int is_err) {
 	e->count = 0;
 	e->seq = NULL;
 	e->mf = NULL;
+	e->packed = NULL;
+	e->exc = NULL;
+	e->nexc = 0;
+	e->lru_prev = e->lru_next = NULL;
+	e->loading = 0;
+	e->prefetched = 0;
 
 	hd.p = e;
 	if (!(hi = HashTableAdd(r->h_meta, e->name, strlen(e->name), hd, &n))){
@@ -3330,16 +4034,122 @@ void mkdir_prefix(char *path, int mode) {
 	return;
     }
 
-    mkdir_prefix(path, mode);
-    mkdir(path, mode);
-    chmod(path, mode);
-    *cp = '/';
+    mkdir_prefix(path, mode);
+    mkdir(path, mode);
+    chmod(path, mode);
+    *cp = '/';
+}
+
+/*
+ * Upper-cases a reference sequence in place.  Only a-z are changed, so
+ * this matches toupper() in the C locale.
+ */
+static void ref_upper_scalar(char *seq, size_t len) {
+    unsigned char *s = (unsigned char *)seq;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	s[i] -= ((unsigned char)(s[i] - 'a') < 26) << 5;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define REF_SIMD
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void ref_upper_sse2(char *seq, size_t len) {
+    __m128i lo = _mm_set1_epi8('a'-1), hi = _mm_set1_epi8('z'+1);
+    __m128i bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+	__m128i x = _mm_loadu_si128((__m128i *)(seq+i));
+	__m128i m = _mm_and_si128(_mm_cmpgt_epi8(x, lo), _mm_cmplt_epi8(x, hi));
+	_mm_storeu_si128((__m128i *)(seq+i),
+			 _mm_sub_epi8(x, _mm_and_si128(m, bit)));
+    }
+
+    ref_upper_scalar(seq+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static void ref_upper_avx2(char *seq, size_t len) {
+    __m256i lo = _mm256_set1_epi8('a'-1), hi = _mm256_set1_epi8('z'+1);
+    __m256i bit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+	__m256i x = _mm256_loadu_si256((__m256i *)(seq+i));
+	__m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(x, lo),
+				     _mm256_cmpgt_epi8(hi, x));
+	_mm256_storeu_si256((__m256i *)(seq+i),
+			    _mm256_sub_epi8(x, _mm256_and_si256(m, bit)));
+    }
+
+    ref_upper_scalar(seq+i, len-i);
+}
+#endif
+
+static void (*ref_upper)(char *seq, size_t len) = ref_upper_scalar;
+static pthread_once_t ref_upper_once = PTHREAD_ONCE_INIT;
+
+static void ref_upper_init_once(void) {
+#ifdef REF_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	ref_upper = ref_upper_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+	ref_upper = ref_upper_sse2;
+#endif
+}
+
+/*
+ * Checks whether a reference is already in the normalised form used for
+ * M5 sums: upper case with no white-space or other non-printables.
+ *
+ * Returns 1 if so,
+ *         0 if not.
+ */
+static int ref_is_normalised(const char *seq, size_t len) {
+    const unsigned char *s = (const unsigned char *)seq;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	if (s[i] < '!' || s[i] > '~' || (s[i] >= 'a' && s[i] <= 'z'))
+	    return 0;
+
+    return 1;
+}
+
+/*
+ * Normalises a reference in-place, as per load_ref_portion().
+ * Returns the new length.
+ */
+static size_t ref_normalise(char *seq, size_t len) {
+    size_t i, j;
+
+    for (i = j = 0; i < len; i++)
+	if (seq[i] >= '!' && seq[i] <= '~')
+	    seq[j++] = seq[i];
+
+    pthread_once(&ref_upper_once, ref_upper_init_once);
+    ref_upper(seq, j);
+
+    return j;
 }
 
 /*
  * Queries the M5 string from the header and attempts to populate the
  * reference from this using the REF_PATH environment.
  *
+ * Files in the REF_CACHE directory are normalised, so where possible
+ * these are memory mapped read-only rather than loaded.  This lets many
+ * processes on the same machine share a single copy via the page cache.
+ * The cache is named by the MD5 of the normalised sequence and is only
+ * written normalised, so rather than scanning the file on every open we
+ * just check its size matches the @SQ length.
+ *
  * Returns 0 on sucess
  *        -1 on failure
  */
@@ -3376,6 +4186,23 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
 
 	expand_cache_path(path, local_cache, tag->str+3);
 
+#ifdef HAVE_MMAP
+	if (0 == stat(path, &sb) && (mf = mfopen(path, "rm"))) {
+	    if (mfmmapped(mf) && id < fd->header->nref &&
+		fd->header->ref[id].len == mf->size) {
+		if (fd->verbose)
+		    fprintf(stderr, "Mapped ref %s\n", path);
+		r->seq = mf->data;
+		r->mf = mf;
+		r->length = mf->size;
+		r->offset = r->line_length = r->bases_per_line = 0;
+		r->fn = string_dup(fd->refs->pool, path);
+		return 0;
+	    }
+	    mfclose(mf);
+	}
+#endif
+
 	if (0 == stat(path, &sb) && (fp = bzi_open(path, "r"))) {
 	    r->length = sb.st_size;
 	    r->offset = r->line_length = r->bases_per_line = 0;
@@ -3444,8 +4271,15 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
 	return 0;
     }
 
-    /* Populate the local disk cache if required */
-    if (local_cache && *local_cache) {
+    /*
+     * Populate the local disk cache if required.  The cache holds
+     * normalised sequences only so that it can be mapped in directly.
+     */
+    if (local_cache && *local_cache && !r->mf)
+	r->length = ref_normalise(r->seq, r->length);
+
+    if (local_cache && *local_cache &&
+	(!r->mf || ref_is_normalised(r->seq, r->length))) {
 	FILE *fp;
 	int i;
 
@@ -3483,17 +4317,90 @@ static int cram_populate_ref(cram_fd *fd, int id, ref_entry *r) {
     return 0;
 }
 
+/*
+ * The memory held by a loaded reference, for the LRU size limit.
+ * Memory mapped references are owned by the page cache so count as 0.
+ */
+static size_t ref_entry_size(ref_entry *e) {
+    if (e->mf)
+	return 0;
+    if (e->packed)
+	return e->length/4 + 1 + e->nexc * sizeof(*e->exc);
+    return e->length;
+}
+
+#define REF_IN_LRU(r,e) ((e)->lru_prev || (r)->lru_head == (e))
+
+/*
+ * Removes e from the list of unused references.  Called with r->lock held.
+ */
+static void ref_lru_remove(refs_t *r, ref_entry *e) {
+    if (!REF_IN_LRU(r, e))
+	return;
+
+    if (e->lru_prev)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	r->lru_head = e->lru_next;
+
+    if (e->lru_next)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	r->lru_tail = e->lru_prev;
+
+    e->lru_prev = e->lru_next = NULL;
+    r->lru_size -= ref_entry_size(e);
+}
+
+/*
+ * Adds a loaded reference whose count has just dropped to zero onto
+ * the tail of the list of unused references, and then frees the oldest
+ * ones until we're within r->lru_max bytes.  The most recent one is
+ * always kept, so incr/decr loops on the same sequence don't cause
+ * load/free loops.  Called with r->lock held.
+ */
+static void ref_lru_add(refs_t *r, ref_entry *e) {
+    if (REF_IN_LRU(r, e))
+	return;
+
+    e->lru_prev = r->lru_tail;
+    e->lru_next = NULL;
+    if (r->lru_tail)
+	r->lru_tail->lru_next = e;
+    else
+	r->lru_head = e;
+    r->lru_tail = e;
+    r->lru_size += ref_entry_size(e);
+
+    while (r->lru_size > r->lru_max && r->lru_head != r->lru_tail) {
+	ref_entry *old = r->lru_head;
+	ref_lru_remove(r, old);
+	RP("%d FREE REF %s (%p)\n", gettid(), old->name, old->seq);
+	ref_entry_free_seq(old);
+
+	/* No .fai entry, so it needs finding again via cram_populate_ref */
+	if (!old->bases_per_line)
+	    old->length = 0;
+    }
+}
+
 static void cram_ref_incr_locked(refs_t *r, int id) {
     RP("%d INC REF %d, %d %p\n", gettid(), id, (int)(id>=0?r->ref_id[id]->count+1:-999), id>=0?r->ref_id[id]->seq:(char *)1);
 
     if (id >= 0 && id >= r->nref)
 	return;
 
-    if (id < 0 || !r->ref_id[id] || !r->ref_id[id]->seq)
+    if (id < 0 || !r->ref_id[id] || !REF_LOADED(r->ref_id[id]))
+	return;
+
+    /* The first user of a prefetched sequence takes over its pin */
+    if (r->ref_id[id]->prefetched) {
+	r->ref_id[id]->prefetched = 0;
 	return;
+    }
 
-    if (r->last_id == id)
-	r->last_id = -1;
+    if (r->ref_id[id]->count == 0)
+	ref_lru_remove(r, r->ref_id[id]);
 
     ++r->ref_id[id]->count;
 }
@@ -3510,23 +4417,14 @@ static void cram_ref_decr_locked(refs_t *r, int id) {
     if (id >= 0 && id >= r->nref)
 	return;
 
-    if (id < 0 || !r->ref_id[id] || !r->ref_id[id]->seq) {
+    if (id < 0 || !r->ref_id[id] || !REF_LOADED(r->ref_id[id])) {
 	assert(id < 0 || !r->ref_id[id] || r->ref_id[id]->count >= 0);
 	return;
     }
 
     if (--r->ref_id[id]->count <= 0) {
 	assert(r->ref_id[id]->count == 0);
-	if (r->last_id >= 0) {
-	    if (r->ref_id[r->last_id]->count <= 0 &&
-		r->ref_id[r->last_id]->seq) {
-		RP("%d FREE REF %d (%p)\n", gettid(),
-		   r->last_id, r->ref_id[r->last_id]->seq);
-		ref_entry_free_seq(r->ref_id[r->last_id]);
-		r->ref_id[r->last_id]->length = 0;
-	    }
-	}
-	r->last_id = id;
+	ref_lru_add(r, r->ref_id[id]);
     }
 }
 
@@ -3536,6 +4434,64 @@ void cram_ref_decr(refs_t *r, int id) {
     pthread_mutex_unlock(&r->lock);
 }
 
+/*
+ * Computes the file offset and number of bytes holding bases start to
+ * end (1-based, inclusive) of e, including any line endings.
+ */
+static void ref_file_span(ref_entry *e, int64_t start, int64_t end,
+			  off_t *offset, off_t *len) {
+    *offset = e->line_length
+	? e->offset + (start-1)/e->bases_per_line * e->line_length +
+	  (start-1) % e->bases_per_line
+	: start-1;
+
+    *len = (e->line_length
+	    ? e->offset + (end-1)/e->bases_per_line * e->line_length +
+	      (end-1) % e->bases_per_line
+	    : end-1) - *offset + 1;
+}
+
+/*
+ * Copies n bases from the file data in 'in', which starts at base
+ * 'start' of e, to 'out' dropping the line endings and upper-casing.
+ * The .fai line geometry tells us where each line ends, so whole lines
+ * are copied at a time.  in and out may be the same buffer.
+ *
+ * Returns 0 on success
+ *        -1 on failure (the data doesn't match the .fai)
+ */
+static int ref_strip_lines(ref_entry *e, int64_t start, char *in,
+			   char *out, int64_t n) {
+    int64_t i = 0, o = 0, col = 0;
+    int gap = 0, k;
+
+    pthread_once(&ref_upper_once, ref_upper_init_once);
+
+    if (e->line_length) {
+	col = (start-1) % e->bases_per_line;
+	gap = e->line_length - e->bases_per_line;
+    }
+
+    while (o < n) {
+	int64_t l = e->line_length ? MIN(e->bases_per_line - col, n - o) : n;
+	memmove(out+o, in+i, l);
+	o += l;
+	i += l;
+	col = 0;
+
+	if (o < n) {
+	    for (k = 0; k < gap; k++)
+		if (in[i+k] >= '!' && in[i+k] <= '~')
+		    return -1;
+	    i += gap;
+	}
+    }
+
+    ref_upper(out, n);
+
+    return 0;
+}
+
 /*
  * Used by cram_ref_load and cram_ref_get. The file handle will have
  * already been opened, so we can catch it. The ref_entry *e informs us
@@ -3556,15 +4512,7 @@ char *load_ref_portion(bzi_FILE *fp, ref_entry *e, int start, int end) {
      * Compute locations in file. This is trivial for the MD5 files, but
      * is still necessary for the fasta variants.
      */
-    offset = e->line_length
-	? e->offset + (start-1)/e->bases_per_line * e->line_length +
-	  (start-1) % e->bases_per_line
-	: start-1;
-
-    len = (e->line_length
-	   ? e->offset + (end-1)/e->bases_per_line * e->line_length + 
-	     (end-1) % e->bases_per_line
-	   : end-1) - offset + 1;
+    ref_file_span(e, start, end, &offset, &len);
 
     if (0 != bzi_seek(fp, offset, SEEK_SET)) {
 	perror("fseeko() on reference file");
@@ -3581,31 +4529,133 @@ char *load_ref_portion(bzi_FILE *fp, ref_entry *e, int start, int end) {
 	return NULL;
     }
 
-    /* Strip white-space if required. */
-    if (len != end-start+1) {
-	int i, j;
-	char *cp = seq;
-	char *cp_to;
+    /* Strip line endings and upper-case */
+    if (ref_strip_lines(e, start, seq, seq, end-start+1) < 0) {
+	fprintf(stderr, "Malformed reference file?\n");
+	free(seq);
+	return NULL;
+    }
+
+    return seq;
+}
 
-	for (i = j = 0; i < len; i++) {
-	    if (cp[i] >= '!' && cp[i] <= '~')
-		cp[j++] = toupper(cp[i]);
-	}
-	cp_to = cp+j;
+/*
+ * Parallel loading of a whole reference.
+ *
+ * Large references are split into REF_LOAD_CHUNK sized pieces which
+ * are read via t_pool_parallel_for directly into their place in the
+ * final sequence.  The calling thread reuses its already open file
+ * handle while the pool workers open their own per chunk.
+ */
+#define REF_LOAD_CHUNK (8<<20)
+
+typedef struct {
+    ref_entry *e;
+    bzi_FILE *fp;     // file handle of the calling thread
+    pthread_t caller;
+    char *seq;
+} ref_load_job;
+
+static int ref_load_chunk(void *arg, int i) {
+    ref_load_job *j = (ref_load_job *)arg;
+    int64_t start = (int64_t)i * REF_LOAD_CHUNK + 1;
+    int64_t end = MIN(start + REF_LOAD_CHUNK - 1, j->e->length);
+    bzi_FILE *fp = j->fp, *own = NULL;
+    off_t offset, len;
+    char *buf;
+    int err = 0;
+
+    ref_file_span(j->e, start, end, &offset, &len);
+    if (!(buf = malloc(len)))
+	return -1;
+
+    if (!pthread_equal(pthread_self(), j->caller) &&
+	!(fp = own = bzi_open(j->e->fn, "r"))) {
+	perror(j->e->fn);
+	err = 1;
+    }
+
+    if (!err && (0 != bzi_seek(fp, offset, SEEK_SET) ||
+		 len != bzi_read(buf, 1, len, fp))) {
+	perror("fread() on reference file");
+	err = 1;
+    }
+
+    if (!err && ref_strip_lines(j->e, start, buf, j->seq + start-1,
+				end-start+1) < 0) {
+	fprintf(stderr, "Malformed reference file?\n");
+	err = 1;
+    }
+
+    if (own)
+	bzi_close(own);
+    free(buf);
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Loads all of e, using the thread pool if there is one and e is big
+ * enough to be worth splitting.  fp is the already open reference file.
+ *
+ * Returns the sequence on success (malloced);
+ *         NULL on failure.
+ */
+static char *load_ref_whole(t_pool *pool, bzi_FILE *fp, ref_entry *e) {
+    ref_load_job j;
+    int n;
+
+    if (!pool || !e->line_length || e->length < 2*REF_LOAD_CHUNK)
+	return load_ref_portion(fp, e, 1, e->length);
+
+    if (!(j.seq = malloc(e->length)))
+	return NULL;
+    j.e = e;
+    j.fp = fp;
+    j.caller = pthread_self();
+
+    /*
+     * Every call has finished by the time this returns, so jobs that
+     * start late never see e.
+     */
+    n = (e->length + REF_LOAD_CHUNK-1) / REF_LOAD_CHUNK;
+    if (t_pool_parallel_for(pool, n, MIN(n-1, pool->tsize), ref_load_chunk,
+			    &j) < 0) {
+	free(j.seq);
+	return NULL;
+    }
+
+    return j.seq;
+}
+
+/*
+ * Loads the entire reference for e in packed form.  This is done a
+ * portion at a time so we never hold the whole unpacked sequence.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int load_ref_packed(bzi_FILE *fp, ref_entry *e) {
+    int64_t pos, end;
+    int exc_alloc = 0;
+
+    if (!(e->packed = calloc(e->length/4 + 1, 1)))
+	return -1;
+
+    for (pos = 0; pos < e->length; pos = end) {
+	char *seq;
 
-	if (cp_to - seq != end-start+1) {
-	    fprintf(stderr, "Malformed reference file?\n");
+	end = MIN(pos + REF_PACK_CHUNK, e->length);
+	if (!(seq = load_ref_portion(fp, e, pos+1, end)) ||
+	    ref_pack_bases(e, seq, pos, end - pos, &exc_alloc) < 0) {
 	    free(seq);
-	    return NULL;
-	}
-    } else {
-	int i;
-	for (i = 0; i < len; i++) {
-	    seq[i] = toupper(seq[i]);
+	    ref_entry_free_seq(e);
+	    return -1;
 	}
+	free(seq);
     }
 
-    return seq;
+    return 0;
 }
 
 /*
@@ -3615,12 +4665,11 @@ char *load_ref_portion(bzi_FILE *fp, ref_entry *e, int start, int end) {
  * Returns ref_entry on success;
  *         NULL on failure
  */
-ref_entry *cram_ref_load(refs_t *r, int id) {
+ref_entry *cram_ref_load(refs_t *r, int id, t_pool *pool) {
     ref_entry *e = r->ref_id[id];
-    int start = 1, end = e->length;
-    char *seq;
+    char *seq = NULL;
 
-    if (e->seq) {
+    if (REF_LOADED(e)) {
 	return e;
     }
 
@@ -3636,11 +4685,8 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
 #endif
 
 	assert(r->last->count > 0);
-	if (--r->last->count <= 0) {
-	    RP("%d FREE REF %d (%p)\n", gettid(), id, r->last->seq);
-	    if (r->last->seq)
-		ref_entry_free_seq(r->last);
-	}
+	if (--r->last->count <= 0 && REF_LOADED(r->last))
+	    ref_lru_add(r, r->last);
     }
 
     /* Open file if it's not already the current open reference */
@@ -3654,16 +4700,21 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
 	}
     }
 
-    RP("%d Loading ref %d (%d..%d)\n", gettid(), id, start, end);
+    RP("%d Loading ref %d (1..%d)\n", gettid(), id, (int)e->length);
 
-    if (!(seq = load_ref_portion(r->fp, e, start, end))) {
-	return NULL;
+    if (r->packed) {
+	if (load_ref_packed(r->fp, e) < 0)
+	    return NULL;
+    } else {
+	if (!(seq = load_ref_whole(pool, r->fp, e))) {
+	    return NULL;
+	}
+	e->seq = seq;
     }
 
-    RP("%d Loaded ref %d (%d..%d) = %p\n", gettid(), id, start, end, seq);
+    RP("%d Loaded ref %d (1..%d) = %p\n", gettid(), id, (int)e->length, seq);
 
     RP("%d INC REF %d, %d\n", gettid(), id, (int)(e->count+1));
-    e->seq = seq;
     e->mf = NULL;
     e->count++;
 
@@ -3678,6 +4729,119 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
     return e;
 }
 
+/*
+ * Asynchronous reference loading.
+ *
+ * On sorted data each reference is used in turn, so when we start on
+ * one we queue a job on the thread pool to load the next in @SQ order.
+ * The prefetched entry is left holding a single count (e->prefetched)
+ * which the first cram_ref_incr_locked adopts rather than increments.
+ * If we prefetch another before it is used, the pin is dropped and it
+ * joins the LRU of unused references instead.
+ */
+typedef struct {
+    refs_t *r;
+    ref_entry *e;
+} ref_prefetch_job;
+
+static void *ref_prefetch_thread(void *arg) {
+    ref_prefetch_job *j = (ref_prefetch_job *)arg;
+    refs_t *r = j->r;
+    ref_entry *e = j->e, tmp;
+    bzi_FILE *fp = NULL;
+    int err = 0;
+
+    pthread_mutex_lock(&r->lock);
+    if (e->loading != 1) {
+	/* Cancelled; someone needed it before we started */
+	goto done;
+    }
+    e->loading = 2;
+    tmp = *e;
+    pthread_mutex_unlock(&r->lock);
+
+    RP("%d Prefetching ref %s\n", gettid(), tmp.name);
+
+    tmp.seq = NULL;
+    tmp.mf = NULL;
+    tmp.packed = NULL;
+    tmp.exc = NULL;
+    tmp.nexc = 0;
+
+    if (!(fp = bzi_open(tmp.fn, "r")))
+	err = 1;
+    else if (r->packed)
+	err = load_ref_packed(fp, &tmp) < 0;
+    else
+	err = !(tmp.seq = load_ref_portion(fp, &tmp, 1, tmp.length));
+
+    if (fp)
+	bzi_close(fp);
+
+    pthread_mutex_lock(&r->lock);
+    if (!err) {
+	e->seq = tmp.seq;
+	e->packed = tmp.packed;
+	e->exc = tmp.exc;
+	e->nexc = tmp.nexc;
+	e->count = 1;
+	e->prefetched = 1;
+	r->prefetch = e;
+    }
+    e->loading = 0;
+
+ done:
+    r->nprefetch--;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    free(j);
+
+    return NULL;
+}
+
+/*
+ * Queues loading of reference 'id' on the thread pool, if it is not
+ * already loaded.  Failure is not an error, as cram_get_ref will just
+ * load it itself when needed.  Called with fd->refs->lock held.
+ */
+static void ref_prefetch(cram_fd *fd, int id) {
+    refs_t *r = fd->refs;
+    ref_prefetch_job *j;
+    ref_entry *e;
+
+    if (!fd->pool || fd->unsorted || id < 0 || id >= r->nref)
+	return;
+
+    /* Only .fai entries; M5 lookups may need the network */
+    e = r->ref_id[id];
+    if (!e || !e->fn || e->length <= 0 || e->bases_per_line <= 0 ||
+	REF_LOADED(e) || e->loading)
+	return;
+
+    if (!(j = malloc(sizeof(*j))))
+	return;
+    j->r = r;
+    j->e = e;
+
+    /* Unpin the previous one if it turned out not to be needed */
+    if (r->prefetch && r->prefetch->prefetched) {
+	r->prefetch->prefetched = 0;
+	r->prefetch->count = 0;
+	ref_lru_add(r, r->prefetch);
+    }
+    r->prefetch = NULL;
+
+    e->loading = 1;
+    r->nprefetch++;
+
+    /* Non-blocking as we hold locks the workers may want */
+    if (t_pool_dispatch2(fd->pool, NULL, ref_prefetch_thread, j, 1) < 0) {
+	e->loading = 0;
+	r->nprefetch--;
+	free(j);
+    }
+}
+
 /*
  * Returns a portion of a reference sequence from start to end inclusive.
  * The returned pointer is owned by either the cram_file fd or by the
@@ -3695,16 +4859,25 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
  * To return the entire reference sequence, specify start as 1 and end
  * as 0.
  *
+ * If the references are held packed (CRAM_OPT_PACKED_REF) then the
+ * returned sequence is instead a malloced copy of just start to end.
+ * This is also stored in *copy and must be freed by the caller, otherwise
+ * *copy is set to NULL.  Unlike cram_get_ref() this never replaces the
+ * previous sequence returned for fd, so it may be used by multiple
+ * threads decoding the same file.
+ *
  * To cease using a reference, call cram_ref_decr().
  *
  * Returns reference on success,
  *         NULL on failure
  */
-char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
+char *cram_get_ref_copy(cram_fd *fd, int id, int start, int end,
+			char **copy) {
     ref_entry *r;
     char *seq;
-    int ostart = start;
+    int ostart = start, oend;
 
+    *copy = NULL;
     if (id == -1)
 	return NULL;
 
@@ -3759,6 +4932,20 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
      * rewrite my code to have one curl handle per thread.
      */
     pthread_mutex_lock(&fd->refs->lock);
+
+    /*
+     * Wait for any running prefetch of this reference to complete, or
+     * cancel it if it's still queued as we may be holding up the worker
+     * that would run it.
+     */
+    while (r->loading) {
+	if (r->loading == 1) {
+	    r->loading = 0;
+	    break;
+	}
+	pthread_cond_wait(&fd->refs->cond, &fd->refs->lock);
+    }
+
     if (r->length == 0) {
 	if (cram_populate_ref(fd, id, r) == -1) {
 	    fprintf(stderr, "Failed to populate reference for id %d\n", id);
@@ -3767,6 +4954,11 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	    return NULL;
 	}
 	r = fd->refs->ref_id[id];
+	if (fd->refs->packed && ref_entry_pack(r) < 0) {
+	    pthread_mutex_unlock(&fd->refs->lock);
+	    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+	    return NULL;
+	}
 	if (fd->unsorted)
 	    cram_ref_incr_locked(fd->refs, id);
     }
@@ -3783,6 +4975,7 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	end  = r->length; 
     if (start < 1)
 	return NULL;
+    oend = end;
 
     if (end - start >= 0.5*r->length || fd->shared_ref) {
 	start = 1;
@@ -3796,16 +4989,20 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
      * references and/or are asking for the entire length of it, then
      * load the full reference into the refs structure and return
      * a pointer to that one instead.
+     *
+     * Packed references are always held whole in the refs structure.
      */
-    if (fd->shared_ref || r->seq || (start == 1 && end == r->length)) {
+    if (fd->shared_ref || fd->refs->packed || REF_LOADED(r) ||
+	(start == 1 && end == r->length)) {
 	char *cp;
+	ref_entry *packed = NULL;
 
 	if (id >= 0) {
-	    if (r->seq) {
+	    if (REF_LOADED(r)) {
 		cram_ref_incr_locked(fd->refs, id);
 	    } else {
 		ref_entry *e;
-		if (!(e = cram_ref_load(fd->refs, id))) {
+		if (!(e = cram_ref_load(fd->refs, id, fd->pool))) {
 		    pthread_mutex_unlock(&fd->refs->lock);
 		    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 		    return NULL;
@@ -3823,7 +5020,14 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	    fd->ref_end   = r->length;
 	    fd->ref_id    = id;
 
-	    cp = fd->refs->ref_id[id]->seq + ostart-1;
+	    ref_prefetch(fd, id+1);
+
+	    if (fd->refs->packed) {
+		packed = fd->refs->ref_id[id];
+		cp = NULL;
+	    } else {
+		cp = fd->refs->ref_id[id]->seq + ostart-1;
+	    }
 	} else {
 	    fd->ref = NULL;
 	    cp = NULL;
@@ -3833,6 +5037,17 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 
 	pthread_mutex_unlock(&fd->refs->lock);
 	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+
+	/*
+	 * Our reference count keeps the packed data in memory, so the
+	 * unpacking can run without holding the locks.
+	 */
+	if (packed && !(cp = *copy = ref_entry_window(packed, ostart, oend))) {
+	    if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
+	    cram_ref_decr(fd->refs, id);
+	    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+	}
+
 	return cp;
     }
 
@@ -3891,6 +5106,33 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
     return seq + ostart - start;
 }
 
+/*
+ * Returns a portion of a reference sequence from start to end inclusive.
+ * The returned pointer is owned by the cram_file fd or the refs and should
+ * not be freed by the caller.  See cram_get_ref_copy() for details.
+ *
+ * Packed references are unpacked into a buffer held by fd, which is
+ * valid only until the next cram_get_ref call on fd or cram_close.
+ *
+ * To cease using a reference, call cram_ref_decr().
+ *
+ * Returns reference on success,
+ *         NULL on failure
+ */
+char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
+    char *copy, *seq = cram_get_ref_copy(fd, id, start, end, &copy);
+
+    if (copy) {
+	if (fd->ref_lock) pthread_mutex_lock(fd->ref_lock);
+	if (fd->ref_free)
+	    free(fd->ref_free);
+	fd->ref_free = copy;
+	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
+    }
+
+    return seq;
+}
+
 /*
  * If fd has been opened for reading, it may be permitted to specify 'fn'
  * as NULL and let the code auto-detect the reference by parsing the
@@ -3923,6 +5165,11 @@ int cram_load_reference(cram_fd *fd, char *fn) {
     if (-1 == refs2id(fd->refs, fd->header))
 	return -1;
 
+    if (fd->packed_ref && fd->refs)
+	fd->refs->packed = 1;
+    if (fd->ref_cache_size && fd->refs)
+	fd->refs->lru_max = (size_t)fd->ref_cache_size << 20;
+
     return ret;
 }
 
@@ -4006,6 +5253,9 @@ void cram_free_container(cram_container *c) {
     if (c->refs_used)
 	free(c->refs_used);
 
+    if (c->ref_free)
+	free(c->ref_free);
+
     if (c->landmark)
 	free(c->landmark);
 
@@ -4531,6 +5781,9 @@ void cram_free_compression_header(cram_block_compression_hdr *hdr) {
     if (hdr->TD)
 	HashTableDestroy(hdr->TD, 0);
 
+    if (hdr->required)
+	cram_required_free(hdr->required);
+
     free(hdr);
 }
 
@@ -4561,6 +5814,9 @@ void cram_free_slice(cram_slice *s) {
     if (s->bl)
 	free(s->bl);
 
+    if (s->ref_free)
+	free(s->ref_free);
+
     if (s->hdr_block)
 	cram_free_block(s->hdr_block);
 
@@ -4620,6 +5876,9 @@ void cram_free_slice(cram_slice *s) {
     if (s->crecs)
 	free(s->crecs);
 
+    if (s->columns)
+	free(s->columns);
+
     if (s->features)
 	free(s->features);
 
@@ -4720,8 +5979,22 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs) {
  *         NULL on failure
  */
 cram_slice *cram_read_slice(cram_fd *fd) {
+    return cram_read_slice_required(fd, NULL);
+}
+
+/*
+ * As cram_read_slice(), but if CRAM_OPT_LAZY_BLOCKS is enabled then
+ * external blocks not needed to decode fd->required_fields, according to
+ * hdr->required, are skipped over without being read.
+ *
+ * Returns cram_slice ptr on success
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice_required(cram_fd *fd,
+				     cram_block_compression_hdr *hdr) {
     cram_block *b = cram_read_block(fd);
     cram_slice *s = calloc(1, sizeof(*s));
+    cram_required *r = NULL;
     int i, n, max_id, min_id;
 
     if (!b || !s)
@@ -4750,8 +6023,14 @@ cram_slice *cram_read_slice(cram_fd *fd) {
     if (!s->block)
 	goto err;
 
+    if (fd->lazy_blocks && CRAM_MAJOR_VERS(fd->version) >= 2 &&
+	hdr && hdr->required &&
+	hdr->required->fields == fd->required_fields)
+	r = hdr->required;
+
     for (max_id = i = 0, min_id = INT_MAX; i < n; i++) {
-	if (!(s->block[i] = cram_read_block(fd)))
+	if (!(s->block[i] = cram_read_block_required(fd, r,
+						     s->hdr->ref_base_id)))
 	    goto err;
 
 	if (s->block[i]->content_type == EXTERNAL) {
@@ -5033,12 +6312,30 @@ int cram_write_SAM_hdr(cram_fd *fd, SAM_hdr *hdr) {
 
 		rlen = fd->refs->ref_id[i]->length;
 		MD5_Init(&md5);
-		ref = cram_get_ref(fd, i, 1, rlen);
-		if (NULL == ref) return -1;
-		rlen = fd->refs->ref_id[i]->length; /* In case it just loaded */
-		MD5_Update(&md5, ref, rlen);
+		if (fd->refs->packed) {
+		    /* We get copies of packed refs, so digest in portions */
+		    int pos = 1, end;
+		    char *copy;
+		    do {
+			end = pos + REF_PACK_CHUNK - 1;
+			ref = cram_get_ref_copy(fd, i, pos, end, &copy);
+			if (NULL == ref) return -1;
+			rlen = fd->refs->ref_id[i]->length;
+			if (end > rlen)
+			    end = rlen;
+			MD5_Update(&md5, ref, end - pos + 1);
+			free(copy);
+			cram_ref_decr(fd->refs, i);
+			pos = end + 1;
+		    } while (pos <= rlen);
+		} else {
+		    ref = cram_get_ref(fd, i, 1, rlen);
+		    if (NULL == ref) return -1;
+		    rlen = fd->refs->ref_id[i]->length; /* In case it just loaded */
+		    MD5_Update(&md5, ref, rlen);
+		    cram_ref_decr(fd->refs, i);
+		}
 		MD5_Final(buf, &md5);
-		cram_ref_decr(fd->refs, i);
 
 		for (j = 0; j < 16; j++) {
 		    buf2[j*2+0] = "0123456789abcdef"[buf[j]>>4];
@@ -5213,6 +6510,10 @@ void cram_init_varint(varint_vec *vv, int version) {
 	vv->varint_decode32_crc = uint7_decode_crc32;
 	vv->varint_decode32s_crc = sint7_decode_crc32;
 	vv->varint_decode64_crc = uint7_decode_crc64;
+	vv->varint_get32_blk = uint7_get_blk32;
+	vv->varint_get32s_blk = sint7_get_blk32;
+	vv->varint_get64_blk = uint7_get_blk64;
+	vv->varint_get64s_blk = sint7_get_blk64;
     } else {
 	vv->varint_get32 = safe_itf8_get;
 	vv->varint_get32s = safe_itf8_get;
@@ -5230,7 +6531,13 @@ void cram_init_varint(varint_vec *vv, int version) {
 	vv->varint_decode32_crc = itf8_decode_crc;
 	vv->varint_decode32s_crc = itf8_decode_crc;
 	vv->varint_decode64_crc = ltf8_decode_crc;
+	vv->varint_get32_blk = itf8_get_blk32;
+	vv->varint_get32s_blk = itf8_get_blk32;
+	vv->varint_get64_blk = ltf8_get_blk64;
+	vv->varint_get64s_blk = ltf8_get_blk64;
     }
+
+    pthread_once(&varint_once, varint_init_once);
 }
 
 /*
@@ -5659,9 +6966,18 @@ cram_fd *cram_open(const char *filename, const char *mode) {
     fd->multi_seq_user = 0;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
+    fd->packed_ref = 0;
+    fd->ref_cache_size = 0;
+    fd->trial_budget = 0;
+    fd->no_bam = 0;
+    fd->lazy_blocks = 0;
+    fd->keep_features = 0;
     fd->last_RI = 0;
 
     fd->index       = NULL;
+    fd->index_map   = NULL;
+    fd->index_lazy  = NULL;
+    fd->index_ctr   = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5771,8 +7087,17 @@ cram_fd *cram_open_by_callbacks(
     fd->multi_seq_user = 0;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
+    fd->packed_ref = 0;
+    fd->ref_cache_size = 0;
+    fd->trial_budget = 0;
+    fd->no_bam = 0;
+    fd->lazy_blocks = 0;
+    fd->keep_features = 0;
 
     fd->index       = NULL;
+    fd->index_map   = NULL;
+    fd->index_lazy  = NULL;
+    fd->index_ctr   = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -5899,8 +7224,17 @@ cram_fd *cram_openw_by_callbacks(
     fd->multi_seq_user = 0;
     fd->unsorted   = 0;
     fd->shared_ref = 0;
+    fd->packed_ref = 0;
+    fd->ref_cache_size = 0;
+    fd->trial_budget = 0;
+    fd->no_bam = 0;
+    fd->lazy_blocks = 0;
+    fd->keep_features = 0;
 
     fd->index       = NULL;
+    fd->index_map   = NULL;
+    fd->index_lazy  = NULL;
+    fd->index_ctr   = NULL;
     fd->own_pool    = 0;
     fd->pool        = NULL;
     fd->rqueue      = NULL;
@@ -6136,7 +7470,7 @@ int cram_close(cram_fd *fd) {
     if (fd->tags_used)
 	HashTableDestroy(fd->tags_used, 1);
 
-    if (fd->index)
+    if (fd->index || fd->index_ctr)
 	cram_index_free(fd);
 
     if (fd->own_pool && fd->pool)
@@ -6157,6 +7491,23 @@ int cram_eof(cram_fd *fd) {
 }
 
 
+/*
+ * Configures how fd's jobs are scheduled on a thread pool, which may be
+ * shared with other files.  Encoding runs at a higher priority than
+ * decoding so that in a transcoding pipeline the output drains rather
+ * than decoded data piling up in memory.  Decoders are limited to about
+ * 3/4 of the pool queue so a shared encoder can always get jobs in.
+ */
+static void cram_set_queue_sched(cram_fd *fd) {
+    if (fd->mode == 'w') {
+	t_results_queue_set_name(fd->rqueue, "cram_encode");
+	t_results_queue_set_priority(fd->rqueue, 1);
+    } else {
+	t_results_queue_set_name(fd->rqueue, "cram_decode");
+	t_results_queue_set_limit(fd->rqueue, (fd->pool->qsize*3)/4 + 1);
+    }
+}
+
 /* 
  * Sets options on the cram_fd. See CRAM_OPT_* definitions in cram_structs.h.
  * Use this immediately after opening.
@@ -6280,6 +7631,39 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	    fd->refs = refs;
 	    fd->refs->count++;
 	}
+	if (fd->packed_ref)
+	    fd->refs->packed = 1;
+	if (fd->ref_cache_size)
+	    fd->refs->lru_max = (size_t)fd->ref_cache_size << 20;
+	break;
+
+    case CRAM_OPT_PACKED_REF:
+	fd->packed_ref = va_arg(args, int);
+	if (fd->packed_ref && fd->refs)
+	    fd->refs->packed = 1;
+	break;
+
+    case CRAM_OPT_TRIAL_BUDGET:
+	fd->trial_budget = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_LAZY_BLOCKS:
+	fd->lazy_blocks = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_NO_BAM:
+	// Decoding threads consult this, so it cannot change mid-stream.
+	if (fd->ctr || fd->ctr_mt || fd->job_pending) {
+	    fprintf(stderr, "CRAM_OPT_NO_BAM must be set before reading\n");
+	    return -1;
+	}
+	fd->no_bam = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_REF_CACHE_SIZE:
+	fd->ref_cache_size = va_arg(args, int);
+	if (fd->refs)
+	    fd->refs->lru_max = (size_t)fd->ref_cache_size << 20;
 	break;
 
     case CRAM_OPT_RANGE: {
@@ -6333,6 +7717,7 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
                 return -1;
 
 	    fd->rqueue = t_results_queue_init();
+	    cram_set_queue_sched(fd);
 	    fd->metrics_lock = malloc(sizeof(pthread_mutex_t));
 	    fd->ref_lock = malloc(sizeof(pthread_mutex_t));
 	    fd->bam_list_lock = malloc(sizeof(pthread_mutex_t));
@@ -6349,6 +7734,7 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	fd->pool = va_arg(args, t_pool *);
 	if (fd->pool) {
 	    fd->rqueue = t_results_queue_init();
+	    cram_set_queue_sched(fd);
 	    fd->metrics_lock = malloc(sizeof(pthread_mutex_t));
 	    fd->ref_lock = malloc(sizeof(pthread_mutex_t));
 	    fd->bam_list_lock = malloc(sizeof(pthread_mutex_t));
@@ -311,15 +311,34 @@ void refs_free(refs_t *r);
  * The returned pointer is owned by the cram_file fd and should not be freed
  * by the caller. It is valid only until the next cram_get_ref is called
  * with the same fd parameter (so is thread-safe if given multiple files).
+ * This also holds when the references are packed (CRAM_OPT_PACKED_REF).
  *
  * To return the entire reference sequence, specify start as 1 and end
  * as 0.
  *
+ * To cease using a reference, call cram_ref_decr().
+ *
  * @return
  * Returns reference on success;
  *         NULL on failure
  */
 char *cram_get_ref(cram_fd *fd, int id, int start, int end);
+
+/*! As cram_get_ref(), but packed references are returned as a private copy.
+ *
+ * If the references are packed (CRAM_OPT_PACKED_REF) the returned
+ * sequence is a malloced copy of just start to end, which is also stored
+ * in *copy and must be freed by the caller.  This is not disturbed by
+ * further calls on fd, so threads sharing fd may each hold one.
+ * Otherwise *copy is set to NULL and the sequence is owned as described
+ * for cram_get_ref().
+ *
+ * @return
+ * Returns reference on success;
+ *         NULL on failure
+ */
+char *cram_get_ref_copy(cram_fd *fd, int id, int start, int end,
+			char **copy);
 void cram_ref_incr(refs_t *r, int id);
 void cram_ref_decr(refs_t *r, int id);
 /**@}*/
@@ -418,6 +437,19 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs);
  */
 cram_slice *cram_read_slice(cram_fd *fd);
 
+/*! Reads a slice, skipping blocks not needed for the required fields.
+ *
+ * As cram_read_slice(), but if CRAM_OPT_LAZY_BLOCKS is enabled then
+ * external blocks not needed to decode fd->required_fields, according
+ * to hdr->required, are skipped over without being read.
+ *
+ * @return
+ * Returns cram_slice ptr on success;
+ *         NULL on failure
+ */
+cram_slice *cram_read_slice_required(cram_fd *fd,
+				     cram_block_compression_hdr *hdr);
+
 
 
 /**@}*/
@@ -297,6 +297,11 @@ typedef struct {
 
     double extra[CRAM_MAX_METHOD];
 
+    // Learnt ratio of compressed size to entropy estimate, for choosing
+    // which methods to trial when limited by CRAM_OPT_TRIAL_BUDGET.
+    double ratio[CRAM_MAX_METHOD];
+    int nratio[CRAM_MAX_METHOD];
+
     cram_stats *stats;
 } cram_metrics;
 
@@ -326,6 +331,17 @@ typedef struct {
 struct cram_codec; /* defined in cram_codecs.h */
 struct cram_map;
 
+/*
+ * The data series and external blocks needed to decode a given
+ * CRAM_OPT_REQUIRED_FIELDS set, as computed by cram_required_new().
+ */
+typedef struct {
+    unsigned int fields;  // required_fields these apply to
+    uint32_t data_series; // CRAM_* data series to decode
+    int32_t *ids;         // content ids of external blocks used
+    int nids;
+} cram_required;
+
 #define CRAM_MAP_HASH 32
 #define CRAM_MAP(a,b) (((a)*3+(b))&(CRAM_MAP_HASH-1))
 
@@ -363,6 +379,9 @@ typedef struct {
 
     // Total codec count, used for index to block_by_id for transforms
     int ncodecs;
+
+    // Blocks needed for fd->required_fields; NULL if not yet known
+    cram_required *required;
 } cram_block_compression_hdr;
 
 typedef struct cram_map {
@@ -448,6 +467,7 @@ typedef struct {
     /* Copied from fd before encoding, to allow multi-threading */
     int64_t ref_start, first_base, last_base, ref_id, ref_end;
     char *ref;
+    char *ref_free;              // c->ref if a private copy (packed refs)
     //struct ref_entry *ref;
 
     /* For multi-threading */
@@ -526,7 +546,9 @@ typedef struct {
 
 /*
  * A feature is a base difference, used for the sequence reference encoding.
- * (We generate these internally when writing CRAM.)
+ * (We generate these internally when writing CRAM, and keep the decoded
+ * ones when reading if cram_fd keep_features is set.  Decoded X, B and i
+ * features hold the base call itself rather than a substitution code.)
  */
 typedef struct {
     union {
@@ -595,6 +617,18 @@ typedef struct {
 //// Turns [A-Z][A-Z] into an integer from 0 to 32*32
 //#define ID(a) ((((a)[0]-'A')<<5)+(a)[1]-'A')
 
+/*
+ * The portion of one reference held while decoding a multi-reference
+ * slice.  It grows to cover the records seen so far for that reference.
+ */
+typedef struct {
+    char *seq;               // bases start..end, from cram_get_ref_copy()
+    char *copy;              // seq if a private copy (packed refs)
+    int start;               // 1-based, inclusive
+    int end;
+    int len;                 // length of the whole reference
+} cram_ref_win;
+
 /*
  * A slice is really just a set of blocks, but it
  * is the logical unit for decoding a number of
@@ -612,6 +646,10 @@ typedef struct cram_slice {
     /* Array of decoded cram records */
     cram_record *crecs;
 
+    /* Data series decoded for the whole slice at once; see
+     * cram_decode_columns() */
+    int64_t *columns;
+
     /* An dynamically growing buffers for data pointed
      * to by crecs[] array.
      */
@@ -643,9 +681,11 @@ typedef struct cram_slice {
     HashTable *pair[2];      // for identifying read-pairs in this slice.
 
     char *ref;               // slice of current reference
+    char *ref_free;          // s->ref if a private copy (packed refs)
     int ref_start;           // start position of current reference;
     int ref_end;             // end position of current reference;
     int ref_id;
+    cram_ref_win *ref_win;   // per ref_id, for multi-ref slices when decoding
     char *cons;              // from ref_start to ref_end inclusive
 
     uint32_t BD_crc;         // base call digest
@@ -682,8 +722,26 @@ typedef struct ref_entry {
     int64_t count;	   // for shared references so we know to dealloc seq
     char *seq;
     mFILE *mf;
+    uint8_t *packed;	   // 2-bit packed seq, used instead of seq if set
+    struct ref_exception *exc; // runs of non-ACGT bases in packed
+    int nexc;
+    struct ref_entry *lru_prev; // unused loaded seqs, oldest first
+    struct ref_entry *lru_next;
+    int loading;	   // 1 prefetch queued, 2 prefetch running
+    int prefetched;	   // count holds a pin from the prefetcher
 } ref_entry;
 
+/*
+ * A run of 'len' copies of 'base' starting at 0-based 'pos'.  Packed
+ * references hold ACGT at 2 bits per base and list everything else
+ * (N, IUPAC codes, etc) here, sorted by position.
+ */
+typedef struct ref_exception {
+    int64_t pos;
+    int64_t len;
+    char base;
+} ref_exception;
+
 // References structure.
 typedef struct {
     string_alloc_t *pool;  // String pool for holding filenames and SN vals
@@ -699,7 +757,15 @@ typedef struct {
 
     pthread_mutex_t lock;  // Mutex for multi-threaded updating
     ref_entry *last;       // Last queried sequence
-    int last_id;           // Used in cram_ref_decr_locked to delay free
+    int packed;            // Hold loaded sequences 2-bit packed
+
+    ref_entry *lru_head;   // Loaded but unused sequences, oldest first
+    ref_entry *lru_tail;
+    size_t lru_size;       // memory used by the sequences in the lru
+    size_t lru_max;        // and the limit; newest is always kept
+    pthread_cond_t cond;   // Signalled when a prefetch completes
+    int nprefetch;         // number of prefetch jobs outstanding
+    ref_entry *prefetch;   // last sequence we prefetched
 } refs_t;
 
 /*-----------------------------------------------------------------------------
@@ -735,6 +801,29 @@ typedef struct {
     int64_t end;
 } cram_range;
 
+/*
+ * The records of one slice held as parallel arrays, as filled out by
+ * cram_get_columns().  Element i of every array refers to the same
+ * record, being s->crecs[rec[i]].  Sequence, quality and CIGAR are not
+ * copied but may be viewed in place via cram_columns_seq() and friends.
+ */
+typedef struct {
+    int n;                  // number of records held
+    int alloc;              // allocated length of the arrays below
+    int32_t *ref_id;
+    int32_t *flag;          // BAM flags
+    int64_t *pos;           // 1-based leftmost aligned position
+    int64_t *end;           // 1-based rightmost aligned position
+    int32_t *len;           // sequence length
+    int32_t *mate_ref_id;
+    int64_t *mate_pos;
+    uint8_t *mapq;
+    int32_t *rec;           // index into s->crecs[]
+
+    cram_slice *s;          // slice owning the records; valid until next call
+    unsigned int fields;    // CRAM_OPT_REQUIRED_FIELDS in force when read
+} cram_columns;
+
 /*-----------------------------------------------------------------------------
  */
 /* CRAM File handle */
@@ -822,6 +911,17 @@ typedef struct varint_vec {
     int64_t (*varint_get64) (char **cp, const char *endp, int *err);
     int64_t (*varint_get64s)(char **cp, const char *endp, int *err);
 
+    // Decodes up to n values into out[], returning the number decoded and
+    // incrementing *cp.  Sets err to 1 iff an error occurs.
+    int (*varint_get32_blk) (char **cp, const char *endp, int32_t *out,
+			     int n, int *err);
+    int (*varint_get32s_blk)(char **cp, const char *endp, int32_t *out,
+			     int n, int *err);
+    int (*varint_get64_blk) (char **cp, const char *endp, int64_t *out,
+			     int n, int *err);
+    int (*varint_get64s_blk)(char **cp, const char *endp, int64_t *out,
+			     int n, int *err);
+
     // Returns the number of bytes written, <= 0 on error.
     int (*varint_put32) (char *cp, const char *endp, int32_t val_p);
     int (*varint_put32s)(char *cp, const char *endp, int32_t val_p);
@@ -907,8 +1007,14 @@ typedef struct cram_fd {
     int use_tok;
     int use_arith;
     int shared_ref;
+    int packed_ref;
+    int ref_cache_size;
+    int trial_budget;
     enum quality_binning binning;
     unsigned int required_fields;
+    int no_bam;             // CRAM_OPT_NO_BAM; cram_get_columns() only
+    int lazy_blocks;        // don't read blocks not in required_fields
+    int keep_features;      // keep cram_features; seq may be partial
     cram_range range;
 
     // lookup tables, stored here so we can be trivially multi-threaded
@@ -920,6 +1026,14 @@ typedef struct cram_fd {
 
     int         index_sz;
     cram_index *index;                  // array, sizeof index_sz
+    char       *index_map;              // binary index (.crbi) contents
+    size_t      index_map_sz;
+    int         index_mmapped;          // index_map via mmap, else malloc
+    char       *index_lazy;             // 1 if index[i] not yet loaded
+    int64_t    *index_ctr;              // LE {offset, 1st record} pairs
+    int64_t     index_nctr;             // number of index_ctr pairs
+    int64_t     index_nrecords;         // total records, if index_ctr set
+    int         index_ctr_alloced;      // index_ctr malloced, not in map
     off_t first_container;
     int eof;
     int last_slice;                     // number of recs encoded in last slice
@@ -939,7 +1053,7 @@ typedef struct cram_fd {
     pthread_mutex_t *bam_list_lock;
     void *job_pending;
 
-    int ooc;                            // out of containers.
+    int ooc;                            // out of containers; -1 on error
     int ignore_chksum;
     int lossy_read_names;
     int preserve_aux_order;             // if set implies emitting RG, MD and NM
@@ -1081,7 +1195,12 @@ enum cram_option {
     CRAM_OPT_USE_FQZ,
     CRAM_OPT_EMBED_CONS,
     CRAM_OPT_USE_TOK,
-    CRAM_OPT_PROFILE
+    CRAM_OPT_PROFILE,
+    CRAM_OPT_PACKED_REF,
+    CRAM_OPT_REF_CACHE_SIZE,
+    CRAM_OPT_TRIAL_BUDGET,
+    CRAM_OPT_LAZY_BLOCKS,
+    CRAM_OPT_NO_BAM
 };
 
 /* BF bitfields */
@@ -143,8 +143,10 @@ int mfmmap(mFILE *mf, FILE *fp, const char *fn) {
     mf->data = mmap(NULL, mf->size, PROT_READ, MAP_SHARED,
 		    fileno(fp), 0);
 
-    if (!mf->data)
+    if (mf->data == MAP_FAILED) {
+	mf->data = NULL;
 	return -1;
+    }
 
     mf->alloced = 0;
     return 0;
@@ -722,3 +724,11 @@ void mfascii(mFILE *mf) {
 
     mf->offset = mf->flush_pos = 0;
 }
+
+/*
+ * Returns 1 if the data held by mf is a read-only memory mapping of the
+ * underlying file (as requested by mfopen mode "rm"), 0 otherwise.
+ */
+int mfmmapped(mFILE *mf) {
+    return (mf->mode & MF_MMAP) ? 1 : 0;
+}
@@ -76,6 +76,7 @@ mFILE *mstdin(void);
 mFILE *mstdout(void);
 mFILE *mstderr(void);
 void mfascii(mFILE *mf);
+int mfmmapped(mFILE *mf);
 
 #ifdef __cplusplus
 }
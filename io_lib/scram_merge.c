@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2026 The io_lib contributors.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A k-way merge of sorted scram_fd inputs.
+ *
+ * The record to emit next is selected via a loser tree.  tree[0] holds
+ * the index of the overall winner and tree[1..n-1] the index of the
+ * input that lost the match played at that internal node.  Leaves are
+ * implicit, with input i being node n+i.  After emitting a record only
+ * the path from that input's leaf to the root needs replaying.
+ *
+ * Each input caches the sort key of its current head record so it is
+ * computed once per record rather than once per comparison.
+ *
+ * Records are read in batches.  With a thread pool each input has two
+ * batches; one being consumed by the merge while the other is being
+ * filled by a job on the pool.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "io_lib/scram_merge.h"
+
+typedef struct {
+    scram_fd *fd;
+    bam_seq_t **s; // batch of records
+    int alloc;     // size of s[]
+    int n;         // number of records loaded into s[]
+    int end;       // 0 = more data, 1 = EOF, -1 = error
+} merge_batch;
+
+typedef struct {
+    merge_batch b[2];
+    merge_batch *cur;  // batch being merged
+    merge_batch *next; // read-ahead batch, when using a thread pool
+    int idx;           // current record in cur
+    int done;          // no further records
+    int in_flight;     // next is being filled by the pool
+    t_results_queue *q;
+
+    // Cached sort key for cur->s[idx]
+    uint64_t key;
+    char *name;
+    int flag;
+} merge_input;
+
+struct scram_merge {
+    merge_input *in;
+    int n_input;
+    int *tree;
+    enum scram_merge_order order;
+    t_pool *pool;
+    int last;          // input the last returned record came from
+};
+
+/*
+ * Compares two strings taking embedded numbers into account, so that
+ * "r9" sorts before "r10".  This matches the samtools sort -n order.
+ */
+static int strnum_cmp(const char *a, const char *b) {
+    const unsigned char *pa = (const unsigned char *)a;
+    const unsigned char *pb = (const unsigned char *)b;
+
+    while (*pa && *pb) {
+	if (isdigit(*pa) && isdigit(*pb)) {
+	    const unsigned char *sa, *sb;
+	    int d;
+
+	    while (*pa == '0') pa++;
+	    while (*pb == '0') pb++;
+	    for (sa = pa; isdigit(*pa); pa++);
+	    for (sb = pb; isdigit(*pb); pb++);
+
+	    if (pa-sa != pb-sb)
+		return pa-sa < pb-sb ? -1 : 1;
+	    if ((d = memcmp(sa, sb, pa-sa)))
+		return d;
+	} else {
+	    if (*pa != *pb)
+		return (int)*pa - (int)*pb;
+	    pa++, pb++;
+	}
+    }
+
+    return *pa ? 1 : (*pb ? -1 : 0);
+}
+
+/* Returns true if input a sorts before input b. */
+static inline int merge_lt(scram_merge *m, int a, int b) {
+    merge_input *ia = &m->in[a], *ib = &m->in[b];
+
+    if (ia->done != ib->done)
+	return ib->done;
+
+    if (!ia->done) {
+	if (m->order == SCRAM_MERGE_COORD) {
+	    if (ia->key != ib->key)
+		return ia->key < ib->key;
+	} else {
+	    int d = strnum_cmp(ia->name, ib->name);
+	    if (d)
+		return d < 0;
+	    if (ia->flag != ib->flag)
+		return ia->flag < ib->flag;
+	}
+    }
+
+    // Equal keys are taken from the earliest input first.
+    return a < b;
+}
+
+/* Caches the sort key of the current record of input 'in'. */
+static void merge_set_key(scram_merge *m, merge_input *in) {
+    bam_seq_t *b = in->cur->s[in->idx];
+
+    if (m->order == SCRAM_MERGE_COORD) {
+	int64_t pos = bam_pos(b);
+
+	// Unplaced records go last; at the end of their reference if
+	// they have one, or after everything else if not.  Packing a
+	// negative pos as-is would sign extend over the ref bits.
+	if (bam_ref(b) < 0) {
+	    in->key = UINT64_MAX;
+	    return;
+	}
+	if (pos < 0)
+	    pos = INT32_MAX;
+
+	in->key = (((uint64_t)bam_ref(b))<<33)
+	    | ((uint64_t)pos<<2)
+	    | (bam_strand(b)<<1)
+	    | !(bam_flag(b) & BAM_FREAD1);
+    } else {
+	in->name = bam_name(b);
+	in->flag = bam_flag(b) & (BAM_FREAD1 | BAM_FREAD2);
+    }
+}
+
+/*
+ * Fills out a batch of records from a single input.
+ * This is the function run on the thread pool.
+ */
+static void *merge_read_batch(void *arg) {
+    merge_batch *b = (merge_batch *)arg;
+
+    for (b->n = 0; b->n < b->alloc; b->n++) {
+	if (scram_get_seq(b->fd, &b->s[b->n]) < 0) {
+	    b->end = scram_eof(b->fd) > 0 ? 1 : -1;
+	    break;
+	}
+    }
+
+    return b;
+}
+
+/*
+ * Starts filling in->next on the pool.
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int merge_read_ahead(scram_merge *m, merge_input *in) {
+    if (t_pool_dispatch(m->pool, in->q, merge_read_batch, in->next) < 0)
+	return -1;
+    in->in_flight = 1;
+    return 0;
+}
+
+/* Waits for any outstanding read-ahead on input 'in' to complete. */
+static void merge_read_wait(merge_input *in) {
+    t_pool_result *r;
+
+    if (!in->in_flight)
+	return;
+
+    r = t_pool_next_result_wait(in->q);
+    t_pool_delete_result(r, 0);
+    in->in_flight = 0;
+}
+
+/*
+ * Moves input 'in' on to its next record, switching batches when the
+ * current one is exhausted.
+ *
+ * Returns 0 on success (check in->done for end of input);
+ *        -1 on failure
+ */
+static int merge_advance(scram_merge *m, merge_input *in) {
+    if (in->done)
+	return 0;
+
+    if (++in->idx < in->cur->n) {
+	merge_set_key(m, in);
+	return 0;
+    }
+
+    // A short batch means the input has been fully consumed.
+    if (in->cur->end) {
+	in->done = 1;
+	return in->cur->end < 0 ? -1 : 0;
+    }
+
+    if (m->pool) {
+	merge_batch *b = in->cur;
+
+	merge_read_wait(in);
+	in->cur = in->next;
+	in->next = b;
+
+	if (!in->cur->end && merge_read_ahead(m, in) < 0)
+	    return -1;
+    } else {
+	merge_read_batch(in->cur);
+    }
+
+    in->idx = 0;
+    if (in->cur->n == 0) {
+	in->done = 1;
+	return in->cur->end < 0 ? -1 : 0;
+    }
+
+    merge_set_key(m, in);
+    return 0;
+}
+
+/* Replays the matches from input w's leaf up to the root. */
+static void merge_tree_replay(scram_merge *m, int w) {
+    int node;
+
+    for (node = (w + m->n_input)/2; node > 0; node /= 2) {
+	if (merge_lt(m, m->tree[node], w)) {
+	    int t = m->tree[node];
+	    m->tree[node] = w;
+	    w = t;
+	}
+    }
+
+    m->tree[0] = w;
+}
+
+/*
+ * Plays all matches to initialise the tree.
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+static int merge_tree_build(scram_merge *m) {
+    int n = m->n_input, node;
+    int *win = malloc(2 * n * sizeof(*win));
+
+    if (!win)
+	return -1;
+
+    for (node = n; node < 2*n; node++)
+	win[node] = node - n;
+
+    for (node = n-1; node > 0; node--) {
+	int a = win[2*node], b = win[2*node+1];
+	if (merge_lt(m, a, b)) {
+	    win[node] = a;
+	    m->tree[node] = b;
+	} else {
+	    win[node] = b;
+	    m->tree[node] = a;
+	}
+    }
+    m->tree[0] = n > 1 ? win[1] : 0;
+
+    free(win);
+    return 0;
+}
+
+/*
+ * Creates a new merge over n_input already opened input files.
+ *
+ * Returns a scram_merge pointer on success;
+ *         NULL on failure.
+ */
+scram_merge *scram_merge_init(scram_fd **in, int n_input,
+			      enum scram_merge_order order,
+			      t_pool *pool, int batch_size) {
+    scram_merge *m;
+    int i, j;
+
+    if (n_input <= 0)
+	return NULL;
+
+    if (batch_size <= 0)
+	batch_size = SCRAM_MERGE_BATCH;
+
+    if (!(m = calloc(1, sizeof(*m))))
+	return NULL;
+
+    m->n_input = n_input;
+    m->order = order;
+    m->pool = pool;
+    m->last = -1;
+
+    if (!(m->in = calloc(n_input, sizeof(*m->in))) ||
+	!(m->tree = calloc(n_input, sizeof(*m->tree))))
+	goto err;
+
+    for (i = 0; i < n_input; i++) {
+	merge_input *mi = &m->in[i];
+
+	for (j = 0; j < (pool ? 2 : 1); j++) {
+	    mi->b[j].fd = in[i];
+	    mi->b[j].alloc = batch_size;
+	    if (!(mi->b[j].s = calloc(batch_size, sizeof(bam_seq_t *))))
+		goto err;
+	}
+
+	// An empty current batch; the first merge_advance() loads more.
+	mi->cur = &mi->b[0];
+	mi->next = &mi->b[1];
+	mi->idx = -1;
+
+	if (pool) {
+	    if (!(mi->q = t_results_queue_init()))
+		goto err;
+	    t_results_queue_set_name(mi->q, "merge_read");
+
+	    // Swap so the first read-ahead becomes our first cur batch.
+	    mi->cur = &mi->b[1];
+	    mi->next = &mi->b[0];
+	    if (merge_read_ahead(m, mi) < 0)
+		goto err;
+	}
+    }
+
+    for (i = 0; i < n_input; i++)
+	if (merge_advance(m, &m->in[i]) < 0)
+	    goto err;
+
+    if (merge_tree_build(m) < 0)
+	goto err;
+
+    return m;
+
+ err:
+    scram_merge_free(m);
+    return NULL;
+}
+
+/*
+ * Fetches the next record in sorted order.
+ *
+ * Returns 0 on success;
+ *         1 when all inputs have been exhausted;
+ *        -1 on failure.
+ */
+int scram_merge_next(scram_merge *m, bam_seq_t **bsp) {
+    merge_input *in;
+
+    // Deferred so the previously returned record stays valid until now.
+    if (m->last >= 0) {
+	if (merge_advance(m, &m->in[m->last]) < 0)
+	    return -1;
+	merge_tree_replay(m, m->last);
+    }
+
+    in = &m->in[m->tree[0]];
+    if (in->done) {
+	m->last = -1;
+	return 1;
+    }
+
+    m->last = m->tree[0];
+    *bsp = in->cur->s[in->idx];
+
+    return 0;
+}
+
+/* Deallocates a merge, waiting for any outstanding read-ahead jobs. */
+void scram_merge_free(scram_merge *m) {
+    int i, j, k;
+
+    if (!m)
+	return;
+
+    if (m->in) {
+	for (i = 0; i < m->n_input; i++) {
+	    merge_input *mi = &m->in[i];
+
+	    if (mi->q) {
+		merge_read_wait(mi);
+		t_results_queue_destroy(mi->q);
+	    }
+
+	    for (j = 0; j < 2; j++) {
+		if (!mi->b[j].s)
+		    continue;
+		for (k = 0; k < mi->b[j].alloc; k++)
+		    if (mi->b[j].s[k])
+			free(mi->b[j].s[k]);
+		free(mi->b[j].s);
+	    }
+	}
+	free(m->in);
+    }
+
+    if (m->tree)
+	free(m->tree);
+
+    free(m);
+}
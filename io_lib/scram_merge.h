@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2026 The io_lib contributors.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! \file
+ * K-way merging of sorted SAM/BAM/CRAM streams.
+ *
+ * This combines multiple scram_fd inputs, each already sorted in the
+ * same order, into a single sorted stream.  The next record is chosen
+ * using a tournament (loser) tree with a cached sort key per input, so
+ * selecting a record costs O(log N) comparisons rather than a scan of
+ * all N inputs.
+ *
+ * If a thread pool is supplied, each input reads ahead in batches on
+ * the pool so decoding of the inputs overlaps with the merge itself.
+ */
+
+#ifndef _SCRAM_MERGE_H_
+#define _SCRAM_MERGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "io_lib/scram.h"
+#include "io_lib/thread_pool.h"
+
+/*! Sort orders understood by the merge engine */
+enum scram_merge_order {
+    SCRAM_MERGE_COORD, /*!< reference, position, strand, READ1 first */
+    SCRAM_MERGE_NAME,  /*!< query name (natural order), READ1 first */
+};
+
+/*! Default number of records each input reads ahead per batch */
+#define SCRAM_MERGE_BATCH 256
+
+typedef struct scram_merge scram_merge;
+
+/*! Creates a new merge over n_input already opened input files.
+ *
+ * The inputs remain owned by the caller and should be closed after
+ * scram_merge_free().  If pool is non-NULL, reading of each input is
+ * performed in batches of batch_size records on the pool.  Note the
+ * inputs must not themselves be using the same pool for decoding, as
+ * the read-ahead jobs would then wait on their own pool.
+ *
+ * batch_size <= 0 selects SCRAM_MERGE_BATCH.
+ *
+ * @return
+ * Returns a scram_merge pointer on success;
+ *         NULL on failure.
+ */
+scram_merge *scram_merge_init(scram_fd **in, int n_input,
+			      enum scram_merge_order order,
+			      t_pool *pool, int batch_size);
+
+/*! Fetches the next record in sorted order.
+ *
+ * On success *bsp is set to point to an internal bam_seq_t which
+ * remains valid until the next call to scram_merge_next() or
+ * scram_merge_free().  It must not be freed by the caller.
+ *
+ * @return
+ * Returns 0 on success;
+ *         1 when all inputs have been exhausted;
+ *        -1 on failure.
+ */
+int scram_merge_next(scram_merge *m, bam_seq_t **bsp);
+
+/*! Deallocates a merge, waiting for any outstanding read-ahead jobs. */
+void scram_merge_free(scram_merge *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SCRAM_MERGE_H_ */
@@ -0,0 +1,1525 @@
+/*
+ * Copyright (c) 2013 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Author: James Bonfield, Wellcome Trust Sanger Institute. 2011-2013
+ *
+ * The pileup_loop API.
+ *
+ * Active sequences are held in a contiguous array in the order they
+ * were added, rather than a linked list, so walking a column touches
+ * memory sequentially.  Finished sequences are removed by compacting
+ * the array in place and their bam_seq_t buffers are kept for reuse.
+ *
+ * pileup_loop_mt() shards each reference at CRAM slice boundaries.  A
+ * shard covering [start, end] seeks to start using the index, builds
+ * the pileup from the first overlapping sequence onwards but only
+ * reports columns within [start, end], and stops on reading the first
+ * sequence beyond end.
+ *
+ * pileup_count_loop() on CRAM does not use pileup_t at all.  Each read
+ * is applied to a window of per position counters using only its
+ * decoded features; a matching stretch between two features costs two
+ * depth updates irrespective of its length.  The reference base
+ * absorbs whatever depth the explicit base calls and deletions do not
+ * account for, so the reference never needs copying into each read.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "io_lib/scram_pileup.h"
+#include "io_lib/cram.h"
+
+/*
+ * START_WITH_DEL is the mode that Gap5 uses when building this. It prepends
+ * all cigar strings with 1D and decrements the position by one. (And then
+ * has code to reverse this operation in the pileup handler.)
+ *
+ * The reason for this is that it means reads starting with an insertion work.
+ * Otherwise the inserted bases are silently lost. (Try it with "samtools
+ * mpileup" and you can see it has the same issue.)
+ *
+ * However it's probably not want most people expect.
+ */
+//#define START_WITH_DEL
+
+/* --------------------------------------------------------------------------
+ * The pileup code itself. 
+ *
+ * This consists of the external pileup_loop() function, which takes a
+ * sam/bam samfile_t pointer and a callback function. The callback function
+ * is called once per column of aligned data (so once per base in an
+ * insertion).
+ *
+ * Current known issues.
+ * 1) zero length matches, ie 2S2S cause failures.
+ * 2) Insertions at starts of sequences get included in the soft clip, so
+ *    2S2I2M is treated as if it's 4S2M
+ * 3) From 1 and 2 above, 1S1I2S becomes 2S2S which fails.
+ */
+
+/*
+ * Fast conversion from encoded SAM base nibble to a printable character
+ */
+static char tab[256][2];
+static void init_tab(void) {
+    int i, j;
+    unsigned char b2;
+    static int done = 0;
+
+    if (done)
+	return;
+
+    for (i = 0; i < 16; i++) {
+	for (j = 0; j < 16; j++) {
+	    b2 = (i<<4) | j;
+	    tab[b2][0] = "NACMGRSVTWYHKDBN"[i];
+	    tab[b2][1] = "NACMGRSVTWYHKDBN"[j];
+	}
+    }
+
+    done = 1;
+}
+
+
+/*
+ * Fetches the next base => the nth base at unpadded position pos. (Nth can
+ * be greater than 0 if we have an insertion in this column). Do not call this
+ * with pos/nth lower than the previous query, although higher is better.
+ * (This allows it to be initialised at base 0.)
+ *
+ * Stores the result in base and also updates is_insert to indicate that
+ * this sequence still has more bases in this position beyond the current
+ * nth parameter.
+ *
+ * Returns 1 if a base was fetched
+ *         0 if not (eg ran off the end of sequence)
+ */
+static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
+    bam_seq_t *b = p->b;
+    enum cigar_op op = p->cigar_op;
+
+    if (p->first_del && op != BAM_CPAD)
+	p->first_del = 0;
+
+    *is_insert = 0;
+
+    /* Find pos first */
+    while (p->pos < pos) {
+	p->nth = 0;
+
+	if (p->cigar_len == 0) {
+	    if (p->cigar_ind >= bam_cigar_len(b)) {
+		p->eof = 1;
+		return 0;
+	    }
+
+	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
+	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
+	    p->cigar_ind++;
+	}
+	
+	if ((op == BAM_CMATCH ||
+	     op == BAM_CBASE_MATCH ||
+	     op == BAM_CBASE_MISMATCH) && p->cigar_len <= pos - p->pos) {
+	    p->seq_offset += p->cigar_len;
+	    p->pos += p->cigar_len;
+	    p->cigar_len = 0;
+	} else {
+	    switch (op) {
+	    case BAM_CMATCH:
+	    case BAM_CBASE_MATCH:
+	    case BAM_CBASE_MISMATCH:
+		p->seq_offset++;
+		/* Fall through */
+	    case BAM_CDEL:
+	    case BAM_CREF_SKIP:
+		p->pos++;
+		p->cigar_len--;
+		break;
+
+	    case BAM_CINS:
+	    case BAM_CSOFT_CLIP:
+		p->seq_offset += p->cigar_len;
+		/* Fall through */
+	    case BAM_CPAD:
+	    case BAM_CHARD_CLIP:
+		p->cigar_len = 0;
+		break;
+
+	    default:
+		fprintf(stderr, "Unhandled cigar_op %d\n", op);
+		return -1;
+	    }
+	}
+    }
+
+    /* Now at pos, find nth base */
+    while (p->nth < nth) {
+	if (p->cigar_len == 0) {
+	    if (p->cigar_ind >= bam_cigar_len(b)) {
+		p->eof = 1;
+		return 0; /* off end of seq */
+	    }
+
+	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
+	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
+	    p->cigar_ind++;
+	}
+
+	switch (op) {
+	case BAM_CMATCH:
+	case BAM_CBASE_MATCH:
+	case BAM_CBASE_MISMATCH:
+	case BAM_CSOFT_CLIP:
+	case BAM_CDEL:
+	case BAM_CREF_SKIP:
+	    goto at_nth; /* sorry, but it's fast! */
+
+	case BAM_CINS:
+	    p->seq_offset++;
+	    /* Fall through */
+	case BAM_CPAD:
+	    p->cigar_len--;
+	    p->nth++;
+	    break;
+
+	case BAM_CHARD_CLIP:
+	    p->cigar_len = 0;
+	    break;
+
+	default:
+	    fprintf(stderr, "Unhandled cigar_op %d\n", op);
+	    return -1;
+	}
+    }
+ at_nth:
+
+    /* Fill out base & qual fields */
+    p->ref_skip = 0;
+    if (p->nth < nth && op != BAM_CINS) {
+	//p->base = '-';
+	p->base = '*';
+	p->padding = 1;
+	if (p->seq_offset < b->len)
+	    p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	else
+	    p->qual = 0;
+    } else {
+	p->padding = 0;
+	switch(op) {
+	case BAM_CDEL:
+	    p->base = '*';
+	    if (p->seq_offset+1 < b->len)
+		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	    else
+		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
+	    break;
+
+	case BAM_CPAD:
+	    //p->base = '+';
+	    p->base = '*';
+	    if (p->seq_offset+1 < b->len)
+		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	    else
+		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
+	    break;
+
+	case BAM_CREF_SKIP:
+	    p->base = '.';
+	    p->qual = 0;
+	    /* end of fragment, but not sequence */
+	    p->eof = p->eof ? 2 : 3;
+	    p->ref_skip = 1;
+	    break;
+
+	default:
+	    if (p->seq_offset < b->len) {
+		p->qual = p->b_qual[p->seq_offset];
+	    /*
+	     * If you need to label inserted bases as different from
+	     * (mis)matching bases then this is where we'd make that change.
+	     * The reason could be to allow the consensus algorithm to easily
+	     * distinguish between reference bases and non-reference bases.
+	     *
+	     * Eg:
+	     * if (nth)
+	     *     p->base = tolower(tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1]);
+	     * else
+	     */
+		p->base = tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1];
+	    } else {
+		p->base = 'N';
+		p->qual = 0xff;
+	    }
+		
+	    break;
+	}
+    }
+
+    /* Handle moving out of N (skip) into sequence again */
+    if (p->eof && p->base != '.') {
+	p->start = 1;
+	p->ref_skip = 1;
+	p->eof = 0;
+    }
+
+    /* Starting with an indel needs a minor fudge */
+    if (p->start && p->cigar_op == BAM_CDEL) {
+	p->first_del = 1;
+    }
+
+    /* Check if next op is an insertion of some sort */
+    if (p->cigar_len == 0) {
+	if (p->cigar_ind < bam_cigar_len(b)) {
+	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
+	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
+	    p->cigar_ind++;
+	    if (op == BAM_CREF_SKIP) {
+		p->eof = 3;
+		p->ref_skip = 1;
+	    }
+	} else {
+	    p->eof = 1;
+	}
+    }
+
+    switch (op) {
+    case BAM_CPAD:
+    case BAM_CINS:
+	*is_insert = p->cigar_len;
+	break;
+
+    case BAM_CSOFT_CLIP:
+	/* Last op 'S' => eof */
+        p->eof = (p->cigar_ind == bam_cigar_len(b) ||
+		  (p->cigar_ind+1 == bam_cigar_len(b) &&
+		   (p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK)
+		   == BAM_CHARD_CLIP))
+	    ? 1
+	    : 0;
+	break;
+
+    case BAM_CHARD_CLIP:
+	p->eof = 1;
+	break;
+
+    default:
+	break;
+    }
+    
+    return 1;
+}
+
+/*
+ * Appends a newly read sequence to the active array, initialising the
+ * pileup state for it.
+ *
+ * Returns a pointer to the new entry on success
+ *         NULL on failure
+ */
+static pileup_t *pileup_add(pileup_t **act, int *nact, int *aact,
+			    bam_seq_t *b, int pos) {
+    pileup_t *p;
+
+    if (*nact == *aact) {
+	int n = *aact ? *aact * 2 : 256;
+	if (!(p = realloc(*act, n * sizeof(*p))))
+	    return NULL;
+	*act = p;
+	*aact = n;
+    }
+
+    p = &(*act)[(*nact)++];
+    p->b          = b;
+    p->cd         = NULL;
+    p->start      = 1;
+    p->eof        = 0;
+    p->nth        = 0;
+    p->qual       = 0;
+    p->base       = 0;
+    p->ref_skip   = 0;
+    p->padding    = 0;
+
+    /*
+     * Note: cigars starting with I or P ops (eg 2P3I10M) mean we have
+     * alignment instructions that take place before the designated
+     * starting location listed in the SAM file. They won't get included
+     * in the callback function until they officially start, which is
+     * already too late.
+     *
+     * So to workaround this, we prefix all CIGAR with 1D, move the
+     * position by 1bp, and then force the callback code to remove
+     * leaving pads (either P or D generated).
+     *
+     * Ie it's a level 10 hack!
+     */
+#ifdef START_WITH_DEL
+    p->pos        = pos-1;
+    p->cigar_ind  = 0;
+    p->b_cigar    = bam_cigar(p->b);
+    if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP) {
+	p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
+	p->cigar_op   = BAM_CHARD_CLIP;
+	if ((p->b_cigar[1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
+	    /* xHxS... => xHxS1D... */
+	    p->b_cigar[0] = p->b_cigar[1];
+	    p->b_cigar[1] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
+	} else {
+	    /* xH... => xH1D... */
+	    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
+	}
+    } else {
+	if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
+	    /* xS... => xS1D... */
+	    p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
+	    p->cigar_op   = BAM_CSOFT_CLIP;
+	    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
+	} else {
+	    /* ... => 1D... */
+	    p->cigar_len  = 1;        /* was  0  */
+	    p->cigar_op   = BAM_CDEL; /* was 'X' */
+	}
+    }
+    p->seq_offset = -1;
+    p->first_del  = 1;
+#else
+    p->pos        = pos-1;
+    p->cigar_ind  = 0;
+    p->b_cigar    = bam_cigar(p->b);
+    p->cigar_len  = 0;
+    p->cigar_op   = -1;
+    p->seq_offset = -1;
+    p->first_del  = 0;
+#endif
+    p->b_strand   = bam_strand(p->b) ? 1 : 0;
+    p->b_qual     = (uc *)bam_qual(p->b);
+    p->b_seq      = (uc *)bam_seq(p->b);
+
+    return p;
+}
+
+/*
+ * The pileup itself.  Sequences are consumed from fp until EOF or until
+ * one starts beyond end, but seq_add is only called for columns within
+ * start to end inclusive.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_run(scram_fd *fp, int start, int end,
+		      pileup_seq_init_func *seq_init,
+		      pileup_seq_add_func *seq_add,
+		      void *client_data) {
+    int ret = -1;
+    pileup_t *act = NULL, *p;   // active seqs, in order of addition
+    int nact = 0, aact = 0;
+    bam_seq_t **spare = NULL;   // bam_seq_t buffers free for reuse
+    int nspare = 0, aspare = 0;
+    bam_seq_t *b = NULL;
+    int is_insert, nth = 0, i, j;
+    int col = 0, r, done = 0;
+    int last_ref = -1;
+
+    init_tab();
+
+    do {
+	int pos, last_in_contig;
+
+	r = scram_next_seq(fp, &b);
+	if (r == -1) {
+	    if (!scram_eof(fp)) {
+		fprintf(stderr, "bam_next_seq() failure.\n");
+		goto error;
+	    }
+	}
+
+	if (r >= 0) {
+	    if (bam_flag(b) & BAM_FUNMAP)
+		continue;
+
+	    /* Beyond our region, so finish as if at EOF */
+	    if (b->ref != -1 && b->pos+1 > end)
+		r = -1;
+	}
+
+	if (r >= 0) {
+	    if (b->ref == -1) {
+		/* Another indicator for unmapped */
+		continue;
+	    } else if (b->ref == last_ref) {
+		pos = b->pos+1;
+		last_in_contig = 0;
+	    } else {
+		pos = (b->pos > col ? b->pos : col)+1;
+		last_in_contig = 1;
+	    }
+	} else {
+	    last_in_contig = 1;
+	    pos = col+1;
+	}
+
+	if (col > pos) {
+	    fprintf(stderr, "BAM/SAM file is not sorted by position. "
+		    "Aborting\n");
+	    goto error;
+	}
+
+	/* Process data between the last column and our latest addition */
+	while (col < pos && nact) {
+	    int v, ins;
+
+	    if (col > end) {
+		done = 1;
+		break;
+	    }
+
+	    /* Pileup */
+	    is_insert = 0;
+	    for (i = 0; i < nact; i++) {
+		if (!get_next_base(&act[i], col, nth, &ins))
+		    act[i].eof = 1;
+
+		if (is_insert < ins)
+		    is_insert = ins;
+	    }
+
+	    /* Call our function on the active array */
+	    if (col >= start) {
+#ifdef START_WITH_DEL
+		v = seq_add(client_data, fp, act, nact, col-1, nth, is_insert);
+#else
+		v = seq_add(client_data, fp, act, nact, col, nth, is_insert);
+#endif
+	    } else {
+		v = 0;
+	    }
+
+	    /* Remove dead seqs, keeping the remainder in order */
+	    for (i = j = 0; i < nact; i++) {
+		act[i].start = 0;
+		if (act[i].eof == 1) {
+		    spare[nspare++] = act[i].b;
+		} else {
+		    if (i != j)
+			act[j] = act[i];
+		    j++;
+		}
+	    }
+	    nact = j;
+
+	    if (v == 1)
+		break; /* early abort */
+
+	    if (v != 0)
+		goto error;
+
+	    /* Next column */
+	    if (is_insert) {
+		nth++;
+	    } else {
+		nth = 0;
+		col++;
+	    }
+
+	    /* Special case for the last sequence in a contig */
+	    if (last_in_contig && nact)
+		pos++;
+	}
+
+	if (done)
+	    break;
+
+	/* May happen if we have a hole in the contig */
+	col = pos;
+
+	if (r < 0)
+	    break;
+
+	/* New contig */
+	if (b->ref != last_ref) {
+	    last_ref = b->ref;
+	    pos = b->pos+1;
+	    nth = 0;
+	    col = pos;
+	}
+
+	/* Add this seq */
+	if (!(p = pileup_add(&act, &nact, &aact, b, pos)))
+	    goto error;
+
+	/* Every bam_seq_t is either active, spare or b */
+	if (aspare < aact) {
+	    bam_seq_t **s = realloc(spare, aact * sizeof(*s));
+	    if (!s)
+		goto error;
+	    spare = s;
+	    aspare = aact;
+	}
+
+	if (seq_init) {
+	    int v = seq_init(client_data, fp, p);
+	    if (v == -1)
+		goto error;
+
+	    if (v != 1) {
+		/* Rejected, so reuse its buffer for the next read */
+		nact--;
+		continue;
+	    }
+	}
+
+	b = nspare ? spare[--nspare] : NULL;
+    } while (r >= 0);
+
+    ret = 0;
+ error:
+
+    /* Tidy up */
+    for (i = 0; i < nact; i++)
+	free(act[i].b);
+    for (i = 0; i < nspare; i++)
+	free(spare[i]);
+    free(b);
+    free(act);
+    free(spare);
+
+    return ret;
+}
+
+/*
+ * Loops through all the sequences in fp producing columns of data.
+ * When found, it calls func with clientdata as a callback. Func should
+ * return 0 for success and non-zero for failure. seq_init() is called
+ * on each new entry before we start processing it. It should return 0 or 1
+ * to indicate reject or accept status (eg to filter unmapped data).
+ * If seq_init() returns -1 we abort the pileup_loop with an error.
+ * seq_init may be NULL.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_loop(scram_fd *fp,
+		pileup_seq_init_func *seq_init,
+		pileup_seq_add_func *seq_add,
+		void *client_data) {
+    return pileup_run(fp, 0, INT_MAX, seq_init, seq_add, client_data);
+}
+
+/* --------------------------------------------------------------------------
+ * The multi-threaded, region sharded, pileup.
+ */
+
+/* State shared by all shards */
+typedef struct {
+    const char *fn;
+    refs_t *refs;
+    int ignore_md5, ignore_chksum; // as set on the original file
+    pileup_seq_init_func *seq_init;
+    pileup_seq_add_func *seq_add;
+    pileup_cd_init_func *cd_init;
+    pileup_cd_free_func *cd_free;
+    void *arg;
+
+    /* File handles not currently in use by a shard */
+    pthread_mutex_t lock;
+    scram_fd **idle;
+    int nidle, aidle;
+} pileup_mt;
+
+/* A single shard, also used as the job result */
+typedef struct {
+    pileup_mt *m;
+    cram_range r;
+    dstring_t *out;
+    int ret;
+} pileup_shard;
+
+/*
+ * Obtains a file handle for a shard, opening a new one if none are
+ * idle.
+ *
+ * Returns scram_fd pointer on success
+ *         NULL on failure
+ */
+static scram_fd *pileup_fd_get(pileup_mt *m) {
+    scram_fd *fd = NULL;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->nidle)
+	fd = m->idle[--m->nidle];
+    pthread_mutex_unlock(&m->lock);
+
+    if (fd)
+	return fd;
+
+    if (!(fd = scram_open(m->fn, "rc")))
+	return NULL;
+
+    if ((m->refs && scram_set_option(fd, CRAM_OPT_SHARED_REF, m->refs)) ||
+	scram_set_option(fd, CRAM_OPT_IGNORE_MD5, m->ignore_md5) ||
+	scram_set_option(fd, CRAM_OPT_IGNORE_CHKSUM, m->ignore_chksum) ||
+	cram_index_load(fd->c, m->fn) != 0) {
+	scram_close(fd);
+	return NULL;
+    }
+
+    return fd;
+}
+
+/*
+ * Returns a file handle to the idle list.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_fd_put(pileup_mt *m, scram_fd *fd) {
+    int ret = 0;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->nidle == m->aidle) {
+	int n = m->aidle ? m->aidle * 2 : 8;
+	scram_fd **idle = realloc(m->idle, n * sizeof(*idle));
+	if (idle) {
+	    m->idle = idle;
+	    m->aidle = n;
+	}
+    }
+    if (m->nidle < m->aidle)
+	m->idle[m->nidle++] = fd;
+    else
+	ret = -1;
+    pthread_mutex_unlock(&m->lock);
+
+    if (ret)
+	scram_close(fd);
+
+    return ret;
+}
+
+/* Thread pool job: the pileup of a single shard */
+static void *pileup_shard_job(void *arg) {
+    pileup_shard *s = (pileup_shard *)arg;
+    pileup_mt *m = s->m;
+    scram_fd *fd;
+    void *cd;
+
+    s->ret = -1;
+    if (!(fd = pileup_fd_get(m)))
+	return s;
+
+    if (scram_set_option(fd, CRAM_OPT_RANGE, &s->r) == 0 &&
+	(cd = m->cd_init(m->arg, s->out))) {
+	s->ret = pileup_run(fd, s->r.start, s->r.end,
+			    m->seq_init, m->seq_add, cd);
+	m->cd_free(cd);
+    }
+
+    pileup_fd_put(m, fd);
+
+    return s;
+}
+
+static int pos_cmp(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int index_off_cmp(const void *a, const void *b) {
+    const cram_index *x = *(const cram_index **)a;
+    const cram_index *y = *(const cram_index **)b;
+    if (x->offset != y->offset)
+	return x->offset < y->offset ? -1 : 1;
+    return (x->slice > y->slice) - (x->slice < y->slice);
+}
+
+/*
+ * Checks the index describes each reference as one contiguous run of
+ * the file with slice start positions ascending in file order, as
+ * shards depend on this to find their data.
+ *
+ * Returns 1 if so
+ *         0 if not
+ *        -1 on failure
+ */
+static int pileup_can_shard(cram_fd *fd, int nref) {
+    int64_t (*run)[2];
+    int i, j, n, nrun = 0, ok = 1;
+
+    if (!(run = malloc((nref+1) * sizeof(*run))))
+	return -1;
+
+    for (i = 0; ok && i < nref; i++) {
+	cram_range r = {i, 1, INT_MAX};
+	cram_index **e;
+
+	if ((n = cram_index_query_range(fd, &r, &e)) < 0) {
+	    free(run);
+	    return -1;
+	}
+	if (n == 0)
+	    continue;
+
+	qsort(e, n, sizeof(*e), index_off_cmp);
+	for (j = 1; j < n; j++)
+	    if (e[j]->start < e[j-1]->start)
+		ok = 0;
+	run[nrun][0] = e[0]->offset;
+	run[nrun][1] = e[n-1]->offset;
+	nrun++;
+	free(e);
+    }
+
+    /*
+     * Runs of different references may only meet at a container
+     * holding both, so sorted by start they must not overlap.
+     */
+    if (ok) {
+	qsort(run, nrun, sizeof(*run), pos_cmp);
+	for (i = 1; i < nrun; i++)
+	    if (run[i][0] < run[i-1][1])
+		ok = 0;
+    }
+
+    free(run);
+    return ok;
+}
+
+/*
+ * Splits reference ref into shards of PILEUP_SHARD_SLICES slices each,
+ * appending them to *shards.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_shards_ref(cram_fd *fd, int ref, cram_range **shards,
+			     int *nshard, int *ashard) {
+    cram_range r = {ref, 1, INT_MAX};
+    cram_index **e;
+    int64_t *st;
+    int i, n, ns, k;
+
+    if ((n = cram_index_query_range(fd, &r, &e)) <= 0)
+	return n;
+
+    if (!(st = malloc(n * sizeof(*st)))) {
+	free(e);
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+	st[i] = e[i]->start;
+    free(e);
+
+    /* Sorted unique slice start positions */
+    qsort(st, n, sizeof(*st), pos_cmp);
+    for (i = ns = 0; i < n; i++)
+	if (i == 0 || st[i] != st[ns-1])
+	    st[ns++] = st[i];
+
+    for (k = 0; k < ns; k += PILEUP_SHARD_SLICES) {
+	if (*nshard == *ashard) {
+	    int a = *ashard ? *ashard * 2 : 256;
+	    cram_range *s = realloc(*shards, a * sizeof(*s));
+	    if (!s) {
+		free(st);
+		return -1;
+	    }
+	    *shards = s;
+	    *ashard = a;
+	}
+
+	r.start = k ? st[k] : 1;
+	r.end   = k + PILEUP_SHARD_SLICES < ns
+	    ? st[k + PILEUP_SHARD_SLICES] - 1
+	    : INT_MAX;
+	if (r.start > r.end)
+	    continue;
+	(*shards)[(*nshard)++] = r;
+    }
+
+    free(st);
+    return 0;
+}
+
+/*
+ * Writes the output of a completed shard and frees it.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_shard_write(pileup_shard *s, FILE *out) {
+    int ret = s->ret;
+    size_t len = dstring_length(s->out);
+
+    if (ret == 0 && len && fwrite(dstring_str(s->out), 1, len, out) != len)
+	ret = -1;
+
+    dstring_destroy(s->out);
+    free(s);
+
+    return ret;
+}
+
+/*
+ * Runs a pileup over an indexed CRAM file, with independent shards of
+ * each reference processed in parallel on pool.
+ *
+ * Returns 0 on success
+ *         1 if the file cannot be sharded, having output nothing
+ *        -1 on failure
+ */
+int pileup_loop_mt(scram_fd *fp, const char *fn, t_pool *pool,
+		   pileup_seq_init_func *seq_init,
+		   pileup_seq_add_func *seq_add,
+		   pileup_cd_init_func *cd_init,
+		   pileup_cd_free_func *cd_free,
+		   void *arg, FILE *out) {
+    pileup_mt m;
+    t_results_queue *q = NULL;
+    cram_range *shards = NULL;
+    int nshard = 0, ashard = 0;
+    int i, ndisp = 0, nout = 0, window, ret = -1;
+
+    if (fp->is_bam || !fp->c->index)
+	return 1;
+
+    if ((i = pileup_can_shard(fp->c, scram_get_header(fp)->nref)) <= 0)
+	return i < 0 ? -1 : 1;
+
+    /* Plan the shards, one reference at a time */
+    for (i = 0; i < scram_get_header(fp)->nref; i++)
+	if (pileup_shards_ref(fp->c, i, &shards, &nshard, &ashard) < 0)
+	    goto err;
+
+    init_tab();
+
+    m.fn       = fn;
+    m.refs     = scram_get_refs(fp);
+    m.ignore_md5    = fp->c->ignore_md5;
+    m.ignore_chksum = fp->c->ignore_chksum;
+    m.seq_init = seq_init;
+    m.seq_add  = seq_add;
+    m.cd_init  = cd_init;
+    m.cd_free  = cd_free;
+    m.arg      = arg;
+    m.idle     = NULL;
+    m.nidle    = m.aidle = 0;
+    pthread_mutex_init(&m.lock, NULL);
+
+    if (!(q = t_results_queue_init()))
+	goto err2;
+
+    /*
+     * Results are returned strictly in order, so limit how far ahead
+     * of the oldest outstanding shard we dispatch.  This bounds the
+     * memory used to hold completed but not yet written output.
+     */
+    window = pool->tsize * 2;
+
+    ret = 0;
+    for (i = 0; i < nshard || nout < ndisp; ) {
+	t_pool_result *res;
+
+	if (i < nshard && ret == 0 && ndisp - nout < window) {
+	    pileup_shard *s = malloc(sizeof(*s));
+	    if (!s || !(s->out = dstring_create(NULL))) {
+		free(s);
+		ret = -1;
+		i = nshard;
+		continue;
+	    }
+	    s->m = &m;
+	    s->r = shards[i++];
+	    s->ret = -1;
+
+	    if (t_pool_dispatch(pool, q, pileup_shard_job, s) < 0) {
+		dstring_destroy(s->out);
+		free(s);
+		ret = -1;
+		i = nshard;
+		continue;
+	    }
+	    ndisp++;
+	    continue;
+	}
+
+	if (!(res = t_pool_next_result_wait(q))) {
+	    ret = -1;
+	    break;
+	}
+
+	if (pileup_shard_write((pileup_shard *)res->data, out) != 0) {
+	    /* Stop dispatching, but drain the remaining jobs */
+	    ret = -1;
+	    i = nshard;
+	}
+	t_pool_delete_result(res, 0);
+	nout++;
+    }
+
+    t_results_queue_destroy(q);
+
+ err2:
+    for (i = 0; i < m.nidle; i++)
+	scram_close(m.idle[i]);
+    free(m.idle);
+    pthread_mutex_destroy(&m.lock);
+
+ err:
+    free(shards);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * The depth and base count pileup.
+ */
+
+/* Maps a base call to enum pileup_count_base */
+static int pileup_base_idx(int base) {
+    switch (base) {
+    case 'A': case 'a': return PILEUP_A;
+    case 'C': case 'c': return PILEUP_C;
+    case 'G': case 'g': return PILEUP_G;
+    case 'T': case 't': return PILEUP_T;
+    default:            return PILEUP_N;
+    }
+}
+
+/* A position not yet reported */
+typedef struct {
+    int diff;                // change in depth starting at this position
+    int count[PILEUP_NBASE]; // explicit base calls and deletions
+    int ins;
+    char ref_base;           // from an embedded reference, or 0
+} count_col;
+
+/*
+ * The positions not yet reported, held in a ring buffer indexed by
+ * position modulo size.  It covers base to base+size-1.
+ */
+typedef struct {
+    count_col *col;
+    int64_t size;   // a power of 2
+    int64_t base;   // first position not yet reported
+    int64_t end;    // one beyond the last position updated
+    int depth;      // depth at base-1
+    int ref_id;
+    char *ref;      // external reference sequence for ref_id, or NULL
+    char *ref_free; // ref, if a private copy (packed refs)
+    int64_t ref_len;
+    int ref_loaded; // set once ref has been fetched (or failed to be)
+    int64_t ref_upto; // col[].ref_base is filled in below this position
+    int64_t ref_slice;// and came from an earlier slice below this one
+} count_win;
+
+/*
+ * Returns the counters for position pos, growing the window if needed.
+ * pos must be no lower than w->base.
+ *
+ * Returns count_col pointer on success
+ *         NULL on failure
+ */
+static count_col *count_at(count_win *w, int64_t pos) {
+    if (pos - w->base >= w->size) {
+	int64_t sz = w->size, p;
+	count_col *c;
+
+	while (pos - w->base >= sz)
+	    sz *= 2;
+	if (!(c = calloc(sz, sizeof(*c))))
+	    return NULL;
+	for (p = w->base; p < w->end; p++)
+	    c[p & (sz-1)] = w->col[p & (w->size-1)];
+	free(w->col);
+	w->col = c;
+	w->size = sz;
+    }
+
+    if (w->end <= pos)
+	w->end = pos+1;
+
+    return &w->col[pos & (w->size-1)];
+}
+
+/*
+ * Reports all positions before upto.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int count_flush(count_win *w, int64_t upto, scram_fd *fp,
+		       pileup_count_func *func, void *client_data) {
+    pileup_count_t pc;
+    int i, sum;
+
+    for (; w->base < upto; w->base++) {
+	count_col *c;
+
+	if (w->base >= w->end) {
+	    /* Nothing beyond here has been touched */
+	    w->base = upto;
+	    break;
+	}
+
+	c = &w->col[w->base & (w->size-1)];
+	w->depth += c->diff;
+
+	if (w->depth > 0) {
+	    pc.ref_id = w->ref_id;
+	    pc.pos = w->base;
+	    if (c->ref_base)
+		pc.ref_base = toupper((unsigned char)c->ref_base);
+	    else if (w->ref && w->base <= w->ref_len)
+		pc.ref_base = toupper((unsigned char)w->ref[w->base-1]);
+	    else
+		pc.ref_base = 'N';
+	    pc.depth = w->depth;
+	    for (sum = i = 0; i < PILEUP_NBASE; i++)
+		sum += (pc.count[i] = c->count[i]);
+	    pc.count[pileup_base_idx(pc.ref_base)] += w->depth - sum;
+	    pc.ins = c->ins;
+
+	    if (func(client_data, fp, &pc) != 0)
+		return -1;
+	}
+
+	memset(c, 0, sizeof(*c));
+    }
+
+    return 0;
+}
+
+/*
+ * Reports everything pending and moves the window to reference ref_id,
+ * starting at pos.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int count_new_ref(count_win *w, cram_fd *fd, int ref_id, int64_t pos,
+			 scram_fd *fp, pileup_count_func *func,
+			 void *client_data) {
+    if (count_flush(w, w->end, fp, func, client_data) < 0)
+	return -1;
+
+    if (w->ref) {
+	cram_ref_decr(fd->refs, w->ref_id);
+	free(w->ref_free);
+	w->ref = w->ref_free = NULL;
+    }
+
+    w->ref_id = ref_id;
+    w->base = w->end = w->ref_upto = w->ref_slice = pos;
+    w->depth = 0;
+    w->ref_loaded = 0;
+
+    return 0;
+}
+
+/*
+ * Fetches the whole of the current reference, for slices that were
+ * encoded against an external reference.  This is only attempted once
+ * per reference; without it reference bases are reported as N.
+ */
+static void count_load_ref(count_win *w, cram_fd *fd) {
+    int ref_id = w->ref_id;
+
+    w->ref_loaded = 1;
+    if (ref_id >= 0 && ref_id < fd->refs->nref &&
+	fd->refs->ref_id[ref_id] &&
+	(w->ref = cram_get_ref_copy(fd, ref_id, 1, 0, &w->ref_free)))
+	w->ref_len = fd->refs->ref_id[ref_id]->length;
+}
+
+/*
+ * Copies the embedded reference bases under record cr into the window.
+ * The embedded reference only lives as long as slice s, whereas the
+ * positions may be reported after later slices have been decoded.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int count_slice_ref(count_win *w, cram_slice *s, cram_record *cr) {
+    int64_t p = MAX(MAX(cr->apos, w->ref_upto), s->ref_start);
+    int64_t end = MIN(cr->aend, s->ref_end);
+
+    if (end < p)
+	return 0;
+
+    /* Grow the window once, then fill it directly */
+    if (!count_at(w, end))
+	return -1;
+    for (; p <= end; p++)
+	w->col[p & (w->size-1)].ref_base = s->ref[p - s->ref_start];
+    w->ref_upto = end+1;
+
+    return 0;
+}
+
+/*
+ * Adds the aligned depth from start to end-1.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int count_span(count_win *w, int64_t start, int64_t end) {
+    count_col *c;
+
+    if (end <= start)
+	return 0;
+
+    if (!(c = count_at(w, start)))
+	return -1;
+    c->diff++;
+
+    if (!(c = count_at(w, end)))
+	return -1;
+    c->diff--;
+
+    return 0;
+}
+
+/*
+ * Adds an implicit match of len bases starting at rp.  These take the
+ * reference base, which count_flush() fills in, unless the record has
+ * no sequence in which case they are counted as N.
+ *
+ * es is the slice if its reference is embedded.  Columns before
+ * w->ref_slice got their reference base from an earlier slice, which
+ * need not agree (eg an embedded consensus), so these are counted
+ * explicitly where they differ.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int count_match(count_win *w, cram_slice *es, int64_t rp, int64_t len,
+		       int no_seq) {
+    count_col *c;
+    int64_t j;
+
+    if (no_seq) {
+	for (j = 0; j < len; j++) {
+	    if (!(c = count_at(w, rp+j)))
+		return -1;
+	    c->count[PILEUP_N]++;
+	}
+    } else if (es) {
+	for (j = 0; j < len && rp+j < w->ref_slice; j++) {
+	    int b = rp+j >= es->ref_start && rp+j <= es->ref_end
+		? toupper((unsigned char)es->ref[rp+j - es->ref_start])
+		: 'N';
+	    if (!(c = count_at(w, rp+j)))
+		return -1;
+	    if (b != toupper((unsigned char)c->ref_base))
+		c->count[pileup_base_idx(b)]++;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Applies a single CRAM record to the window, using its features.
+ * This mirrors the reference and sequence position tracking of
+ * cram_decode_seq().  embed is set if s holds its own reference.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int count_cram_record(count_win *w, cram_slice *s, cram_record *cr,
+			     int embed) {
+    cram_slice *es = embed ? s : NULL;
+    cram_feature *f = &s->features[cr->feature];
+    char *seqs = (char *)BLOCK_DATA(s->seqs_blk);
+    int64_t rp = cr->apos, span = rp;
+    int no_seq = cr->cram_flags & CRAM_FLAG_NO_SEQ;
+    int sp = 1, i, j, b;
+    count_col *c;
+
+    for (i = 0; i < cr->nfeature; i++, f++) {
+	/* Implicit match up to the feature */
+	if (f->X.pos > sp) {
+	    if (count_match(w, es, rp, f->X.pos - sp, no_seq) < 0)
+		return -1;
+	    rp += f->X.pos - sp;
+	    sp = f->X.pos;
+	}
+
+	switch (f->X.code) {
+	case 'X':
+	case 'B':
+	    if (!(c = count_at(w, rp)))
+		return -1;
+	    b = f->X.code == 'X' ? f->X.base : f->B.base;
+	    c->count[no_seq ? PILEUP_N : pileup_base_idx(b)]++;
+	    rp++;
+	    sp++;
+	    break;
+
+	case 'b':
+	    for (j = 0; j < f->b.len; j++) {
+		if (!(c = count_at(w, rp+j)))
+		    return -1;
+		b = seqs[f->b.seq_idx + j];
+		c->count[no_seq ? PILEUP_N : pileup_base_idx(b)]++;
+	    }
+	    rp += f->b.len;
+	    sp += f->b.len;
+	    break;
+
+	case 'D':
+	    for (j = 0; j < f->D.len; j++) {
+		if (!(c = count_at(w, rp+j)))
+		    return -1;
+		c->count[PILEUP_DEL]++;
+	    }
+	    rp += f->D.len;
+	    break;
+
+	case 'N':
+	    if (count_span(w, span, rp) < 0)
+		return -1;
+	    rp += f->N.len;
+	    span = rp;
+	    break;
+
+	case 'I':
+	case 'i':
+	    if (rp-1 >= w->base) {
+		if (!(c = count_at(w, rp-1)))
+		    return -1;
+		c->ins++;
+	    }
+	    sp += f->X.code == 'I' ? f->I.len : 1;
+	    break;
+
+	case 'S':
+	    sp += f->S.len;
+	    break;
+
+	default:
+	    break;
+	}
+    }
+
+    /*
+     * An implicit match for any remaining bases.  cr->len is zeroed by
+     * the decoder for records without a sequence, so use the end.
+     */
+    if (cr->aend + 1 > rp) {
+	if (count_match(w, es, rp, cr->aend + 1 - rp, no_seq) < 0)
+	    return -1;
+	rp = cr->aend + 1;
+    }
+
+    return count_span(w, span, rp);
+}
+
+/*
+ * pileup_count_loop() for CRAM, driven from the decoded features.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int pileup_count_cram(scram_fd *fp, pileup_count_func *func,
+			     void *client_data) {
+    cram_fd *fd = fp->c;
+    cram_columns cols;
+    count_win w;
+    int i, r, ret = -1;
+
+    if (scram_set_option(fp, CRAM_OPT_REQUIRED_FIELDS,
+			 SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR | SAM_SEQ) ||
+	scram_set_option(fp, CRAM_OPT_NO_BAM, 1))
+	return -1;
+    fd->keep_features = 1;
+
+    memset(&cols, 0, sizeof(cols));
+    memset(&w, 0, sizeof(w));
+    w.ref_id = -1;
+    w.size = 1024;
+    if (!(w.col = calloc(w.size, sizeof(*w.col))))
+	return -1;
+
+    while ((r = cram_get_columns(fd, &cols)) == 0) {
+	cram_block_slice_hdr *sh = cols.s->hdr;
+	int embed = cols.s->ref &&
+	    (CRAM_MAJOR_VERS(fd->version) < 4
+	     ? sh->ref_base_id >= 0
+	     : sh->ref_base_id > 0);
+
+	/* Each call returns the (remaining) records of a new slice */
+	if (embed)
+	    w.ref_slice = w.ref_upto;
+
+	for (i = 0; i < cols.n; i++) {
+	    cram_record *cr = &cols.s->crecs[cols.rec[i]];
+
+	    if ((cols.flag[i] & BAM_FUNMAP) || cols.ref_id[i] < 0)
+		continue;
+
+	    if (cols.ref_id[i] != w.ref_id) {
+		if (count_new_ref(&w, fd, cols.ref_id[i], cols.pos[i],
+				  fp, func, client_data) < 0)
+		    goto err;
+	    } else if (cols.pos[i] < w.base) {
+		fprintf(stderr, "CRAM file is not sorted by position. "
+			"Aborting\n");
+		goto err;
+	    } else if (count_flush(&w, cols.pos[i], fp,
+				   func, client_data) < 0) {
+		goto err;
+	    }
+
+	    /*
+	     * Reference bases come from the slice itself when embedded,
+	     * otherwise from the external reference if the data was
+	     * encoded against one.
+	     */
+	    if (embed) {
+		if (count_slice_ref(&w, cols.s, cr) < 0)
+		    goto err;
+	    } else if (!w.ref_loaded && !fd->ctr->comp_hdr->no_ref) {
+		count_load_ref(&w, fd);
+	    }
+
+	    if (count_cram_record(&w, cols.s, cr, embed) < 0)
+		goto err;
+	}
+    }
+
+    if (r < 0)
+	goto err;
+
+    if (count_new_ref(&w, fd, -1, 0, fp, func, client_data) < 0)
+	goto err;
+
+    ret = 0;
+ err:
+    if (w.ref) {
+	cram_ref_decr(fd->refs, w.ref_id);
+	free(w.ref_free);
+    }
+    free(w.col);
+    cram_columns_free(&cols);
+    fd->keep_features = 0;
+
+    return ret;
+}
+
+/* The client data for count_adapter_add() */
+typedef struct {
+    pileup_count_func *func;
+    void *client_data;
+} count_adapter;
+
+/*
+ * Returns true if the sequence's current column is followed by inserted
+ * bases, ignoring any pads in between.
+ */
+static int pileup_ins_next(pileup_t *p) {
+    int i, op;
+
+    if (p->cigar_op == BAM_CINS)
+	return 1;
+    if (p->cigar_op != BAM_CPAD)
+	return 0;
+
+    for (i = p->cigar_ind; i < bam_cigar_len(p->b); i++) {
+	op = p->b_cigar[i] & BAM_CIGAR_MASK;
+	if (op == BAM_CINS)
+	    return 1;
+	if (op != BAM_CPAD)
+	    return 0;
+    }
+
+    return 0;
+}
+
+/* A pileup_loop() callback building pileup_count_t from the columns */
+static int count_adapter_add(void *cd, scram_fd *fp, pileup_t *p,
+			     int depth, int pos, int nth, int is_insert) {
+    count_adapter *a = (count_adapter *)cd;
+    pileup_count_t c;
+    int i;
+
+    if (nth)
+	return 0;
+
+    memset(&c, 0, sizeof(c));
+    c.ref_id = p->b->ref;
+    c.pos = pos;
+    c.ref_base = 'N';
+    for (i = 0; i < depth; i++) {
+	if (p[i].base == '.')
+	    continue; /* reference skip */
+	c.count[p[i].base == '*'
+		? PILEUP_DEL
+		: pileup_base_idx(p[i].base)]++;
+	c.depth++;
+	c.ins += pileup_ins_next(&p[i]);
+    }
+
+    if (c.depth && a->func(a->client_data, fp, &c) != 0)
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Reports the depth and base counts at each covered reference position.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_count_loop(scram_fd *fp, pileup_count_func *func,
+		      void *client_data) {
+    count_adapter a;
+
+    if (!fp->is_bam)
+	return pileup_count_cram(fp, func, client_data);
+
+    a.func = func;
+    a.client_data = client_data;
+
+    return pileup_loop(fp, NULL, count_adapter_add, &a);
+}
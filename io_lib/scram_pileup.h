@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2013 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*! \file
+ * A column by column pileup of sorted SAM/BAM/CRAM data.
+ *
+ * pileup_loop() walks the input once, calling a client function for
+ * every column of aligned data (once per base within an insertion).
+ *
+ * pileup_loop_mt() produces the same columns from an indexed CRAM file
+ * by splitting each reference into shards of a few slices each and
+ * running an independent pileup per shard on a thread pool.  Shard
+ * output is written in the original order.
+ *
+ * pileup_count_loop() is a lighter weight alternative for callers that
+ * only need the depth and base counts of each reference position.  On
+ * CRAM it works directly from the decoded features (the differences to
+ * the reference) instead of building BAM records and walking each base
+ * of the CIGAR strings.
+ */
+
+#ifndef _SCRAM_PILEUP_H_
+#define _SCRAM_PILEUP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+
+#include "io_lib/scram.h"
+#include "io_lib/thread_pool.h"
+#include "io_lib/dstring.h"
+
+typedef struct pileup {
+    void *cd;		  // General purpose per-seq client-data
+
+    bam_seq_t *b;	  // Bam entry associated with struct
+    unsigned char *b_qual;// cached bam_qual
+    unsigned char *b_seq; // cached bam_seq
+    uint32_t *b_cigar;    // cached bam_cigar
+    int  b_strand;        // 0 => fwd, 1 => rev
+
+    int  pos;             // Current unpadded position in seq
+    int  nth;		  // nth base at unpadded position 'pos'
+    int  seq_offset;      // Current base position in s->seq[] array.
+
+    int  cigar_ind;       // Current location in s->alignment cigar str
+    int  cigar_op;        // Current cigar operation
+    int  cigar_len;       // Remaining length of this cigar op
+
+    int  first_del;       // Used when first base is a deletion
+
+    int  eof;		  // True if this sequence has finished
+    int  qual;            // Current qual (for active seq only)
+    char base;		  // Current base (for active seq only)
+    char start;		  // True if this is a new sequence
+    char ref_skip;        // True if the cause of eof or start is cigar N
+    char padding;         // True if the base was added due to another seq
+} pileup_t;
+
+/*! Number of CRAM slices per shard used by pileup_loop_mt() */
+#define PILEUP_SHARD_SLICES 4
+
+/*! Called for each new sequence before it joins the pileup.
+ *
+ * @return
+ * Returns 1 to accept the sequence;
+ *         0 to reject it;
+ *        -1 to abort the pileup with an error.
+ */
+typedef int pileup_seq_init_func(void *client_data, scram_fd *fp,
+				 pileup_t *p);
+
+/*! Called once per column.
+ *
+ * p is an array of the depth active sequences, in the order they were
+ * added.  It is only valid for the duration of the call.
+ *
+ * @return
+ * Returns 0 on success;
+ *         1 to skip the remainder of the current gap in the data;
+ *        any other value to abort the pileup with an error.
+ */
+typedef int pileup_seq_add_func(void *client_data, scram_fd *fp,
+				pileup_t *p, int depth, int pos, int nth,
+				int is_insert);
+
+/*! Creates the client data for one shard of pileup_loop_mt().
+ *
+ * Output for the shard should be appended to out.  Returns NULL on
+ * failure.
+ */
+typedef void *pileup_cd_init_func(void *arg, dstring_t *out);
+
+/*! Frees client data created by a pileup_cd_init_func */
+typedef void pileup_cd_free_func(void *client_data);
+
+/*! Runs a pileup over all of fp.
+ *
+ * seq_init may be NULL.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int pileup_loop(scram_fd *fp,
+		pileup_seq_init_func *seq_init,
+		pileup_seq_add_func *seq_add,
+		void *client_data);
+
+/*! Runs a pileup over an indexed CRAM file using a thread pool.
+ *
+ * fp is an already opened CRAM file named fn with its index loaded
+ * via cram_index_load().  Each shard reopens fn, sharing the reference
+ * of fp, and calls cd_init / cd_free to create and destroy the client
+ * data handed to seq_init and seq_add.  The text each shard appends to
+ * its dstring is written to out in genome order.
+ *
+ * Each column, including any inserted columns following it, belongs
+ * to exactly one shard and sees the same sequences as it would in
+ * pileup_loop(), so the combined output matches a serial run.
+ *
+ * Shards seek by position, so each reference must occupy a single
+ * position sorted run of the file.  If fp is not an indexed CRAM file
+ * or the index shows a reference recurring (eg concatenated sorted
+ * files) nothing is read or written and 1 is returned, so the caller
+ * can use pileup_loop() instead.
+ *
+ * @return
+ * Returns 0 on success;
+ *         1 if fp cannot be sharded;
+ *        -1 on failure.
+ */
+int pileup_loop_mt(scram_fd *fp, const char *fn, t_pool *pool,
+		   pileup_seq_init_func *seq_init,
+		   pileup_seq_add_func *seq_add,
+		   pileup_cd_init_func *cd_init,
+		   pileup_cd_free_func *cd_free,
+		   void *arg, FILE *out);
+
+/*! Indices into pileup_count_t count[] */
+enum pileup_count_base {
+    PILEUP_A, PILEUP_C, PILEUP_G, PILEUP_T,
+    PILEUP_N,   /*!< any other base call */
+    PILEUP_DEL, /*!< deletion */
+    PILEUP_NBASE
+};
+
+/*! The summary of a single reference position */
+typedef struct {
+    int ref_id;
+    int pos;                 // 1-based reference position
+    char ref_base;           // reference base, or 'N' if not known
+    int depth;               // sequences covering pos, including deletions
+    int count[PILEUP_NBASE]; // base calls at pos, summing to depth
+    int ins;                 // sequences with an insertion following pos
+} pileup_count_t;
+
+/*! Called once per covered reference position by pileup_count_loop().
+ *
+ * @return
+ * Returns 0 on success;
+ *        any other value to abort the pileup with an error.
+ */
+typedef int pileup_count_func(void *client_data, scram_fd *fp,
+			      pileup_count_t *c);
+
+/*! Reports the depth and base counts at each covered position of fp.
+ *
+ * Positions within a reference skip (CIGAR N) are not covered.  Inserted
+ * bases are not counted, other than in ins.
+ *
+ * For CRAM the file's required fields are replaced by those needed here
+ * and ref_base is taken from the reference the data was encoded against,
+ * either external or embedded in the slices.  Where the data was encoded
+ * without a reference, or the reference cannot be loaded, ref_base is 'N'
+ * and any bases stored only as matching the reference are counted as N.
+ * Sequences are only rebuilt from the reference where needed to verify
+ * slice checksums, so this is faster with CRAM_OPT_IGNORE_CHKSUM set.
+ * Other formats use pileup_loop(), with ref_base always 'N'.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int pileup_count_loop(scram_fd *fp, pileup_count_func *func,
+		      void *client_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SCRAM_PILEUP_H_ */
@@ -89,6 +89,144 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
 }
 #endif
 
+/*
+ * Atomic fetch-and-add, returning the old value, and a full memory
+ * barrier.  The fetch-and-add is also a full barrier, which the
+ * work-stealing scheduler and results ring rely on.
+ */
+#ifdef _MSC_VER
+#define t_pool_fetch_add(v,n) InterlockedExchangeAdd((volatile LONG *)(v),(n))
+#define t_pool_barrier() MemoryBarrier()
+#else
+#define t_pool_fetch_add(v,n) __sync_fetch_and_add((v),(n))
+#define t_pool_barrier() __sync_synchronize()
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Statistics gathering, enabled by t_pool_stats_enable().
+ *
+ * Callers check p->stats is set before calling these, so the only cost
+ * when disabled is that test.  The statistics are guarded by stats_m,
+ * which is always the innermost lock held.
+ */
+
+static volatile int t_results_queue_next_id = 0;
+
+/* Returns the current time in microseconds */
+static long long t_pool_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/*
+ * Finds the statistics for results queue q, adding them if new.  The
+ * caller must hold stats_m.
+ *
+ * Returns the queue stats on success;
+ *         NULL if too many queues are in use
+ */
+static t_pool_queue_stats *t_pool_stats_queue(t_pool_stats *s,
+					      t_results_queue *q) {
+    int i;
+
+    for (i = 0; i < s->nqueue; i++)
+	if (s->queue[i].id == q->id)
+	    return &s->queue[i];
+
+    if (s->nqueue == T_POOL_MAX_QUEUE)
+	return NULL;
+
+    memset(&s->queue[i], 0, sizeof(s->queue[i]));
+    s->queue[i].id = q->id;
+    s->queue[i].name = q->name;
+    s->nqueue++;
+
+    return &s->queue[i];
+}
+
+/* Records a job dispatched to q, with the pool queue now at depth */
+static void t_pool_stats_dispatch(t_pool *p, t_results_queue *q, int depth) {
+    t_pool_stats *s = p->stats;
+    t_pool_queue_stats *qs;
+
+    pthread_mutex_lock(&p->stats_m);
+    s->ndispatch++;
+    s->depth_sum += depth;
+    if (s->depth_max < depth)
+	s->depth_max = depth;
+    s->depth_hist[depth < T_POOL_DEPTH_HIST ? depth : T_POOL_DEPTH_HIST-1]++;
+    if (q && (qs = t_pool_stats_queue(s, q)))
+	qs->ndispatch++;
+    pthread_mutex_unlock(&p->stats_m);
+}
+
+/* Records a dispatch that blocked from time 'start' until now */
+static void t_pool_stats_blocked(t_pool *p, long long start) {
+    long long t = t_pool_now();
+
+    pthread_mutex_lock(&p->stats_m);
+    p->stats->nblocked++;
+    p->stats->blocked_us += t - start;
+    pthread_mutex_unlock(&p->stats_m);
+}
+
+/* Records a worker that was idle from time 'start' until now */
+static void t_pool_stats_idle(t_pool *p, long long start) {
+    long long t = t_pool_now();
+
+    pthread_mutex_lock(&p->stats_m);
+    p->stats->nidle++;
+    p->stats->idle_us += t - start;
+    pthread_mutex_unlock(&p->stats_m);
+}
+
+/* Records job j taking 'us' microseconds to execute */
+static void t_pool_stats_job(t_pool *p, t_pool_job *j, long long us) {
+    t_pool_stats *s = p->stats;
+    int i, b;
+
+    for (b = 0; b < T_POOL_HIST-1 && us >= (1LL << b); b++)
+	;
+
+    pthread_mutex_lock(&p->stats_m);
+    for (i = 0; i < s->nfunc; i++)
+	if (s->func[i].func == j->func)
+	    break;
+    if (i == s->nfunc && i < T_POOL_MAX_FUNC) {
+	memset(&s->func[i], 0, sizeof(s->func[i]));
+	s->func[i].func = j->func;
+	s->func[i].name = j->q ? j->q->name : NULL;
+	s->nfunc++;
+    }
+    if (i < s->nfunc) {
+	s->func[i].njobs++;
+	s->func[i].time_us += us;
+	s->func[i].hist[b]++;
+    }
+    pthread_mutex_unlock(&p->stats_m);
+}
+
+/*
+ * Records a result consumed from q.  If non-zero, 'start' is the time
+ * the consumer started waiting for it.
+ */
+static void t_pool_stats_result(t_results_queue *q, long long start) {
+    t_pool *p = q->p;
+    t_pool_queue_stats *qs;
+    long long t = start ? t_pool_now() : 0;
+
+    pthread_mutex_lock(&p->stats_m);
+    if ((qs = t_pool_stats_queue(p->stats, q))) {
+	qs->nresults++;
+	if (start) {
+	    qs->nwait++;
+	    qs->wait_us += t - start;
+	}
+    }
+    pthread_mutex_unlock(&p->stats_m);
+}
+
 /* ----------------------------------------------------------------------------
  * A queue to hold results from the thread pool.
  *
@@ -108,6 +246,7 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
 static int t_pool_add_result(t_pool_job *j, void *data) {
     t_results_queue *q = j->q;
     t_pool_result *r;
+    int pending;
 
 #ifdef DEBUG
     fprintf(stderr, "%d: Adding resulting to queue %p, serial %d\n",
@@ -125,6 +264,28 @@ static int t_pool_add_result(t_pool_job *j, void *data) {
     r->data = data;
     r->serial = j->serial;
 
+    /*
+     * If the consumer has taken serial - ring_sz then its slot is free.
+     * next_serial may be stale, but only ever lower than the truth, in
+     * which case we just use the overflow list unnecessarily.
+     */
+    if ((unsigned)(r->serial - q->next_serial) < (unsigned)q->ring_sz) {
+	t_pool_barrier(); // r is complete before being published
+	q->ring[r->serial & (q->ring_sz-1)] = r;
+	t_pool_fetch_add(&q->queue_len, 1);
+	pending = t_pool_fetch_add(&q->pending, -1);
+
+	// Paired with the consumer setting waiting before rechecking, and
+	// likewise for a dispatcher blocked on the pending job limit.
+	if (q->waiting || (q->space_waiting && pending <= q->max_pending)) {
+	    pthread_mutex_lock(&q->result_m);
+	    pthread_cond_signal(&q->result_avail_c);
+	    pthread_cond_broadcast(&q->space_c);
+	    pthread_mutex_unlock(&q->result_m);
+	}
+	return 0;
+    }
+
     pthread_mutex_lock(&q->result_m);
     if (q->result_tail) {
 	q->result_tail->next = r;
@@ -132,8 +293,11 @@ static int t_pool_add_result(t_pool_job *j, void *data) {
     } else {
 	q->result_head = q->result_tail = r;
     }
-    q->queue_len++;
-    q->pending--;
+    t_pool_fetch_add(&q->n_overflow, 1);
+    t_pool_fetch_add(&q->queue_len, 1);
+    if (t_pool_fetch_add(&q->pending, -1) <= q->max_pending &&
+	q->space_waiting)
+	pthread_cond_broadcast(&q->space_c);
 
 #ifdef DEBUG
     fprintf(stderr, "%d: Broadcasting result_avail (id %d)\n",
@@ -149,7 +313,7 @@ static int t_pool_add_result(t_pool_job *j, void *data) {
     return 0;
 }
 
-/* Core of t_pool_next_result() */
+/* Searches the overflow list for the next result; result_m must be held */
 static t_pool_result *t_pool_next_result_locked(t_results_queue *q) {
     t_pool_result *r, *last;
 
@@ -170,8 +334,36 @@ static t_pool_result *t_pool_next_result_locked(t_results_queue *q) {
 	if (!q->result_head)
 	    q->result_tail = NULL;
 
+	t_pool_fetch_add(&q->n_overflow, -1);
+    }
+
+    return r;
+}
+
+/*
+ * Core of t_pool_next_result().  The ring slot is read without locking;
+ * the overflow list is only checked (under result_m unless 'locked')
+ * when non-empty.
+ */
+static t_pool_result *t_pool_next_result_(t_results_queue *q, int locked) {
+    t_pool_result * volatile *slot = &q->ring[q->next_serial & (q->ring_sz-1)];
+    t_pool_result *r;
+
+    if ((r = *slot)) {
+	*slot = NULL;
+    } else if (q->n_overflow) {
+	if (!locked)
+	    pthread_mutex_lock(&q->result_m);
+	r = t_pool_next_result_locked(q);
+	if (!locked)
+	    pthread_mutex_unlock(&q->result_m);
+    }
+
+    if (r) {
+	// Slot is cleared before producers may see the new next_serial.
+	t_pool_barrier();
 	q->next_serial++;
-	q->queue_len--;
+	t_pool_fetch_add(&q->queue_len, -1);
     }
 
     return r;
@@ -194,9 +386,9 @@ t_pool_result *t_pool_next_result(t_results_queue *q) {
     fprintf(stderr, "Requesting next result on queue %p\n", q);
 #endif
 
-    pthread_mutex_lock(&q->result_m);
-    r = t_pool_next_result_locked(q);
-    pthread_mutex_unlock(&q->result_m);
+    r = t_pool_next_result_(q, 0);
+    if (r && q->p && q->p->stats)
+	t_pool_stats_result(q, 0);
 
 #ifdef DEBUG
     fprintf(stderr, "(q=%p) Found %p\n", q, r);
@@ -207,14 +399,24 @@ t_pool_result *t_pool_next_result(t_results_queue *q) {
 
 t_pool_result *t_pool_next_result_wait(t_results_queue *q) {
     t_pool_result *r;
+    long long start;
 
 #ifdef DEBUG
     fprintf(stderr, "Waiting for result %d...\n", q->next_serial);
 #endif
 
+    if ((r = t_pool_next_result_(q, 0))) {
+	if (q->p && q->p->stats)
+	    t_pool_stats_result(q, 0);
+	return r;
+    }
+
+    start = q->p && q->p->stats ? t_pool_now() : 0;
     pthread_mutex_lock(&q->result_m);
-    while (!(r = t_pool_next_result_locked(q))) {
-	/* Possible race here now avoided via _locked() call, but incase... */
+    q->waiting = 1;
+    t_pool_barrier();
+    while (!(r = t_pool_next_result_(q, 1))) {
+	/* Possible race here now avoided via waiting flag, but incase... */
 	struct timeval now;
 	struct timespec timeout;
 
@@ -224,8 +426,12 @@ t_pool_result *t_pool_next_result_wait(t_results_queue *q) {
 
 	pthread_cond_timedwait(&q->result_avail_c, &q->result_m, &timeout);
     }
+    q->waiting = 0;
     pthread_mutex_unlock(&q->result_m);
 
+    if (start)
+	t_pool_stats_result(q, start);
+
     return r;
 }
 
@@ -234,13 +440,8 @@ t_pool_result *t_pool_next_result_wait(t_results_queue *q) {
  * also none still pending.
  */
 int t_pool_results_queue_empty(t_results_queue *q) {
-    int empty;
-
-    pthread_mutex_lock(&q->result_m);
-    empty = q->queue_len == 0 && q->pending == 0;
-    pthread_mutex_unlock(&q->result_m);
-
-    return empty;
+    // Producers increment queue_len before decrementing pending.
+    return q->pending == 0 && q->queue_len == 0;
 }
 
 
@@ -248,23 +449,11 @@ int t_pool_results_queue_empty(t_results_queue *q) {
  * Returns the number of completed jobs on the results queue.
  */
 int t_pool_results_queue_len(t_results_queue *q) {
-    int len;
-
-    pthread_mutex_lock(&q->result_m);
-    len = q->queue_len;
-    pthread_mutex_unlock(&q->result_m);
-
-    return len;
+    return q->queue_len;
 }
 
 int t_pool_results_queue_sz(t_results_queue *q) {
-    int len;
-
-    pthread_mutex_lock(&q->result_m);
-    len = q->queue_len + q->pending;
-    pthread_mutex_unlock(&q->result_m);
-
-    return len;
+    return q->queue_len + q->pending;
 }
 
 /*
@@ -288,10 +477,34 @@ void t_pool_delete_result(t_pool_result *r, int free_data) {
  *         NULL on failure
  */
 t_results_queue *t_results_queue_init(void) {
+    return t_results_queue_init2(T_RESULTS_RING);
+}
+
+/*
+ * As above, but with a ring of ring_sz in-order slots (rounded up to a
+ * power of 2).
+ *
+ * Results queue pointer on success;
+ *         NULL on failure
+ */
+t_results_queue *t_results_queue_init2(int ring_sz) {
     t_results_queue *q = malloc(sizeof(*q));
+    int sz = 1;
+
+    if (!q)
+	return NULL;
+
+    while (sz < ring_sz)
+	sz *= 2;
+    if (!(q->ring = calloc(sz, sizeof(*q->ring)))) {
+	free(q);
+	return NULL;
+    }
+    q->ring_sz = sz;
 
     pthread_mutex_init(&q->result_m, NULL);
     pthread_cond_init(&q->result_avail_c, NULL);
+    pthread_cond_init(&q->space_c, NULL);
 
     q->result_head = NULL;
     q->result_tail = NULL;
@@ -299,10 +512,130 @@ t_results_queue *t_results_queue_init(void) {
     q->curr_serial = 0;
     q->queue_len   = 0;
     q->pending     = 0;
+    q->n_overflow  = 0;
+    q->waiting     = 0;
+    q->priority    = 0;
+    q->max_pending = 0;
+    q->space_waiting = 0;
+    q->id          = t_pool_fetch_add(&t_results_queue_next_id, 1);
+    q->name        = NULL;
+    q->p           = NULL;
+    q->next_q      = NULL;
+    q->shutdown    = 0;
 
     return q;
 }
 
+/*
+ * Names a results queue, for use in the pool statistics.
+ */
+void t_results_queue_set_name(t_results_queue *q, const char *name) {
+    q->name = name;
+}
+
+/*
+ * Sets the scheduling priority for jobs dispatched to this queue.
+ * Higher values run first.
+ */
+void t_results_queue_set_priority(t_results_queue *q, int priority) {
+    q->priority = priority;
+}
+
+/*
+ * Limits the number of jobs for this queue that may be waiting in the
+ * pool or running at any one time.  0 means no limit.
+ */
+void t_results_queue_set_limit(t_results_queue *q, int max_pending) {
+    q->max_pending = max_pending > 0 ? max_pending : 0;
+}
+
+/* Removes q from its pool's list of queues.  Called with pool_m held. */
+static void t_results_queue_unlink(t_results_queue *q) {
+    t_results_queue **qp;
+
+    for (qp = &q->p->queues; *qp; qp = &(*qp)->next_q) {
+	if (*qp == q) {
+	    *qp = q->next_q;
+	    break;
+	}
+    }
+    q->next_q = NULL;
+    q->p = NULL;
+}
+
+/*
+ * Records that q is being dispatched to p, so the consumer can find
+ * the pool statistics and t_pool_destroy can wake blocked dispatchers.
+ */
+static void t_results_queue_attach(t_pool *p, t_results_queue *q) {
+    t_pool *old = q->p;
+
+    if (old && old != p) {
+	pthread_mutex_lock(&old->pool_m);
+	if (q->p == old)
+	    t_results_queue_unlink(q);
+	pthread_mutex_unlock(&old->pool_m);
+    }
+
+    pthread_mutex_lock(&p->pool_m);
+    if (q->p != p) {
+	q->p = p;
+	q->next_q = p->queues;
+	p->queues = q;
+	q->shutdown = 0;
+    }
+    pthread_mutex_unlock(&p->pool_m);
+}
+
+/*
+ * Waits until q has fewer than max_pending jobs outstanding.  The
+ * nonblock argument is as per t_pool_dispatch2.  This must be called
+ * without holding the pool mutex, as workers need it to make progress.
+ *
+ * Returns 0 on success
+ *        -1 with errno EAGAIN if q is full and nonblock is 1
+ *        -1 with errno EPIPE if the pool is destroyed while waiting
+ */
+static int t_results_queue_wait_space(t_pool *p, t_results_queue *q,
+				      int nonblock) {
+    long long start;
+    int shutdown;
+
+    if (q && q->p != p)
+	t_results_queue_attach(p, q);
+
+    if (!q || !q->max_pending || nonblock == -1 ||
+	q->pending < q->max_pending)
+	return 0;
+
+    if (nonblock == 1) {
+	errno = EAGAIN;
+	return -1;
+    }
+
+    start = p->stats ? t_pool_now() : 0;
+    pthread_mutex_lock(&q->result_m);
+    // Paired with t_pool_add_result decrementing pending before checking
+    // space_waiting; one of the two is guaranteed to see the other.
+    t_pool_fetch_add(&q->space_waiting, 1);
+    while (q->pending >= q->max_pending && !q->shutdown)
+	pthread_cond_wait(&q->space_c, &q->result_m);
+    t_pool_fetch_add(&q->space_waiting, -1);
+    shutdown = q->shutdown;
+    pthread_mutex_unlock(&q->result_m);
+
+    // p may already have been freed, so it must not be touched.
+    if (shutdown) {
+	errno = EPIPE;
+	return -1;
+    }
+
+    if (start)
+	t_pool_stats_blocked(p, start);
+
+    return 0;
+}
+
 /* Deallocates memory for a results queue */
 void t_results_queue_destroy(t_results_queue *q) {
 #ifdef DEBUG
@@ -312,8 +645,17 @@ void t_results_queue_destroy(t_results_queue *q) {
     if (!q)
 	return;
 
+    if (q->p) {
+	t_pool *p = q->p;
+	pthread_mutex_lock(&p->pool_m);
+	t_results_queue_unlink(q);
+	pthread_mutex_unlock(&p->pool_m);
+    }
+
     pthread_mutex_destroy(&q->result_m);
     pthread_cond_destroy(&q->result_avail_c);
+    pthread_cond_destroy(&q->space_c);
+    free((void *)q->ring);
 
     memset(q, 0xbb, sizeof(*q));
     free(q);
@@ -329,6 +671,74 @@ void t_results_queue_destroy(t_results_queue *q) {
 
 #define TDIFF(t2,t1) ((t2.tv_sec-t1.tv_sec)*1000000 + t2.tv_usec-t1.tv_usec)
 
+/*
+ * Adds job j to the job list *head..*tail, which is kept in priority
+ * order.  Equal priority jobs run first come first served.  A higher
+ * priority job is placed ahead of lower priority ones, but never ahead
+ * of a job that has already been overtaken T_POOL_MAX_OVERTAKE times,
+ * so low priority work still progresses under a steady stream of high
+ * priority jobs.  The caller must hold the lock guarding the list.
+ */
+static void t_pool_enqueue(t_pool_job **head, t_pool_job **tail,
+			   t_pool_job *j) {
+    t_pool_job *x, *ins;
+
+    j->next = NULL;
+    j->overtaken = 0;
+
+    // The common case: same priority as everything else.
+    if (!*tail || (*tail)->priority >= j->priority) {
+	if (*tail)
+	    (*tail)->next = j;
+	else
+	    *head = j;
+	*tail = j;
+	return;
+    }
+
+    // Find the last job we may not overtake.
+    for (ins = NULL, x = *head; x; x = x->next)
+	if (x->priority >= j->priority ||
+	    x->overtaken >= T_POOL_MAX_OVERTAKE)
+	    ins = x;
+
+    if (ins == *tail) {
+	(*tail)->next = j;
+	*tail = j;
+	return;
+    }
+
+    for (x = ins ? ins->next : *head; x; x = x->next)
+	x->overtaken++;
+
+    if (ins) {
+	j->next = ins->next;
+	ins->next = j;
+    } else {
+	j->next = *head;
+	*head = j;
+    }
+}
+
+
+/*
+ * Executes job j and queues its result, timing it if gathering stats.
+ */
+static void t_pool_run_job(t_pool *p, t_pool_job *j) {
+    long long start;
+    void *r;
+
+    if (!p->stats) {
+	t_pool_add_result(j, j->func(j->arg));
+	return;
+    }
+
+    start = t_pool_now();
+    r = j->func(j->arg);
+    t_pool_stats_job(p, j, t_pool_now() - start);
+    t_pool_add_result(j, r);
+}
+
 /*
  * A worker thread.
  *
@@ -340,6 +750,7 @@ static void *t_pool_worker(void *arg) {
     t_pool_worker_t *w = (t_pool_worker_t *)arg;
     t_pool *p = w->p;
     t_pool_job *j;
+    long long idle;
 #ifdef DEBUG_TIME
     struct timeval t1, t2, t3;
 #endif
@@ -366,6 +777,7 @@ static void *t_pool_worker(void *arg) {
 //	    pthread_mutex_lock(&p->pool_m);
 //	}
 
+	idle = p->stats && !p->head && !p->shutdown ? t_pool_now() : 0;
 	while (!p->head && !p->shutdown) {
 	    p->nwaiting++;
 
@@ -406,6 +818,8 @@ static void *t_pool_worker(void *arg) {
 #endif
 	    p->nwaiting--;
 	}
+	if (idle)
+	    t_pool_stats_idle(p, idle);
 
 	if (p->shutdown) {
 #ifdef DEBUG_TIME
@@ -431,7 +845,7 @@ static void *t_pool_worker(void *arg) {
 	pthread_mutex_unlock(&p->pool_m);
 	    
 	// We have job 'j' - now execute it.
-	t_pool_add_result(j, j->func(j->arg));	
+	t_pool_run_job(p, j);
 #ifdef DEBUG_TIME
 	pthread_mutex_lock(&p->pool_m);
 	gettimeofday(&t3, NULL);
@@ -445,6 +859,196 @@ static void *t_pool_worker(void *arg) {
     return NULL;
 }
 
+/* ----------------------------------------------------------------------------
+ * The work-stealing scheduler (T_POOL_STEALING).
+ *
+ * Each worker has its own job queue with its own mutex.  Dispatching
+ * appends to the queues in turn, and a worker takes jobs from the front
+ * of its own queue, or failing that from the front of the other queues.
+ * Taking the oldest job rather than the newest keeps results arriving
+ * roughly in order, which matters as results queues are strictly ordered.
+ *
+ * p->njobs and p->nwaiting are maintained with atomic operations so the
+ * pool mutex is only taken when a worker needs to sleep or wake, or
+ * when the dispatcher must block on a full queue.
+ */
+
+/*
+ * Allocates a job and assigns it the next serial number on q.
+ *
+ * Returns job on success;
+ *         NULL on failure
+ */
+static t_pool_job *t_pool_ws_job(t_pool *p, t_results_queue *q,
+				 void *(*func)(void *arg), void *arg) {
+    t_pool_job *j = malloc(sizeof(*j));
+
+    if (!j)
+	return NULL;
+    j->func = func;
+    j->arg = arg;
+    j->next = NULL;
+    j->p = p;
+    j->q = q;
+    j->priority = q ? q->priority : 0;
+    j->overtaken = 0;
+    if (q) {
+	pthread_mutex_lock(&q->result_m);
+	j->serial = q->curr_serial++;
+	t_pool_fetch_add(&q->pending, 1);
+	pthread_mutex_unlock(&q->result_m);
+    } else {
+	j->serial = 0;
+    }
+
+    return j;
+}
+
+/* Adds j to queue wq, in priority order */
+static void t_pool_wq_push(t_pool_wqueue *wq, t_pool_job *j) {
+    pthread_mutex_lock(&wq->m);
+    t_pool_enqueue(&wq->head, &wq->tail, j);
+    wq->n++;
+    pthread_mutex_unlock(&wq->m);
+}
+
+/* Removes the first job from queue wq, or returns NULL if empty */
+static t_pool_job *t_pool_wq_pop(t_pool_wqueue *wq) {
+    t_pool_job *j;
+
+    // Unlocked check to avoid needless contention on empty queues.
+    if (!wq->n)
+	return NULL;
+
+    pthread_mutex_lock(&wq->m);
+    if ((j = wq->head)) {
+	if (!(wq->head = j->next))
+	    wq->tail = NULL;
+	wq->n--;
+    }
+    pthread_mutex_unlock(&wq->m);
+
+    return j;
+}
+
+/*
+ * Finds a job for worker w, first from its own queue and then by
+ * stealing from the others.
+ */
+static t_pool_job *t_pool_ws_find_job(t_pool_worker_t *w) {
+    t_pool *p = w->p;
+    t_pool_job *j;
+    int i;
+
+    if ((j = t_pool_wq_pop(&p->wq[w->idx])))
+	return j;
+
+    for (i = 1; i < p->tsize; i++)
+	if ((j = t_pool_wq_pop(&p->wq[(w->idx + i) % p->tsize])))
+	    return j;
+
+    return NULL;
+}
+
+static void *t_pool_ws_worker(void *arg) {
+    t_pool_worker_t *w = (t_pool_worker_t *)arg;
+    t_pool *p = w->p;
+    t_pool_job *j;
+
+    for (;;) {
+	if (!(j = t_pool_ws_find_job(w))) {
+	    // Nothing to do, so sleep until a job is dispatched.
+	    long long idle = p->stats ? t_pool_now() : 0;
+	    pthread_mutex_lock(&p->pool_m);
+	    t_pool_fetch_add(&p->nwaiting, 1);
+	    while (!p->shutdown && p->njobs <= 0) {
+		pthread_cond_signal(&p->empty_c);
+		pthread_cond_wait(&p->pending_c, &p->pool_m);
+	    }
+	    t_pool_fetch_add(&p->nwaiting, -1);
+
+	    if (p->shutdown) {
+		pthread_mutex_unlock(&p->pool_m);
+		pthread_exit(NULL);
+	    }
+	    pthread_mutex_unlock(&p->pool_m);
+
+	    if (idle)
+		t_pool_stats_idle(p, idle);
+
+	    continue;
+	}
+
+	// Wake any dispatcher blocked on a full queue.
+	if (t_pool_fetch_add(&p->njobs, -1) >= p->qsize) {
+	    pthread_mutex_lock(&p->pool_m);
+	    pthread_cond_broadcast(&p->full_c);
+	    pthread_mutex_unlock(&p->pool_m);
+	}
+
+	t_pool_run_job(p, j);
+	memset(j, 0xbb, sizeof(*j));
+	free(j);
+    }
+
+    return NULL;
+}
+
+/*
+ * Adds a job to one of the per-worker queues.  The nonblock argument
+ * is as per t_pool_dispatch2.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int t_pool_ws_dispatch(t_pool *p, t_results_queue *q,
+			      void *(*func)(void *arg), void *arg,
+			      int nonblock) {
+    t_pool_job *j;
+
+    if (-1 == t_results_queue_wait_space(p, q, nonblock))
+	return -1;
+
+    if (nonblock == 1 && p->njobs >= p->qsize) {
+	errno = EAGAIN;
+	return -1;
+    }
+
+    if (!(j = t_pool_ws_job(p, q, func, arg)))
+	return -1;
+
+    if (nonblock == 0 && p->njobs >= p->qsize) {
+	long long start = p->stats ? t_pool_now() : 0;
+	pthread_mutex_lock(&p->pool_m);
+	while (p->njobs >= p->qsize && !p->shutdown)
+	    pthread_cond_wait(&p->full_c, &p->pool_m);
+	pthread_mutex_unlock(&p->pool_m);
+	if (start)
+	    t_pool_stats_blocked(p, start);
+    }
+
+    // Push before counting it, so a worker seeing njobs > 0 can
+    // normally find the job.  Workers may briefly take njobs negative.
+    t_pool_wq_push(&p->wq[t_pool_fetch_add(&p->next_wq, 1) % p->tsize], j);
+    t_pool_fetch_add(&p->njobs, 1);
+    if (p->stats)
+	t_pool_stats_dispatch(p, q, p->njobs);
+
+    // Paired with the worker incrementing nwaiting before checking
+    // njobs; one of the two is guaranteed to see the other.
+    //
+    // As with the shared scheduler, only wake a thread if there are
+    // more jobs queued than running workers to take them.  Running
+    // workers scan every queue before sleeping.
+    if (p->nwaiting && p->njobs > p->tsize - p->nwaiting) {
+	pthread_mutex_lock(&p->pool_m);
+	pthread_cond_signal(&p->pending_c);
+	pthread_mutex_unlock(&p->pool_m);
+    }
+
+    return 0;
+}
+
 /*
  * Creates a worker pool of length qsize with tsize worker threads.
  *
@@ -452,6 +1056,16 @@ static void *t_pool_worker(void *arg) {
  *         NULL on failure
  */
 t_pool *t_pool_init(int qsize, int tsize) {
+    return t_pool_init_sched(qsize, tsize, T_POOL_SHARED);
+}
+
+/*
+ * As t_pool_init, but also specifying the job scheduler to use.
+ *
+ * Returns pool pointer on success;
+ *         NULL on failure
+ */
+t_pool *t_pool_init_sched(int qsize, int tsize, enum t_pool_sched sched) {
     int i;
     t_pool *p = malloc(sizeof(*p));
     p->qsize = qsize;
@@ -459,8 +1073,14 @@ t_pool *t_pool_init(int qsize, int tsize) {
     p->njobs = 0;
     p->nwaiting = 0;
     p->shutdown = 0;
+    p->sched = sched;
     p->head = p->tail = NULL;
     p->t_stack = NULL;
+    p->queues = NULL;
+    p->wq = NULL;
+    p->next_wq = 0;
+    p->stats = NULL;
+    pthread_mutex_init(&p->stats_m, NULL);
 #ifdef DEBUG_TIME
     p->total_time = p->wait_time = 0;
 #endif
@@ -473,6 +1093,35 @@ t_pool *t_pool_init(int qsize, int tsize) {
 
     pthread_mutex_lock(&p->pool_m);
 
+    if (sched == T_POOL_STEALING) {
+	pthread_attr_t attr;
+	if (pthread_attr_init(&attr) < 0)
+	    return NULL;
+	pthread_attr_setstacksize(&attr, 4*1024*1024);
+
+	pthread_cond_init(&p->pending_c, NULL);
+	if (!(p->wq = calloc(tsize, sizeof(*p->wq))))
+	    return NULL;
+
+	for (i = 0; i < tsize; i++) {
+	    t_pool_worker_t *w = &p->t[i];
+	    pthread_mutex_init(&p->wq[i].m, NULL);
+	    w->p = p;
+	    w->idx = i;
+	    w->wait_time = 0;
+	    pthread_cond_init(&w->pending_c, NULL);
+	}
+	// Start threads only once all queues exist, as they steal.
+	for (i = 0; i < tsize; i++)
+	    if (0 != pthread_create(&p->t[i].tid, &attr, t_pool_ws_worker,
+				    &p->t[i]))
+		return NULL;
+	pthread_attr_destroy(&attr);
+	pthread_mutex_unlock(&p->pool_m);
+
+	return p;
+    }
+
 #ifdef IN_ORDER
     // rANS needs ~3Mb unless we rewrite to use malloc.
     pthread_attr_t attr;
@@ -527,7 +1176,15 @@ t_pool *t_pool_init(int qsize, int tsize) {
  */
 int t_pool_dispatch(t_pool *p, t_results_queue *q,
 		    void *(*func)(void *arg), void *arg) {
-    t_pool_job *j = malloc(sizeof(*j));
+    t_pool_job *j;
+
+    if (p->sched == T_POOL_STEALING)
+	return t_pool_ws_dispatch(p, q, func, arg, 0);
+
+    if (-1 == t_results_queue_wait_space(p, q, 0))
+	return -1;
+
+    j = malloc(sizeof(*j));
 
     if (!j)
 	return -1;
@@ -536,10 +1193,12 @@ int t_pool_dispatch(t_pool *p, t_results_queue *q,
     j->next = NULL;
     j->p = p;
     j->q = q;
+    j->priority = q ? q->priority : 0;
+    j->overtaken = 0;
     if (q) {
 	pthread_mutex_lock(&q->result_m);
 	j->serial = q->curr_serial++;
-	q->pending++;
+	t_pool_fetch_add(&q->pending, 1);
 	pthread_mutex_unlock(&q->result_m);
     } else {
 	j->serial = 0;
@@ -552,17 +1211,19 @@ int t_pool_dispatch(t_pool *p, t_results_queue *q,
     pthread_mutex_lock(&p->pool_m);
 
     // Check if queue is full
-    while (p->njobs >= p->qsize)
-	pthread_cond_wait(&p->full_c, &p->pool_m);
+    if (p->njobs >= p->qsize) {
+	long long start = p->stats ? t_pool_now() : 0;
+	while (p->njobs >= p->qsize)
+	    pthread_cond_wait(&p->full_c, &p->pool_m);
+	if (start)
+	    t_pool_stats_blocked(p, start);
+    }
 
     p->njobs++;
+    if (p->stats)
+	t_pool_stats_dispatch(p, q, p->njobs);
 
-    if (p->tail) {
-	p->tail->next = j;
-	p->tail = j;
-    } else {
-	p->head = p->tail = j;
-    }
+    t_pool_enqueue(&p->head, &p->tail, j);
 
     // Let a worker know we have data.
 #ifdef IN_ORDER
@@ -591,6 +1252,12 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
 		     void *(*func)(void *arg), void *arg, int nonblock) {
     t_pool_job *j;
 
+    if (p->sched == T_POOL_STEALING)
+	return t_pool_ws_dispatch(p, q, func, arg, nonblock);
+
+    if (-1 == t_results_queue_wait_space(p, q, nonblock))
+	return -1;
+
 #ifdef DEBUG
     fprintf(stderr, "Dispatching job for queue %p, serial %d\n", q, q->curr_serial);
 #endif
@@ -610,6 +1277,8 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
     j->next = NULL;
     j->p = p;
     j->q = q;
+    j->priority = q ? q->priority : 0;
+    j->overtaken = 0;
     if (q) {
 	pthread_mutex_lock(&q->result_m);
 	j->serial = q->curr_serial;
@@ -621,26 +1290,27 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
     if (q) {
 	pthread_mutex_lock(&q->result_m);
 	q->curr_serial++;
-	q->pending++;
+	t_pool_fetch_add(&q->pending, 1);
 	pthread_mutex_unlock(&q->result_m);
     }
 
     // Check if queue is full
-    if (nonblock == 0)
+    if (nonblock == 0 && p->njobs >= p->qsize) {
+	long long start = p->stats ? t_pool_now() : 0;
 	while (p->njobs >= p->qsize)
 	    pthread_cond_wait(&p->full_c, &p->pool_m);
+	if (start)
+	    t_pool_stats_blocked(p, start);
+    }
 
     p->njobs++;
+    if (p->stats)
+	t_pool_stats_dispatch(p, q, p->njobs);
     
 //    if (q->curr_serial % 100 == 0)
 //	fprintf(stderr, "p->njobs = %d    p->qsize = %d\n", p->njobs, p->qsize);
 
-    if (p->tail) {
-	p->tail->next = j;
-	p->tail = j;
-    } else {
-	p->head = p->tail = j;
-    }
+    t_pool_enqueue(&p->head, &p->tail, j);
 
 #ifdef DEBUG
     fprintf(stderr, "Dispatched (serial %d)\n", j->serial);
@@ -664,6 +1334,113 @@ int t_pool_dispatch2(t_pool *p, t_results_queue *q,
     return 0;
 }
 
+/*
+ * Shared state for t_pool_parallel_for.  Dispatched jobs may not start
+ * until after the caller has finished, so this is reference counted
+ * and freed by the last user.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int (*func)(void *arg, int i);
+    void *arg;
+    int n;
+    int next;     // next index to hand out
+    int running;  // calls in progress
+    int users;    // caller plus dispatched jobs
+    int err;
+} t_pool_for;
+
+/* Makes calls until there are none left */
+static void t_pool_for_run(t_pool_for *f) {
+    pthread_mutex_lock(&f->lock);
+    while (!f->err && f->next < f->n) {
+	int i = f->next++, err;
+
+	f->running++;
+	pthread_mutex_unlock(&f->lock);
+
+	err = f->func(f->arg, i) != 0;
+
+	pthread_mutex_lock(&f->lock);
+	f->err |= err;
+	if (--f->running == 0)
+	    pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void t_pool_for_release(t_pool_for *f) {
+    int last;
+
+    pthread_mutex_lock(&f->lock);
+    last = --f->users == 0;
+    pthread_mutex_unlock(&f->lock);
+
+    if (last) {
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+    }
+}
+
+static void *t_pool_for_job(void *arg) {
+    t_pool_for *f = (t_pool_for *)arg;
+
+    t_pool_for_run(f);
+    t_pool_for_release(f);
+
+    return NULL;
+}
+
+int t_pool_parallel_for(t_pool *p, int n, int njobs,
+			int (*func)(void *arg, int i), void *arg) {
+    t_pool_for *f;
+    int i, err;
+
+    if (!p || n <= 1 || njobs <= 0) {
+	for (i = 0; i < n; i++)
+	    if (func(arg, i) != 0)
+		return -1;
+	return 0;
+    }
+
+    if (!(f = malloc(sizeof(*f))))
+	return -1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->func = func;
+    f->arg = arg;
+    f->n = n;
+    f->next = 0;
+    f->running = 0;
+    f->users = 1;
+    f->err = 0;
+
+    if (njobs > n-1)
+	njobs = n-1;
+    while (njobs-- > 0) {
+	pthread_mutex_lock(&f->lock);
+	f->users++;
+	pthread_mutex_unlock(&f->lock);
+	if (t_pool_dispatch2(p, NULL, t_pool_for_job, f, 1) < 0) {
+	    t_pool_for_release(f);
+	    break;
+	}
+    }
+
+    t_pool_for_run(f);
+
+    pthread_mutex_lock(&f->lock);
+    while (f->running)
+	pthread_cond_wait(&f->cond, &f->lock);
+    err = f->err;
+    pthread_mutex_unlock(&f->lock);
+    t_pool_for_release(f);
+
+    return err ? -1 : 0;
+}
+
 /*
  * Flushes the pool, but doesn't exit. This simply drains the queue and
  * ensures all worker threads have finished their current task.
@@ -682,9 +1459,10 @@ int t_pool_flush(t_pool *p) {
     pthread_mutex_lock(&p->pool_m);
 
     // Wake up everything for the final sprint!
-    for (i = 0; i < p->tsize; i++)
-	if (p->t_stack[i])
-	    pthread_cond_signal(&p->t[i].pending_c);
+    if (p->t_stack)
+	for (i = 0; i < p->tsize; i++)
+	    if (p->t_stack[i])
+		pthread_cond_signal(&p->t[i].pending_c);
 
     while (p->njobs || p->nwaiting != p->tsize)
 	pthread_cond_wait(&p->empty_c, &p->pool_m);
@@ -708,12 +1486,28 @@ int t_pool_flush(t_pool *p) {
  * t_pool_destroy(p,1) to quickly exit after a fatal error.
  */
 void t_pool_destroy(t_pool *p, int kill) {
+    t_results_queue *q;
     int i;
     
 #ifdef DEBUG
     fprintf(stderr, "Destroying pool %p, kill=%d\n", p, kill);
 #endif
 
+    /*
+     * Detach the results queues, failing any dispatch blocked on a
+     * queue's pending job limit.  Those dispatchers only look at the
+     * queue once woken, so may safely return after p is freed.
+     */
+    pthread_mutex_lock(&p->pool_m);
+    while ((q = p->queues)) {
+	pthread_mutex_lock(&q->result_m);
+	t_results_queue_unlink(q);
+	q->shutdown = 1;
+	pthread_cond_broadcast(&q->space_c);
+	pthread_mutex_unlock(&q->result_m);
+    }
+    pthread_mutex_unlock(&p->pool_m);
+
     /* Send shutdown message to worker threads */
     if (!kill) {
 	pthread_mutex_lock(&p->pool_m);
@@ -723,12 +1517,17 @@ void t_pool_destroy(t_pool *p, int kill) {
 	fprintf(stderr, "Sending shutdown request\n");
 #endif
 
+	if (p->sched == T_POOL_STEALING) {
+	    pthread_cond_broadcast(&p->pending_c);
+	    pthread_cond_broadcast(&p->full_c);
+	} else {
 #ifdef IN_ORDER
-	for (i = 0; i < p->tsize; i++)
-	    pthread_cond_signal(&p->t[i].pending_c);
+	    for (i = 0; i < p->tsize; i++)
+		pthread_cond_signal(&p->t[i].pending_c);
 #else
-	pthread_cond_broadcast(&p->pending_c);
+	    pthread_cond_broadcast(&p->pending_c);
 #endif
+	}
 	pthread_mutex_unlock(&p->pool_m);
 
 #ifdef DEBUG
@@ -747,10 +1546,18 @@ void t_pool_destroy(t_pool *p, int kill) {
 #ifdef IN_ORDER
     for (i = 0; i < p->tsize; i++)
 	pthread_cond_destroy(&p->t[i].pending_c);
+    if (p->sched == T_POOL_STEALING)
+	pthread_cond_destroy(&p->pending_c);
 #else
     pthread_cond_destroy(&p->pending_c);
 #endif
 
+    if (p->wq) {
+	for (i = 0; i < p->tsize; i++)
+	    pthread_mutex_destroy(&p->wq[i].m);
+	free(p->wq);
+    }
+
 #ifdef DEBUG_TIME
     fprintf(stderr, "Total time=%f\n", p->total_time / 1000000.0);
     fprintf(stderr, "Wait  time=%f\n", p->wait_time  / 1000000.0);
@@ -764,6 +1571,10 @@ void t_pool_destroy(t_pool *p, int kill) {
     if (p->t_stack)
 	free(p->t_stack);
 
+    pthread_mutex_destroy(&p->stats_m);
+    if (p->stats)
+	free(p->stats);
+
     free(p->t);
     free(p);
 
@@ -772,6 +1583,140 @@ void t_pool_destroy(t_pool *p, int kill) {
 #endif
 }
 
+/*
+ * Starts gathering statistics on the pool.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int t_pool_stats_enable(t_pool *p) {
+    t_pool_stats *s;
+
+    if (p->stats)
+	return 0;
+
+    if (!(s = calloc(1, sizeof(*s))))
+	return -1;
+    gettimeofday(&s->start, NULL);
+
+    pthread_mutex_lock(&p->stats_m);
+    p->stats = s;
+    pthread_mutex_unlock(&p->stats_m);
+
+    return 0;
+}
+
+/*
+ * Copies a snapshot of the pool statistics into s.
+ *
+ * Returns 0 on success
+ *        -1 if statistics are not enabled
+ */
+int t_pool_stats_get(t_pool *p, t_pool_stats *s) {
+    if (!p->stats)
+	return -1;
+
+    pthread_mutex_lock(&p->stats_m);
+    *s = *p->stats;
+    pthread_mutex_unlock(&p->stats_m);
+
+    return 0;
+}
+
+/* Writes a JSON string, or null */
+static void t_pool_json_str(FILE *fp, const char *str) {
+    if (!str) {
+	fputs("null", fp);
+	return;
+    }
+
+    putc('"', fp);
+    for (; *str; str++) {
+	if (*str == '"' || *str == '\\')
+	    putc('\\', fp);
+	if ((unsigned char)*str >= ' ')
+	    putc(*str, fp);
+    }
+    putc('"', fp);
+}
+
+/* Writes the first n entries of a histogram as a JSON array */
+static void t_pool_json_hist(FILE *fp, long long *hist, int n) {
+    int i;
+
+    putc('[', fp);
+    for (i = 0; i < n; i++)
+	fprintf(fp, "%s%lld", i ? "," : "", hist[i]);
+    putc(']', fp);
+}
+
+/*
+ * Writes the pool statistics to fp as a JSON object.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int t_pool_stats_json(t_pool *p, FILE *fp) {
+    t_pool_stats s;
+    struct timeval now;
+    int i, n;
+
+    if (-1 == t_pool_stats_get(p, &s))
+	return -1;
+    gettimeofday(&now, NULL);
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"threads\": %d,\n", p->tsize);
+    fprintf(fp, "  \"queue_size\": %d,\n", p->qsize);
+    fprintf(fp, "  \"scheduler\": \"%s\",\n",
+	    p->sched == T_POOL_STEALING ? "stealing" : "shared");
+    fprintf(fp, "  \"elapsed_us\": %lld,\n",
+	    (long long)TDIFF(now, s.start));
+    fprintf(fp, "  \"worker_idle\": {\"count\": %lld, \"us\": %lld},\n",
+	    s.nidle, s.idle_us);
+    fprintf(fp, "  \"dispatch_blocked\": {\"count\": %lld, \"us\": %lld},\n",
+	    s.nblocked, s.blocked_us);
+
+    n = s.depth_max+1 < T_POOL_DEPTH_HIST ? s.depth_max+1 : T_POOL_DEPTH_HIST;
+    fprintf(fp, "  \"queue_depth\": {\"samples\": %lld, \"mean\": %.2f, "
+	    "\"max\": %d, \"hist\": ", s.ndispatch,
+	    s.ndispatch ? (double)s.depth_sum / s.ndispatch : 0.0, s.depth_max);
+    t_pool_json_hist(fp, s.depth_hist, s.ndispatch ? n : 0);
+    fprintf(fp, "},\n");
+
+    fprintf(fp, "  \"functions\": [");
+    for (i = 0; i < s.nfunc; i++) {
+	t_pool_func_stats *f = &s.func[i];
+	char addr[64];
+
+	for (n = T_POOL_HIST; n > 0 && !f->hist[n-1]; n--)
+	    ;
+	sprintf(addr, "%p", (void *)f->func);
+	fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+	t_pool_json_str(fp, f->name ? f->name : addr);
+	fprintf(fp, ", \"jobs\": %lld, \"us\": %lld, \"mean_us\": %.1f, "
+		"\"hist_log2_us\": ", f->njobs, f->time_us,
+		f->njobs ? (double)f->time_us / f->njobs : 0.0);
+	t_pool_json_hist(fp, f->hist, n);
+	putc('}', fp);
+    }
+    fprintf(fp, "%s],\n", s.nfunc ? "\n  " : "");
+
+    fprintf(fp, "  \"queues\": [");
+    for (i = 0; i < s.nqueue; i++) {
+	t_pool_queue_stats *q = &s.queue[i];
+
+	fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+	t_pool_json_str(fp, q->name);
+	fprintf(fp, ", \"dispatched\": %lld, \"consumed\": %lld, "
+		"\"waits\": %lld, \"wait_us\": %lld}",
+		q->ndispatch, q->nresults, q->nwait, q->wait_us);
+    }
+    fprintf(fp, "%s]\n}\n", s.nqueue ? "\n  " : "");
+
+    return ferror(fp) ? -1 : 0;
+}
+
 
 /*-----------------------------------------------------------------------------
  * Test app.
@@ -782,11 +1727,24 @@ void t_pool_destroy(t_pool *p, int kill) {
 #include <stdio.h>
 #include <math.h>
 
+/* Work per job in benchmark mode (-b), or 0 for the original demo */
+static int bench_work = 0;
+
 void *doit(void *arg) {
     int i, k, x = 0;
     int job = *(int *)arg;
     int *res;
 
+    if (bench_work) {
+	// Small CPU-bound jobs so scheduling overhead dominates.
+	for (i = 0; i < bench_work; i++)
+	    x = x * 1103515245 + 12345 + job;
+	free(arg);
+	res = malloc(sizeof(*res));
+	*res = x;
+	return res;
+    }
+
     printf("Worker: execute job %d\n", job);
 
     usleep(random() % 1000000); // to coerce job completion out of order
@@ -814,14 +1772,138 @@ void *doit(void *arg) {
     return res;
 }
 
+/*
+ * Dispatches njobs doit() jobs to a pool with nthreads using scheduler
+ * sched, consuming results as they arrive.  Returns elapsed seconds.
+ */
+static double bench(enum t_pool_sched sched, int nthreads, int njobs) {
+    t_pool *p = t_pool_init_sched(nthreads*2, nthreads, sched);
+    t_results_queue *q = t_results_queue_init();
+    struct timeval t1, t2;
+    t_pool_result *r;
+    int i;
+
+    gettimeofday(&t1, NULL);
+    for (i = 0; i < njobs; i++) {
+	int *ip = malloc(sizeof(*ip));
+	*ip = i;
+	t_pool_dispatch(p, q, doit, ip);
+	while ((r = t_pool_next_result(q)))
+	    t_pool_delete_result(r, 1);
+    }
+
+    t_pool_flush(p);
+    while ((r = t_pool_next_result(q)))
+	t_pool_delete_result(r, 1);
+    gettimeofday(&t2, NULL);
+
+    t_pool_destroy(p, 0);
+    t_results_queue_destroy(q);
+
+    return TDIFF(t2,t1) / 1000000.0;
+}
+
+/*
+ * A slice job in the style of cram_block_run() and
+ * cram_uncompress_blocks(): it runs from a worker and fans its blocks
+ * out over the same pool with t_pool_parallel_for().
+ */
+#define BENCH_BLOCKS 32
+
+typedef struct {
+    t_pool *p;
+    int job;
+    int x[BENCH_BLOCKS];
+} bench_slice;
+
+static int bench_block(void *arg, int i) {
+    bench_slice *s = (bench_slice *)arg;
+    int k, x = 0;
+
+    for (k = 0; k < bench_work; k++)
+	x = x * 1103515245 + 12345 + s->job + i;
+    s->x[i] = x;
+
+    return 0;
+}
+
+static void *bench_slice_job(void *arg) {
+    bench_slice *s = (bench_slice *)arg;
+
+    if (t_pool_parallel_for(s->p, BENCH_BLOCKS, s->p->tsize-1,
+			    bench_block, s) < 0)
+	fprintf(stderr, "t_pool_parallel_for failed\n");
+
+    return s;
+}
+
+/*
+ * As bench(), but each of the njobs/BENCH_BLOCKS jobs is a slice
+ * whose blocks are processed by t_pool_parallel_for().
+ */
+static double bench_for(enum t_pool_sched sched, int nthreads, int njobs) {
+    t_pool *p = t_pool_init_sched(nthreads*2, nthreads, sched);
+    t_results_queue *q = t_results_queue_init();
+    struct timeval t1, t2;
+    t_pool_result *r;
+    int i;
+
+    gettimeofday(&t1, NULL);
+    for (i = 0; i < njobs / BENCH_BLOCKS; i++) {
+	bench_slice *s = malloc(sizeof(*s));
+	s->p = p;
+	s->job = i;
+	t_pool_dispatch(p, q, bench_slice_job, s);
+	while ((r = t_pool_next_result(q)))
+	    t_pool_delete_result(r, 1);
+    }
+
+    t_pool_flush(p);
+    while ((r = t_pool_next_result(q)))
+	t_pool_delete_result(r, 1);
+    gettimeofday(&t2, NULL);
+
+    t_pool_destroy(p, 0);
+    t_results_queue_destroy(q);
+
+    return TDIFF(t2,t1) / 1000000.0;
+}
+
 #define NTHREADS 8
 
+/*
+ * Usage: thread_pool           Ordering demo
+ *        thread_pool -b [N]    Benchmark shared vs work-stealing schedulers,
+ *                              with plain jobs and with slice jobs that
+ *                              use t_pool_parallel_for.
+ */
 int main(int argc, char **argv) {
-    t_pool *p = t_pool_init(NTHREADS*2, NTHREADS);
-    t_results_queue *q = t_results_queue_init();
+    t_pool *p;
+    t_results_queue *q;
     int i;
     t_pool_result *r;
 
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+	int nt[] = {8, 32, 64};
+	int njobs = argc > 2 ? atoi(argv[2]) : 200000;
+
+	bench_work = 2000;
+	printf("%8s %10s %10s %10s %10s\n", "threads",
+	       "shared", "stealing", "for/shared", "for/steal");
+	for (i = 0; i < sizeof(nt)/sizeof(*nt); i++) {
+	    double t_sh  = bench(T_POOL_SHARED,   nt[i], njobs);
+	    double t_ws  = bench(T_POOL_STEALING, nt[i], njobs);
+	    double tf_sh = bench_for(T_POOL_SHARED,   nt[i], njobs);
+	    double tf_ws = bench_for(T_POOL_STEALING, nt[i], njobs);
+	    printf("%8d %9.3fs %9.3fs %9.3fs %9.3fs\n",
+		   nt[i], t_sh, t_ws, tf_sh, tf_ws);
+	}
+	return 0;
+    }
+
+    p = t_pool_init(NTHREADS*2, NTHREADS);
+    q = t_results_queue_init();
+
     // Dispatch jobs
     for (i = 0; i < 20; i++) {
 	int *ip = malloc(sizeof(*ip));
@@ -47,12 +47,31 @@
  * An example: reading from BAM and writing to CRAM with 10 threads. We'll
  * have a pool of 10 threads and two results queues holding decoded BAM blocks
  * and encoded CRAM blocks respectively.
+ *
+ * Two job schedulers are available.  The default (T_POOL_SHARED) holds all
+ * pending jobs on one list guarded by the pool mutex.  T_POOL_STEALING
+ * gives each worker its own job queue with its own lock; jobs are spread
+ * across these and idle workers steal from their neighbours, so dispatch
+ * and job retrieval do not all contend on a single mutex at high thread
+ * counts.
+ *
+ * Each results queue may be given a priority and a limit on the number of
+ * jobs it may have outstanding.  Jobs from higher priority queues are run
+ * first, but a job can only be overtaken by T_POOL_MAX_OVERTAKE later
+ * jobs so lower priority queues are never starved.  The limit gives
+ * per-queue back-pressure, stopping one producer from filling the entire
+ * pool and locking out the others.
+ *
+ * Optionally the pool can gather statistics on job execution times, queue
+ * depth and time spent blocked; see t_pool_stats_enable().
  */
 
 #ifndef _THREAD_POOL_H_
 #define _THREAD_POOL_H_
 
 #include <pthread.h>
+#include <stdio.h>
+#include <sys/time.h>
 
 struct t_pool;
 struct t_results_queue;
@@ -65,6 +84,8 @@ typedef struct t_pool_job {
     struct t_pool *p;
     struct t_results_queue *q;
     int serial;
+    int priority;  // copied from q at dispatch time
+    int overtaken; // number of later jobs scheduled ahead of this one
 } t_pool_job;
 
 typedef struct t_res {
@@ -83,11 +104,65 @@ typedef struct {
     long long wait_time;
 } t_pool_worker_t;
 
+/* Per-worker job queue used by the T_POOL_STEALING scheduler */
+typedef struct {
+    pthread_mutex_t m;
+    t_pool_job *head, *tail;
+    volatile int n;   // number of jobs, may be read without the lock
+} t_pool_wqueue;
+
+/*
+ * Pool statistics, gathered only once t_pool_stats_enable() is called.
+ * Times are in microseconds.
+ */
+#define T_POOL_HIST       32 // job time histogram bins
+#define T_POOL_DEPTH_HIST 65 // queue depth histogram bins
+#define T_POOL_MAX_FUNC   16 // distinct job functions tracked
+#define T_POOL_MAX_QUEUE  16 // distinct results queues tracked
+
+typedef struct {
+    void *(*func)(void *arg);
+    const char *name;        // name of the first results queue used
+    long long njobs;
+    long long time_us;       // total execution time
+    long long hist[T_POOL_HIST]; // [i] counts jobs of < 2^i us
+} t_pool_func_stats;
+
+typedef struct {
+    int id;                  // results queue id
+    const char *name;
+    long long ndispatch;     // jobs dispatched
+    long long nresults;      // results consumed
+    long long nwait;         // times consumer waited for the next serial
+    long long wait_us;
+} t_pool_queue_stats;
+
+typedef struct {
+    struct timeval start;    // when enabled
+    int nfunc, nqueue;
+    t_pool_func_stats func[T_POOL_MAX_FUNC];
+    t_pool_queue_stats queue[T_POOL_MAX_QUEUE];
+    long long ndispatch;
+    long long depth_sum;     // pool queue depth summed over dispatches
+    int depth_max;
+    long long depth_hist[T_POOL_DEPTH_HIST]; // last bin also holds deeper
+    long long nblocked;      // dispatches blocked on a full pool or queue
+    long long blocked_us;
+    long long nidle;         // times a worker waited for a job
+    long long idle_us;
+} t_pool_stats;
+
+enum t_pool_sched {
+    T_POOL_SHARED,    // single job list
+    T_POOL_STEALING,  // per-worker job queues with work stealing
+};
+
 typedef struct t_pool {
     int qsize;    // size of queue
-    int njobs;    // pending job count
-    int nwaiting; // how many workers waiting for new jobs
+    volatile int njobs;    // pending job count
+    volatile int nwaiting; // how many workers waiting for new jobs
     int shutdown; // true if pool is being destroyed
+    enum t_pool_sched sched;
 
     // queue of pending jobs
     t_pool_job *head, *tail;
@@ -106,21 +181,59 @@ typedef struct t_pool {
     // array of worker IDs free
     int *t_stack, t_stack_top;
 
+    // results queues dispatched to, linked by next_q
+    struct t_results_queue *queues;
+
+    // T_POOL_STEALING: one job queue per worker
+    t_pool_wqueue *wq;
+    volatile unsigned int next_wq; // round-robin dispatch target
+
     // Debugging to check wait time
     long long total_time, wait_time;
+
+    // Optional statistics, NULL unless enabled
+    t_pool_stats *stats;
+    pthread_mutex_t stats_m;
 } t_pool;
 
+/*
+ * Results are held in a ring indexed by serial number, so the consumer
+ * can fetch the next in-order result without locking.  Results too far
+ * ahead of the consumer to fit in the ring go onto the result_head list
+ * under result_m instead.  Each queue must have a single consumer.
+ */
+#define T_RESULTS_RING 1024 // default ring size, a power of 2
+
 typedef struct t_results_queue {
-    t_pool_result *result_head;
+    t_pool_result *result_head; // overflow list
     t_pool_result *result_tail;
-    int next_serial;
+    volatile int next_serial;
     int curr_serial;
-    int queue_len;  // number of items in queue
-    int pending;    // number of pending items (in progress or in pool list)
+    volatile int queue_len;  // number of items in queue
+    volatile int pending;    // number of pending items (in progress or in pool list)
     pthread_mutex_t result_m;
     pthread_cond_t result_avail_c;
+
+    t_pool_result * volatile *ring; // ring_sz slots, by serial & (ring_sz-1)
+    int ring_sz;
+    volatile int n_overflow;  // items on result_head list
+    volatile int waiting;     // consumer is blocked on result_avail_c
+
+    int priority;             // higher runs first, default 0
+    int max_pending;          // limit on pending jobs, 0 for none
+    volatile int space_waiting; // dispatcher is blocked on space_c
+    pthread_cond_t space_c;
+
+    int id;                   // unique, for statistics
+    const char *name;         // for statistics, may be NULL
+    struct t_pool *p;         // pool last dispatched to, NULL once destroyed
+    struct t_results_queue *next_q; // next queue attached to p
+    int shutdown;             // p was destroyed while we were attached
 } t_results_queue;
 
+/* How many later, higher priority, jobs may be run ahead of a job */
+#define T_POOL_MAX_OVERTAKE 16
+
 
 /*
  * Creates a worker pool of length qsize with tsize worker threads.
@@ -130,6 +243,14 @@ typedef struct t_results_queue {
  */
 t_pool *t_pool_init(int qsize, int tsize);
 
+/*
+ * As t_pool_init, but also specifying the job scheduler to use.
+ *
+ * Returns pool pointer on success;
+ *         NULL on failure
+ */
+t_pool *t_pool_init_sched(int qsize, int tsize, enum t_pool_sched sched);
+
 /*
  * Adds an item to the work pool.
  *
@@ -147,6 +268,28 @@ int t_pool_dispatch(t_pool *p, t_results_queue *q,
 int t_pool_dispatch2(t_pool *p, t_results_queue *q,
 		     void *(*func)(void *arg), void *arg, int nonblock);
 
+/*
+ * Both the above obey the results queue pending job limit, if set.
+ * With nonblock 0 dispatch waits for the queue to drop below its limit,
+ * with nonblock 1 it fails with errno EAGAIN and with nonblock -1 the
+ * limit is ignored.  A dispatch waiting on the limit fails with errno
+ * EPIPE if the pool is destroyed meanwhile, without touching the pool.
+ */
+
+/*
+ * Calls func(arg, i) for every i from 0 to n-1, spread over up to
+ * 'njobs' pool jobs plus the calling thread.  The caller works through
+ * the calls too rather than waiting, and jobs are dispatched without
+ * blocking, so this is safe to call from within a pool job.  Indices
+ * are handed out in order and no more are started after a failure.
+ * p may be NULL to run everything in the calling thread.
+ *
+ * Returns 0 on success
+ *        -1 if any call to func failed
+ */
+int t_pool_parallel_for(t_pool *p, int n, int njobs,
+			int (*func)(void *arg, int i), void *arg);
+
 /*
  * Flushes the pool, but doesn't exit. This simply drains the queue and
  * ensures all worker threads have finished their current task.
@@ -163,6 +306,9 @@ int t_pool_flush(t_pool *p);
  *
  * Use t_pool_destroy(p,0) after a t_pool_flush(p) on a normal shutdown or
  * t_pool_destroy(p,1) to quickly exit after a fatal error.
+ *
+ * Results queues that were dispatched to are detached from the pool, and
+ * any dispatch blocked on their pending job limit fails.
  */
 void t_pool_destroy(t_pool *p, int kill);
 
@@ -171,7 +317,8 @@ void t_pool_destroy(t_pool *p, int kill);
  * free it (and any internals as appropriate) after use. This doesn't
  * wait for a result to be present.
  *
- * Results will be returned in strict order.
+ * Results will be returned in strict order.  Only one thread may
+ * consume from any given queue.
  * 
  * Returns t_pool_result pointer if a result is ready.
  *         NULL if not.
@@ -193,6 +340,38 @@ void t_pool_delete_result(t_pool_result *r, int free_data);
  */
 t_results_queue *t_results_queue_init(void);
 
+/*
+ * As above, but with a ring of ring_sz in-order slots (rounded up to a
+ * power of 2).  This should exceed the number of results expected to be
+ * outstanding at any one time.
+ *
+ * Results queue pointer on success;
+ *         NULL on failure
+ */
+t_results_queue *t_results_queue_init2(int ring_sz);
+
+/*
+ * Sets the scheduling priority for jobs dispatched to this queue.
+ * Higher values run first; the default is 0.  Jobs dispatched without
+ * a results queue have priority 0.
+ */
+void t_results_queue_set_priority(t_results_queue *q, int priority);
+
+/*
+ * Limits the number of jobs for this queue that may be waiting in the
+ * pool or running at any one time.  Completed results waiting to be
+ * consumed do not count, so a thread that both dispatches and consumes
+ * cannot deadlock.  A limit of 0 (the default) means no limit beyond
+ * the pool's own queue size.
+ */
+void t_results_queue_set_limit(t_results_queue *q, int max_pending);
+
+/*
+ * Names a results queue, for use in the pool statistics.  The string
+ * is not copied so must outlive the pool.
+ */
+void t_results_queue_set_name(t_results_queue *q, const char *name);
+
 /* Deallocates memory for a results queue */
 void t_results_queue_destroy(t_results_queue *q);
 
@@ -212,4 +391,32 @@ int t_pool_results_queue_len(t_results_queue *q);
  */
 int t_pool_results_queue_sz(t_results_queue *q);
 
+/*
+ * Starts gathering statistics on the pool: the number of jobs and a
+ * histogram of their execution times for each job function, samples of
+ * the pool queue depth at each dispatch, time producers spend blocked
+ * on a full pool or results queue, time workers spend idle, and time
+ * consumers spend waiting for the next result on each results queue.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int t_pool_stats_enable(t_pool *p);
+
+/*
+ * Copies a snapshot of the pool statistics into s.
+ *
+ * Returns 0 on success
+ *        -1 if statistics are not enabled
+ */
+int t_pool_stats_get(t_pool *p, t_pool_stats *s);
+
+/*
+ * Writes the pool statistics to fp as a JSON object.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int t_pool_stats_json(t_pool *p, FILE *fp);
+
 #endif /* _THREAD_POOL_H_ */
@@ -770,6 +770,9 @@ void usage(int err) {
 	"Valid options:\n"
 	"    -n start[-end]    Only emit containers 'start' to 'end' inclusive.\n"
 	"                      '-n 100' is equivalent to '-n 100-100'.\n"
+	"    -N start[-end]    Only emit containers whose first record number\n"
+	"                      lies in [start,end), counting records from 0.\n"
+	"                      Consecutive ranges partition the file.\n"
 	"    -r range          Limit output to containers overlapping 'range'.\n"
         "                      '-r chr1' matches all of chr1.\n"
 	"                      '-r chr1:1000' is equivalent to '-r chr1:1000-1000'.\n"
@@ -788,6 +791,8 @@ int main(int argc, char **argv) {
     int drop_qs = 0, ignore_md5 = 0;
     char *keep_aux = NULL, *range = NULL;
     int c, c_start = 0, c_end = -1, require_index = 0;
+    int64_t r_start = 0, r_end = INT64_MAX;
+    int no_output = 0;
 
     // Map of data series 2 or 3 byte code to content_id(s).
     HashTable *ds_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
@@ -797,7 +802,7 @@ int main(int argc, char **argv) {
 	return 1;
 
     // Parse arguments
-    while ((c = getopt(argc, argv, "hqt:T:!n:r:")) != -1) {
+    while ((c = getopt(argc, argv, "hqt:T:!n:N:r:")) != -1) {
 	switch (c) {
 	case 't': {
 	    while (*optarg) {
@@ -831,6 +836,17 @@ int main(int argc, char **argv) {
 	    require_index = 2;
 	    break;
 
+	case 'N':
+	    r_start = strtoll(optarg, &optarg, 0);
+	    if (*optarg == '-' && optarg[1])
+		r_end = strtoll(optarg+1, &optarg, 0);
+	    if (*optarg || r_start < 0 || r_end < r_start) {
+		fprintf(stderr, "Malformed record range\n");
+		return 1;
+	    }
+	    require_index = 3;
+	    break;
+
 	case 'h': usage(0);
 	default:  usage(1);
 	}
@@ -893,6 +909,50 @@ int main(int argc, char **argv) {
 	    fprintf(stderr, "Failed to seek to range.\n");
 	    return 1;
 	}
+    } else if (require_index == 3) {
+	// Record numbers.  Without an index we scan container headers.
+	int64_t ctr, first, nrec;
+	off_t offset;
+
+	cram_index_load(fd_in, argv[optind]);
+	if ((nrec = cram_index_num_records(fd_in)) < 0) {
+	    fprintf(stderr, "Failed to count records\n");
+	    return 1;
+	}
+
+	// First container starting at or after r_start.
+	no_output = 1;
+	if (r_start < nrec) {
+	    ctr = cram_index_query_record(fd_in, r_start, &offset, &first);
+	    if (ctr < 0)
+		return 1;
+	    if (first < r_start)
+		ctr++;
+	    c_start = ctr;
+
+	    // And the first starting at or after r_end.
+	    if (r_end < nrec) {
+		ctr = cram_index_query_record(fd_in, r_end, &offset, &first);
+		if (ctr < 0)
+		    return 1;
+		if (first < r_end)
+		    ctr++;
+		c_end = ctr-1;
+	    } else {
+		c_end = c_start-1; // all remaining
+	    }
+	    no_output = r_end < nrec && c_end < c_start;
+	}
+
+	// Nothing to emit if r_start is within the last container.
+	if (!no_output &&
+	    cram_index_container_record(fd_in, c_start, &offset) < 0)
+	    no_output = 1;
+
+	if (!no_output && cram_seek(fd_in, offset, SEEK_SET) != 0) {
+	    fprintf(stderr, "Failed to seek to record %"PRId64"\n", r_start);
+	    return 1;
+	}
     }
 
     char vers[4] = {
@@ -931,7 +991,8 @@ int main(int argc, char **argv) {
 	HashTableAdd(ds_h, (char *)k, sizeof(k), hd, NULL);
     }
 
-    if (0 != filter_blocks(fd_in, fd_out, ds_h, drop_qs, keep_aux,
+    if (!no_output &&
+	0 != filter_blocks(fd_in, fd_out, ds_h, drop_qs, keep_aux,
 			   c_end - c_start+1)) {
 	fprintf(stderr, "Filter blocks failed\n");
 	return 1;
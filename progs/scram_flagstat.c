@@ -94,6 +94,12 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
     fprintf(fp, "    -t N           Use N threads (availability varies by format)\n");
+    fprintf(fp, "    -l             [Cram] Lazy mode: skip over blocks not needed\n"
+	        "                   for the counts rather than reading them.\n");
+    fprintf(fp, "    -f             Fast mode: only decode the flags.  Omits the\n"
+	        "                   mate mapped to a different chr counts.\n");
+    fprintf(fp, "    -x             Report idxstats style per reference mapped\n"
+	        "                   and unmapped counts instead.\n");
 }
 
 typedef struct {
@@ -103,6 +109,55 @@ typedef struct {
     int64_t n_diffchr[2], n_diffhigh[2];
 } bam_flagstat_t;
 
+/* Per reference mapped/unmapped counts, indexed by ref+1 so "*" is 0 */
+typedef struct {
+    int nref;
+    int64_t (*count)[2];
+} bam_idxstat_t;
+
+static void idxstat_add(bam_idxstat_t *ix, int flag, int ref) {
+    if (ref < -1 || ref >= ix->nref)
+	ref = -1;
+    ++ix->count[ref+1][flag & BAM_FUNMAP ? 1 : 0];
+}
+
+static void flagstat_add(bam_flagstat_t *st, int flag, int ref, int mate_ref,
+			 int map_qual) {
+    int w = flag & BAM_FQCFAIL ? 1 : 0;
+    ++st->n_reads[w];
+
+    if (flag & BAM_FPAIRED) {
+	++st->n_pair_all[w];
+	if (flag & BAM_FPROPER_PAIR)
+	    ++st->n_pair_good[w];
+
+	if (flag & BAM_FREAD1)
+	    ++st->n_read1[w];
+
+	if (flag & BAM_FREAD2)
+	    ++st->n_read2[w];
+
+	if ((flag & BAM_FMUNMAP) && !(flag & BAM_FUNMAP))
+	    ++st->n_sgltn[w]; 
+
+	if (!(flag & BAM_FUNMAP) && !(flag & BAM_FMUNMAP)) {
+	    ++st->n_pair_map[w];
+
+	    if (mate_ref != ref) {
+		++st->n_diffchr[w];
+		if (map_qual >= 5)
+		    ++st->n_diffhigh[w];
+	    }
+	}
+    }
+
+    if (!(flag & BAM_FUNMAP))
+	++st->n_mapped[w];
+
+    if (flag & BAM_FDUP)
+	++st->n_dup[w];
+}
+
 int main(int argc, char **argv) {
     scram_fd *in;
     bam_seq_t *s;
@@ -115,13 +170,15 @@ int main(int argc, char **argv) {
     bam_flagstat_t st;
     int nthreads = 1;
     int benchmark = 0;
+    int lazy = 0, fast = 0;
+    bam_idxstat_t *ix = NULL, ix_s;
 
     scram_init();
 
     memset(&st, 0, sizeof(st));
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "hI:R:r:!t:b")) != -1) {
+    while ((c = getopt(argc, argv, "hI:R:r:!t:blfx")) != -1) {
 	switch (c) {
 	case 'h':
 	    usage(stdout);
@@ -175,6 +232,18 @@ int main(int argc, char **argv) {
 	    benchmark = 1;
 	    break;
 
+	case 'l':
+	    lazy = 1;
+	    break;
+
+	case 'f':
+	    fast = 1;
+	    break;
+
+	case 'x':
+	    ix = &ix_s;
+	    break;
+
 	case '?':
 	    fprintf(stderr, "Unrecognised option: -%c\n", optopt);
 	    usage(stderr);
@@ -217,9 +286,31 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
-    if (!benchmark)
+    if (ix) {
+	// Flags and reference only, which for CRAM is just the BF and RI
+	// data series, so these also default to skipping other blocks.
+	SAM_hdr *sh = scram_get_header(in);
+	ix->nref = sh->nref;
+	if (!(ix->count = calloc(sh->nref+1, sizeof(*ix->count))))
+	    return 1;
+	scram_set_option(in, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG | SAM_RNAME);
+	lazy = 1;
+    } else if (fast) {
+	scram_set_option(in, CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG);
+	lazy = 1;
+    } else if (!benchmark) {
 	scram_set_option(in, CRAM_OPT_REQUIRED_FIELDS,
 			 SAM_FLAG | SAM_MAPQ | SAM_RNEXT);
+    }
+
+    if (lazy && !benchmark && !in->is_bam)
+	if (scram_set_option(in, CRAM_OPT_LAZY_BLOCKS, lazy))
+	    return 1;
+
+    // CRAM is read via cram_get_columns(), so skip building BAM records
+    if (!benchmark && !in->is_bam)
+	if (scram_set_option(in, CRAM_OPT_NO_BAM, 1))
+	    return 1;
 
     /* Support for sub-range queries, currently implemented for CRAM only */
     if (*ref_name != 0) {
@@ -255,49 +346,54 @@ int main(int argc, char **argv) {
 	return ret;
     }
 
-    s = NULL;
-    while (scram_get_seq(in, &s) >= 0) {
-	int w = s->flag & BAM_FQCFAIL ? 1 : 0;
-	++st.n_reads[w];
-
-	if (s->flag & BAM_FPAIRED) {
-	    ++st.n_pair_all[w];
-	    if (s->flag & BAM_FPROPER_PAIR)
-		++st.n_pair_good[w];
+    if (!in->is_bam) {
+	// CRAM: walk the decoded slices directly, skipping BAM conversion
+	cram_columns cols;
+	int i, r;
 
-	    if (s->flag & BAM_FREAD1)
-		++st.n_read1[w];
-
-	    if (s->flag & BAM_FREAD2)
-		++st.n_read2[w];
-
-	    if ((s->flag & BAM_FMUNMAP) && !(s->flag & BAM_FUNMAP))
-		++st.n_sgltn[w]; 
-
-	    if (!(s->flag & BAM_FUNMAP) && !(s->flag & BAM_FMUNMAP)) {
-		++st.n_pair_map[w];
-
-		if (s->mate_ref != s->ref) {
-		    ++st.n_diffchr[w];
-		    if (s->map_qual >= 5)
-			++st.n_diffhigh[w];
-		}
+	memset(&cols, 0, sizeof(cols));
+	while ((r = cram_get_columns(in->c, &cols)) == 0) {
+	    if (ix) {
+		for (i = 0; i < cols.n; i++)
+		    idxstat_add(ix, cols.flag[i], cols.ref_id[i]);
+	    } else {
+		for (i = 0; i < cols.n; i++)
+		    flagstat_add(&st, cols.flag[i], cols.ref_id[i],
+				 cols.mate_ref_id[i], cols.mapq[i]);
 	    }
 	}
+	cram_columns_free(&cols);
+	in->eof = r < 0 ? 0 : cram_eof(in->c);
+    } else {
+	s = NULL;
+	while (scram_get_seq(in, &s) >= 0) {
+	    if (ix)
+		idxstat_add(ix, s->flag, s->ref);
+	    else
+		flagstat_add(&st, s->flag, s->ref, s->mate_ref, s->map_qual);
+	}
 
-	if (!(s->flag & BAM_FUNMAP))
-	    ++st.n_mapped[w];
-
-	if (s->flag & BAM_FDUP)
-	    ++st.n_dup[w];
+	if (s)
+	    free(s);
     }
 
-    if (s)
-	free(s);
-
     if (!scram_eof(in))
 	return 1;
 
+    if (ix) {
+	SAM_hdr *sh = scram_get_header(in);
+	int i;
+
+	for (i = 0; i < ix->nref; i++)
+	    printf("%s\t%u\t%"PRId64"\t%"PRId64"\n",
+		   sh->ref[i].name, sh->ref[i].len,
+		   ix->count[i+1][0], ix->count[i+1][1]);
+	printf("*\t0\t%"PRId64"\t%"PRId64"\n", ix->count[0][0], ix->count[0][1]);
+	free(ix->count);
+
+	return scram_close(in) ? 1 : 0;
+    }
+
     if (scram_close(in))
 	return 1;
 
@@ -310,8 +406,10 @@ int main(int argc, char **argv) {
     printf("%"PRId64" + %"PRId64" properly paired (%.2f%%:%.2f%%)\n", st.n_pair_good[0], st.n_pair_good[1], (float)st.n_pair_good[0] / st.n_pair_all[0] * 100.0, (float)st.n_pair_good[1] / st.n_pair_all[1] * 100.0);
     printf("%"PRId64" + %"PRId64" with itself and mate mapped\n", st.n_pair_map[0], st.n_pair_map[1]);
     printf("%"PRId64" + %"PRId64" singletons (%.2f%%:%.2f%%)\n", st.n_sgltn[0], st.n_sgltn[1], (float)st.n_sgltn[0] / st.n_pair_all[0] * 100.0, (float)st.n_sgltn[1] / st.n_pair_all[1] * 100.0);
-    printf("%"PRId64" + %"PRId64" with mate mapped to a different chr\n", st.n_diffchr[0], st.n_diffchr[1]);
-    printf("%"PRId64" + %"PRId64" with mate mapped to a different chr (mapQ>=5)\n", st.n_diffhigh[0], st.n_diffhigh[1]);
+    if (!fast) {
+	printf("%"PRId64" + %"PRId64" with mate mapped to a different chr\n", st.n_diffchr[0], st.n_diffchr[1]);
+	printf("%"PRId64" + %"PRId64" with mate mapped to a different chr (mapQ>=5)\n", st.n_diffhigh[0], st.n_diffhigh[1]);
+    }
 
     return 0;
 }
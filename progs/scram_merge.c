@@ -54,6 +54,7 @@
 #endif
 
 #include <io_lib/scram.h>
+#include <io_lib/scram_merge.h>
 #include <io_lib/os.h>
 #include <io_lib/version.h>
 
@@ -76,6 +77,29 @@ static int hdr_compare(SAM_hdr *h1, SAM_hdr *h2) {
     return 1;
 }
 
+/*
+ * Sets the @HD SO: field to match the order the records are merged in,
+ * adding an @HD line if the header has none.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int set_sort_order(SAM_hdr *h, enum scram_merge_order order) {
+    char *so = order == SCRAM_MERGE_NAME ? "queryname" : "coordinate";
+    SAM_hdr_type *ty;
+
+    if ((ty = sam_hdr_find(h, "HD", NULL, NULL))) {
+	if (sam_hdr_update(h, ty, "SO", so, NULL))
+	    return -1;
+    } else {
+	if (sam_hdr_add(h, "HD", "VN", "1.4", "SO", so, NULL))
+	    return -1;
+    }
+
+    h->sort_order = order == SCRAM_MERGE_NAME ? ORDER_NAME : ORDER_COORD;
+    return 0;
+}
+
 static char *parse_format(char *str) {
     if (strcmp(str, "sam") == 0 || strcmp(str, "SAM") == 0)
 	return "";
@@ -117,6 +141,8 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -O format      Set output format: \"bam\", \"sam\" or \"cram\".\n");
     fprintf(fp, "    -1 to -9       Set zlib compression level.\n");
     fprintf(fp, "    -0 or -u       No zlib compression.\n");
+    fprintf(fp, "    -n             Inputs are sorted by read name, not position.\n");
+    fprintf(fp, "    -t threads     Number of threads for reading and writing.\n");
     //fprintf(fp, "    -v             Verbose output.\n");
     fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
@@ -131,7 +157,11 @@ static void usage(FILE *fp) {
 int main(int argc, char **argv) {
     scram_fd **in, *out;
     int n_input, i;
-    bam_seq_t **s;
+    bam_seq_t *s;
+    scram_merge *m;
+    enum scram_merge_order order = SCRAM_MERGE_COORD;
+    t_pool *pool = NULL;
+    int nthreads = 1;
     char imode[10], *in_f = "", omode[10], *out_f = "";
     int level = '\0'; // nul terminate string => auto level
     int c, verbose = 0;
@@ -143,7 +173,7 @@ int main(int argc, char **argv) {
     int max_reads = -1;
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:XI:O:R:N:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:XI:O:R:N:nt:")) != -1) {
 	switch (c) {
 	case '0': case '1': case '2': case '3': case '4':
 	case '5': case '6': case '7': case '8': case '9':
@@ -216,6 +246,14 @@ int main(int argc, char **argv) {
 	    max_reads = atoi(optarg);
 	    break;
 
+	case 'n':
+	    order = SCRAM_MERGE_NAME;
+	    break;
+
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+
 	case '?':
 	    fprintf(stderr, "Unrecognised option: -%c\n", optopt);
 	    usage(stderr);
@@ -239,10 +277,7 @@ int main(int argc, char **argv) {
     }
     if (!(in = malloc(n_input * sizeof(*in))))
 	return 1;
-    if (!(s = malloc(n_input * sizeof(*s))))
-	return 1;
     for (i = 0; i < n_input; i++, optind++) {
-	s[i] = NULL;
 	if (*in_f == 0)
 	    sprintf(imode, "r%s%c", detect_format(argv[optind]), level);
 	if (!(in[i] = scram_open(argv[optind], imode))) {
@@ -308,11 +343,28 @@ int main(int argc, char **argv) {
     if (embed_ref)
 	if (scram_set_option(out, CRAM_OPT_EMBED_REF, embed_ref))
 	    return 1;
-    
+
+    /*
+     * The pool is used for reading ahead on each input and for output
+     * encoding.  The inputs must not use it for their own decoding as
+     * the read-ahead jobs would then block waiting on their own pool.
+     */
+    if (nthreads > 1) {
+	if (!(pool = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+	if (scram_set_option(out, CRAM_OPT_THREAD_POOL, pool))
+	    return 1;
+    }
+
     /* Copy header and refs from in to out, for writing purposes */
     // FIXME: do proper merging of @PG lines
     // FIXME: track mapping of old PG aux name to new PG aux name per seq
     scram_set_header(out, sam_hdr_dup(scram_get_header(in[0])));
+    if (scram_get_header(out) &&
+	set_sort_order(scram_get_header(out), order)) {
+	fprintf(stderr, "Failed to set the header sort order\n");
+	return 1;
+    }
 
     // Needs doing after loading the header.
     if (ref_fn)
@@ -327,69 +379,37 @@ int main(int argc, char **argv) {
 
     /* Do the actual file format conversion */
     fprintf(stderr, "Opening and loading initial seqs\n");
-    for (i = 0; i < n_input; i++) {
-	if (scram_get_seq(in[i], &s[i]) < 0) {
-	    if (scram_close(in[i]))
-		return 1;
-	    in[i] = NULL;
-	    free(s[i]);
-	    continue;
-	}
+    if (!(m = scram_merge_init(in, n_input, order, pool, 0))) {
+	fprintf(stderr, "Failed to read from input files\n");
+	return 1;
     }
 
     fprintf(stderr, "Merging...\n");
-    for (;;) {
-	int64_t best_val = INT64_MAX;
-	int best_j = 0, j;
-
-	for (j = 0; j < n_input; j++) {
-	    bam_seq_t *b = s[j];
-	    uint64_t x;
-	    if (!in[j])
-		continue;
-
-	    x = (((uint64_t)bam_ref(b))<<33)
-		| (bam_pos(b)<<2)
-		| (bam_strand(b)<<1)
-		| !(bam_flag(b) & BAM_FREAD1);
-	    if (best_val > x) {
-		best_val = x;
-		best_j = j;
-	    }
-	}
-	
-	if (best_val == INT64_MAX) { // all closed
-	    break;
-	}
-
-	if (-1 == scram_put_seq(out, s[best_j]))
+    while ((c = scram_merge_next(m, &s)) == 0) {
+	if (-1 == scram_put_seq(out, s))
 	    return 1;
-	
-	if (scram_get_seq(in[best_j], &s[best_j]) < 0) {
-	    if (scram_close(in[best_j]))
-		return 1;
-	    in[best_j] = NULL;
-	    free(s[best_j]);
-	}
 
 	if (max_reads >= 0)
 	    if (--max_reads == 0)
 		break;
     }
+    if (c < 0) {
+	fprintf(stderr, "Failed to read from input files\n");
+	return 1;
+    }
 
-    for (i = 0; i < n_input; i++) {
-	if (!in[i])
-	    continue;
+    scram_merge_free(m);
+    for (i = 0; i < n_input; i++)
 	scram_close(in[i]);
-	if (s[i])
-	    free(s[i]);
-    }
 
     /* Finally tidy up and close files */
     if (scram_close(out))
 	return 1;
+    if (pool) {
+	t_pool_flush(pool);
+	t_pool_destroy(pool, 0);
+    }
     free(in);
-    free(s);
 
     return 0;
 }
@@ -31,23 +31,22 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 /*
  * Author: James Bonfield, Wellcome Trust Sanger Institute. 2011-2013
  *
  * A basic pileup command.
- * This needs a lot of work still and to be split into library + program.
- * For now we have all in one place.
  *
  * Compatibility wise it is not meant to be a full blown replacement for
  * samtools mpileup or even the old samtools pileup. Primarily it is a test
- * harness for the pileup_loop API code.
+ * harness for the pileup_loop API code in io_lib/scram_pileup.c.
  *
  * Speed wise it is approaching double the performance of samtools mpileup
  * (with no extra arguments) when run on BAM. CRAM performance is approx 40%
- * slower than the BAM version.
+ * slower than the BAM version.  With -t an indexed CRAM file is processed
+ * in parallel, one region at a time per thread.
  */
 
-
 #ifdef HAVE_CONFIG_H
 #include <io_lib_config.h>
 #endif
@@ -56,625 +55,105 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
-#include "scram_pileup.h"
-
-/*
- * START_WITH_DEL is the mode that Gap5 uses when building this. It prepends
- * all cigar strings with 1D and decrements the position by one. (And then
- * has code to reverse this operation in the pileup handler.)
- *
- * The reason for this is that it means reads starting with an insertion work.
- * Otherwise the inserted bases are silently lost. (Try it with "samtools
- * mpileup" and you can see it has the same issue.)
- *
- * However it's probably not want most people expect.
- */
-//#define START_WITH_DEL
-
-/* --------------------------------------------------------------------------
- * The pileup code itself. 
- *
- * This consists of the external pileup_loop() function, which takes a
- * sam/bam samfile_t pointer and a callback function. The callback function
- * is called once per column of aligned data (so once per base in an
- * insertion).
- *
- * Current known issues.
- * 1) zero length matches, ie 2S2S cause failures.
- * 2) Insertions at starts of sequences get included in the soft clip, so
- *    2S2I2M is treated as if it's 4S2M
- * 3) From 1 and 2 above, 1S1I2S becomes 2S2S which fails.
- */
+#include <ctype.h>
+#include <unistd.h>
 
-/*
- * Fast conversion from encoded SAM base nibble to a printable character
- */
-static char tab[256][2];
-static void init_tab(void) {
-    int i, j;
-    unsigned char b2;
-    static int done = 0;
+#if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
+#   include <getopt.h>
+#endif
 
-    if (done)
-	return;
+#include <io_lib/scram.h>
+#include <io_lib/scram_pileup.h>
+#include <io_lib/bam.h>
 
-    for (i = 0; i < 16; i++) {
-	for (j = 0; j < 16; j++) {
-	    b2 = (i<<4) | j;
-	    tab[b2][0] = "NACMGRSVTWYHKDBN"[i];
-	    tab[b2][1] = "NACMGRSVTWYHKDBN"[j];
-	}
+char strand_char[2][256];
+void strand_init(void) {
+    int i;
+    for (i = 0; i < 256; i++) {
+	strand_char[0][i] = toupper((unsigned char)i);
+	strand_char[1][i] = tolower((unsigned char)i);
     }
-
-    done = 1;
 }
 
-
 /*
- * Fetches the next base => the nth base at unpadded position pos. (Nth can
- * be greater than 0 if we have an insertion in this column). Do not call this
- * with pos/nth lower than the previous query, although higher is better.
- * (This allows it to be initialised at base 0.)
- *
- * Stores the result in base and also updates is_insert to indicate that
- * this sequence still has more bases in this position beyond the current
- * nth parameter.
- *
- * Returns 1 if a base was fetched
- *         0 if not (eg ran off the end of sequence)
+ * Per run client data. With multiple threads there is one of these per
+ * region being processed.
  */
-static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
-    bam_seq_t *b = p->b;
-    enum cigar_op op = p->cigar_op;
-
-    if (p->first_del && op != BAM_CPAD)
-	p->first_del = 0;
-
-    *is_insert = 0;
-
-    /* Find pos first */
-    while (p->pos < pos) {
-	p->nth = 0;
-
-	if (p->cigar_len == 0) {
-	    if (p->cigar_ind >= bam_cigar_len(b)) {
-		p->eof = 1;
-		return 0;
-	    }
-
-	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
-	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
-	    p->cigar_ind++;
-	}
-	
-	if ((op == BAM_CMATCH ||
-	     op == BAM_CBASE_MATCH ||
-	     op == BAM_CBASE_MISMATCH) && p->cigar_len <= pos - p->pos) {
-	    p->seq_offset += p->cigar_len;
-	    p->pos += p->cigar_len;
-	    p->cigar_len = 0;
-	} else {
-	    switch (op) {
-	    case BAM_CMATCH:
-	    case BAM_CBASE_MATCH:
-	    case BAM_CBASE_MISMATCH:
-		p->seq_offset++;
-		/* Fall through */
-	    case BAM_CDEL:
-	    case BAM_CREF_SKIP:
-		p->pos++;
-		p->cigar_len--;
-		break;
-
-	    case BAM_CINS:
-	    case BAM_CSOFT_CLIP:
-		p->seq_offset += p->cigar_len;
-		/* Fall through */
-	    case BAM_CPAD:
-	    case BAM_CHARD_CLIP:
-		p->cigar_len = 0;
-		break;
-
-	    default:
-		fprintf(stderr, "Unhandled cigar_op %d\n", op);
-		return -1;
-	    }
-	}
-    }
-
-    /* Now at pos, find nth base */
-    while (p->nth < nth) {
-	if (p->cigar_len == 0) {
-	    if (p->cigar_ind >= bam_cigar_len(b)) {
-		p->eof = 1;
-		return 0; /* off end of seq */
-	    }
-
-	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
-	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
-	    p->cigar_ind++;
-	}
-
-	switch (op) {
-	case BAM_CMATCH:
-	case BAM_CBASE_MATCH:
-	case BAM_CBASE_MISMATCH:
-	case BAM_CSOFT_CLIP:
-	case BAM_CDEL:
-	case BAM_CREF_SKIP:
-	    goto at_nth; /* sorry, but it's fast! */
-
-	case BAM_CINS:
-	    p->seq_offset++;
-	    /* Fall through */
-	case BAM_CPAD:
-	    p->cigar_len--;
-	    p->nth++;
-	    break;
-
-	case BAM_CHARD_CLIP:
-	    p->cigar_len = 0;
-	    break;
-
-	default:
-	    fprintf(stderr, "Unhandled cigar_op %d\n", op);
-	    return -1;
-	}
-    }
- at_nth:
-
-    /* Fill out base & qual fields */
-    p->ref_skip = 0;
-    if (p->nth < nth && op != BAM_CINS) {
-	//p->base = '-';
-	p->base = '*';
-	p->padding = 1;
-	if (p->seq_offset < b->len)
-	    p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
-	else
-	    p->qual = 0;
-    } else {
-	p->padding = 0;
-	switch(op) {
-	case BAM_CDEL:
-	    p->base = '*';
-	    if (p->seq_offset+1 < b->len)
-		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
-	    else
-		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
-	    break;
-
-	case BAM_CPAD:
-	    //p->base = '+';
-	    p->base = '*';
-	    if (p->seq_offset+1 < b->len)
-		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
-	    else
-		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
-	    break;
-
-	case BAM_CREF_SKIP:
-	    p->base = '.';
-	    p->qual = 0;
-	    /* end of fragment, but not sequence */
-	    p->eof = p->eof ? 2 : 3;
-	    p->ref_skip = 1;
-	    break;
-
-	default:
-	    if (p->seq_offset < b->len) {
-		p->qual = p->b_qual[p->seq_offset];
-	    /*
-	     * If you need to label inserted bases as different from
-	     * (mis)matching bases then this is where we'd make that change.
-	     * The reason could be to allow the consensus algorithm to easily
-	     * distinguish between reference bases and non-reference bases.
-	     *
-	     * Eg:
-	     * if (nth)
-	     *     p->base = tolower(tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1]);
-	     * else
-	     */
-		p->base = tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1];
-	    } else {
-		p->base = 'N';
-		p->qual = 0xff;
-	    }
-		
-	    break;
-	}
-    }
-
-    /* Handle moving out of N (skip) into sequence again */
-    if (p->eof && p->base != '.') {
-	p->start = 1;
-	p->ref_skip = 1;
-	p->eof = 0;
-    }
+typedef struct {
+    dstring_t *out;   // output buffer, or NULL to write to stdout
 
-    /* Starting with an indel needs a minor fudge */
-    if (p->start && p->cigar_op == BAM_CDEL) {
-	p->first_del = 1;
-    }
+    /*
+     * Used to delay emitting pileup lines around insertions, so we can
+     * stack multiple bases together.
+     */
+    int alloc;
+    char *base;       // first base call
+    int  *seq_offset; // first seq_offset
+    int  *seq_len;    // length of insertion
 
-    /* Check if next op is an insertion of some sort */
-    if (p->cigar_len == 0) {
-	if (p->cigar_ind < bam_cigar_len(b)) {
-	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
-	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
-	    p->cigar_ind++;
-	    if (op == BAM_CREF_SKIP) {
-		p->eof = 3;
-		p->ref_skip = 1;
-	    }
-	} else {
-	    p->eof = 1;
-	}
-    }
+    /* Working buffers for formatting a column */
+    unsigned char *seq, *qual, *buf;
+    size_t seq_alloc, buf_alloc;
+    int max_depth;
+} sam_pileup_t;
 
-    switch (op) {
-    case BAM_CPAD:
-    case BAM_CINS:
-	*is_insert = p->cigar_len;
-	break;
+static void *sam_pileup_init(void *arg, dstring_t *out) {
+    sam_pileup_t *cd = calloc(1, sizeof(*cd));
+    if (cd)
+	cd->out = out;
+    return cd;
+}
 
-    case BAM_CSOFT_CLIP:
-	/* Last op 'S' => eof */
-        p->eof = (p->cigar_ind == bam_cigar_len(b) ||
-		  (p->cigar_ind+1 == bam_cigar_len(b) &&
-		   (p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK)
-		   == BAM_CHARD_CLIP))
-	    ? 1
-	    : 0;
-	break;
+static void sam_pileup_free(void *cd_v) {
+    sam_pileup_t *cd = (sam_pileup_t *)cd_v;
 
-    case BAM_CHARD_CLIP:
-	p->eof = 1;
-	break;
+    if (!cd)
+	return;
 
-    default:
-	break;
-    }
-    
-    return 1;
+    free(cd->base);
+    free(cd->seq_offset);
+    free(cd->seq_len);
+    free(cd->seq);
+    free(cd->qual);
+    free(cd->buf);
+    free(cd);
 }
 
 /*
- * Loops through a set of supplied ranges producing columns of data.
- * When found, it calls func with clientdata as a callback. Func should
- * return 0 for success and non-zero for failure. seq_init() is called
- * on each new entry before we start processing it. It should return 0 or 1
- * to indicate reject or accept status (eg to filter unmapped data).
- * If seq_init() returns -1 we abort the pileup_loop with an error.
- * seq_init may be NULL.
+ * Emits a formatted line of len bytes, including the trailing newline.
  *
  * Returns 0 on success
  *        -1 on failure
  */
-int pileup_loop(scram_fd *fp,
-		int (*seq_init)(void *client_data,
-				scram_fd *fp,
-				pileup_t *p),
-		int (*seq_add)(void *client_data,
-			       scram_fd *fp,
-			       pileup_t *p,
-			       int depth,
-			       int pos,
-			       int nth,
-			       int is_insert),
-		void *client_data) {
-    int ret = -1;
-    pileup_t *phead = NULL, *p, *pfree = NULL, *last, *next, *ptail = NULL;
-    pileup_t *pnew = NULL;
-    int is_insert, nth = 0;
-    int col = 0, r;
-    int last_ref = -1;
-
-    /* FIXME: allow for start/stop boundaries rather than consuming all data */
-
-    init_tab();
-    if (NULL == (pnew = calloc(1, sizeof(*p))))
-	return -1;
-    
-    do {
-	bam_seq_t *b;
-	int pos, last_in_contig;
-
-	r = scram_next_seq(fp, &pnew->b);
-	if (r == -1) {
-	    //fprintf(stderr, "bam_next_seq() failure on line %d\n", fp->line);
-	    if (!scram_eof(fp)) {
-		fprintf(stderr, "bam_next_seq() failure.\n");
-		return -1;
-	    }
-	}
-
-	b = pnew->b;
-
-	/* Force realloc */
-	//fp->bs = NULL;
-	//fp->bs_size = 0;
-
-	//r = samread(fp, pnew->b);
-	if (r >= 0) {
-	    if (bam_flag(b) & BAM_FUNMAP)
-		continue;
-	    
-	    if (b->ref == -1) {
-		/* Another indicator for unmapped */
-		continue;
-	    } else if (b->ref == last_ref) {
-		pos = b->pos+1;
-		//printf("New seq at pos %d @ %d %s\n", pos, b->ref,
-		//       bam_name(b));
-		last_in_contig = 0;
-	    } else {
-		//printf("New ctg at pos %d @ %d\n",b->pos+1,b->ref);
-		pos = (b->pos > col ? b->pos : col)+1;
-		last_in_contig = 1;
-	    }
-	} else {
-	    last_in_contig = 1;
-	    pos = col+1;
-	}
-
-	if (col > pos) {
-	    fprintf(stderr, "BAM/SAM file is not sorted by position. "
-		    "Aborting\n");
-	    return -1;
-	}
-
-	/* Process data between the last column and our latest addition */
-	while (col < pos && phead) {
-	    int v, ins, depth = 0;
-
-	    //printf("Col=%d pos=%d nth=%d\n", col, pos, nth);
-
-	    /* Pileup */
-	    is_insert = 0;
-	    for (p = phead; p; p = p->next) {
-		if (!get_next_base(p, col, nth, &ins))
-		    p->eof = 1;
-
-		if (is_insert < ins)
-		    is_insert = ins;
-		
-		depth++;
-	    }
-
-	    /* Call our function on phead linked list */
-#ifdef START_WITH_DEL
-	    v = seq_add(client_data, fp, phead, depth, col-1, nth, is_insert);
-#else
-	    v = seq_add(client_data, fp, phead, depth, col, nth, is_insert);
-#endif
-
-	    /* Remove dead seqs */
-	    for (p = phead, last = NULL; p; p = next) {
-		next = p->next;
-		
-		p->start = 0;
-		if (p->eof == 1) {
-		    if (last)
-			last->next = p->next;
-		    else
-			phead = p->next;
-
-		    p->next = pfree;
-		    pfree = p;
-		    
-		    //printf("Del seq %s at pos %d\n", bam_name(p->b), col);
-		} else {
-		    last = p;
-		}
-	    }
-	    if ((ptail = last) == NULL)
-		ptail = phead;
-
-	    if (v == 1)
-		break; /* early abort */
-	    
-	    if (v != 0)
-		goto error;
-
-	    /* Next column */
-	    if (is_insert) {
-		nth++;
-	    } else {
-		nth = 0;
-		col++;
-	    }
-
-	    /* Special case for the last sequence in a contig */
-	    if (last_in_contig && phead)
-		pos++;
-	}
-
-	/* May happen if we have a hole in the contig */
-	col = pos;
-
-	/* New contig */
-	if (b && b->ref != last_ref) {
-	    last_ref = b->ref;
-	    pos = b->pos+1;
-	    nth = 0;
-	    col = pos;
-	}
-
-	/*
-	 * Add this seq.
-	 * Note: cigars starting with I or P ops (eg 2P3I10M) mean we have
-	 * alignment instructions that take place before the designated
-	 * starting location listed in the SAM file. They won't get included
-	 * in the callback function until they officially start, which is
-	 * already too late.
-	 *
-	 * So to workaround this, we prefix all CIGAR with 1D, move the
-	 * position by 1bp, and then force the callback code to remove
-	 * leaving pads (either P or D generated).
-	 *
-	 * Ie it's a level 10 hack!
-	 */
-	if (r >= 0) {
-	    p = pnew;
-	    p->next       = NULL;
-	    p->cd         = NULL;
-	    p->start      = 1;
-	    p->eof        = 0;
-#ifdef START_WITH_DEL
-	    p->pos        = pos-1;
-	    p->cigar_ind  = 0;
-	    p->b_cigar    = bam_cigar(p->b);
-	    if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP) {
-		p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
-		p->cigar_op   = BAM_CHARD_CLIP;
-		if ((p->b_cigar[1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
-		    /* xHxS... => xHxS1D... */
-		    p->b_cigar[0] = p->b_cigar[1];
-		    p->b_cigar[1] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
-		} else {
-		    /* xH... => xH1D... */
-		    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
-		}
-	    } else {
-		if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
-		    /* xS... => xS1D... */
-		    p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
-		    p->cigar_op   = BAM_CSOFT_CLIP;
-		    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
-		} else {
-		    /* ... => 1D... */
-		    p->cigar_len  = 1;        /* was  0  */
-		    p->cigar_op   = BAM_CDEL; /* was 'X' */
-		}
-	    }
-	    p->seq_offset = -1;
-	    p->first_del  = 1;
-#else
-	    p->pos        = pos-1;
-	    p->cigar_ind  = 0;
-	    p->b_cigar    = bam_cigar(p->b);
-	    p->cigar_len  = 0;
-	    p->cigar_op   = -1;
-	    p->seq_offset = -1;
-	    p->first_del  = 0;
-#endif
-	    p->b_strand   = bam_strand(p->b) ? 1 : 0;
-	    p->b_qual     = (uc *)bam_qual(p->b);
-	    p->b_seq      = (uc *)bam_seq(p->b);
-
-	    if (seq_init) {
-		int v;
-		v = seq_init(client_data, fp, p);
-		if (v == -1)
-		    return -1;
-		
-		if (v == 1) {
-		    /* Keep this seq */
-		    if (phead) {
-			ptail->next = p;
-		    } else {
-			phead = p;
-		    }
-		    ptail = p;
-		} else {
-		    /* Push back on free list */
-		    p->next = pfree;
-		    pfree = p;
-		}
-	    } else {
-		if (phead)
-		    ptail->next = p;
-		else
-		    phead = p;
-		ptail = p;
-	    }
-
-	    /* Allocate the next pileup rec */
-	    if (pfree) {
-		pnew = pfree;
-		pfree = pfree->next;
-	    } else {
-		if (NULL == (pnew = calloc(1, sizeof(*pnew))))
-		    goto error;
-	    }
-	}
-    } while (r >= 0);
-
-    ret = 0;
- error:
-
-    if (pnew) {
-	free(pnew->b);
-	free(pnew);
-    }
-
-    /* Tidy up */
-    for (p = pfree; p; p = next) {
-	next = p->next;
-	free(p->b);
-	free(p);
-    }
-
-    return ret;
-}
-
-/* --------------------------------------------------------------------------
- * Example usage of the above pileup code
- */
+static int pileup_write(sam_pileup_t *cd, unsigned char *buf, size_t len) {
+    if (cd->out)
+	return dstring_nappend(cd->out, (char *)buf, len);
 
-#include <ctype.h>
-#include <io_lib/bam.h>
-
-char strand_char[2][256];
-void strand_init(void) {
-    int i;
-    for (i = 0; i < 256; i++) {
-	strand_char[0][i] = toupper((unsigned char)i);
-	strand_char[1][i] = tolower((unsigned char)i);
-    }
+    return fwrite(buf, 1, len, stdout) == len ? 0 : -1;
 }
 
-/*
- * Used to delay emitting pileup lines around insertions, so we can
- * stack multiple bases together.
- */
-typedef struct {
-    int alloc;
-    char *base;       // first base call
-    int  *seq_offset; // first seq_offset
-    int  *seq_len;    // length of insertion
-} sam_pileup_t;
-
 static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 		      int depth, int pos, int nth, int is_insert) {
-    static unsigned char *seq = NULL, *qual = NULL, *buf = NULL;
-    static size_t seq_alloc = 0, buf_alloc = 0;
-    static int max_depth = 0;
     unsigned char *sp, *qp, *cp;
-    int ref;
+    int ref, n;
     sam_pileup_t *cd = (sam_pileup_t *)cd_v;
     size_t buf_len;
 
-    if (max_depth < depth) {
-	max_depth = depth;
-	seq  = realloc(seq,  seq_alloc = max_depth*2);
-	qual = realloc(qual, max_depth);
-	//buf  = realloc(buf,  max_depth*2+1000);
+    if (cd->max_depth < depth) {
+	cd->max_depth = depth;
+	cd->seq  = realloc(cd->seq,  cd->seq_alloc = cd->max_depth*2);
+	cd->qual = realloc(cd->qual, cd->max_depth);
 
-	if (!seq || !qual)
+	if (!cd->seq || !cd->qual)
 	    return -1;
     }
 
-    sp = seq; qp = qual; cp = buf;
+    sp = cd->seq; qp = cd->qual;
 
-    if (!p)
+    if (!depth)
 	return 0;
 
     if (is_insert) {
-	pileup_t *p_orig = p;
-	int i;
-
 	if (nth == 0) {
 	    /* Reference position pos with is_insert inserted bases to come */
 	    if (cd->alloc < depth) {
@@ -688,25 +167,23 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 	    }
 
 	    /*
-	     * FIXME: This assumes that the number of entries in the p list
-	     * here matches the number of entries in the p list when is_inser
-	     * becomes 0 (ie the last base of the insert).
+	     * FIXME: This assumes that the number of entries in the p array
+	     * here matches the number of entries in the p array when
+	     * is_insert becomes 0 (ie the last base of the insert).
 	     *
 	     * Given that sequences can end mid-way through an insert or
 	     * even start mid-way, this assumption is false.
 	     */
-	    for (i = 0; p; p = p->next, i++) {
-		cd->base[i]       = strand_char[p->b_strand][(uc)p->base];
-		cd->seq_offset[i] = p->seq_offset+1;
-		cd->seq_len[i]    = 0;
+	    for (n = 0; n < depth; n++) {
+		cd->base[n]       = strand_char[p[n].b_strand][(uc)p[n].base];
+		cd->seq_offset[n] = p[n].seq_offset+1;
+		cd->seq_len[n]    = 0;
 	    }
-	    p = p_orig;
 	} else {
-	    for (i = 0; p; p = p->next, i++)
-		if (p->base != '*')
-		    cd->seq_len[i]++;
+	    for (n = 0; n < depth; n++)
+		if (p[n].base != '*')
+		    cd->seq_len[n]++;
 	}
-	p = p_orig;
 
 	return 0;
     }
@@ -714,23 +191,23 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
     ref = p->b->ref;
 
     if (nth) {
-	int n;
-	for (n = 0; p; p = p->next, n++) {
+	for (n = 0; n < depth; n++) {
+	    pileup_t *pn = &p[n];
 	    int i, j;
-	    uint8_t *b_seq = (uint8_t *)bam_seq(p->b);
+	    uint8_t *b_seq = (uint8_t *)bam_seq(pn->b);
 
-	    while ((sp - seq + 5 + cd->seq_len[n]) > seq_alloc) {
-		ptrdiff_t d = sp - seq;
-		seq = realloc(seq, seq_alloc*=2);
-		sp = seq + d;
+	    while ((sp - cd->seq + 5 + cd->seq_len[n]) > cd->seq_alloc) {
+		ptrdiff_t d = sp - cd->seq;
+		cd->seq = realloc(cd->seq, cd->seq_alloc*=2);
+		sp = cd->seq + d;
 	    }
 
-	    if(p->base != '*')
+	    if(pn->base != '*')
 		cd->seq_len[n]++;
 
-	    if (p->start) {
+	    if (pn->start) {
 		*sp++ = '^';
-		*sp++ = MIN(p->b->map_qual,93) + '!';
+		*sp++ = MIN(pn->b->map_qual,93) + '!';
 	    }
 	    *sp++ = cd->base[n];
 	    if (cd->seq_len[n]) {
@@ -739,43 +216,45 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 
 		for (i = cd->seq_offset[n], j = 0; j < cd->seq_len[n]; i++, j++) {
 		    uc call = bam_nt16_rev_table[bam_seqi(b_seq, i)];
-		    *sp++ = strand_char[bam_strand(p->b)][call];
+		    *sp++ = strand_char[bam_strand(pn->b)][call];
 		}
 	    }
-	    if (p->eof)
+	    if (pn->eof)
 		*sp++ = '$';
-	    *qp++ = MIN(p->qual,93) + '!';
+	    *qp++ = MIN(pn->qual,93) + '!';
 	}
     } else {
-	for (; p; p = p->next) {
-	    while ((sp - seq + 4) > seq_alloc) {
-		ptrdiff_t d = sp - seq;
-		seq = realloc(seq, seq_alloc*=2);
-		sp = seq + d;
+	for (n = 0; n < depth; n++) {
+	    pileup_t *pn = &p[n];
+
+	    while ((sp - cd->seq + 4) > cd->seq_alloc) {
+		ptrdiff_t d = sp - cd->seq;
+		cd->seq = realloc(cd->seq, cd->seq_alloc*=2);
+		sp = cd->seq + d;
 	    }
-	    if (p->start) {
+	    if (pn->start) {
 		*sp++ = '^';
-		*sp++ = MIN(p->b->map_qual,93) + '!';
+		*sp++ = MIN(pn->b->map_qual,93) + '!';
 	    }
-	    *sp++ = strand_char[p->b_strand][(uc)p->base];
-	    //*sp++ = strand_char[bam_strand(p->b)][p->base];
-	    if (p->eof)
+	    *sp++ = strand_char[pn->b_strand][(uc)pn->base];
+	    if (pn->eof)
 		*sp++ = '$';
-	    *qp++ = MIN(p->qual,93) + '!';
+	    *qp++ = MIN(pn->qual,93) + '!';
 	}
     }
 
-    /* Equivalent to the printf below, but faster */
+    /* Equivalent to a printf, but faster */
     buf_len = strlen(scram_get_header(fp)->ref[ref].name) + 1 // name
 	+ 10 + 1                                              // pos
 	+ 1  + 1                                              // base
 	+ 10 + 1                                              // depth
-	+ sp - seq + 1                                        // seq
-	+ qp - qual + 1;                                      // qual
-    if (buf_len > buf_alloc)
-	buf = realloc(buf, buf_alloc = buf_len);
+	+ sp - cd->seq + 1                                    // seq
+	+ qp - cd->qual + 1;                                  // qual
+    if (buf_len > cd->buf_alloc)
+	if (!(cd->buf = realloc(cd->buf, cd->buf_alloc = buf_len)))
+	    return -1;
 
-    cp = buf;
+    cp = cd->buf;
     strcpy((char *) cp, scram_get_header(fp)->ref[ref].name);
     cp += strlen((char *) cp);
     *cp++ = '\t';
@@ -783,39 +262,31 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
     *cp++ = 'N';
     *cp++ = '\t';
     cp = append_int(cp, depth); *cp++ = '\t';
-    memcpy(cp, seq,  sp-seq);  cp += sp-seq;  *cp++ = '\t';
-    memcpy(cp, qual, qp-qual); cp += qp-qual; *cp++ = '\0';
-    puts((char *) buf);
-
-    //*sp++ = 0;
-    //*qp++ = 0;
-    //printf("ref\t%d+%d\tN\t%d\t%s\t%s\n", pos, nth, depth, seq, qual);
+    memcpy(cp, cd->seq,  sp-cd->seq);  cp += sp-cd->seq;  *cp++ = '\t';
+    memcpy(cp, cd->qual, qp-cd->qual); cp += qp-cd->qual; *cp++ = '\n';
 
-    return 0;
+    return pileup_write(cd, cd->buf, cp - cd->buf);
 }
 
-static int basic_pileup(void *cd, scram_fd *fp, pileup_t *p,
+static int basic_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 			int depth, int pos, int nth, int is_insert) {
-    static unsigned char *seq = NULL, *qual = NULL, *buf = NULL;
-    static int max_depth = 0;
+    sam_pileup_t *cd = (sam_pileup_t *)cd_v;
     unsigned char *qp, *cp, *rp;
-    int ref;
+    int ref, n;
 
-    if (max_depth < depth) {
-	max_depth = depth;
-	seq  = realloc(seq,  max_depth*3);
-	qual = realloc(qual, max_depth);
-	buf  = realloc(buf,  max_depth*2+1000);
+    if (cd->max_depth < depth) {
+	cd->max_depth = depth;
+	cd->buf = realloc(cd->buf, cd->max_depth*2+1000);
 
-	if (!seq || !qual || !buf)
+	if (!cd->buf)
 	    return -1;
     }
 
-    qp = qual; cp = buf;
-
-    if (!p)
+    if (!depth)
 	return 0;
 
+    cp = cd->buf;
+
     /* Ref, pos, depth */
     ref = p->b->ref;
     rp = (unsigned char *) scram_get_header(fp)->ref[ref].name;
@@ -831,19 +302,19 @@ static int basic_pileup(void *cd, scram_fd *fp, pileup_t *p,
 
     /* Seq + qual at predetermined offsets */
     qp = cp + depth + 1;
-    for (; p; p = p->next) {
-	*cp++ = p->base;
-	*qp++ = MIN(p->qual,93) + '!';
+    for (n = 0; n < depth; n++) {
+	*cp++ = p[n].base;
+	*qp++ = MIN(p[n].qual,93) + '!';
     }
     *cp++ = '\t';
-    *qp++ = '\0';
-    puts((char *) buf);
+    *qp++ = '\n';
 
-    return 0;
+    return pileup_write(cd, cd->buf, qp - cd->buf);
 }
 
-static int depth_pileup(void *cd, scram_fd *fp, pileup_t *p,
+static int depth_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 			int depth, int pos, int nth, int is_insert) {
+    sam_pileup_t *cd = (sam_pileup_t *)cd_v;
     unsigned char buf[1024], *cp = buf, *rp;
 
     if (nth)
@@ -856,76 +327,188 @@ static int depth_pileup(void *cd, scram_fd *fp, pileup_t *p,
     cp = append_int(cp, pos);
     *cp++=  '\t';
     cp = append_int(cp, depth);
-    *cp++ = '\0';
-    puts((char *) buf);
-    
-    return 0;
+    *cp++ = '\n';
+
+    return pileup_write(cd, buf, cp - buf);
+}
+
+static int count_pileup(void *cd_v, scram_fd *fp, pileup_count_t *c) {
+    sam_pileup_t *cd = (sam_pileup_t *)cd_v;
+    unsigned char buf[1024], *cp = buf, *rp;
+    int i;
+
+    rp = (unsigned char *) scram_get_header(fp)->ref[c->ref_id].name;
+    while ((*cp++ = *rp++))
+	;
+    cp[-1] = '\t';
+    cp = append_int(cp, c->pos);
+    *cp++ = '\t';
+    *cp++ = c->ref_base;
+    *cp++ = '\t';
+    cp = append_int(cp, c->depth);
+    for (i = 0; i < PILEUP_NBASE; i++) {
+	*cp++ = '\t';
+	cp = append_int(cp, c->count[i]);
+    }
+    *cp++ = '\t';
+    cp = append_int(cp, c->ins);
+    *cp++ = '\n';
+
+    return pileup_write(cd, buf, cp - buf);
+}
+
+/*
+ * Checks for a CRAM index without the error cram_index_load() reports
+ * when there is none.
+ *
+ * Returns 1 if found
+ *         0 if not
+ */
+static int has_index(const char *fn) {
+    char *idx = malloc(strlen(fn) + 6);
+    int found;
+
+    if (!idx)
+	return 0;
+    sprintf(idx, "%s.crai", fn);
+    found = access(idx, R_OK) == 0;
+    if (!found) {
+	sprintf(idx, "%s.crbi", fn);
+	found = access(idx, R_OK) == 0;
+    }
+    free(idx);
+
+    return found;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp, "Usage: scram_pileup [options] filename.{sam,bam,cram}\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, " -5          Gap5 pileup format.\n");
+    fprintf(fp, " -d          Depth format.\n");
+    fprintf(fp, " -c          Base counts: ref, pos, ref base, depth, "
+	    "A, C, G, T, N, del, ins.\n");
+    fprintf(fp, " (otherwise) Samtools pileup format.\n");
+    fprintf(fp, " -t N        Use N threads; requires an indexed CRAM file\n"
+	    "             with each reference in one sorted run.\n"
+	    "             Not used with -c.\n");
+    fprintf(fp, " -!          Disable CRAM MD5 and checksum verification.\n"
+	    "             With -c this avoids rebuilding each sequence.\n");
+    fprintf(fp, "\n\nNOTE: This program is still under development "
+	    "and should be considered a proof\nof concept only.\n");
 }
 
 int main(int argc, char **argv) {
     scram_fd *fp;
     sam_pileup_t *p;
-    int mode = 0;
-
-    if (argc < 2) {
-	fprintf(stderr, "Usage: scram_pileup [options] filename.{sam,bam,cram}\n");
-	fprintf(stderr, "Options:\n");
-	fprintf(stderr, " -5          Gap5 pileup format.\n");
-	fprintf(stderr, " -d          Depth format.\n");
-	fprintf(stderr, " (otherwise) Samtools pileup format.\n");
-	fprintf(stderr, "\n\nNOTE: This program is still under development "
-		"and should be considered a proof\nof concept only.\n");
-	return 1;
-    }
+    pileup_seq_add_func *func;
+    t_pool *pool = NULL;
+    int mode = 0, nthreads = 1, ignore_md5 = 0, c, ret;
+
+    while ((c = getopt(argc, argv, "5dct:!h")) != -1) {
+	switch (c) {
+	case '5':
+	case 'd':
+	case 'c':
+	    mode = c;
+	    break;
 
-    if (argc >= 2 && strcmp(argv[1], "-5") == 0) {
-	mode = '5';
-	argc--;
-	argv++;
-    }
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
 
-    if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
-	mode = 'd';
-	argc--;
-	argv++;
+	case '!':
+	    ignore_md5 = 1;
+	    break;
+
+	case 'h':
+	    usage(stdout);
+	    return 0;
+
+	case '?':
+	    usage(stderr);
+	    return 1;
+	}
     }
 
-    if (argc != 2) {
-	fprintf(stderr, "sam_pileup filename\n");
+    if (argc - optind != 1) {
+	usage(stderr);
 	return 1;
     }
 
     strand_init();
 
-    fp = scram_open(argv[1], "r");
+    fp = scram_open(argv[optind], "r");
     if (!fp) {
-	perror(argv[1]);
+	perror(argv[optind]);
 	return 1;
     }
-    
-    if (!(p = calloc(1, sizeof(*p))))
-	return 1;
+
+    if (ignore_md5 && !fp->is_bam) {
+	if (scram_set_option(fp, CRAM_OPT_IGNORE_MD5, ignore_md5) ||
+	    scram_set_option(fp, CRAM_OPT_IGNORE_CHKSUM, ignore_md5))
+	    return 1;
+    }
 
     switch(mode) {
     case '5':
-	pileup_loop(fp, NULL, basic_pileup, NULL);
+	func = basic_pileup;
 	break;
 
     case 'd':
-	pileup_loop(fp, NULL, depth_pileup, NULL);
+	func = depth_pileup;
 	break;
 
     default:
-	pileup_loop(fp, NULL, sam_pileup, p);
+	func = sam_pileup;
 	break;
     }
 
-    if (p)
-	free(p);
+    if (mode == 'c') {
+	if (!(p = sam_pileup_init(NULL, NULL)))
+	    return 1;
 
-    if (0 != scram_close(fp))
+	ret = pileup_count_loop(fp, count_pileup, p);
+	sam_pileup_free(p);
+    } else {
+	ret = 1;
+	if (nthreads > 1) {
+	    if (fp->is_bam) {
+		fprintf(stderr, "Threaded pileup needs an indexed CRAM file; "
+			"running with a single thread.\n");
+	    } else if (!has_index(argv[optind]) ||
+		       cram_index_load(fp->c, argv[optind]) != 0) {
+		fprintf(stderr, "No index found for %s; "
+			"running with a single thread.\n", argv[optind]);
+	    } else {
+		if (!(pool = t_pool_init(nthreads*2, nthreads)))
+		    return 1;
+
+		ret = pileup_loop_mt(fp, argv[optind], pool, NULL, func,
+				     sam_pileup_init, sam_pileup_free, NULL,
+				     stdout);
+
+		t_pool_flush(pool);
+		t_pool_destroy(pool, 0);
+
+		if (ret == 1)
+		    fprintf(stderr, "References in %s are not each in one "
+			    "sorted run; running with a single thread.\n",
+			    argv[optind]);
+	    }
+	}
+
+	if (ret == 1) {
+	    if (!(p = sam_pileup_init(NULL, NULL)))
+		return 1;
+
+	    ret = pileup_loop(fp, NULL, func, p);
+	    sam_pileup_free(p);
+	}
+    }
+
+    if (0 != scram_close(fp) || ret != 0)
 	return 1;
 
     return 0;
 }
-
@@ -181,6 +181,83 @@ static int filter_tags(bam_seq_t *s, char *aux_filter, int keep) {
     return 0;
 }
 
+static int range_cmp(const void *v1, const void *v2) {
+    const cram_range *r1 = (const cram_range *)v1;
+    const cram_range *r2 = (const cram_range *)v2;
+
+    // Unmapped (-1) goes last, to match file order.
+    if (r1->refid != r2->refid)
+	return (unsigned)r1->refid < (unsigned)r2->refid ? -1 : 1;
+    return (r1->start > r2->start) - (r1->start < r2->start);
+}
+
+/*
+ * Loads a BED file of regions and converts them to an array of
+ * cram_range, sorted into the order they appear in the file.
+ * BED is 0-based half open, while cram_range is 1-based inclusive.
+ *
+ * Returns malloced array on success, with *nr set to the count;
+ *         NULL with *nr set to 0 if the file holds no regions;
+ *         NULL with *nr set to -1 on failure
+ */
+static cram_range *load_bed(SAM_hdr *h, char *fn, int *nr) {
+    FILE *fp;
+    char line[8192], name[1024];
+    cram_range *r = NULL;
+    int n = 0, a = 0;
+
+    *nr = -1;
+    if (!(fp = fopen(fn, "r"))) {
+	perror(fn);
+	return NULL;
+    }
+
+    while (fgets(line, 8192, fp)) {
+	long start, end;
+	int refid;
+
+	if (*line == '#' || *line == '\n' ||
+	    strncmp(line, "track", 5) == 0 ||
+	    strncmp(line, "browser", 7) == 0)
+	    continue;
+
+	if (sscanf(line, "%1023s %ld %ld", name, &start, &end) != 3 ||
+	    start < 0 || end < start) {
+	    fprintf(stderr, "Malformed BED line: %s", line);
+	    goto err;
+	}
+
+	refid = sam_hdr_name2ref(h, name);
+	if (refid == -1 && strcmp(name, "*") != 0) {
+	    fprintf(stderr, "Unknown reference name '%s'\n", name);
+	    goto err;
+	}
+
+	if (n == a) {
+	    cram_range *r2;
+	    a = a ? a*2 : 256;
+	    if (!(r2 = realloc(r, a * sizeof(*r))))
+		goto err;
+	    r = r2;
+	}
+	r[n].refid = refid;
+	r[n].start = start + 1;
+	r[n].end   = end;
+	n++;
+    }
+
+    fclose(fp);
+    if (r)
+	qsort(r, n, sizeof(*r), range_cmp);
+    *nr = n;
+    return r;
+
+ err:
+    fclose(fp);
+    free(r);
+    return NULL;
+}
+
 
 static void usage(FILE *fp) {
     fprintf(fp, "  -=- sCRAMble -=-     version %s\n", IOLIB_VERSION);
@@ -196,6 +273,7 @@ static void usage(FILE *fp) {
     //fprintf(fp, "    -v             Verbose output.\n");
     fprintf(fp, "    -H             [SAM] Do not print header\n");
     fprintf(fp, "    -R range       [Cram] Specifies the refseq:start-end range\n");
+    fprintf(fp, "    -L file.bed    [Cram] Only output reads overlapping regions in BED file\n");
     fprintf(fp, "    -r ref.fa      [Cram] Specifies the reference file.\n");
     fprintf(fp, "    -b integer     [Cram] Max. bases per slice, default %d.\n",
 	    BASES_PER_SLICE);
@@ -208,6 +286,8 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -x             [Cram] Non-reference based encoding.\n");
     fprintf(fp, "    -M             [Cram] Use multiple references per slice.\n");
     fprintf(fp, "    -m             [Cram] Generate MD and NM tags.\n");
+    fprintf(fp, "    -K             [Cram] Hold references 2-bit packed in memory.\n");
+    fprintf(fp, "    -C MB          [Cram] Cache up to MB of unused references.\n");
     fprintf(fp, "    -a             [Cram] Also compress using arithmetic coder (V3.1+).\n");
 #ifdef HAVE_LIBBZ2
     fprintf(fp, "    -j             [Cram] Also compress using bzip2.\n");
@@ -229,11 +309,14 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -q             Don't add scramble @PG header line\n");
     fprintf(fp, "    -N integer     Stop decoding after 'integer' sequences\n");
     fprintf(fp, "    -t N           Use N threads (availability varies by format)\n");
+    fprintf(fp, "    -Y FILE        Write thread pool statistics as JSON to FILE (- for stderr)\n");
+    fprintf(fp, "    -Q sched       Thread pool job scheduler: shared (default) or stealing\n");
     fprintf(fp, "    -B             Enable Illumina 8 quality-binning system (lossy)\n");
     fprintf(fp, "    -!             Disable all checking of checksums\n");
     fprintf(fp, "    -g FILE        Convert to Bam using index (file.gzi)\n");
     fprintf(fp, "    -G FILE        Output Bam index when bam input(file.gzi)\n");
     fprintf(fp, "    -X mode        [Cram] Mode is fast, normal, small or archive.\n");
+    fprintf(fp, "    -W budget      [Cram] Limit compression trials to budget (see man page).\n");
     fprintf(fp, "    -d tag-list    Keep only specified aux tags (discard the others)\n");
     fprintf(fp, "    -D tag-list    Discard specified aux tags (keep the others)\n");
 }
@@ -266,16 +349,29 @@ int main(int argc, char **argv) {
     char *profile = "normal";
     int aux_keep = -1;
     char aux_filter[65536] = {0};
+    char *bed_fn = NULL;
+    cram_range *regions = NULL;
+    int nregions = 0;
+    cram_region_iter *iter = NULL;
+    char *stats_fn = NULL;
+    enum t_pool_sched sched = T_POOL_SHARED;
+    int packed_ref = 0;
+    int ref_cache_size = 0;
+    int trial_budget = 0;
 
     scram_init();
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJzZt:BN:F:Hb:nPpqg:G:fTX:d:D:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:L:!MmajJzZt:BN:F:Hb:nPpqg:G:fTX:d:D:Y:Q:KC:W:")) != -1) {
 	switch (c) {
 	case 'X':
 	    profile = optarg;
 	    break;
 
+	case 'W':
+	    trial_budget = atoi(optarg);
+	    break;
+
 	case 'F':
 	    sam_fields = strtol(optarg, NULL, 0); // undocumented for testing
 	    break;
@@ -336,6 +432,14 @@ int main(int argc, char **argv) {
 	    embed_cons = 1;
 	    break;
 
+	case 'K':
+	    packed_ref = 1;
+	    break;
+
+	case 'C':
+	    ref_cache_size = atoi(optarg);
+	    break;
+
 	case 'x':
 	    no_ref = 1;
 	    break;
@@ -370,6 +474,10 @@ int main(int argc, char **argv) {
 	    break;
 	}
 
+	case 'L':
+	    bed_fn = optarg;
+	    break;
+
 	case '!':
 	    ignore_md5 = 1;
 	    break;
@@ -438,6 +546,21 @@ int main(int argc, char **argv) {
 	    }
 	    break;
 
+	case 'Y':
+	    stats_fn = optarg;
+	    break;
+
+	case 'Q':
+	    if (strcmp(optarg, "shared") == 0) {
+		sched = T_POOL_SHARED;
+	    } else if (strcmp(optarg, "stealing") == 0) {
+		sched = T_POOL_STEALING;
+	    } else {
+		fprintf(stderr, "Unknown scheduler '%s'\n", optarg);
+		return 1;
+	    }
+	    break;
+
 	case 'B':
 	    binning = BINNING_ILLUMINA;
 	    break;
@@ -561,11 +684,29 @@ int main(int argc, char **argv) {
     /* Set any format specific options */
     scram_set_refs(out, refs = scram_get_refs(in));
 
+    if (packed_ref) {
+	if (scram_set_option(in,  CRAM_OPT_PACKED_REF, packed_ref))
+	    return 1;
+	if (scram_set_option(out, CRAM_OPT_PACKED_REF, packed_ref))
+	    return 1;
+    }
+
+    if (ref_cache_size) {
+	if (scram_set_option(in,  CRAM_OPT_REF_CACHE_SIZE, ref_cache_size))
+	    return 1;
+	if (scram_set_option(out, CRAM_OPT_REF_CACHE_SIZE, ref_cache_size))
+	    return 1;
+    }
+
     scram_set_option(out, CRAM_OPT_VERBOSITY, verbose);
     if (profile) // do this one first so we can override it
 	if (scram_set_option(out, CRAM_OPT_PROFILE, profile))
 	    return 1;
 
+    if (trial_budget)
+	if (scram_set_option(out, CRAM_OPT_TRIAL_BUDGET, trial_budget))
+	    return 1;
+
     if (s_opt)
 	if (scram_set_option(out, CRAM_OPT_SEQS_PER_SLICE, s_opt))
 	    return 1;
@@ -666,7 +807,9 @@ int main(int argc, char **argv) {
     }
 
     if (nthreads > 1) {
-	if (NULL == (p = t_pool_init(nthreads*2, nthreads)))
+	if (NULL == (p = t_pool_init_sched(nthreads*2, nthreads, sched)))
+	    return 1;
+	if (stats_fn && t_pool_stats_enable(p))
 	    return 1;
 
 	if (scram_set_option(in,  CRAM_OPT_THREAD_POOL, p))
@@ -758,10 +901,75 @@ int main(int argc, char **argv) {
 	    return 1;
     }
 
+    /* Multiple regions from a BED file, also CRAM only */
+    if (bed_fn) {
+	if (in->is_bam || *ref_name) {
+	    fprintf(stderr, "The -L option is only implemented for CRAM indices "
+		    "and cannot be combined with -R\n");
+	    return 1;
+	}
+
+	regions = load_bed(in->c->header, bed_fn, &nregions);
+	if (nregions < 0)
+	    return 1;
+
+	/* An empty BED selects no records; only the header is written */
+	if (nregions) {
+	    if (cram_index_load(in->c, argv[optind]) != 0) {
+		fprintf(stderr, "Failed to load index for %s\n",
+			argv[optind]);
+		return 1;
+	    }
+
+	    if (!(iter = cram_region_iter_init(in->c, regions, nregions)))
+		return 1;
+	}
+    }
+
     /* Do the actual file format conversion */
     s = NULL;
 
-    while (scram_get_seq(in, &s) >= 0) {
+    if (iter) {
+	int ret, region, i, *prev_end;
+
+	/*
+	 * The iterator returns a record once per overlapping region.
+	 * Regions are sorted by start, so a record has already been
+	 * emitted if it starts before the end of any prior region on
+	 * the same reference.
+	 */
+	if (!(prev_end = malloc((nregions+1) * sizeof(*prev_end))))
+	    return 1;
+	for (i = 0; i < nregions; i++) {
+	    if (i == 0 || regions[i-1].refid != regions[i].refid)
+		prev_end[i] = 0;
+	    else
+		prev_end[i] = MAX(prev_end[i-1], regions[i-1].end);
+	}
+
+	while ((ret = cram_region_iter_next(iter, &s, &region)) == 0) {
+	    if (regions[region].refid >= 0 && bam_pos(s)+1 <= prev_end[region])
+		continue;
+
+	    if (aux_keep >= 0)
+		filter_tags(s, aux_filter, aux_keep);
+	    if (-1 == scram_put_seq(out, s)) {
+		fprintf(stderr, "Failed to encode sequence\n");
+		return 1;
+	    }
+	    if (max_reads >= 0)
+		if (--max_reads == 0)
+		    break;
+	}
+	cram_region_iter_free(iter);
+	free(prev_end);
+	free(regions);
+
+	if (ret < 0) {
+	    fprintf(stderr, "Failed to decode sequence\n");
+	    return 1;
+	}
+    } else if (!bed_fn) while (scram_get_seq(in, &s) >= 0) {
 	if (aux_keep >= 0)
 	    filter_tags(s, aux_filter, aux_keep);
 	if (-1 == scram_put_seq(out, s)) {
@@ -773,7 +981,7 @@ int main(int argc, char **argv) {
 		break;
     }
 
-    switch(scram_eof(in)) {
+    switch(bed_fn ? 1 : scram_eof(in)) {
     case -1:
 	fprintf(stderr, "Failed to decode sequence\n");
 	return 1;
@@ -803,6 +1011,16 @@ int main(int argc, char **argv) {
 	return 1;
     }
 
+    if (p && stats_fn) {
+	FILE *fp = strcmp(stats_fn, "-") ? fopen(stats_fn, "w") : stderr;
+	if (!fp || t_pool_stats_json(p, fp) || (fp != stderr && fclose(fp))) {
+	    perror(stats_fn);
+	    return 1;
+	}
+    } else if (stats_fn) {
+	fprintf(stderr, "Warning: -Y requires -t; no statistics written\n");
+    }
+
     if (p)
 	t_pool_destroy(p, 0);
 
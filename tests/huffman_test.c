@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2026 The io_lib contributors.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks the table driven huffman decoder against the bit at a time
+ * decoder, including code sets with codes longer than HUFF_LUT_BITS.
+ *
+ * Each code set is turned into a CRAM huffman encoding header and a
+ * core block of randomly chosen symbols, which is then decoded both
+ * ways as BYTE, INT and LONG data series.
+ *
+ * With -b the same is done on a larger block and the decode times of
+ * both methods are reported, as a benchmark.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <io_lib/cram.h>
+
+/* Code lengths; a length of 0 ends the list */
+static int set_short[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 10, 0};
+static int set_long[]  = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+			  14, 15, 16, 17, 18, 19, 20, 20, 0};
+static int set_mixed[] = {2, 2, 2, 5, 5, 5, 5, 5, 5, 5,
+			  11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+			  11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+			  11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+			  11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+			  11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+			  24, 24, 0};
+
+typedef struct {
+    const char *name;
+    int *len;
+} code_set;
+
+static code_set sets[] = {
+    {"short", set_short},
+    {"long",  set_long},
+    {"mixed", set_mixed},
+};
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Builds a huffman codec for the lengths in len[], with symbol i having
+ * length len[i].  LONG symbols are spread out so they need 64 bits.
+ */
+static cram_codec *huffman_codec(int *len, int *ncodes,
+				 enum cram_external_type option,
+				 varint_vec *vv) {
+    static cram_block_compression_hdr ch;
+    char hdr[1024], *cp = hdr, *end = hdr + sizeof(hdr);
+    int i, n;
+
+    for (n = 0; len[n]; n++)
+	;
+    *ncodes = n;
+
+    cp += vv->varint_put32(cp, end, n);
+    for (i = 0; i < n; i++) {
+	if (option == E_LONG)
+	    cp += vv->varint_put64(cp, end, i * 1000000007LL);
+	else
+	    cp += vv->varint_put32(cp, end, i);
+    }
+    cp += vv->varint_put32(cp, end, n);
+    for (i = 0; i < n; i++)
+	cp += vv->varint_put32(cp, end, len[i]);
+
+    return cram_decoder_init(&ch, E_HUFFMAN, hdr, cp - hdr, option, 3, vv);
+}
+
+/*
+ * Encodes nsym symbols chosen at random into a block, MSB first, using
+ * the canonical codes assigned by the decoder.  sym[] receives the
+ * index of each symbol chosen.  The symbols are weighted towards the
+ * shorter codes, but every code is used at least once.
+ */
+static cram_block *huffman_block(cram_codec *c, int *sym, int nsym) {
+    cram_huffman_code *codes = c->huffman.codes;
+    int ncodes = c->huffman.ncodes, i, j;
+    size_t bit = 0;
+    cram_block *b;
+
+    if (!(b = cram_new_block(CORE, 0)))
+	return NULL;
+    free(b->data);
+    if (!(b->data = calloc(((size_t)nsym * HUFF_MAX_LEN + 7) / 8 + 1, 1))) {
+	cram_free_block(b);
+	return NULL;
+    }
+
+    for (i = 0; i < nsym; i++) {
+	int k;
+	cram_huffman_code *hc;
+
+	if (i < ncodes) {
+	    k = i;
+	} else {
+	    k = 0;
+	    while (k < ncodes-1 && (random() & 1))
+		k++;
+	}
+	hc = &codes[k];
+	sym[i] = hc->symbol / (c->huffman.option == E_LONG ? 1000000007LL : 1);
+
+	for (j = hc->len-1; j >= 0; j--, bit++)
+	    if (hc->code & (1 << j))
+		b->data[bit/8] |= 0x80 >> (bit%8);
+    }
+
+    b->uncomp_size = (bit + 7) / 8;
+    b->byte = 0;
+    b->bit = 7;
+
+    return b;
+}
+
+/*
+ * Decodes nsym symbols from b using either the lookup table or the bit
+ * at a time decoder.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int huffman_decode(cram_codec *c, cram_block *b, char *out, int nsym,
+			  int use_lut) {
+    uint32_t *lut = c->huffman.lut;
+    int ret;
+
+    b->byte = 0;
+    b->bit = 7;
+    if (!use_lut)
+	c->huffman.lut = NULL;
+    ret = c->decode(NULL, c, b, out, &nsym);
+    c->huffman.lut = lut;
+
+    return ret;
+}
+
+static int64_t out_val(enum cram_external_type option, char *out, int i) {
+    switch (option) {
+    case E_LONG:
+	return ((int64_t *)out)[i] / 1000000007LL;
+    case E_INT:
+	return ((int32_t *)out)[i];
+    default:
+	return (unsigned char)out[i];
+    }
+}
+
+/*
+ * Checks one code set and data series type.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int test_set(code_set *set, enum cram_external_type option,
+		    int nsym, int bench, varint_vec *vv) {
+    static const char *type[] = {"INT", "LONG", "BYTE"};
+    char *out[2] = {NULL, NULL};
+    int *sym = NULL, ncodes, i, k, ret = -1;
+    cram_codec *c;
+    cram_block *b = NULL;
+    double t[2];
+
+    if (!(c = huffman_codec(set->len, &ncodes, option, vv))) {
+	fprintf(stderr, "%s: failed to build codec\n", set->name);
+	return -1;
+    }
+
+    if (!c->huffman.lut) {
+	fprintf(stderr, "%s: no lookup table\n", set->name);
+	goto err;
+    }
+
+    if (!(sym = malloc(nsym * sizeof(*sym))) ||
+	!(out[0] = malloc(nsym * sizeof(int64_t))) ||
+	!(out[1] = malloc(nsym * sizeof(int64_t))) ||
+	!(b = huffman_block(c, sym, nsym)))
+	goto err;
+
+    for (k = 0; k < 2; k++) {
+	t[k] = now();
+	if (huffman_decode(c, b, out[k], nsym, k == 0) < 0) {
+	    fprintf(stderr, "%s %s: %s decode failed\n", set->name,
+		    type[option - E_INT], k == 0 ? "table" : "bitwise");
+	    goto err;
+	}
+	t[k] = now() - t[k];
+
+	for (i = 0; i < nsym; i++) {
+	    if (out_val(option, out[k], i) != sym[i]) {
+		fprintf(stderr, "%s %s: %s decode of symbol %d gave %"PRId64
+			", expected %d\n", set->name, type[option - E_INT],
+			k == 0 ? "table" : "bitwise", i,
+			out_val(option, out[k], i), sym[i]);
+		goto err;
+	    }
+	}
+    }
+
+    /* Decoding past the end of the data must fail rather than overrun */
+    b->uncomp_size--;
+    for (k = 0; k < 2; k++) {
+	if (huffman_decode(c, b, out[k], nsym, k == 0) == 0) {
+	    fprintf(stderr, "%s %s: %s decode of truncated data succeeded\n",
+		    set->name, type[option - E_INT],
+		    k == 0 ? "table" : "bitwise");
+	    goto err;
+	}
+    }
+
+    if (bench)
+	printf("%-5s %-4s %d codes, max len %2d: table %.3fs, "
+	       "bitwise %.3fs\n", set->name, type[option - E_INT], ncodes,
+	       c->huffman.max_len, t[0], t[1]);
+
+    ret = 0;
+ err:
+    if (b)
+	cram_free_block(b);
+    free(out[0]);
+    free(out[1]);
+    free(sym);
+    c->free(c);
+
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    static enum cram_external_type opts[] = {E_BYTE, E_INT, E_LONG};
+    int nsym = 100000, bench = 0, c, i, j;
+    varint_vec vv;
+
+    while ((c = getopt(argc, argv, "b")) != -1) {
+	switch (c) {
+	case 'b':
+	    bench = 1;
+	    nsym = 10000000;
+	    break;
+
+	default:
+	    fprintf(stderr, "Usage: huffman_test [-b]\n");
+	    return 1;
+	}
+    }
+
+    srandom(15);
+    cram_init_varint(&vv, 3);
+
+    for (i = 0; i < sizeof(sets)/sizeof(*sets); i++)
+	for (j = 0; j < sizeof(opts)/sizeof(*opts); j++)
+	    if (test_set(&sets[i], opts[j], nsym, bench, &vv) < 0)
+		return 1;
+
+    return 0;
+}
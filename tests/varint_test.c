@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2026 The io_lib contributors.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks the block varint decoders (varint_get32_blk and friends)
+ * against repeated calls to the single value varint getters, for both
+ * ITF8/LTF8 (CRAM 3) and uint7/sint7 (CRAM 4).
+ *
+ * The block decoders convert runs of single byte values 16 or 32 at a
+ * time when the CPU supports SSE4.1 or AVX2, so block lengths either
+ * side of those boundaries are tried, with multi-byte values placed in
+ * and around the runs.  Every truncation of each encoded buffer is also
+ * decoded, into a buffer of exactly that size, and must fail at the
+ * same value as the single value getters without writing beyond the
+ * requested number of values.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <io_lib/cram.h>
+
+#define MAX_VALS 600
+#define GUARD    8
+#define SENTINEL 0x5a5a5a5a
+
+typedef enum {T_U32, T_S32, T_U64, T_S64} vtype;
+static const char *type_name[] = {"get32", "get32s", "get64", "get64s"};
+
+/*
+ * Value mixes: all single byte, mostly single byte, runs of single byte
+ * values of lengths either side of the SIMD widths separated by single
+ * multi-byte values, and all multi-byte.
+ */
+typedef enum {M_SMALL, M_MIXED, M_RUNS, M_LARGE} vmix;
+static const char *mix_name[] = {"small", "mixed", "runs", "large"};
+
+static int run_lengths[] = {
+    0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 100
+};
+
+static int lengths[] = {
+    0, 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65,
+    95, 96, 127, 128, 129, 255, 256, 257, 511, MAX_VALS
+};
+
+static int64_t rand64(void) {
+    return ((int64_t)random() << 33) ^ ((int64_t)random() << 2)
+	^ (random() & 3);
+}
+
+/*
+ * Returns a random value for type t.  Small values encode to a single
+ * byte in both ITF8 and uint7/sint7.
+ */
+static int64_t rand_val(vtype t, int small) {
+    int64_t v;
+
+    if (small) {
+	v = random() % 64;
+	return (t == T_S32 || t == T_S64) && (random() & 1) ? -v : v;
+    }
+
+    v = rand64();
+    switch (t) {
+    case T_U32:
+    case T_S32:
+	v = (int32_t)v;
+	if (random() & 1)
+	    v %= 100000; // two or three bytes
+	break;
+    default:
+	if (random() & 1)
+	    v %= 10000000000LL;
+	break;
+    }
+    if (v >= 0 && v < 200)
+	v += 200;
+
+    return v;
+}
+
+/*
+ * Fills val[] with n values of mix m, and encodes them to buf.
+ *
+ * Returns the encoded length
+ */
+static int encode(varint_vec *vv, vtype t, vmix m, int64_t *val, int n,
+		  char *buf, int buf_sz) {
+    char *cp = buf, *end = buf + buf_sz;
+    int i, run = 0, run_left = run_lengths[0];
+
+    for (i = 0; i < n; i++) {
+	int small;
+	switch (m) {
+	case M_SMALL: small = 1; break;
+	case M_LARGE: small = 0; break;
+	case M_RUNS:
+	    if ((small = run_left-- > 0) == 0)
+		run_left = run_lengths[++run % (sizeof(run_lengths)
+						/ sizeof(*run_lengths))];
+	    break;
+	default:
+	    // Multi-byte values at and either side of the SIMD boundaries
+	    // as well as at random.
+	    small = !((i % 16) == 15 || (i % 32) == 16 || i == 33 ||
+		      random() % 10 == 0);
+	    break;
+	}
+	val[i] = rand_val(t, small);
+
+	switch (t) {
+	case T_U32: cp += vv->varint_put32 (cp, end, val[i]); break;
+	case T_S32: cp += vv->varint_put32s(cp, end, val[i]); break;
+	case T_U64: cp += vv->varint_put64 (cp, end, val[i]); break;
+	case T_S64: cp += vv->varint_put64s(cp, end, val[i]); break;
+	}
+    }
+
+    return cp - buf;
+}
+
+/*
+ * Decodes up to n values from cp..endp with the single value getter
+ * for type t, stopping at the first error.
+ *
+ * Returns the number of values decoded, setting *err on error.
+ */
+static int decode_scalar(varint_vec *vv, vtype t, char **cp, char *endp,
+			 int64_t *out, int n, int *err) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+	int e = 0;
+	int64_t v;
+
+	if (*cp >= endp) {
+	    *err = 1;
+	    break;
+	}
+
+	switch (t) {
+	case T_U32: v = (int32_t)vv->varint_get32 (cp, endp, &e); break;
+	case T_S32: v = (int32_t)vv->varint_get32s(cp, endp, &e); break;
+	case T_U64: v = vv->varint_get64 (cp, endp, &e); break;
+	default:    v = vv->varint_get64s(cp, endp, &e); break;
+	}
+	if (e) {
+	    *err = 1;
+	    break;
+	}
+	out[i] = v;
+    }
+
+    return i;
+}
+
+/*
+ * Decodes up to n values from cp..endp with the block decoder for type
+ * t, widening 32-bit results into out[].  Also checks that nothing past
+ * out[n-1] was written.
+ *
+ * Returns the number of values decoded, setting *err on error;
+ *         -2 if the output guard was overwritten
+ */
+static int decode_blk(varint_vec *vv, vtype t, char **cp, char *endp,
+		      int64_t *out, int n, int *err) {
+    static int32_t out32[MAX_VALS + GUARD];
+    static int64_t out64[MAX_VALS + GUARD];
+    int i, r;
+
+    for (i = 0; i < MAX_VALS + GUARD; i++)
+	out32[i] = out64[i] = SENTINEL;
+
+    switch (t) {
+    case T_U32: r = vv->varint_get32_blk (cp, endp, out32, n, err); break;
+    case T_S32: r = vv->varint_get32s_blk(cp, endp, out32, n, err); break;
+    case T_U64: r = vv->varint_get64_blk (cp, endp, out64, n, err); break;
+    default:    r = vv->varint_get64s_blk(cp, endp, out64, n, err); break;
+    }
+
+    for (i = n; i < MAX_VALS + GUARD; i++)
+	if (out32[i] != SENTINEL || out64[i] != SENTINEL)
+	    return -2;
+
+    for (i = 0; i < r; i++)
+	out[i] = t == T_U32 || t == T_S32 ? out32[i] : out64[i];
+
+    return r;
+}
+
+/*
+ * Decodes the first len bytes of buf, copied to a buffer of exactly
+ * that size, asking for n values with both decoders.
+ *
+ * Returns 0 if they agree
+ *        -1 if not
+ */
+static int compare(varint_vec *vv, vtype t, const char *buf, int len, int n,
+		   const char *desc) {
+    int64_t out_s[MAX_VALS], out_b[MAX_VALS];
+    char *data = malloc(len ? len : 1), *cp_s, *cp_b;
+    int r_s, r_b, err_s = 0, err_b = 0, i, ret = -1;
+
+    if (!data)
+	return -1;
+    memcpy(data, buf, len);
+
+    cp_s = data;
+    r_s = decode_scalar(vv, t, &cp_s, data + len, out_s, n, &err_s);
+    cp_b = data;
+    r_b = decode_blk(vv, t, &cp_b, data + len, out_b, n, &err_b);
+
+    if (r_b == -2) {
+	fprintf(stderr, "%s: wrote beyond %d values\n", desc, n);
+	goto err;
+    }
+    if (r_s != r_b || err_s != err_b) {
+	fprintf(stderr, "%s: block decoded %d values (err %d), "
+		"expected %d (err %d)\n", desc, r_b, err_b, r_s, err_s);
+	goto err;
+    }
+    for (i = 0; i < r_s; i++) {
+	if (out_s[i] != out_b[i]) {
+	    fprintf(stderr, "%s: value %d is %"PRId64", expected %"PRId64
+		    "\n", desc, i, out_b[i], out_s[i]);
+	    goto err;
+	}
+    }
+    if (!err_s && cp_s != cp_b) {
+	fprintf(stderr, "%s: block decoder consumed %d bytes, expected %d\n",
+		desc, (int)(cp_b - data), (int)(cp_s - data));
+	goto err;
+    }
+
+    ret = 0;
+ err:
+    free(data);
+    return ret;
+}
+
+/*
+ * Checks one encoding version, value type and mix at every length.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int test_type(varint_vec *vv, int version, vtype t, vmix m) {
+    static char buf[MAX_VALS * 10];
+    int64_t val[MAX_VALS];
+    char desc[100];
+    int i, j, len;
+
+    for (i = 0; i < sizeof(lengths)/sizeof(*lengths); i++) {
+	int n = lengths[i];
+
+	len = encode(vv, t, m, val, n, buf, sizeof(buf));
+	sprintf(desc, "CRAM %d %s %s n=%d", version, type_name[t],
+		mix_name[m], n);
+
+	/* Whole buffer, exactly n values */
+	if (compare(vv, t, buf, len, n, desc) < 0)
+	    return -1;
+
+	/* Asking for more values than the buffer holds */
+	if (n < MAX_VALS && compare(vv, t, buf, len, n+1, desc) < 0)
+	    return -1;
+	if (n < MAX_VALS && compare(vv, t, buf, len, MAX_VALS, desc) < 0)
+	    return -1;
+
+	/* Every truncation, including mid-value */
+	for (j = 0; j < len; j++)
+	    if (compare(vv, t, buf, j, n, desc) < 0)
+		return -1;
+
+	/* Asking for fewer values than the buffer holds */
+	for (j = 0; j < n && j < 40; j++)
+	    if (compare(vv, t, buf, len, j, desc) < 0)
+		return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static int versions[] = {3, 4};
+    int i, t, m;
+
+    srandom(15);
+
+    for (i = 0; i < sizeof(versions)/sizeof(*versions); i++) {
+	varint_vec vv;
+
+	cram_init_varint(&vv, versions[i]);
+	for (t = T_U32; t <= T_S64; t++)
+	    for (m = M_SMALL; m <= M_LARGE; m++)
+		if (test_type(&vv, versions[i], t, m) < 0)
+		    return 1;
+    }
+
+    return 0;
+}